@@ -18,6 +18,9 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
  #include <sys/time.h>
  #include <time.h>
@@ -25,6 +28,7 @@
 /* my headers */
 #include "core/db_backend.hpp"
 #include "core/hybfsdef.h"
+#include "core/epoch.hpp"
 #include "core/misc.h"
 
 #include "hybfs.h"
@@ -46,24 +50,91 @@ using namespace std;
 #define DB_PRINTERR(message,db) \
 	fprintf(stderr, "%s: %s\n",message, sqlite3_errmsg(db));
 
+/* when a file loses a tag, the tag goes away if it was the last file; only
+ * the deleted row is looked at, so deleting many rows stays linear
+ */
+#define DELETE_TRIGGER "CREATE TRIGGER delete_trig AFTER " \
+	"DELETE ON assoc \n" \
+	"BEGIN \n" \
+	"DELETE FROM files WHERE files.ino = old.ino AND files.tags = '' ; \n" \
+	"DELETE FROM tags WHERE tags.tag_id = old.tag_id AND NOT EXISTS \n" \
+	"(SELECT 1 FROM assoc WHERE assoc.tag_id = old.tag_id); \n" \
+	"END ;"
+
+/* the row of the file whose relative path is the parameter n */
+#define FILE_IS(n) "files.dir_id = hybfs_find_dir(?" #n ") AND " \
+	"files.name = hybfs_name(?" #n ")"
+
 DbBackend::DbBackend(const char *_path, const char *_vdir_path)
 {
+	pthread_mutexattr_t attr;
+
 	db_path.assign(_path);
 	db = NULL;
 
 	vdir_path = _vdir_path;
+	/* this keeps working if the branch is moved while we're mounted */
+	dir_fd = open(_vdir_path, O_PATH | O_DIRECTORY);
+	if (dir_fd == -1)
+		PRINT_ERROR("hybfs: cannot open %s: %s\n", _vdir_path,
+		            strerror(errno));
 	
 	DBG_PRINT("DbBackend Constructor: I have directories: %s %s\n",
 	          _path, _vdir_path);
 	/* init virtual query caches */
+	pthread_mutex_init(&cache_lock, NULL);
+	pthread_mutex_init(&catalog_lock, NULL);
+	generation = 0;
+	base_mtime = last_mtime = time(NULL);
+	memset(tag_gens, 0, sizeof(tag_gens));
+	attr_cache = new attr_cache_t;
+	attr_fgen = 0;
+	catalog = NULL;
+	counter_fd = -1;
+	pthread_mutex_init(&tag_ids_lock, NULL);
+	pthread_mutex_init(&counter_lock, NULL);
+	pthread_mutex_init(&dirs_lock, NULL);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&trans_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	trans_depth = 0;
+	trans_failed = 0;
+	seen_counter = 0;
+	own_commits = 0;
+	foreign_gen = 0;
+	tag_ids_gen = dirs_gen = 0;
+	dirs_moved = 0;
+	analyze_changes = -1;
+	analyze_gen = 0;
 }
 
-DbBackend::~DbBackend()
+static void destroy_attr_cache(void *ptr)
 {
-	db_close_storage();
+	delete (attr_cache_t *) ptr;
+}
 
-	/* destroy the caches here */
+static void destroy_catalog(void *ptr)
+{
+	delete (tag_catalog_t *) ptr;
+}
 
+DbBackend::~DbBackend()
+{
+	db_close_storage();
+	if (dir_fd != -1)
+		close(dir_fd);
+
+	/* destroy the caches here; there are no readers left */
+	delete attr_cache;
+	if (catalog)
+		delete catalog;
+	pthread_mutex_destroy(&catalog_lock);
+	pthread_mutex_destroy(&cache_lock);
+	pthread_mutex_destroy(&tag_ids_lock);
+	pthread_mutex_destroy(&counter_lock);
+	pthread_mutex_destroy(&dirs_lock);
+	pthread_mutex_destroy(&trans_lock);
 }
 
 void DbBackend::db_close_storage()
@@ -76,6 +147,19 @@ void DbBackend::db_close_storage()
 	if (!db)
 		return;
 
+	/* the next mount starts from here */
+	db_write_snapshot();
+	snapshot.close();
+	if (counter_fd != -1) {
+		close(counter_fd);
+		counter_fd = -1;
+	}
+	tag_ids.clear();
+	tag_dict_ids.clear();
+	dir_nodes.clear();
+	dir_ids.clear();
+	dir_paths.clear();
+
 	ret = sqlite3_close(db);
 	if(ret != SQLITE_OK)
 		DB_PRINTERR("Error at closing the database: ",db);
@@ -97,6 +181,25 @@ int DbBackend::run_simple_query(const char* query)
 	return ret;
 }
 
+int DbBackend::run_path_query(const char *query, const char *path)
+{
+	int ret;
+	sqlite3_stmt *sql = NULL;
+	
+	ret = sqlite3_prepare_v2(db, query, -1, &sql, 0);
+	DB_ERROR(ret != SQLITE_OK || !sql, "Preparing query: ", db);
+	sqlite3_bind_text(sql, 1, path, -1, SQLITE_STATIC);
+	ret = sqlite3_step(sql);
+	DB_ERROR(ret != SQLITE_DONE, "SQL run path query error", db);
+	ret = 0;
+	
+out:
+	if (sql)
+		sqlite3_finalize(sql);
+	
+	return ret;
+}
+
 int DbBackend::create_main_tables()
 {
 	int ret, empty, exit;
@@ -144,6 +247,9 @@ int DbBackend::create_main_tables()
 	if (empty) {
 		DBG_PRINT("HYBFS: Creating main tables \n");
 		
+		/* only a database without tables can take it; the free pages
+		 * are given back by the maintenance */
+		run_simple_query("PRAGMA auto_vacuum = INCREMENTAL;");
 		sqlite3_exec(db, "BEGIN",NULL,NULL,NULL);
 		do_trans = 1;
 		
@@ -158,7 +264,9 @@ int DbBackend::create_main_tables()
 			"ino INTEGER PRIMARY KEY, \n"
 			"mode INTEGER, \n"
 			"path VARCHAR(256), \n"
-			"tags VARCHAR(512)) ;");
+			"tags VARCHAR(512), \n"
+			"dir_id INTEGER, \n"
+			"name VARCHAR(256)) ;");
 		DB_ERROR(ret != SQLITE_OK,"Table FILES ", db);
 
 		ret = run_simple_query("CREATE TABLE assoc("
@@ -168,19 +276,17 @@ int DbBackend::create_main_tables()
 		DB_ERROR(ret != SQLITE_OK,"Table ASSOC ", db);
 
 		/* add a trigger for delete from assoc */
-		ret = run_simple_query("CREATE TRIGGER delete_trig AFTER "
-				"DELETE ON assoc \n"
-				"BEGIN \n"
-				"DELETE FROM files WHERE files.tags = '' ; \n"
-				"DELETE FROM tags WHERE tags.tag_id IN \n"
-				"(SELECT tags.tag_id FROM tags EXCEPT \n"
-				"SELECT assoc.tag_id FROM assoc ); \n "
-				"END ;");
+		ret = run_simple_query(DELETE_TRIGGER);
 		DB_ERROR(ret != SQLITE_OK,"Trigger error ", db);
 		
 		sqlite3_exec(db, "COMMIT",NULL,NULL,NULL);
+		do_trans = 0;
 	}
-	ret = 0;
+	ret = create_fprint_table();
+	if (ret == 0)
+		ret = create_checkpoint_table();
+	if (ret == 0)
+		ret = create_assoc_index();
 	
 out:
 	if(do_trans) {
@@ -193,9 +299,169 @@ out:
 	return ret;
 }
 
+int DbBackend::create_fprint_table()
+{
+	int ret;
+	
+	/* the modules keep here what they saw of a file the last time they
+	 * read it; the row goes away with the file
+	 */
+	ret = run_simple_query("CREATE TABLE IF NOT EXISTS fingerprints("
+		"ino INTEGER, \n"
+		"module INTEGER, \n"
+		"version INTEGER, \n"
+		"size INTEGER, \n"
+		"mtime INTEGER, \n"
+		"PRIMARY KEY (ino, module));");
+	if (ret != SQLITE_OK) {
+		DB_PRINTERR("Table FINGERPRINTS ", db);
+		return -1;
+	}
+	
+	ret = run_simple_query("CREATE TRIGGER IF NOT EXISTS fprint_trig AFTER "
+			"DELETE ON files \n"
+			"BEGIN \n"
+			"DELETE FROM fingerprints WHERE ino = old.ino ; \n"
+			"END ;");
+	if (ret != SQLITE_OK) {
+		DB_PRINTERR("Trigger error ", db);
+		return -1;
+	}
+	
+	return 0;
+}
+
+int DbBackend::create_checkpoint_table()
+{
+	int ret;
+	
+	ret = run_simple_query("CREATE TABLE IF NOT EXISTS checkpoints("
+		"root VARCHAR(256), \n"
+		"dir VARCHAR(256), \n"
+		"PRIMARY KEY (root, dir));");
+	if (ret != SQLITE_OK) {
+		DB_PRINTERR("Table CHECKPOINTS ", db);
+		return -1;
+	}
+	
+	return 0;
+}
+
+int DbBackend::create_assoc_index()
+{
+	int ret, old = 0;
+	int do_trans = 0;
+	const char *sql;
+	sqlite3_stmt *select = NULL;
+	
+	ret = run_simple_query("CREATE INDEX IF NOT EXISTS assoc_tag "
+			"ON assoc (tag_id, ino);");
+	DB_ERROR(ret != SQLITE_OK, "Index ASSOC_TAG ", db);
+	
+	/* the first trigger looked at all the tags for every deleted row */
+	ret = sqlite3_prepare_v2(db, "SELECT sql FROM sqlite_master WHERE "
+			"type = 'trigger' AND name = 'delete_trig';", -1, &select, 0);
+	DB_ERROR(ret != SQLITE_OK || !select, "Preparing select: ", db);
+	ret = sqlite3_step(select);
+	if (ret == SQLITE_ROW) {
+		sql = (const char *)sqlite3_column_text(select, 0);
+		old = (sql != NULL && strstr(sql, "old.tag_id") == NULL);
+	} else
+		DB_ERROR(ret != SQLITE_DONE, "Reading the triggers: ", db);
+	sqlite3_finalize(select);
+	select = NULL;
+	ret = 0;
+	if (!old)
+		goto out;
+	
+	ret = sqlite3_exec(db, "BEGIN",NULL,NULL,NULL);
+	DB_ERROR(ret != SQLITE_OK, "Cannot start the transaction", db);
+	do_trans = 1;
+	ret = run_simple_query("DROP TRIGGER delete_trig;");
+	DB_ERROR(ret != SQLITE_OK, "Trigger error ", db);
+	ret = run_simple_query(DELETE_TRIGGER);
+	DB_ERROR(ret != SQLITE_OK, "Trigger error ", db);
+	ret = 0;
+	
+out:
+	if (select)
+		sqlite3_finalize(select);
+	if (do_trans) {
+		if (ret)
+			sqlite3_exec(db, "ROLLBACK",NULL,NULL,NULL);
+		else
+			sqlite3_exec(db, "COMMIT",NULL,NULL,NULL);
+	}
+	
+	return ret;
+}
+
+int DbBackend::create_dirs_table()
+{
+	int ret, found = 0;
+	int do_trans = 0;
+	const char *col;
+	sqlite3_stmt *select = NULL;
+	
+	ret = run_simple_query("CREATE TABLE IF NOT EXISTS dirs("
+		"dir_id INTEGER PRIMARY KEY AUTOINCREMENT, \n"
+		"parent INTEGER, \n"
+		"name VARCHAR(256), \n"
+		"UNIQUE (parent, name));");
+	DB_ERROR(ret != SQLITE_OK, "Table DIRS ", db);
+	
+	/* the files of an older database have only their paths */
+	ret = sqlite3_prepare_v2(db, "PRAGMA table_info(files);", -1, &select, 0);
+	DB_ERROR(ret != SQLITE_OK || !select, "Preparing select: ", db);
+	while ((ret = sqlite3_step(select)) == SQLITE_ROW) {
+		col = (const char *)sqlite3_column_text(select, 1);
+		if (col && strcmp(col, "dir_id") == 0)
+			found = 1;
+	}
+	DB_ERROR(ret != SQLITE_DONE, "Reading the files table: ", db);
+	sqlite3_finalize(select);
+	select = NULL;
+	
+	if (!found) {
+		DBG_PRINT("HYBFS: Moving the files to the dirs table \n");
+		
+		ret = sqlite3_exec(db, "BEGIN",NULL,NULL,NULL);
+		DB_ERROR(ret != SQLITE_OK, "Cannot start the transaction", db);
+		do_trans = 1;
+		
+		ret = run_simple_query("ALTER TABLE files ADD COLUMN dir_id INTEGER;");
+		DB_ERROR(ret != SQLITE_OK, "Table FILES ", db);
+		ret = run_simple_query("ALTER TABLE files ADD COLUMN name VARCHAR(256);");
+		DB_ERROR(ret != SQLITE_OK, "Table FILES ", db);
+		/* the directories are added as the paths go by */
+		ret = run_simple_query("UPDATE files SET dir_id = hybfs_dir(path), "
+				"name = hybfs_name(path);");
+		DB_ERROR(ret != SQLITE_OK, "Cannot split the paths ", db);
+	}
+	
+	ret = run_simple_query("CREATE INDEX IF NOT EXISTS files_dir "
+			"ON files (dir_id, name);");
+	DB_ERROR(ret != SQLITE_OK, "Index FILES_DIR ", db);
+	ret = 0;
+	
+out:
+	if (select)
+		sqlite3_finalize(select);
+	if (do_trans) {
+		if (ret)
+			sqlite3_exec(db, "ROLLBACK",NULL,NULL,NULL);
+		else
+			sqlite3_exec(db, "COMMIT",NULL,NULL,NULL);
+	}
+	
+	return ret;
+}
+
 int DbBackend::db_init_storage()
 {
 	int ret = 0;
+	size_t pos;
+	struct stat st;
 
 	DBG_SHOWFC();
 
@@ -208,6 +474,7 @@ int DbBackend::db_init_storage()
 		sqlite3_close(db);
 		return ret;
 	}
+	sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
 	
 	ret = create_main_tables();
 	if (ret) {
@@ -215,15 +482,873 @@ int DbBackend::db_init_storage()
 		return -1;
 	}
 	
+	/* the files are kept by directory and name */
+	sqlite3_create_function(db, "hybfs_path", 3, SQLITE_UTF8, this,
+	                        sql_path, NULL, NULL);
+	sqlite3_create_function(db, "hybfs_dir", 1, SQLITE_UTF8, this,
+	                        sql_dir, NULL, NULL);
+	sqlite3_create_function(db, "hybfs_find_dir", 1, SQLITE_UTF8, this,
+	                        sql_find_dir, NULL, NULL);
+	sqlite3_create_function(db, "hybfs_name", 1, SQLITE_UTF8, this,
+	                        sql_name, NULL, NULL);
+	ret = create_dirs_table();
+	if (ret) {
+		db_close_storage();
+		return -1;
+	}
+	
+	/* the cache of the tag ids must hear about the tags the trigger deletes
+	 * and about the transactions of the others */
+	sqlite3_create_function(db, "hybfs_tag_dropped", 1, SQLITE_UTF8, this,
+	                        sql_tag_dropped, NULL, NULL);
+	sqlite3_commit_hook(db, sql_commit_hook, this);
+	sqlite3_rollback_hook(db, sql_rollback_hook, this);
+	ret = run_simple_query("CREATE TEMP TRIGGER IF NOT EXISTS tag_drop_trig "
+			"AFTER DELETE ON main.tags BEGIN "
+			"SELECT hybfs_tag_dropped(OLD.tag_id); END;");
+	if (ret) {
+		db_close_storage();
+		return -1;
+	}
+	
+	/* tags that we won't see changing are as old as the database */
+	if (stat(db_path.c_str(), &st) == 0)
+		base_mtime = last_mtime = st.st_mtime;
+	
+	/* the module manager writes the database from another process */
+	counter_fd = open(db_path.c_str(), O_RDONLY);
+	if (counter_fd == -1)
+		PRINT_ERROR("hybfs: cannot watch %s for changes: %s\n",
+		            db_path.c_str(), strerror(errno));
+	
+	/* the snapshot sits next to the database, with the same shard number
+	 * after its name */
+	pos = db_path.rfind('/') + 1;
+	snap_path = db_path.substr(0, pos);
+	snap_path.append(SNAPSHOT_FILE);
+	if (db_path.compare(pos, strlen(MAINDB), MAINDB) == 0)
+		snap_path.append(db_path, pos + strlen(MAINDB), string::npos);
+	/* a snapshot older than the database is of no use */
+	if (snapshot.open(snap_path.c_str()) == 0 &&
+	    !snapshot_valid(read_change_counter()))
+		snapshot.close();
+	
+	/* the queries and the writers find the tags in the dictionary */
+	load_tag_ids();
+	
+	return 0;
+}
+
+int DbBackend::db_write_snapshot()
+{
+	int ret;
+	unsigned int counter, disk_counter;
+	const char *str;
+	vector<snap_build_tag_t> tags;
+	vector<snap_build_file_t> files;
+	boost::unordered_map<long long, size_t> index;
+	boost::unordered_map<long long, size_t>::iterator idx;
+	snap_build_tag_t bt;
+	snap_build_file_t bf;
+	sqlite3_stmt *select = NULL;
+	int do_trans = 0;
+	
+	DBG_SHOWFC();
+	
+	if (db == NULL || counter_fd == -1)
+		return -1;
+	
+	/* the read transaction keeps the writers out until we're done */
+	if (db_begin_transaction())
+		return -1;
+	do_trans = 1;
+	
+	ret = sqlite3_prepare_v2(db, "SELECT tag_id, tag, value FROM tags;",
+			-1, &select, 0);
+	DB_ERROR(ret != SQLITE_OK || !select, "Preparing select: ", db);
+	while ((ret = sqlite3_step(select)) == SQLITE_ROW) {
+		bt.tag_id = sqlite3_column_int64(select, 0);
+		str = (const char *)sqlite3_column_text(select, 1);
+		bt.tag = str ? str : "";
+		str = (const char *)sqlite3_column_text(select, 2);
+		bt.value = str ? str : "";
+		index[bt.tag_id] = tags.size();
+		tags.push_back(bt);
+	}
+	DB_ERROR(ret != SQLITE_DONE, "Cannot read the tags: ", db);
+	sqlite3_finalize(select);
+	select = NULL;
+	
+	/* the table is locked now, so the counter can't move anymore */
+	counter = read_change_counter();
+	if (IndexSnapshot::read_counter(snap_path.c_str(), &disk_counter) == 0 &&
+	    disk_counter == counter) {
+		ret = 0;
+		goto out;
+	}
+	
+	ret = sqlite3_prepare_v2(db, "SELECT tag_id, ino FROM assoc;",
+			-1, &select, 0);
+	DB_ERROR(ret != SQLITE_OK || !select, "Preparing select: ", db);
+	while ((ret = sqlite3_step(select)) == SQLITE_ROW) {
+		idx = index.find(sqlite3_column_int64(select, 0));
+		if (idx != index.end())
+			tags[idx->second].inos.push_back(sqlite3_column_int64(select, 1));
+	}
+	DB_ERROR(ret != SQLITE_DONE, "Cannot read the associations: ", db);
+	sqlite3_finalize(select);
+	select = NULL;
+	
+	sync_dirs();
+	ret = sqlite3_prepare_v2(db, "SELECT ino, mode, " FILE_PATH " FROM files;",
+			-1, &select, 0);
+	DB_ERROR(ret != SQLITE_OK || !select, "Preparing select: ", db);
+	while ((ret = sqlite3_step(select)) == SQLITE_ROW) {
+		bf.ino = sqlite3_column_int64(select, 0);
+		bf.mode = sqlite3_column_int(select, 1);
+		str = (const char *)sqlite3_column_text(select, 2);
+		bf.path = str ? str : "";
+		files.push_back(bf);
+	}
+	DB_ERROR(ret != SQLITE_DONE, "Cannot read the files: ", db);
+	sqlite3_finalize(select);
+	select = NULL;
+	
+	ret = IndexSnapshot::write(snap_path.c_str(), counter, &tags, &files);
+	
+out:
+	if(select)
+		sqlite3_finalize(select);
+	if(do_trans)
+		db_end_transaction();
+	
+	return ret;
+}
+
+/* a plain copy of a file; it's created only for the owner */
+static int copy_file(const char *from, const char *to)
+{
+	int in, out = -1, ret = -1;
+	ssize_t n, done, w;
+	char *buf;
+	
+	buf = (char *) malloc(1 << 20);
+	if (buf == NULL)
+		return -1;
+	in = open(from, O_RDONLY);
+	if (in == -1)
+		goto out;
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (out == -1)
+		goto out;
+	while ((n = read(in, buf, 1 << 20)) > 0) {
+		for (done = 0; done < n; done += w) {
+			w = write(out, buf + done, n - done);
+			if (w == -1)
+				goto out;
+		}
+	}
+	if (n == 0)
+		ret = 0;
+	
+out:
+	if (in != -1)
+		close(in);
+	if (out != -1 && close(out))
+		ret = -1;
+	free(buf);
+	
+	return ret;
+}
+
+/* the path of a directory of a copy of the database, from its rows in
+ * nodes; the paths found are kept in paths, which starts with the root */
+static int copy_dir_path(boost::unordered_map<long long, dir_node_t> *nodes,
+                         boost::unordered_map<long long, string> *paths,
+                         long long dir_id, string *path)
+{
+	vector<long long> up;
+	boost::unordered_map<long long, string>::iterator p;
+	boost::unordered_map<long long, dir_node_t>::iterator dn;
+	
+	/* up to the first directory whose path is known; the root is */
+	while ((p = paths->find(dir_id)) == paths->end()) {
+		dn = nodes->find(dir_id);
+		/* lost, or a loop in a damaged table */
+		if (dn == nodes->end() || up.size() > nodes->size())
+			return -1;
+		up.push_back(dir_id);
+		dir_id = dn->second.parent;
+	}
+	path->assign(p->second);
+	
+	/* and down again, keeping the paths on the way */
+	for (vector<long long>::reverse_iterator i = up.rbegin(); i != up.rend(); i++) {
+		if (path->length() > 0)
+			path->append("/");
+		path->append((*nodes)[*i].name);
+		(*paths)[*i] = *path;
+	}
+	
+	return 0;
+}
+
+int DbBackend::db_export_begin()
+{
+	int ret;
+	string copy = db_path + EXPORT_COPY_SUFFIX;
+	sqlite3_stmt *sql = NULL;
+	
+	if (db_begin_transaction())
+		return -1;
+	
+	/* a read takes the lock of the file, and inside the transaction it
+	 * is kept; a writer can't change the file until we are done */
+	ret = sqlite3_prepare_v2(db, "SELECT tag_id FROM tags LIMIT 1;", -1,
+	                         &sql, 0);
+	DB_ERROR(ret != SQLITE_OK || !sql, "Preparing select: ", db);
+	ret = sqlite3_step(sql);
+	DB_ERROR(ret != SQLITE_ROW && ret != SQLITE_DONE,
+	         "Cannot lock the database: ", db);
+	ret = 0;
+	
+	if (copy_file(db_path.c_str(), copy.c_str())) {
+		PRINT_ERROR("hybfs: cannot copy %s: %s\n", db_path.c_str(),
+		            strerror(errno));
+		unlink(copy.c_str());
+		ret = -1;
+	}
+	
+out:
+	if (sql)
+		sqlite3_finalize(sql);
+	if (ret)
+		db_rollback();
+	
+	return ret ? -1 : 0;
+}
+
+void DbBackend::db_export_end()
+{
+	db_end_transaction();
+}
+
+void DbBackend::db_export_drop()
+{
+	unlink((db_path + EXPORT_COPY_SUFFIX).c_str());
+}
+
+int DbBackend::db_export(ExportWriter *w, int shard, int nshards,
+                         export_stats_t *stats)
+{
+	int ret, aret;
+	long long ino, dir_id;
+	const char *str;
+	string copy = db_path + EXPORT_COPY_SUFFIX, path;
+	vector<uint32_t> ids;
+	dir_node_t node;
+	boost::unordered_map<long long, dir_node_t> nodes;
+	boost::unordered_map<long long, string> paths;
+	sqlite3 *cdb = NULL;
+	sqlite3_stmt *tags = NULL, *files = NULL, *assoc = NULL, *dirs = NULL;
+	
+	/* the copy has none of our functions, the paths are made here */
+	ret = sqlite3_open_v2(copy.c_str(), &cdb, SQLITE_OPEN_READONLY, NULL);
+	DB_ERROR(ret != SQLITE_OK, "Cannot open the copy: ", cdb);
+	
+	ret = sqlite3_prepare_v2(cdb, "SELECT dir_id, parent, name FROM dirs;",
+	                         -1, &dirs, 0);
+	DB_ERROR(ret != SQLITE_OK || !dirs, "Preparing select: ", cdb);
+	while ((ret = sqlite3_step(dirs)) == SQLITE_ROW) {
+		node.parent = sqlite3_column_int64(dirs, 1);
+		str = (const char *) sqlite3_column_text(dirs, 2);
+		node.name.assign(str ? str : "", sqlite3_column_bytes(dirs, 2));
+		nodes[sqlite3_column_int64(dirs, 0)] = node;
+	}
+	DB_ERROR(ret != SQLITE_DONE, "Cannot read the directories: ", cdb);
+	paths[0] = "";
+	
+	ret = sqlite3_prepare_v2(cdb, "SELECT tag_id, tag, value FROM tags;", -1,
+	                         &tags, 0);
+	DB_ERROR(ret != SQLITE_OK || !tags, "Preparing select: ", cdb);
+	while ((ret = sqlite3_step(tags)) == SQLITE_ROW) {
+		w->begin(EXP_TAG);
+		/* the same tag may come from the other shards too */
+		w->put_u32(sqlite3_column_int(tags, 0) * nshards + shard);
+		str = (const char *) sqlite3_column_text(tags, 1);
+		w->put_str(str ? str : "", sqlite3_column_bytes(tags, 1));
+		str = (const char *) sqlite3_column_text(tags, 2);
+		w->put_str(str ? str : "", sqlite3_column_bytes(tags, 2));
+		if (w->end())
+			goto io_error;
+		stats->ntags++;
+	}
+	DB_ERROR(ret != SQLITE_DONE, "Cannot read the tags: ", cdb);
+	
+	/* both in inode order, so they are merged as they are read */
+	ret = sqlite3_prepare_v2(cdb, "SELECT ino, mode, dir_id, name, path "
+			"FROM files ORDER BY ino;", -1, &files, 0);
+	DB_ERROR(ret != SQLITE_OK || !files, "Preparing select: ", cdb);
+	ret = sqlite3_prepare_v2(cdb, "SELECT ino, tag_id FROM assoc "
+			"ORDER BY ino;", -1, &assoc, 0);
+	DB_ERROR(ret != SQLITE_OK || !assoc, "Preparing select: ", cdb);
+	
+	aret = sqlite3_step(assoc);
+	while ((ret = sqlite3_step(files)) == SQLITE_ROW) {
+		ino = sqlite3_column_int64(files, 0);
+		ids.clear();
+		while (aret == SQLITE_ROW && sqlite3_column_int64(assoc, 0) <= ino) {
+			if (sqlite3_column_int64(assoc, 0) == ino)
+				ids.push_back(sqlite3_column_int(assoc, 1) *
+				              nshards + shard);
+			aret = sqlite3_step(assoc);
+		}
+		
+		/* a row from before the dirs table has only its path */
+		if (sqlite3_column_type(files, 2) == SQLITE_NULL) {
+			str = (const char *) sqlite3_column_text(files, 4);
+			path.assign(str ? str : "", sqlite3_column_bytes(files, 4));
+		}
+		else {
+			dir_id = sqlite3_column_int64(files, 2);
+			if (copy_dir_path(&nodes, &paths, dir_id, &path))
+				continue;
+			if (path.length() > 0)
+				path.append("/");
+			str = (const char *) sqlite3_column_text(files, 3);
+			path.append(str ? str : "", sqlite3_column_bytes(files, 3));
+		}
+		
+		w->begin(EXP_FILE);
+		w->put_u64(ino);
+		w->put_u32(sqlite3_column_int(files, 1));
+		w->put_str(path.data(), path.length());
+		w->put_u32(ids.size());
+		for (vector<uint32_t>::iterator i = ids.begin(); i != ids.end(); i++)
+			w->put_u32(*i);
+		if (w->end())
+			goto io_error;
+		stats->nfiles++;
+		stats->nassoc += ids.size();
+	}
+	DB_ERROR(ret != SQLITE_DONE, "Cannot read the files: ", cdb);
+	DB_ERROR(aret != SQLITE_ROW && aret != SQLITE_DONE,
+	         "Cannot read the associations: ", cdb);
+	ret = 0;
+	goto out;
+	
+io_error:
+	PRINT_ERROR("hybfs: cannot write the export: %s\n", strerror(errno));
+	ret = -1;
+out:
+	if (dirs)
+		sqlite3_finalize(dirs);
+	if (tags)
+		sqlite3_finalize(tags);
+	if (files)
+		sqlite3_finalize(files);
+	if (assoc)
+		sqlite3_finalize(assoc);
+	sqlite3_close(cdb);
+	db_export_drop();
+	
+	return ret ? -1 : 0;
+}
+
+/* a tag of the stream, as it is added to the files */
+typedef struct {
+	string tag;
+	string value;
+	/** its id in the tags table, 0 until a file of the stream has it */
+	int tag_id;
+	/** what is appended to the string of tags of a file */
+	string entry;
+} import_tag_t;
+
+int DbBackend::db_import(FILE *in, int shard, int nshards,
+                         export_stats_t *stats)
+{
+	int ret, type, ended = 0, batch = 0, do_trans = 0;
+	int dirfd = db_get_dirfd();
+	uint32_t id, mode, ntags;
+	uint64_t ino, counts[3];
+	long cache_pages;
+	char pragma[64];
+	string tag, value, path, file_tags;
+	struct stat st;
+	import_tag_t it;
+	boost::unordered_map<uint32_t, import_tag_t> stream_tags;
+	boost::unordered_map<uint32_t, import_tag_t>::iterator t;
+	set<string> touched;
+	ExportReader r(in);
+	TagDict *dict = TagDict::get();
+	sqlite3_stmt *get = NULL, *put = NULL, *link = NULL;
+	
+	memset(stats, 0, sizeof(export_stats_t));
+	if (dirfd == -1 || r.header())
+		return -1;
+	
+	/* the import touches most of the pages of a small database and many
+	 * of a big one; the usual cache is given back at the end (newer
+	 * SQLite versions give it in kB, as a negative number) */
+	cache_pages = pragma_value("PRAGMA cache_size;");
+	if (cache_pages != -1)
+		db_set_cache(IMPORT_CACHE_BYTES);
+	
+	/* a write lock from the start: a read lock that has to grow into
+	 * one fails at once when another writer waits for it */
+	ret = trans_begin("BEGIN IMMEDIATE");
+	DB_ERROR(ret, "Cannot start the transaction", db);
+	do_trans = 1;
+	
+	ret = sqlite3_prepare_v2(db, "SELECT tags FROM files WHERE ino = ?1;",
+	                         -1, &get, 0);
+	DB_ERROR(ret != SQLITE_OK || !get, "Preparing select: ", db);
+	ret = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO files "
+			"(ino, mode, dir_id, name, tags) VALUES (?1, ?2, "
+			"hybfs_dir(?3), hybfs_name(?3), ?4);", -1, &put, 0);
+	DB_ERROR(ret != SQLITE_OK || !put, "Preparing insert: ", db);
+	ret = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO assoc (ino, tag_id) "
+			"VALUES (?1, ?2);", -1, &link, 0);
+	DB_ERROR(ret != SQLITE_OK || !link, "Preparing insert: ", db);
+	
+	while (!ended && (type = r.next()) > 0) {
+		switch (type) {
+		case EXP_TAG:
+			if (r.get_u32(&id) || r.get_str(&tag) || r.get_str(&value))
+				goto damaged;
+			it.tag = tag;
+			it.value = value;
+			it.tag_id = 0;
+			it.entry = tag + ":" + value + " ";
+			stream_tags[id] = it;
+			/* the caches may learn a tag id that a rollback takes
+			 * away, so they forget these tags in any case */
+			touched.insert(tag);
+			stats->ntags++;
+			break;
+		case EXP_FILE:
+			if (r.get_u64(&ino) || r.get_u32(&mode) ||
+			    r.get_path(&path) || r.get_u32(&ntags))
+				goto damaged;
+			stats->nfiles++;
+			/* the inode it has in this branch */
+			if (fstatat(dirfd, path.c_str(), &st, AT_SYMLINK_NOFOLLOW)) {
+				if (shard == 0)
+					stats->nskipped++;
+				break;
+			}
+			/* another shard takes it */
+			if (shard_of_ino(st.st_ino, nshards) != shard)
+				break;
+			
+			sqlite3_bind_int64(get, 1, st.st_ino);
+			ret = sqlite3_step(get);
+			if (ret == SQLITE_ROW && sqlite3_column_text(get, 0))
+				file_tags = (const char *) sqlite3_column_text(get, 0);
+			else
+				file_tags = " ";
+			DB_ERROR(ret != SQLITE_ROW && ret != SQLITE_DONE,
+			         "Cannot read the file: ", db);
+			sqlite3_reset(get);
+			
+			sqlite3_bind_int64(link, 1, st.st_ino);
+			for (; ntags > 0; ntags--) {
+				if (r.get_u32(&id))
+					goto damaged;
+				t = stream_tags.find(id);
+				if (t == stream_tags.end())
+					goto damaged;
+				/* only the tags that a file gets take room in
+				 * the dictionary */
+				if (t->second.tag_id == 0) {
+					t->second.tag_id = add_tag(
+						t->second.tag.c_str(),
+						t->second.value.c_str(),
+						dict->intern(t->second.tag.c_str(),
+						             t->second.value.c_str()));
+					DB_ERROR(t->second.tag_id <= 0,
+					         "Cannot add the tag: ", db);
+				}
+				sqlite3_bind_int(link, 2, t->second.tag_id);
+				ret = sqlite3_step(link);
+				DB_ERROR(ret != SQLITE_DONE, "Cannot add the tag: ", db);
+				sqlite3_reset(link);
+				/* the file may have had it already */
+				if (sqlite3_changes(db) == 0)
+					continue;
+				file_tags.append(t->second.entry);
+				stats->nassoc++;
+			}
+			
+			sqlite3_bind_int64(put, 1, st.st_ino);
+			sqlite3_bind_int(put, 2, st.st_mode);
+			sqlite3_bind_text(put, 3, path.data(), path.length(),
+			                  SQLITE_STATIC);
+			sqlite3_bind_text(put, 4, file_tags.data(), file_tags.length(),
+			                  SQLITE_STATIC);
+			ret = sqlite3_step(put);
+			DB_ERROR(ret != SQLITE_DONE, "Cannot add the file: ", db);
+			sqlite3_reset(put);
+			
+			/* let the mounted file system write between the
+			 * batches, before its busy timeout runs out; its
+			 * busy handler looks at the lock again only every
+			 * IMPORT_PAUSE_MS */
+			if (++batch < IMPORT_BATCH)
+				break;
+			batch = 0;
+			do_trans = 0;
+			ret = db_end_transaction();
+			DB_ERROR(ret, "Cannot commit the import", db);
+			usleep(IMPORT_PAUSE_MS * 1000);
+			ret = trans_begin("BEGIN IMMEDIATE");
+			DB_ERROR(ret, "Cannot start the transaction", db);
+			do_trans = 1;
+			break;
+		case EXP_END:
+			if (r.get_u64(&counts[0]) || r.get_u64(&counts[1]) ||
+			    r.get_u64(&counts[2]))
+				goto damaged;
+			if ((long long) counts[0] != stats->ntags ||
+			    (long long) counts[1] != stats->nfiles)
+				goto damaged;
+			ended = 1;
+			break;
+		default:
+			/* from a newer writer; we can do without it */
+			break;
+		}
+	}
+	if (!ended)
+		goto damaged;
+	
+	do_trans = 0;
+	ret = db_end_transaction();
+	DB_ERROR(ret, "Cannot commit the import", db);
+	goto out;
+	
+damaged:
+	PRINT_ERROR("hybfs: the export is damaged or was cut\n");
+	ret = -1;
+out:
+	if (get)
+		sqlite3_finalize(get);
+	if (put)
+		sqlite3_finalize(put);
+	if (link)
+		sqlite3_finalize(link);
+	if (do_trans)
+		db_rollback();
+	if (cache_pages != -1) {
+		snprintf(pragma, sizeof(pragma), "PRAGMA cache_size = %ld;",
+		         cache_pages);
+		run_simple_query(pragma);
+	}
+	for (set<string>::iterator n = touched.begin(); n != touched.end(); n++)
+		touch_tag(n->c_str());
+	
+	return ret;
+}
+
+long DbBackend::pragma_value(const char *pragma)
+{
+	int ret;
+	long value = -1;
+	sqlite3_stmt *sql = NULL;
+	
+	ret = sqlite3_prepare_v2(db, pragma, -1, &sql, 0);
+	DB_ERROR(ret != SQLITE_OK || !sql, "Preparing pragma: ", db);
+	if (sqlite3_step(sql) == SQLITE_ROW)
+		value = sqlite3_column_int64(sql, 0);
+	
+out:
+	if (sql)
+		sqlite3_finalize(sql);
+	
+	return value;
+}
+
+static long elapsed_ms(struct timeval *start)
+{
+	struct timeval now;
+	
+	gettimeofday(&now, NULL);
+	
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_usec - start->tv_usec) / 1000;
+}
+
+long DbBackend::db_set_cache(long bytes)
+{
+	long page_size, pages;
+	char pragma[64];
+	
+	if (!db)
+		return -1;
+	page_size = pragma_value("PRAGMA page_size;");
+	if (page_size <= 0)
+		return -1;
+	
+	pages = bytes / page_size;
+	/* less than this is of no use to anybody */
+	if (pages < 16)
+		pages = 16;
+	snprintf(pragma, sizeof(pragma), "PRAGMA cache_size = %ld;", pages);
+	if (run_simple_query(pragma))
+		return -1;
+	
+	return pages;
+}
+
+int DbBackend::vacuum_step(maint_stats_t *stats)
+{
+	int ret;
+	long mode, free_pages;
+	char pragma[64];
+	struct timeval start;
+	
+	mode = pragma_value("PRAGMA auto_vacuum;");
+	free_pages = pragma_value("PRAGMA freelist_count;");
+	if (mode < 0 || free_pages < 0)
+		return -1;
+	if (free_pages == 0)
+		return 0;
+	
+	/* the others are rebuilt at mount time, by db_convert_vacuum() */
+	if (mode != 2)
+		return 0;
+	
+	gettimeofday(&start, NULL);
+	snprintf(pragma, sizeof(pragma), "PRAGMA incremental_vacuum(%d);",
+	         MAINT_VACUUM_PAGES);
+	ret = run_simple_query(pragma);
+	stats->vacuum = 1;
+	stats->vacuum_ms = elapsed_ms(&start);
+	
+	return ret ? -1 : 0;
+}
+
+int DbBackend::db_convert_vacuum()
+{
+	int ret;
+	long mode, free_pages;
+	struct timeval start;
+	
+	if (!db)
+		return -1;
+	mode = pragma_value("PRAGMA auto_vacuum;");
+	free_pages = pragma_value("PRAGMA freelist_count;");
+	if (mode < 0 || free_pages < 0)
+		return -1;
+	if (mode == 2 || free_pages < MAINT_CONVERT_PAGES)
+		return 0;
+	
+	/* the mode of a database with tables changes only with a rebuild;
+	 * it's the last one */
+	gettimeofday(&start, NULL);
+	ret = run_simple_query("PRAGMA auto_vacuum = INCREMENTAL;");
+	if (ret == SQLITE_OK)
+		ret = run_simple_query("VACUUM;");
+	if (ret) {
+		DB_PRINTERR("hybfs: cannot rebuild the database", db);
+		return -1;
+	}
+	PRINT_ERROR("hybfs: %s rebuilt for the incremental vacuum in %ld ms\n",
+	            db_path.c_str(), elapsed_ms(&start));
+	
+	return 0;
+}
+
+int DbBackend::analyze_step(maint_stats_t *stats)
+{
+	int ret, changes;
+	unsigned long gen;
+	struct timeval start;
+	
+	changes = sqlite3_total_changes(db);
+	gen = check_foreign_writes();
+	if (analyze_changes < 0) {
+		/* the statistics from the last mount are good enough */
+		analyze_changes = changes;
+		analyze_gen = gen;
+		if (pragma_value("SELECT count(*) FROM sqlite_master "
+				"WHERE name = 'sqlite_stat1';") > 0)
+			return 0;
+	} else if (changes - analyze_changes < MAINT_ANALYZE_CHANGES &&
+	           gen == analyze_gen)
+		return 0;
+	
+	gettimeofday(&start, NULL);
+	ret = run_simple_query("ANALYZE;");
+	stats->analyze_ms = elapsed_ms(&start);
+	if (ret)
+		return -1;
+	stats->analyzed = 1;
+	
+	/* without counting what ANALYZE wrote */
+	analyze_changes = sqlite3_total_changes(db);
+	analyze_gen = check_foreign_writes();
+	
 	return 0;
 }
 
+int DbBackend::db_maintain(maint_stats_t *stats)
+{
+	int ret = 0;
+	
+	memset(stats, 0, sizeof(maint_stats_t));
+	if (!db)
+		return -1;
+	/* it would be part of the transaction of another thread; we come
+	 * back at the next idle period rather than make the threads wait */
+	if (pthread_mutex_trylock(&trans_lock))
+		return 1;
+	
+	stats->pages_before = pragma_value("PRAGMA page_count;");
+	if (vacuum_step(stats))
+		ret = -1;
+	if (analyze_step(stats))
+		ret = -1;
+	stats->pages_after = pragma_value("PRAGMA page_count;");
+	stats->free_pages = pragma_value("PRAGMA freelist_count;");
+	stats->cache_pages = pragma_value("PRAGMA cache_size;");
+	pthread_mutex_unlock(&trans_lock);
+	
+	return ret;
+}
+
+int DbBackend::snapshot_valid(unsigned int counter)
+{
+	/* the counter is 0 when we can't read it */
+	return snapshot.is_open() && counter != 0 &&
+	       snapshot.get_counter() == counter;
+}
+
+long DbBackend::snapshot_count(string *query, vector<tag_info_t> *tags,
+                               string *path)
+{
+	if (tags == NULL || tags->empty() || !snapshot_valid(read_change_counter()))
+		return -1;
+	/* the snapshot has no paths to restrict the files to */
+	if (path != NULL && path->length() > 0)
+		return -1;
+	if (query->find(" OR ") != string::npos || query->find(" NOT ") != string::npos)
+		return -1;
+	/* LIKE would take them as wildcards */
+	for (vector<tag_info_t>::iterator i = tags->begin(); i != tags->end(); i++) {
+		const dict_entry_t *e = TagDict::get()->entry((*i).id);
+		if (e == NULL || e->tag.find_first_of("%_") != string::npos ||
+		    e->value.find_first_of("%_") != string::npos)
+			return -1;
+	}
+	
+	return snapshot.count_all(tags);
+}
+
+void DbBackend::touch_tag(const char *tag)
+{
+	touch_tag_id(TagDict::get()->intern(tag, NULL));
+}
+
+void DbBackend::touch_tag_id(dict_id_t name)
+{
+	tag_gen_t *tg = &tag_gens[name % TAG_GEN_BUCKETS];
+	unsigned long gen, old;
+	time_t now = time(NULL);
+	
+	gen = __sync_add_and_fetch(&generation, 1);
+	/* don't go back if another writer stored a newer stamp meanwhile */
+	do {
+		old = tg->gen;
+		if (old >= gen)
+			break;
+	} while (!__sync_bool_compare_and_swap(&tg->gen, old, gen));
+	if (tg->mtime < now)
+		tg->mtime = now;
+	if (last_mtime < now)
+		last_mtime = now;
+}
+
+unsigned int DbBackend::read_change_counter()
+{
+	unsigned char hdr[4];
+	
+	if (counter_fd == -1)
+		return 0;
+	/* big endian, at offset 24 of the database header */
+	if (pread(counter_fd, hdr, sizeof(hdr), 24) != sizeof(hdr))
+		return 0;
+	
+	return (hdr[0] << 24) | (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+}
+
+void DbBackend::touch_file_tags(const char *path)
+{
+	int ret;
+	const char *tags;
+	sqlite3_stmt *select = NULL;
+	
+	ret = sqlite3_prepare_v2(db, "SELECT tags FROM files WHERE "
+			FILE_IS(1) ";", -1, &select, 0);
+	if (ret != SQLITE_OK || !select) {
+		DB_PRINTERR("Preparing select: ",db);
+		goto out;
+	}
+	sqlite3_bind_text(select, 1, path, -1, SQLITE_STATIC);
+	
+	while (sqlite3_step(select) == SQLITE_ROW) {
+		tags = (const char *)sqlite3_column_text(select, 0);
+		if (tags == NULL)
+			continue;
+		/* the tags are stored as " tag:value tag:value " */
+		string stags(tags);
+		boost::char_separator<char> sep(" ");
+		path_tokenizer t(stags, sep);
+		for (path_tokenizer::iterator it = t.begin(); it != t.end(); ++it) {
+			string tag, value;
+			string tag_value = *it;
+			break_tag(&tag_value, &tag, &value);
+			touch_tag(tag.c_str());
+		}
+	}
+	
+out:
+	if (select)
+		sqlite3_finalize(select);
+}
+
 int DbBackend::db_add_tag(const char *tag, const char *value)
+{
+	dict_id_t id;
+	
+	DBG_SHOWFC();
+	
+	if (value == NULL)
+		value = NULL_VALUE;
+	id = TagDict::get()->intern(tag, value);
+	
+	return add_tag(tag, value, id);
+}
+
+int DbBackend::add_tag(const char *tag, const char *value, dict_id_t id)
 {
 	int ret = -1;
+	int tag_id;
 	sqlite3_stmt *select= NULL;
-
-	DBG_SHOWFC();
+	boost::unordered_map<dict_id_t, int>::iterator ti;
+	
+	/* most of the tags are already in the table */
+	pthread_mutex_lock(&tag_ids_lock);
+	if (id && tag_ids_valid()) {
+		ti = tag_ids.find(id);
+		if (ti != tag_ids.end()) {
+			tag_id = ti->second;
+			pthread_mutex_unlock(&tag_ids_lock);
+			return tag_id;
+		}
+	}
+	pthread_mutex_unlock(&tag_ids_lock);
 
 	/* adds the info in the tag table */
 	ret = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO tags (tag, value) "
@@ -235,10 +1360,7 @@ int DbBackend::db_add_tag(const char *tag, const char *value)
 	}
 
 	sqlite3_bind_text(select, 1, tag, -1, SQLITE_STATIC);
-	if(value != NULL)
-		sqlite3_bind_text(select, 2, value, -1, SQLITE_STATIC);
-	else
-		sqlite3_bind_text(select, 2, NULL_VALUE, -1, SQLITE_STATIC);
+	sqlite3_bind_text(select, 2, value, -1, SQLITE_STATIC);
 	
 	ret = sqlite3_step(select);
 	if(ret != SQLITE_DONE) {
@@ -255,13 +1377,475 @@ int DbBackend::db_add_tag(const char *tag, const char *value)
 		goto error;
 	}
 
-	return db_check_tag(tag, value);
+	tag_id = db_check_tag(tag, value);
+	if (tag_id > 0 && id) {
+		pthread_mutex_lock(&tag_ids_lock);
+		tag_ids[id] = tag_id;
+		tag_dict_ids[tag_id] = id;
+		pthread_mutex_unlock(&tag_ids_lock);
+	}
+	
+	return tag_id;
+	
+error:
+	if(select)
+		sqlite3_finalize(select);
+
+	return -1;
+}
+
+int DbBackend::load_tag_ids()
+{
+	int ret;
+	int tag_id;
+	const char *tag, *value;
+	dict_id_t id;
+	sqlite3_stmt *select = NULL;
+	
+	ret = sqlite3_prepare_v2(db, "SELECT tag_id, tag, value FROM tags;",
+			-1, &select, 0);
+	DB_ERROR(ret != SQLITE_OK || !select, "Preparing select: ", db);
+	
+	pthread_mutex_lock(&tag_ids_lock);
+	tag_ids_gen = check_foreign_writes();
+	while ((ret = sqlite3_step(select)) == SQLITE_ROW) {
+		tag_id = sqlite3_column_int(select, 0);
+		tag = (const char *)sqlite3_column_text(select, 1);
+		value = (const char *)sqlite3_column_text(select, 2);
+		if (tag == NULL)
+			continue;
+		id = TagDict::get()->intern(tag, value ? value : NULL_VALUE);
+		if (id == 0)
+			break;
+		tag_ids[id] = tag_id;
+		tag_dict_ids[tag_id] = id;
+	}
+	pthread_mutex_unlock(&tag_ids_lock);
+	DB_ERROR(ret != SQLITE_DONE && ret != SQLITE_ROW,
+	         "Cannot read the tags: ", db);
+	ret = 0;
+	
+out:
+	if (select)
+		sqlite3_finalize(select);
+	
+	return ret;
+}
+
+int DbBackend::tag_ids_valid()
+{
+	unsigned long gen;
+	
+	gen = check_foreign_writes();
+	if (gen == tag_ids_gen)
+		return 1;
+	
+	/* another process wrote the database: its tags may be gone */
+	tag_ids.clear();
+	tag_dict_ids.clear();
+	tag_ids_gen = gen;
+	
+	return 0;
+}
+
+unsigned long DbBackend::check_foreign_writes()
+{
+	unsigned int counter, commits;
+	
+	/* without the counter we can't see the other writers */
+	if (counter_fd == -1)
+		return __sync_add_and_fetch(&foreign_gen, 1);
+	
+	pthread_mutex_lock(&counter_lock);
+	counter = read_change_counter();
+	commits = own_commits;
+	if (counter != seen_counter + commits) {
+		__sync_add_and_fetch(&foreign_gen, 1);
+		/* we can't tell which tags they changed, so all of them are
+		 * as new as this */
+		base_mtime = last_mtime = time(NULL);
+	}
+	seen_counter = counter;
+	__sync_sub_and_fetch(&own_commits, commits);
+	pthread_mutex_unlock(&counter_lock);
+	
+	return foreign_gen;
+}
+
+void DbBackend::sql_tag_dropped(sqlite3_context *ctx, int argc,
+                                sqlite3_value **argv)
+{
+	DbBackend *self = (DbBackend *) sqlite3_user_data(ctx);
+	boost::unordered_map<int, dict_id_t>::iterator di;
+	int tag_id;
+	
+	if (argc != 1)
+		return;
+	tag_id = sqlite3_value_int(argv[0]);
+	
+	pthread_mutex_lock(&self->tag_ids_lock);
+	di = self->tag_dict_ids.find(tag_id);
+	if (di != self->tag_dict_ids.end()) {
+		self->tag_ids.erase(di->second);
+		self->tag_dict_ids.erase(di);
+	}
+	pthread_mutex_unlock(&self->tag_ids_lock);
+	sqlite3_result_null(ctx);
+}
+
+int DbBackend::sql_commit_hook(void *arg)
+{
+	DbBackend *self = (DbBackend *) arg;
+	
+	__sync_add_and_fetch(&self->own_commits, 1);
+	
+	return 0;
+}
+
+void DbBackend::sql_rollback_hook(void *arg)
+{
+	DbBackend *self = (DbBackend *) arg;
+	
+	/* the tags and the directories it added are not in the tables
+	 * anymore; this is rare */
+	__sync_add_and_fetch(&self->foreign_gen, 1);
+}
+
+/* strips the slashes around a relative path, returns what is left of it */
+static size_t trim_path(const char **path, size_t len)
+{
+	while (len > 0 && (*path)[0] == '/') {
+		(*path)++;
+		len--;
+	}
+	while (len > 0 && (*path)[len - 1] == '/')
+		len--;
+	
+	return len;
+}
+
+/* the key of a directory in the cache: its parent and its name */
+static string dir_key(long long parent, const string &name)
+{
+	char buf[32];
+	string key;
+	
+	snprintf(buf, sizeof(buf), "%llx/", parent);
+	key = buf;
+	key.append(name);
+	
+	return key;
+}
+
+void DbBackend::sync_dirs()
+{
+	unsigned long gen;
+	
+	gen = check_foreign_writes();
+	pthread_mutex_lock(&dirs_lock);
+	if (gen != dirs_gen) {
+		/* the others may have moved the directories */
+		dir_nodes.clear();
+		dir_ids.clear();
+		dir_paths.clear();
+		dirs_gen = gen;
+		dirs_moved++;
+	}
+	pthread_mutex_unlock(&dirs_lock);
+}
+
+long long DbBackend::lookup_dir(long long parent, const string &name, int create)
+{
+	int ret;
+	long long dir_id = -1;
+	unsigned long moved;
+	dir_node_t node;
+	sqlite3_stmt *sql = NULL;
+	
+	pthread_mutex_lock(&dirs_lock);
+	moved = dirs_moved;
+	pthread_mutex_unlock(&dirs_lock);
+	
+	if (create) {
+		ret = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO dirs "
+				"(parent, name) VALUES (?1, ?2);", -1, &sql, 0);
+		DB_ERROR(ret != SQLITE_OK || !sql, "Preparing insert: ", db);
+		sqlite3_bind_int64(sql, 1, parent);
+		sqlite3_bind_text(sql, 2, name.data(), name.length(), SQLITE_STATIC);
+		ret = sqlite3_step(sql);
+		DB_ERROR(ret != SQLITE_DONE, "Cannot add the directory: ", db);
+		sqlite3_finalize(sql);
+		sql = NULL;
+	}
+	
+	ret = sqlite3_prepare_v2(db, "SELECT dir_id FROM dirs "
+			"WHERE parent = ?1 AND name = ?2;", -1, &sql, 0);
+	DB_ERROR(ret != SQLITE_OK || !sql, "Preparing select: ", db);
+	sqlite3_bind_int64(sql, 1, parent);
+	sqlite3_bind_text(sql, 2, name.data(), name.length(), SQLITE_STATIC);
+	ret = sqlite3_step(sql);
+	if (ret == SQLITE_ROW)
+		dir_id = sqlite3_column_int64(sql, 0);
+	else
+		DB_ERROR(ret != SQLITE_DONE, "Cannot read the directory: ", db);
+	ret = 0;
+	if (dir_id < 0)
+		goto out;
+	
+	/* unless it was moved while we were reading it */
+	node.parent = parent;
+	node.name = name;
+	pthread_mutex_lock(&dirs_lock);
+	if (moved == dirs_moved) {
+		dir_nodes[dir_id] = node;
+		dir_ids[dir_key(parent, name)] = dir_id;
+	}
+	pthread_mutex_unlock(&dirs_lock);
+	
+out:
+	if (sql)
+		sqlite3_finalize(sql);
+	
+	return ret ? -1 : dir_id;
+}
+
+long long DbBackend::find_dir(const char *path, size_t len, int create)
+{
+	long long dir_id = 0, parent;
+	size_t start, end;
+	string name;
+	boost::unordered_map<string, long long>::iterator di;
+	
+	sync_dirs();
+	for (start = 0; start < len; start = end + 1) {
+		for (end = start; end < len && path[end] != '/'; end++)
+			;
+		if (end == start)
+			continue;
+		name.assign(path + start, end - start);
+		
+		parent = dir_id;
+		pthread_mutex_lock(&dirs_lock);
+		di = dir_ids.find(dir_key(parent, name));
+		dir_id = (di != dir_ids.end()) ? di->second : -1;
+		pthread_mutex_unlock(&dirs_lock);
+		
+		if (dir_id < 0)
+			dir_id = lookup_dir(parent, name, create);
+		if (dir_id < 0)
+			return -1;
+	}
+	
+	return dir_id;
+}
+
+int DbBackend::split_path(const char *path, size_t len, long long *dir_id,
+                          string *name, int create)
+{
+	size_t slash;
+	
+	len = trim_path(&path, len);
+	for (slash = len; slash > 0 && path[slash - 1] != '/'; slash--)
+		;
+	name->assign(path + slash, len - slash);
+	*dir_id = (slash == 0) ? 0 : find_dir(path, slash - 1, create);
+	
+	return (*dir_id < 0) ? -1 : 0;
+}
+
+int DbBackend::get_dir_path(long long dir_id, string *path)
+{
+	int ret;
+	unsigned long moved;
+	dir_node_t node;
+	const char *name;
+	string parent_path;
+	sqlite3_stmt *sql = NULL;
+	boost::unordered_map<long long, string>::iterator dp;
+	boost::unordered_map<long long, dir_node_t>::iterator dn;
+	
+	if (dir_id == 0) {
+		path->clear();
+		return 0;
+	}
+	
+	pthread_mutex_lock(&dirs_lock);
+	dp = dir_paths.find(dir_id);
+	if (dp != dir_paths.end()) {
+		path->assign(dp->second);
+		pthread_mutex_unlock(&dirs_lock);
+		return 0;
+	}
+	moved = dirs_moved;
+	dn = dir_nodes.find(dir_id);
+	ret = (dn != dir_nodes.end());
+	if (ret)
+		node = dn->second;
+	pthread_mutex_unlock(&dirs_lock);
+	
+	if (!ret) {
+		ret = sqlite3_prepare_v2(db, "SELECT parent, name FROM dirs "
+				"WHERE dir_id = ?1;", -1, &sql, 0);
+		DB_ERROR(ret != SQLITE_OK || !sql, "Preparing select: ", db);
+		sqlite3_bind_int64(sql, 1, dir_id);
+		ret = sqlite3_step(sql);
+		DB_ERROR(ret != SQLITE_ROW, "Cannot read the directory: ", db);
+		node.parent = sqlite3_column_int64(sql, 0);
+		name = (const char *) sqlite3_column_text(sql, 1);
+		node.name.assign(name ? name : "", sqlite3_column_bytes(sql, 1));
+		sqlite3_finalize(sql);
+		sql = NULL;
+	}
+	
+	/* the parents are cached on the way, so this walks up only once */
+	ret = get_dir_path(node.parent, &parent_path);
+	if (ret)
+		goto out;
+	path->assign(parent_path);
+	if (path->length() > 0)
+		path->append("/");
+	path->append(node.name);
+	
+	pthread_mutex_lock(&dirs_lock);
+	if (moved == dirs_moved) {
+		dir_nodes[dir_id] = node;
+		dir_ids[dir_key(node.parent, node.name)] = dir_id;
+		dir_paths[dir_id] = *path;
+	}
+	pthread_mutex_unlock(&dirs_lock);
+	
+out:
+	if (sql)
+		sqlite3_finalize(sql);
+	
+	return ret ? -1 : 0;
+}
+
+int DbBackend::rename_dir(const char *from, const char *to)
+{
+	int ret;
+	long long dir_id, parent;
+	size_t len;
+	string name;
+	sqlite3_stmt *sql = NULL;
+	
+	len = trim_path(&from, strlen(from));
+	if (len == 0)
+		return 1;
+	dir_id = find_dir(from, len, 0);
+	if (dir_id < 0)
+		return 1;
+	if (split_path(to, strlen(to), &parent, &name, 1))
+		return -1;
+	
+	/* rename() replaces an empty directory; its row goes away */
+	ret = sqlite3_prepare_v2(db, "DELETE FROM dirs WHERE parent = ?1 AND "
+			"name = ?2 AND dir_id != ?3;", -1, &sql, 0);
+	DB_ERROR(ret != SQLITE_OK || !sql, "Preparing delete: ", db);
+	sqlite3_bind_int64(sql, 1, parent);
+	sqlite3_bind_text(sql, 2, name.data(), name.length(), SQLITE_STATIC);
+	sqlite3_bind_int64(sql, 3, dir_id);
+	ret = sqlite3_step(sql);
+	DB_ERROR(ret != SQLITE_DONE, "Cannot delete the directory: ", db);
+	sqlite3_finalize(sql);
+	sql = NULL;
+	
+	ret = sqlite3_prepare_v2(db, "UPDATE dirs SET parent = ?1, name = ?2 "
+			"WHERE dir_id = ?3;", -1, &sql, 0);
+	DB_ERROR(ret != SQLITE_OK || !sql, "Preparing update: ", db);
+	sqlite3_bind_int64(sql, 1, parent);
+	sqlite3_bind_text(sql, 2, name.data(), name.length(), SQLITE_STATIC);
+	sqlite3_bind_int64(sql, 3, dir_id);
+	ret = sqlite3_step(sql);
+	DB_ERROR(ret != SQLITE_DONE, "Cannot move the directory: ", db);
+	ret = 0;
+	
+	/* the paths of everything under it are different now */
+	pthread_mutex_lock(&dirs_lock);
+	dir_nodes.clear();
+	dir_ids.clear();
+	dir_paths.clear();
+	dirs_moved++;
+	pthread_mutex_unlock(&dirs_lock);
+	
+out:
+	if (sql)
+		sqlite3_finalize(sql);
+	
+	return ret;
+}
+
+void DbBackend::sql_path(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	DbBackend *self = (DbBackend *) sqlite3_user_data(ctx);
+	string path;
+	
+	/* a row from before the dirs table */
+	if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+		sqlite3_result_value(ctx, argv[2]);
+		return;
+	}
+	if (self->get_dir_path(sqlite3_value_int64(argv[0]), &path)) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	if (path.length() > 0)
+		path.append("/");
+	if (sqlite3_value_type(argv[1]) != SQLITE_NULL)
+		path.append((const char *) sqlite3_value_text(argv[1]),
+		            sqlite3_value_bytes(argv[1]));
+	sqlite3_result_text(ctx, path.data(), path.length(), SQLITE_TRANSIENT);
+}
+
+void DbBackend::sql_dir(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	DbBackend *self = (DbBackend *) sqlite3_user_data(ctx);
+	long long dir_id;
+	string name;
 	
-error:
-	if(select)
-		sqlite3_finalize(select);
+	if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	if (self->split_path((const char *) sqlite3_value_text(argv[0]),
+	                     sqlite3_value_bytes(argv[0]), &dir_id, &name, 1)) {
+		sqlite3_result_error(ctx, "cannot add the directory", -1);
+		return;
+	}
+	sqlite3_result_int64(ctx, dir_id);
+}
 
-	return -1;
+void DbBackend::sql_find_dir(sqlite3_context *ctx, int argc,
+                             sqlite3_value **argv)
+{
+	DbBackend *self = (DbBackend *) sqlite3_user_data(ctx);
+	long long dir_id;
+	string name;
+	
+	/* NULL matches no file */
+	if (sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+	    self->split_path((const char *) sqlite3_value_text(argv[0]),
+	                     sqlite3_value_bytes(argv[0]), &dir_id, &name, 0)) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	sqlite3_result_int64(ctx, dir_id);
+}
+
+void DbBackend::sql_name(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const char *path;
+	size_t len, slash;
+	
+	if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	path = (const char *) sqlite3_value_text(argv[0]);
+	len = trim_path(&path, sqlite3_value_bytes(argv[0]));
+	for (slash = len; slash > 0 && path[slash - 1] != '/'; slash--)
+		;
+	sqlite3_result_text(ctx, path + slash, len - slash, SQLITE_TRANSIENT);
 }
 
 int DbBackend::db_add_file(file_info_t * finfo)
@@ -272,8 +1856,9 @@ int DbBackend::db_add_file(file_info_t * finfo)
 	DBG_SHOWFC();
 	
 	/* adds the info in the file table */
-	ret = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO files (ino,mode,path,tags)"
-			" VALUES (?1, ?2, ?3,' ');", -1, &select, 0);
+	ret = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO files "
+			"(ino,mode,dir_id,name,tags) VALUES (?1, ?2, "
+			"hybfs_dir(?3), hybfs_name(?3), ' ');", -1, &select, 0);
 
 	if (ret != SQLITE_OK || !select) {
 		DB_PRINTERR("Preparing insert: ",db);
@@ -305,6 +1890,8 @@ int DbBackend::db_add_tag_info(vector<string> *tags, file_info_t * finfo, int be
 {
 	int ret;
 	int tag_id;
+	dict_id_t id;
+	TagDict *dict = TagDict::get();
 	size_t fpos;
 	sqlite3_stmt *select;
 	const char *sql = NULL;
@@ -334,11 +1921,14 @@ int DbBackend::db_add_tag_info(vector<string> *tags, file_info_t * finfo, int be
 			value = (*tok_iter).substr(fpos+1, (*tok_iter).length() - 1);
 			if(value.length() == 0)
 				value = NULL_VALUE;
-			tag_id = db_add_tag(tag.c_str(), value.c_str());
 		}
 		else {
-			tag_id = db_add_tag((*tok_iter).c_str(), NULL);
+			tag = *tok_iter;
+			value = NULL_VALUE;
 		}
+		/* from here on the tag is a number */
+		id = dict->intern(tag.c_str(), value.c_str());
+		tag_id = add_tag(tag.c_str(), value.c_str(), id);
 		/* adds the tag info */
 		if (tag_id <= 0) {
 			PRINT_ERROR("Failed to add tag %s:%s to file %s\n",
@@ -355,11 +1945,11 @@ int DbBackend::db_add_tag_info(vector<string> *tags, file_info_t * finfo, int be
 		}
 		sqlite3_reset(select);
 		
-		if (fpos != string::npos)
-			file_tags << tag << ":" << value;
+		file_tags << tag << ":" << value << " ";
+		if (id)
+			touch_tag_id(dict->name_of(id));
 		else
-			file_tags << (*tok_iter).c_str() << ":" << NULL_VALUE;
-		file_tags << " ";
+			touch_tag(tag.c_str());
 	}
 
 	ret = sqlite3_finalize(select);
@@ -368,10 +1958,10 @@ int DbBackend::db_add_tag_info(vector<string> *tags, file_info_t * finfo, int be
 	/* add or replace the tags to the file field */
 	switch(behaviour) {
 	case TAG_ADD:
-		sql = "UPDATE files SET tags = tags||?2 WHERE files.path LIKE ?1 ;";
+		sql = "UPDATE files SET tags = tags||?2 WHERE " FILE_IS(1) ";";
 		break;
 	case TAG_REPLACE:
-		sql = "UPDATE files SET tags = ' '||?2 WHERE files.path LIKE ?1;";
+		sql = "UPDATE files SET tags = ' '||?2 WHERE " FILE_IS(1) ";";
 		break;
 	default:
 		sql = NULL;
@@ -426,7 +2016,8 @@ int DbBackend::db_add_file_info(vector<string> *tags, file_info_t * finfo, int e
 	
 	DBG_SHOWFC();
 
-	sqlite3_exec(db, "BEGIN",NULL,NULL,NULL);
+	if (db_begin_transaction())
+		return -1;
 	/* now add the file info */
 	if(!exist)
 		ret = db_add_file(finfo);
@@ -440,10 +2031,340 @@ int DbBackend::db_add_file_info(vector<string> *tags, file_info_t * finfo, int e
 
 error: 
 	if(ret)
-		sqlite3_exec(db, "ROLLBACK",NULL,NULL,NULL);
+		db_rollback();
 	else
-		sqlite3_exec(db, "COMMIT",NULL,NULL,NULL);
+		ret = db_end_transaction();
+		
+	return ret;
+}
+
+int DbBackend::db_add_files_info(vector<tagged_file_t> *files)
+{
+	int ret, failed = 0, do_trans = 0;
+	sqlite3_stmt *fprint = NULL;
+	file_fprint_t *fp;
+	
+	DBG_SHOWFC();
+	
+	/* until the commit, none of them is in */
+	for (vector<tagged_file_t>::iterator it = files->begin();
+			it != files->end(); it++)
+		(*it).failed = 1;
+	
+	if (db_begin_transaction())
+		return -1;
+	do_trans = 1;
+	
+	ret = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO fingerprints "
+			"(ino, module, version, size, mtime) "
+			"VALUES (?1, ?2, ?3, ?4, ?5);", -1, &fprint, 0);
+	DB_ERROR(ret != SQLITE_OK || !fprint, "Preparing insert: ", db);
+	
+	for (vector<tagged_file_t>::iterator it = files->begin();
+			it != files->end(); it++) {
+		if (db_add_file((*it).finfo) ||
+		    db_add_tag_info(&(*it).tags, (*it).finfo, TAG_ADD) != SQLITE_OK) {
+			PRINT_ERROR("Failed to add file %s\n", (*it).finfo->name);
+			failed++;
+			continue;
+		}
+		(*it).failed = 0;
+		
+		/* the fingerprint goes in with the tags, so a file is never
+		 * skipped without them
+		 */
+		fp = &(*it).fp;
+		if (fp->version == 0)
+			continue;
+		sqlite3_bind_int64(fprint, 1, (*it).finfo->fid);
+		sqlite3_bind_int(fprint, 2, fp->module);
+		sqlite3_bind_int(fprint, 3, fp->version);
+		sqlite3_bind_int64(fprint, 4, fp->size);
+		sqlite3_bind_int64(fprint, 5, fp->mtime_ns);
+		if (sqlite3_step(fprint) != SQLITE_DONE)
+			DB_PRINTERR("Cannot store the fingerprint: ", db);
+		sqlite3_reset(fprint);
+	}
+	sqlite3_finalize(fprint);
+	fprint = NULL;
+	
+	do_trans = 0;
+	ret = db_end_transaction();
+	DB_ERROR(ret, "Cannot commit the files", db);
+	ret = failed;
+	
+out:
+	if(fprint)
+		sqlite3_finalize(fprint);
+	if(do_trans)
+		db_rollback();
+	if(ret == -1) {
+		for (vector<tagged_file_t>::iterator it = files->begin();
+				it != files->end(); it++)
+			(*it).failed = 1;
+	}
+	
+	return ret;
+}
+
+int DbBackend::db_checkpoint_add(const char *root, vector<string> *dirs)
+{
+	int ret, do_trans = 0;
+	sqlite3_stmt *insert = NULL;
+	
+	DBG_SHOWFC();
+	
+	if (dirs->size() == 0)
+		return 0;
+	
+	if (db_begin_transaction())
+		return -1;
+	do_trans = 1;
+	
+	ret = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO checkpoints "
+			"(root, dir) VALUES (?1, ?2);", -1, &insert, 0);
+	DB_ERROR(ret != SQLITE_OK || !insert, "Preparing insert: ", db);
+	
+	sqlite3_bind_text(insert, 1, root, -1, SQLITE_STATIC);
+	for (vector<string>::iterator it = dirs->begin(); it != dirs->end(); it++) {
+		sqlite3_bind_text(insert, 2, (*it).c_str(), (*it).length(),
+		                  SQLITE_STATIC);
+		ret = sqlite3_step(insert);
+		DB_ERROR(ret != SQLITE_DONE, "Cannot add the checkpoint: ", db);
+		sqlite3_reset(insert);
+	}
+	sqlite3_finalize(insert);
+	insert = NULL;
+	
+	do_trans = 0;
+	ret = db_end_transaction();
+	DB_ERROR(ret, "Cannot commit the checkpoint", db);
+	
+out:
+	if(insert)
+		sqlite3_finalize(insert);
+	if(do_trans)
+		db_rollback();
+	
+	return ret;
+}
+
+int DbBackend::db_checkpoint_load(const char *root, set<string> *dirs)
+{
+	int ret;
+	sqlite3_stmt *select = NULL;
+	
+	DBG_SHOWFC();
+	
+	ret = sqlite3_prepare_v2(db, "SELECT dir FROM checkpoints WHERE root = ?1;",
+			-1, &select, 0);
+	DB_ERROR(ret != SQLITE_OK || !select, "Preparing select: ", db);
+	
+	sqlite3_bind_text(select, 1, root, -1, SQLITE_STATIC);
+	while ((ret = sqlite3_step(select)) == SQLITE_ROW)
+		dirs->insert((const char *) sqlite3_column_text(select, 0));
+	DB_ERROR(ret != SQLITE_DONE, "Reading the checkpoint: ", db);
+	ret = 0;
+	
+out:
+	if(select)
+		sqlite3_finalize(select);
+	
+	return ret;
+}
+
+int DbBackend::db_checkpoint_clear(const char *root)
+{
+	int ret;
+	sqlite3_stmt *del = NULL;
+	
+	DBG_SHOWFC();
+	
+	ret = sqlite3_prepare_v2(db, "DELETE FROM checkpoints WHERE root = ?1;",
+			-1, &del, 0);
+	DB_ERROR(ret != SQLITE_OK || !del, "Preparing delete: ", db);
+	
+	sqlite3_bind_text(del, 1, root, -1, SQLITE_STATIC);
+	ret = sqlite3_step(del);
+	DB_ERROR(ret != SQLITE_DONE, "Cannot clear the checkpoint: ", db);
+	ret = 0;
+	
+out:
+	if(del)
+		sqlite3_finalize(del);
+	
+	return ret;
+}
+
+int DbBackend::db_get_file_tag_pairs(long long ino, vector<string> *tags)
+{
+	int ret;
+	const char *tag, *value;
+	sqlite3_stmt *select = NULL;
+	string pair;
+	
+	DBG_SHOWFC();
+	
+	ret = sqlite3_prepare_v2(db, "SELECT tag, value FROM tags, assoc "
+			"WHERE assoc.ino = ?1 AND tags.tag_id = assoc.tag_id;",
+			-1, &select, 0);
+	DB_ERROR(ret != SQLITE_OK || !select, "Preparing select: ", db);
+	
+	sqlite3_bind_int64(select, 1, ino);
+	while ((ret = sqlite3_step(select)) == SQLITE_ROW) {
+		tag = (const char *)sqlite3_column_text(select, 0);
+		value = (const char *)sqlite3_column_text(select, 1);
+		if (tag == NULL)
+			continue;
+		pair = tag;
+		/* the form db_add_tag_info() expects */
+		if (value != NULL && strcmp(value, NULL_VALUE) != 0) {
+			pair.append(":");
+			pair.append(value);
+		}
+		tags->push_back(pair);
+	}
+	DB_ERROR(ret != SQLITE_DONE, "Cannot read the tags of the file: ", db);
+	ret = 0;
+	
+out:
+	if(select)
+		sqlite3_finalize(select);
+	
+	return ret;
+}
+
+int DbBackend::db_copy_file_tags(long long src_ino, DbBackend *src_db,
+		file_info_t *finfo)
+{
+	int ret;
+	sqlite3_stmt *sql = NULL;
+	vector<string> tags;
+	
+	DBG_SHOWFC();
+	
+	if (src_db == this && src_ino == (long long) finfo->fid)
+		return 0;
+	
+	/* the copy overwrote whatever was there before, and the virtual
+	 * directories of its old tags lose the file */
+	touch_file_tags(finfo->name);
+	ret = sqlite3_prepare_v2(db, "DELETE FROM assoc WHERE ino = ?1;", -1, &sql, 0);
+	DB_ERROR(ret != SQLITE_OK || !sql, "Preparing delete: ", db);
+	sqlite3_bind_int64(sql, 1, finfo->fid);
+	ret = sqlite3_step(sql);
+	DB_ERROR(ret != SQLITE_DONE, "Cannot delete the old tags: ", db);
+	sqlite3_finalize(sql);
+	sql = NULL;
+	
+	/* a source without tags leaves it like this */
+	ret = sqlite3_prepare_v2(db, "UPDATE files SET tags = ' ' WHERE ino = ?1;",
+			-1, &sql, 0);
+	DB_ERROR(ret != SQLITE_OK || !sql, "Preparing update: ", db);
+	sqlite3_bind_int64(sql, 1, finfo->fid);
+	ret = sqlite3_step(sql);
+	DB_ERROR(ret != SQLITE_DONE, "Cannot clear the old tags: ", db);
+	sqlite3_finalize(sql);
+	sql = NULL;
+	
+	if (src_db != this) {
+		/* only the strings can cross from one DB to another */
+		ret = src_db->db_get_file_tag_pairs(src_ino, &tags);
+		if (ret || tags.empty())
+			goto out;
 		
+		ret = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO files "
+				"(ino,mode,dir_id,name,tags) VALUES (?1, ?2, "
+				"hybfs_dir(?3), hybfs_name(?3), ' ');", -1, &sql, 0);
+		DB_ERROR(ret != SQLITE_OK || !sql, "Preparing insert: ", db);
+		sqlite3_bind_int64(sql, 1, finfo->fid);
+		sqlite3_bind_int(sql, 2, finfo->mode);
+		sqlite3_bind_text(sql, 3, finfo->name, finfo->namelen, SQLITE_STATIC);
+		ret = sqlite3_step(sql);
+		DB_ERROR(ret != SQLITE_DONE, "Cannot add the file: ", db);
+		
+		ret = db_add_tag_info(&tags, finfo, TAG_REPLACE);
+		goto out;
+	}
+	
+	/* the same tag_ids and the same tags string, all inside SQLite */
+	ret = sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO files "
+			"(ino,mode,dir_id,name,tags) SELECT ?1, ?2, "
+			"hybfs_dir(?3), hybfs_name(?3), tags "
+			"FROM files WHERE ino = ?4;", -1, &sql, 0);
+	DB_ERROR(ret != SQLITE_OK || !sql, "Preparing insert: ", db);
+	sqlite3_bind_int64(sql, 1, finfo->fid);
+	sqlite3_bind_int(sql, 2, finfo->mode);
+	sqlite3_bind_text(sql, 3, finfo->name, finfo->namelen, SQLITE_STATIC);
+	sqlite3_bind_int64(sql, 4, src_ino);
+	ret = sqlite3_step(sql);
+	DB_ERROR(ret != SQLITE_DONE, "Cannot add the file: ", db);
+	sqlite3_finalize(sql);
+	sql = NULL;
+	/* the original has no tags */
+	if (sqlite3_changes(db) == 0) {
+		ret = 0;
+		goto out;
+	}
+	
+	ret = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO assoc (ino, tag_id) "
+			"SELECT ?1, tag_id FROM assoc WHERE ino = ?2;", -1, &sql, 0);
+	DB_ERROR(ret != SQLITE_OK || !sql, "Preparing insert: ", db);
+	sqlite3_bind_int64(sql, 1, finfo->fid);
+	sqlite3_bind_int64(sql, 2, src_ino);
+	ret = sqlite3_step(sql);
+	DB_ERROR(ret != SQLITE_DONE, "Cannot copy the tags: ", db);
+	
+	/* the virtual directories of these tags have one more file */
+	touch_file_tags(finfo->name);
+	ret = 0;
+	
+out:
+	if(sql)
+		sqlite3_finalize(sql);
+	if(ret)
+		ret = -1;
+	
+	return ret;
+}
+
+int DbBackend::db_get_fingerprints(int module, fprint_map_t *fps)
+{
+	int ret;
+	sqlite3_stmt *select = NULL;
+	file_fprint_t fp;
+	const unsigned char *path;
+	
+	DBG_SHOWFC();
+	
+	/* only the files that are still known; the name hash tells if
+	 * the inode was reused for another file
+	 */
+	sync_dirs();
+	ret = sqlite3_prepare_v2(db, "SELECT fingerprints.ino, version, size, "
+			"mtime, " FILE_PATH " FROM fingerprints, files "
+			"WHERE fingerprints.ino = files.ino AND module = ?1;",
+			-1, &select, 0);
+	DB_ERROR(ret != SQLITE_OK || !select, "Preparing select: ", db);
+	
+	sqlite3_bind_int(select, 1, module);
+	fp.module = module;
+	while ((ret = sqlite3_step(select)) == SQLITE_ROW) {
+		fp.version = sqlite3_column_int(select, 1);
+		fp.size = sqlite3_column_int64(select, 2);
+		fp.mtime_ns = sqlite3_column_int64(select, 3);
+		path = sqlite3_column_text(select, 4);
+		fp.name_hash = fprint_name_hash((const char *) path,
+		                                sqlite3_column_bytes(select, 4));
+		(*fps)[sqlite3_column_int64(select, 0)] = fp;
+	}
+	DB_ERROR(ret != SQLITE_DONE, "Reading the fingerprints: ", db);
+	ret = 0;
+	
+out:
+	if(select)
+		sqlite3_finalize(select);
+	
 	return ret;
 }
 
@@ -464,9 +2385,7 @@ int DbBackend::db_delete_file_tag(const char *tag, const char *value,
 	sql = "DELETE FROM assoc WHERE "
 	      "assoc.tag_id IN (SELECT assoc.tag_id FROM assoc, tags, files "
 			"WHERE assoc.ino = files.ino AND assoc.tag_id = tags.tag_id "
-			"AND files.path LIKE '";
-	sql.append(path);
-	sql.append("' AND  tags.tag LIKE '");
+			"AND " FILE_IS(1) " AND  tags.tag LIKE '";
 	sql.append(tag);
 	sql.append("' AND tags.value LIKE '");
 	if(value != NULL) {
@@ -476,14 +2395,15 @@ int DbBackend::db_delete_file_tag(const char *tag, const char *value,
 	sql.append("' );");
 	
 	DBG_PRINT("I have the delete query :  %s\n", sql.c_str());
-	ret = run_simple_query(sql.c_str());
+	ret = run_path_query(sql.c_str(), path);
 	if(ret) {
 		PRINT_ERROR("Error deleting file associations\n");
 		return ret;
 	}
+	touch_tag(tag);
 	/* delete the tag from the string of tags */
 	ret = sqlite3_prepare_v2(db,"UPDATE files SET tags = "
-			"replace(files.tags, ?1, ' ') WHERE files.path LIKE ?2",
+			"replace(files.tags, ?1, ' ') WHERE " FILE_IS(2),
 			-1, &select, 0);
 		
 	if (ret != SQLITE_OK || !select) {
@@ -529,7 +2449,8 @@ int DbBackend::db_delete_file_tags(vector<string> *tags, file_info_t *finfo)
 	size_t fpos;
 	const char *tagc, *valuec;
 	
-	sqlite3_exec(db, "BEGIN",NULL,NULL,NULL);
+	if (db_begin_transaction())
+		return -1;
 	
 	/* break the tags in tag:value pairs and call delete_file_tag */
 	for (vector<string>::iterator tok_iter = tags->begin(); tok_iter
@@ -557,9 +2478,9 @@ int DbBackend::db_delete_file_tags(vector<string> *tags, file_info_t *finfo)
 	}
 	
 	if(ret)
-		sqlite3_exec(db, "ROLLBACK",NULL,NULL,NULL);
+		db_rollback();
 	else
-		sqlite3_exec(db, "COMMIT",NULL,NULL,NULL);	
+		ret = db_end_transaction();
 	
 	return ret;
 }
@@ -567,9 +2488,9 @@ int DbBackend::db_delete_file_tags(vector<string> *tags, file_info_t *finfo)
 int DbBackend::db_update_file_tags(vector<string> *new_tags, file_info_t *finfo, int exist)
 {
 	int ret;
-	string sql;
 	
-	sqlite3_exec(db, "BEGIN",NULL,NULL,NULL);
+	if (db_begin_transaction())
+		return -1;
 	/* check if the file exists */
 	ret = 1;
 	if(!exist)
@@ -579,18 +2500,18 @@ int DbBackend::db_update_file_tags(vector<string> *new_tags, file_info_t *finfo,
 				"Adding file info\n");
 		ret = db_add_file(finfo);
 		
-		if(ret)
-			return -1;
+		if(ret) {
+			ret = -1;
+			goto error;
+		}
 	} else {
+		/* the old tags are going away */
+		touch_file_tags(&finfo->name[0]);
 		/* delete the associations info from the table */
-		sql = "DELETE FROM assoc "
+		ret = run_path_query("DELETE FROM assoc "
 				"WHERE assoc.ino IN (SELECT assoc.ino "
-				"FROM assoc, files "
-				"WHERE files.path LIKE '";
-		sql.append(&finfo->name[0]);
-		sql.append("' AND assoc.ino = files.ino );");
-		
-		ret = run_simple_query(sql.c_str());
+				"FROM assoc, files WHERE " FILE_IS(1)
+				" AND assoc.ino = files.ino );", &finfo->name[0]);
 		if(ret) {
 			PRINT_ERROR("Error deleting file associations\n");
 			goto error;
@@ -606,52 +2527,79 @@ int DbBackend::db_update_file_tags(vector<string> *new_tags, file_info_t *finfo,
 	
 error:
 	if(ret)
-		sqlite3_exec(db, "ROLLBACK",NULL,NULL,NULL);
+		db_rollback();
 	else
-		sqlite3_exec(db, "COMMIT",NULL,NULL,NULL);
+		ret = db_end_transaction();
 		
 	return ret;
 }
 
 
-int DbBackend::db_delete_file_info(const char *abspath)
+int DbBackend::delete_file_info(const char *abspath)
 {
 	int ret = -1;
-	string sql;
-	
-	DBG_SHOWFC();
-
-	if(abspath == NULL)
-		return -1;
 	
-	sqlite3_exec(db, "BEGIN",NULL,NULL,NULL);
+	/* the virtual directories that contain the file are changing */
+	touch_file_tags(abspath);
 	/* delete the association info from the table */
-	sql = "DELETE FROM assoc "
+	ret = run_path_query("DELETE FROM assoc "
 			"WHERE assoc.ino IN (SELECT assoc.ino FROM assoc, files "
-			"WHERE files.path LIKE '";
-	sql.append(abspath);
-	sql.append("' AND assoc.ino = files.ino );");
-	
-	ret = run_simple_query(sql.c_str());
+			"WHERE " FILE_IS(1) " AND assoc.ino = files.ino );", abspath);
 	if(ret) {
 		PRINT_ERROR("Error deleting file associations\n");
-		goto error;
+		return ret;
 	}
 	/* delete the file info */
-	sql.assign("DELETE FROM files WHERE files.path LIKE '");
-	sql.append(abspath);
-	sql.append("';");
-	ret = run_simple_query(sql.c_str());
-	if(ret) {
+	ret = run_path_query("DELETE FROM files WHERE " FILE_IS(1) ";", abspath);
+	if(ret)
 		PRINT_ERROR("Error deleting file info\n");
-		goto error;
-	}
 	
-error:
+	return ret;
+}
+
+int DbBackend::db_delete_file_info(const char *abspath)
+{
+	int ret = -1;
+	
+	DBG_SHOWFC();
+
+	if(abspath == NULL)
+		return -1;
+	
+	if (db_begin_transaction())
+		return -1;
+	ret = delete_file_info(abspath);
 	if(ret)
-		sqlite3_exec(db, "ROLLBACK",NULL,NULL,NULL);
+		db_rollback();
 	else
-		sqlite3_exec(db, "COMMIT",NULL,NULL,NULL);
+		ret = db_end_transaction();
+	
+	return ret;
+}
+
+int DbBackend::db_delete_files_info(vector<string> *paths)
+{
+	int ret = 0;
+	
+	DBG_SHOWFC();
+	
+	if(paths == NULL)
+		return -1;
+	if(paths->size() == 0)
+		return 0;
+	
+	if (db_begin_transaction())
+		return -1;
+	for (vector<string>::iterator it = paths->begin(); it != paths->end();
+			it++) {
+		ret = delete_file_info((*it).c_str());
+		if(ret)
+			break;
+	}
+	if(ret)
+		db_rollback();
+	else
+		ret = db_end_transaction();
 	
 	return ret;
 }
@@ -724,8 +2672,8 @@ int DbBackend::db_check_file(const char *path)
 	DBG_PRINT("I check file %s \n", path);
 	/* search for the tag id in the table */
 	
-	res = sqlite3_prepare_v2(db, "SELECT path FROM files WHERE  "
-			"path LIKE ?1 ;", -1, &select, 0);
+	res = sqlite3_prepare_v2(db, "SELECT ino FROM files WHERE "
+			FILE_IS(1) ";", -1, &select, 0);
 
 	if (res != SQLITE_OK || !select) {
 		DB_PRINTERR("Preparing checking file existence: ",db);
@@ -756,6 +2704,57 @@ error:
 }
 
 
+/* a name for a temporary table; the threads share the connection, so
+ * two of them may ask in the same microsecond */
+static string temp_name()
+{
+	static volatile unsigned long seq;
+	ostringstream tbl_name;
+	struct timeval tmv;
+	
+	gettimeofday(&tmv, NULL);
+	tbl_name << "temp" << tmv.tv_sec << tmv.tv_usec << "_"
+	         << __sync_add_and_fetch(&seq, 1);
+	
+	return tbl_name.str();
+}
+
+int DbBackend::begin_restrict(const char *path, string *dirs)
+{
+	string p;
+	
+	dirs->clear();
+	/* the tables of the query are made in one go, the transaction of
+	 * another thread would take them along if it rolled back */
+	if (db_begin_transaction())
+		return -1;
+	sync_dirs();
+	if (path == NULL || path[0] == '\0' || strcmp(path, "/") == 0)
+		return 0;
+	
+	p = path;
+	*dirs = temp_name();
+	if (build_dir_table(&p, *dirs)) {
+		end_restrict(dirs);
+		return -1;
+	}
+	
+	return 0;
+}
+
+int DbBackend::end_restrict(string *dirs)
+{
+	int ret = 0;
+	
+	if (dirs->length() > 0 && delete_temp_table(dirs))
+		ret = -1;
+	dirs->clear();
+	if (db_end_transaction())
+		ret = -1;
+	
+	return ret;
+}
+
 static int tags_callback(void *data, int argc, char **argv, char **colname)
 {
 	ostringstream component;
@@ -779,8 +2778,8 @@ static int tags_callback(void *data, int argc, char **argv, char **colname)
 list<string> * DbBackend::db_get_tags(const char * path)
 {
 	int res = 0;
-	char * err;
-	const char * lpath;
+	char * err = NULL;
+	string dirs;
 	ostringstream sql_string;
 	list<string> *tags = new list<string>;
 	
@@ -789,20 +2788,21 @@ list<string> * DbBackend::db_get_tags(const char * path)
 
 	DBG_SHOWFC();
 	DBG_PRINT("my path is #%s#\n", path);
+	if (begin_restrict(path, &dirs)) {
+		delete tags;
+		return NULL;
+	}
 	sql_string <<  "SELECT DISTINCT tag FROM tags";
-	if(path && path[0] != '\0') {
-		lpath = path;
-		if(lpath[0] == '/')
-			lpath++;
-		sql_string << ", files, assoc WHERE files.path LIKE '" << lpath;
-		sql_string << "%' AND tags.tag_id = assoc.tag_id "
-				"AND files.ino = assoc.ino";
-	
+	if (dirs.length() > 0) {
+		sql_string << ", files, assoc WHERE files.dir_id IN "
+				"(SELECT dir_id FROM " << dirs << ") AND "
+				"tags.tag_id = assoc.tag_id AND files.ino = assoc.ino";
 	}
 	sql_string << ";";
 	DBG_PRINT("my final query is : %s \n", sql_string.str().c_str());
 	
 	res = sqlite3_exec(db, sql_string.str().c_str(), tags_callback, tags, &err);
+	end_restrict(&dirs);
 
 	if( res !=SQLITE_OK ){
 	    PRINT_ERROR("SQL error: %s\n", err);
@@ -846,8 +2846,8 @@ static int tags_values_callback(void *data, int argc, char **argv, char **colnam
 list<string> * DbBackend::db_get_tags_values(const char *path)
 {
 	int res = 0;
-	char * err;
-	const char *lpath;
+	char * err = NULL;
+	string dirs;
 	ostringstream sql_string;
 	list<string> *tags = new list<string>;
 	
@@ -855,20 +2855,21 @@ list<string> * DbBackend::db_get_tags_values(const char *path)
 		return NULL;
 
 	DBG_SHOWFC();
+	if (begin_restrict(path, &dirs)) {
+		delete tags;
+		return NULL;
+	}
 	sql_string <<  "SELECT DISTINCT tag, value FROM tags";
-	if(path && path[0] != '\0') {
-		lpath = path;
-		if(lpath[0] == '/')
-			lpath++;
-		sql_string << ", files, assoc WHERE files.path LIKE '" << lpath;
-		sql_string << "%' AND tags.tag_id = assoc.tag_id "
-				"AND files.ino = assoc.ino";
-	
+	if (dirs.length() > 0) {
+		sql_string << ", files, assoc WHERE files.dir_id IN "
+				"(SELECT dir_id FROM " << dirs << ") AND "
+				"tags.tag_id = assoc.tag_id AND files.ino = assoc.ino";
 	}
 	sql_string << ";";
 	
 	res = sqlite3_exec(db,sql_string.str().c_str(), tags_values_callback,
 	                tags, &err);
+	end_restrict(&dirs);
 
 	if (res !=SQLITE_OK) {
 		PRINT_ERROR("SQL error: %s\n", err);
@@ -887,19 +2888,17 @@ list<string> * DbBackend::db_get_tags_values(const char *path)
 int DbBackend::db_get_files(const char * path, const char * tag, 
                             const char *value, void * buf, filler_t filler)
 {
-	sqlite3_stmt* sql;
+	sqlite3_stmt* sql = NULL;
 	int res, fill;
+	string dirs;
 	ostringstream sql_string;
-	string absolute;
 	
 	/* build the query */
-	sql_string << "SELECT path FROM files, tags, assoc WHERE ";
-	if(path) {
-		if(path[0] != '\0') {
-			const char * pathl = (path[0] == '/') ? (path+1) : path;
-			sql_string<< " path LIKE '" << pathl << "%' AND ";
-		}
-	}
+	if (begin_restrict(path, &dirs))
+		return -1;
+	sql_string << "SELECT " FILE_PATH " FROM files, tags, assoc WHERE ";
+	if (dirs.length() > 0)
+		sql_string << "files.dir_id IN (SELECT dir_id FROM " << dirs << ") AND ";
 	sql_string << "tags.tag = ?1 AND ";
 	if(value[0]!='\0')
 		sql_string << "tags.value = ?2 AND ";
@@ -923,7 +2922,7 @@ int DbBackend::db_get_files(const char * path, const char * tag,
 		stat_t st;
 		char *relpath;
 		
-		char *abspath = (char *)sqlite3_column_text(sql, 2);
+		char *abspath = (char *)sqlite3_column_text(sql, 0);
 		if(abspath == NULL) {
 			res = -1;
 			break;
@@ -935,11 +2934,8 @@ int DbBackend::db_get_files(const char * path, const char * tag,
 			if(path[0] != '\0')
 				relpath = abspath + strlen(path);
 		}
-		/* build the absolute path for stat */
-		absolute.assign(vdir_path);
-		absolute.append(abspath);
-		
-		res = get_stat(absolute.c_str(), &st);
+		/* stat it relative to our branch, no need for the full path */
+		res = get_stat_at(dir_fd, abspath, &st);
 		if(res)
 			break;
 		
@@ -966,6 +2962,7 @@ int DbBackend::db_get_files(const char * path, const char * tag,
 error: 
 	if (sql)
 		sqlite3_finalize(sql);
+	end_restrict(&dirs);
 	
 	return res;
 }
@@ -990,7 +2987,7 @@ static int files_callback(void *data, int argc, char **argv, char **colname)
 		return 0;
 
 	finfo.path = argv[2];
-	finfo.ino  = atoi(argv[0]);
+	finfo.ino  = atoll(argv[0]);
 	
 	files->push_back(finfo);
 	
@@ -1001,18 +2998,16 @@ int DbBackend::get_file_names(string *query, string *path,
                               vector<new_file_info_t> *files)
 {
 	int res = 0;
-	char * err;
-	string sqlp;
+	char * err = NULL;
+	string sqlp, dirs;
 	ostringstream sql_string;
 
-	if(path) {
-		if(path->length() != 0) {
-			const char * pathl = path->c_str();
-			if(pathl[0] == '/')
-				pathl++;
-			sql_string << "SELECT ino, mode, path FROM files WHERE ";
-			sql_string << " path LIKE '" << pathl << "%' INTERSECT ";
-		}
+	if (begin_restrict(path ? path->c_str() : NULL, &dirs))
+		return -1;
+	if (dirs.length() > 0) {
+		sql_string << "SELECT ino, mode, " FILE_PATH " AS path "
+				"FROM files WHERE dir_id IN (SELECT dir_id FROM "
+			   << dirs << ") INTERSECT ";
 	}
 	sql_string << *query;
 	/* done building the query */
@@ -1021,6 +3016,7 @@ int DbBackend::get_file_names(string *query, string *path,
 	DBG_PRINT("I run query: %s \n\n", sqlp.c_str());
 	res = sqlite3_exec(db, sqlp.c_str(), files_callback,
 	                files, &err);
+	end_restrict(&dirs);
 	if (res != SQLITE_OK) {
 		PRINT_ERROR("SQL error: %s\n", err);
 		sqlite3_free(err);
@@ -1030,30 +3026,312 @@ int DbBackend::get_file_names(string *query, string *path,
 	return 0;
 }
 
+int DbBackend::db_get_files_after(long long ino, int limit,
+                                  vector<new_file_info_t> *files)
+{
+	int res;
+	const char *path;
+	new_file_info_t finfo;
+	sqlite3_stmt *sql = NULL;
+
+	sync_dirs();
+	res = sqlite3_prepare_v2(db, "SELECT ino, " FILE_PATH " FROM files "
+			"WHERE ino > ?1 ORDER BY ino LIMIT ?2;", -1, &sql, 0);
+	if (res != SQLITE_OK || !sql) {
+		DB_PRINTERR("Preparing select: ",db);
+		goto error;
+	}
+	sqlite3_bind_int64(sql, 1, ino);
+	sqlite3_bind_int(sql, 2, limit);
+
+	while ((res = sqlite3_step(sql)) == SQLITE_ROW) {
+		path = (const char *)sqlite3_column_text(sql, 1);
+		if (path == NULL)
+			continue;
+		finfo.ino  = sqlite3_column_int64(sql, 0);
+		finfo.path = path;
+		files->push_back(finfo);
+	}
+	if (res != SQLITE_DONE) {
+		DB_PRINTERR("Error at processing select: ",db);
+		goto error;
+	}
+	res = 0;
+
+error:
+	if (sql)
+		sqlite3_finalize(sql);
+	if (res)
+		res = -1;
+	return res;
+}
+
+long DbBackend::count_files(string *query, string *path)
+{
+	int res;
+	long count = -1;
+	size_t end;
+	string sqlp, dirs;
+	ostringstream sql_string;
+	sqlite3_stmt *sql = NULL;
+
+	/* by the directories under the path, never by the text of the
+	 * path: it may hold quotes and wildcards */
+	if (begin_restrict(path ? path->c_str() : NULL, &dirs))
+		return -1;
+	sql_string << "SELECT COUNT(*) FROM (";
+	if (dirs.length() > 0) {
+		sql_string << "SELECT ino, mode, " FILE_PATH " AS path "
+				"FROM files WHERE dir_id IN (SELECT dir_id FROM "
+			   << dirs << ") INTERSECT ";
+	}
+	/* the query is terminated, so strip the ';' */
+	sqlp = *query;
+	end = sqlp.find_last_not_of(" ;");
+	if (end != string::npos)
+		sqlp.erase(end + 1);
+	sql_string << sqlp << ");";
+	sqlp = sql_string.str();
+
+	DBG_PRINT("I run query: %s \n\n", sqlp.c_str());
+	res = sqlite3_prepare_v2(db, sqlp.c_str(), sqlp.length(), &sql, 0);
+	if (res != SQLITE_OK || !sql) {
+		DB_PRINTERR("Preparing count: ",db);
+		goto error;
+	}
+	res = sqlite3_step(sql);
+	if (res != SQLITE_ROW) {
+		DB_PRINTERR("Error at counting files: ",db);
+		goto error;
+	}
+	count = (long) sqlite3_column_int64(sql, 0);
+
+error:
+	if (sql)
+		sqlite3_finalize(sql);
+	end_restrict(&dirs);
+	return count;
+}
+
+void DbBackend::drop_attr_cache()
+{
+	attr_cache_t *cache, *ncache;
+	
+	ncache = new attr_cache_t;
+	pthread_mutex_lock(&cache_lock);
+	cache = attr_cache;
+	EPOCH_PUBLISH(attr_cache, ncache);
+	pthread_mutex_unlock(&cache_lock);
+	epoch_retire(cache, destroy_attr_cache);
+}
+
+int DbBackend::db_get_query_attr(string *query, string *query_key,
+                                 vector<tag_info_t> *tags, string *path,
+                                 long *nentries, time_t *mtime)
+{
+	EpochGuard guard;
+	long count;
+	unsigned long maxgen, curgen, fgen;
+	int unknown = 0;
+	string key;
+	vdir_attr_t attr;
+	tag_gen_t *tg;
+	attr_cache_t *cache, *ncache;
+	attr_cache_t::iterator ca;
+
+	if (path)
+		key.assign(*path);
+	key.append("|");
+	key.append(*query_key);
+
+	/* the module manager tags the files from another process */
+	fgen = check_foreign_writes();
+	if (fgen != attr_fgen) {
+		drop_attr_cache();
+		attr_fgen = fgen;
+	}
+
+	/* the virtual directory is as new as the newest tag from it */
+	maxgen = 0;
+	*mtime = base_mtime;
+	if (tags != NULL) {
+		for (vector<tag_info_t>::iterator iter = tags->begin();
+				iter != tags->end(); iter++) {
+			/* a tag the dictionary doesn't have yet gets its
+			 * bucket when it's created */
+			if ((*iter).name == 0) {
+				unknown = 1;
+				continue;
+			}
+			tg = &tag_gens[(*iter).name % TAG_GEN_BUCKETS];
+			if (tg->gen > maxgen)
+				maxgen = tg->gen;
+			if (tg->gen && tg->mtime > *mtime)
+				*mtime = tg->mtime;
+		}
+	}
+	/* a negation depends on all the other tags, and so does a tag
+	 * without a bucket */
+	if (unknown || query->find(" NOT ") != string::npos) {
+		maxgen = generation;
+		*mtime = last_mtime;
+	}
+	__sync_synchronize();
+	curgen = generation;
+
+	cache = attr_cache;
+	ca = cache->find(key);
+	/* without a key, the query is counted every time */
+	if (query_key->length() > 0 && ca != cache->end() &&
+	    ca->second.gen >= maxgen &&
+	    ca->second.fgen == fgen) {
+		*nentries = ca->second.nentries;
+		return 0;
+	}
+
+	/* right after the mount, the snapshot counts without the scan */
+	count = snapshot_count(query, tags, path);
+	if (count < 0)
+		count = count_files(query, path);
+	if (count < 0)
+		return -1;
+	*nentries = count;
+	if (query_key->length() == 0)
+		return 0;
+
+	/* stamp it with the generation seen before counting, to be safe */
+	attr.nentries = count;
+	attr.gen = curgen;
+	attr.fgen = fgen;
+
+	/* the readers keep using the old version until we publish the copy */
+	pthread_mutex_lock(&cache_lock);
+	cache = attr_cache;
+	if (cache->size() >= ATTR_CACHE_MAX)
+		ncache = new attr_cache_t;
+	else
+		ncache = new attr_cache_t(*cache);
+	(*ncache)[key] = attr;
+	EPOCH_PUBLISH(attr_cache, ncache);
+	pthread_mutex_unlock(&cache_lock);
+	epoch_retire(cache, destroy_attr_cache);
+
+	return 0;
+}
+
+tag_catalog_t *DbBackend::build_catalog(unsigned long gen, unsigned int counter)
+{
+	tag_catalog_t *cat;
+	list<string> *tags;
+	
+	cat = new tag_catalog_t;
+	cat->gen = gen;
+	cat->counter = counter;
+	
+	if (snapshot_valid(counter)) {
+		/* the dictionary is sorted, so the same tags are together */
+		for (size_t i = 0; i < snapshot.get_ntags(); i++) {
+			const char *tag = snapshot.get_tag(i);
+			const char *value = snapshot.get_value(i);
+			
+			if (cat->tags.empty() || cat->tags.back() != tag)
+				cat->tags.push_back(tag);
+			/* as db_get_tags_values() shows them */
+			if (tag[0] == '\0' || value[0] == '\0' ||
+			    strcmp(value, NULL_VALUE) == 0)
+				continue;
+			cat->tags_values.push_back(string("(") + tag + ":" + value + ")");
+		}
+		return cat;
+	}
+	
+	tags = db_get_tags(NULL);
+	if (tags == NULL)
+		goto error;
+	cat->tags.swap(*tags);
+	delete tags;
+	
+	tags = db_get_tags_values(NULL);
+	if (tags == NULL)
+		goto error;
+	cat->tags_values.swap(*tags);
+	delete tags;
+	
+	return cat;
+
+error:
+	delete cat;
+	return NULL;
+}
+
+int DbBackend::db_list_catalog(void *buf, filler_t filler)
+{
+	EpochGuard guard;
+	tag_catalog_t *cat, *ncat;
+	unsigned long gen;
+	unsigned int counter;
+	list<string>::const_iterator i;
+	
+	gen = generation;
+	counter = read_change_counter();
+	
+	cat = catalog;
+	if (cat == NULL || cat->gen != gen || cat->counter != counter) {
+		/* there is nothing to show yet, so wait for it */
+		if (cat == NULL)
+			pthread_mutex_lock(&catalog_lock);
+		else if (pthread_mutex_trylock(&catalog_lock))
+			goto fill;
+		
+		/* somebody else may have read it meanwhile */
+		cat = catalog;
+		if (cat == NULL || cat->gen != gen || cat->counter != counter) {
+			ncat = build_catalog(gen, counter);
+			if (ncat != NULL) {
+				EPOCH_PUBLISH(catalog, ncat);
+				epoch_retire(cat, destroy_catalog);
+				cat = ncat;
+			}
+		}
+		pthread_mutex_unlock(&catalog_lock);
+	}
+
+fill:
+	if (cat == NULL)
+		return -EIO;
+	
+	for (i = cat->tags.begin(); i != cat->tags.end(); i++)
+		if (filler(buf, (*i).c_str(), NULL, 0))
+			return 0;
+	for (i = cat->tags_values.begin(); i != cat->tags_values.end(); i++)
+		if (filler(buf, (*i).c_str(), NULL, 0))
+			return 0;
+	
+	return 0;
+}
+
 string * DbBackend::build_temp_table(string *query, string *path)
 {
 	int res = 0;
-	string sqlp;
+	string sqlp, dirs;
 	string *name;
 	ostringstream sql_string;
-	ostringstream tbl_name;
-	struct timeval tmv;
 	
-	res = gettimeofday(&tmv, NULL);
+	if (query == NULL)
+		return build_subtree_table(path);
 	
-	name = new string();
-	tbl_name << "temp"<<tmv.tv_sec<<tmv.tv_usec;
-	name->assign(tbl_name.str());
+	name = new string(temp_name());
 	DBG_PRINT("I make temp table %s\n", name->c_str());
+	if (begin_restrict(path ? path->c_str() : NULL, &dirs)) {
+		delete name;
+		return NULL;
+	}
 	sql_string << "CREATE TEMPORARY TABLE " << *name <<" AS ";
-	if(path) {
-		if(path->length() != 0) {
-			const char * pathl = path->c_str();
-			if(pathl[0] == '/')
-				pathl++;
-			sql_string << "SELECT ino, mode, path FROM files WHERE ";
-			sql_string << " path LIKE '" << pathl << "%' INTERSECT ";
-		}
+	/* the files under the path come from the files(dir_id, name) index */
+	if (dirs.length() > 0) {
+		sql_string << "SELECT ino, mode, " FILE_PATH " AS path "
+				"FROM files WHERE dir_id IN (SELECT dir_id FROM "
+			   << dirs << ") INTERSECT ";
 	}
 	sql_string << *query;
 	/* done building the query */
@@ -1061,6 +3339,8 @@ string * DbBackend::build_temp_table(string *query, string *path)
 	
 	DBG_PRINT("I run query: %s \n\n", sqlp.c_str());
 	res = run_simple_query(sqlp.c_str());
+	if (end_restrict(&dirs))
+		res = -1;
 	if(res) {
 		delete name;
 		
@@ -1069,6 +3349,97 @@ string * DbBackend::build_temp_table(string *query, string *path)
 	return name;
 }
 
+int DbBackend::build_dir_table(string *path, const string &dirs)
+{
+	int ret, depth;
+	long long dir_id = -1;
+	const char *pathl = "";
+	size_t len = 0;
+	string sql;
+	sqlite3_stmt *stmt = NULL;
+	
+	if (path) {
+		pathl = path->c_str();
+		len = trim_path(&pathl, path->length());
+	}
+	/* a directory the database doesn't know has no files */
+	dir_id = find_dir(pathl, len, 0);
+	
+	sql = "CREATE TEMPORARY TABLE " + dirs + " (dir_id INTEGER, depth INTEGER);";
+	ret = run_simple_query(sql.c_str());
+	DB_ERROR(ret != SQLITE_OK, "Cannot make the table of directories: ", db);
+	
+	sql = "INSERT INTO " + dirs + " VALUES (?1, 0);";
+	ret = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0);
+	DB_ERROR(ret != SQLITE_OK || !stmt, "Preparing insert: ", db);
+	sqlite3_bind_int64(stmt, 1, dir_id);
+	ret = sqlite3_step(stmt);
+	DB_ERROR(ret != SQLITE_DONE, "Cannot add the directory: ", db);
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+	
+	/* the children of the last level, by the dirs(parent, name) index,
+	 * until a level is empty */
+	sql = "INSERT INTO " + dirs + " SELECT dirs.dir_id, ?1 + 1 FROM " +
+		dirs + ", dirs WHERE " + dirs + ".depth = ?1 AND "
+		"dirs.parent = " + dirs + ".dir_id;";
+	ret = sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, 0);
+	DB_ERROR(ret != SQLITE_OK || !stmt, "Preparing insert: ", db);
+	for (depth = 0; dir_id >= 0; depth++) {
+		sqlite3_bind_int(stmt, 1, depth);
+		ret = sqlite3_step(stmt);
+		DB_ERROR(ret != SQLITE_DONE, "Cannot read the directories: ", db);
+		sqlite3_reset(stmt);
+		if (sqlite3_changes(db) == 0)
+			break;
+	}
+	ret = 0;
+	
+out:
+	if (stmt)
+		sqlite3_finalize(stmt);
+	
+	return ret ? -1 : 0;
+}
+
+string * DbBackend::build_subtree_table(string *path)
+{
+	int ret;
+	string dirs, sql;
+	string *name;
+	
+	name = new string(temp_name());
+	dirs = *name + "_dirs";
+	
+	/* the temporary tables are made in one go, the transaction of
+	 * another thread would take them along if it rolled back */
+	if (db_begin_transaction()) {
+		delete name;
+		return NULL;
+	}
+	ret = build_dir_table(path, dirs);
+	if (ret)
+		goto out;
+	
+	/* the files come from the files(dir_id, name) index */
+	sql = "CREATE TEMPORARY TABLE " + *name + " AS "
+		"SELECT ino, mode, " FILE_PATH " AS path FROM files "
+		"WHERE dir_id IN (SELECT dir_id FROM " + dirs + ");";
+	ret = run_simple_query(sql.c_str());
+	DB_ERROR(ret != SQLITE_OK, "Cannot make the table of files: ", db);
+	
+out:
+	delete_temp_table(&dirs);
+	if (db_end_transaction())
+		ret = -1;
+	if (ret) {
+		delete name;
+		return NULL;
+	}
+	
+	return name;
+}
+
 int DbBackend::delete_temp_table(string *name)
 {
 	char command[512];
@@ -1085,7 +3456,6 @@ int DbBackend::fill_files(string *path, string *temp_table, void *buf,
 	sqlite3_stmt* sql;
 	int res, fill;
 	string sqlp;
-	string absolute;
 
 	sqlp = "SELECT ino, mode, path FROM ";
 	sqlp.append(*temp_table);
@@ -1114,9 +3484,7 @@ int DbBackend::fill_files(string *path, string *temp_table, void *buf,
 				relpath = abspath + path->length();
 		}
 
-		absolute = vdir_path;
-		absolute.append(abspath);
-		res = get_stat(absolute.c_str(), &st);
+		res = get_stat_at(dir_fd, abspath, &st);
 		if (res)
 			break;
 
@@ -1142,11 +3510,13 @@ int DbBackend::db_get_filesinfo(string *query, vector<tag_info_t> *tags, string
                                 void * buf, filler_t filler)
 {
 	sqlite3_stmt* sql = NULL;
-	int res, fill, i, ntags;
+	int res, fill, n;
 	string *table_name;
 	string sqlp;
 	string absolute;
 	ostringstream sql_string;
+	vector<const dict_entry_t *> skip;
+	const dict_entry_t *e;
 
 	/* build the query - we make it a temp table */
 	table_name = build_temp_table(query, path);
@@ -1162,26 +3532,23 @@ int DbBackend::db_get_filesinfo(string *query, vector<tag_info_t> *tags, string
 	sql_string << " WHERE tags.tag_id=assoc.tag_id AND " << *table_name;
 	sql_string << ".ino=assoc.ino";
 	
-	/* in a sad way, they must be different than the tags from the query itself */
-	if(tags != NULL) {
-		i = 0;
-		ntags = tags->size();
-		sql_string << " AND NOT (";
+	/* in a sad way, they must be different than the tags from the query
+	 * itself; their strings are the ones of the dictionary */
+	if (tags != NULL) {
 		for (vector<tag_info_t>::iterator iter = tags->begin(); iter
 				                != tags->end(); iter++) {
-			sql_string << " ( tag LIKE '"<< (*iter).tag;
-			sql_string << "' AND value LIKE '";
-			if((*iter).value.length() == 0)
-				 sql_string << NULL_VALUE << "'";
-			else
-				sql_string << (*iter).value <<"'";
-			sql_string << " ) ";
-			if(i<ntags-1)
-				sql_string << " OR ";
-			i++;
+			e = TagDict::get()->entry((*iter).id);
+			if (e != NULL)
+				skip.push_back(e);
 		}
-		sql_string << ")";
 	}
+	for (n = 0; n < (int) skip.size(); n++) {
+		sql_string << (n == 0 ? " AND NOT (" : " OR ");
+		sql_string << " ( tag LIKE ?" << 2 * n + 1;
+		sql_string << " AND value LIKE ?" << 2 * n + 2 << " ) ";
+	}
+	if (skip.size() > 0)
+		sql_string << ")";
 	sql_string << ";";
 	
 	sqlp = sql_string.str();
@@ -1193,6 +3560,14 @@ int DbBackend::db_get_filesinfo(string *query, vector<tag_info_t> *tags, string
 		DB_PRINTERR("Preparing select: ",db);
 		goto error;
 	}
+	for (n = 0; n < (int) skip.size(); n++) {
+		sqlite3_bind_text(sql, 2 * n + 1, skip[n]->tag.c_str(), -1,
+		                  SQLITE_STATIC);
+		/* a tag without a value is stored with NULL_VALUE */
+		sqlite3_bind_text(sql, 2 * n + 2, skip[n]->value.length() ?
+		                  skip[n]->value.c_str() : NULL_VALUE, -1,
+		                  SQLITE_STATIC);
+	}
 
 	/* now I have the temp table with the files */
 	while ((res = sqlite3_step(sql)) == SQLITE_ROW) {
@@ -1233,29 +3608,211 @@ error:
 }
 
 
-int DbBackend::update_file_path(const char *from, const char *to)
+int DbBackend::retag_set(string *table, int op, string *tag_value)
 {
-	int res;
+	int ret, tag_id, i;
+	dict_id_t id;
+	string tag, value, entry;
+	string sql[2];
+	sqlite3_stmt *stmt = NULL;
+	TagDict *dict = TagDict::get();
+	
+	break_tag(tag_value, &tag, &value);
+	if (tag.length() == 0)
+		return 0;
+	if (value.length() == 0)
+		value = NULL_VALUE;
+	id = dict->intern(tag.c_str(), value.c_str());
+	
+	if (op == TAG_REMOVE) {
+		tag_id = db_check_tag(tag.c_str(), value.c_str());
+		/* nobody has it */
+		if (tag_id <= 0)
+			return tag_id;
+		entry = " " + tag + ":" + value + " ";
+		/* the string of tags first: the trigger may take the tag away */
+		sql[0] = "UPDATE files SET tags = replace(tags, ?2, ' ') "
+			"WHERE ino IN (SELECT ino FROM " + *table + ");";
+		sql[1] = "DELETE FROM assoc WHERE tag_id = ?1 AND "
+			"ino IN (SELECT ino FROM " + *table + ");";
+	} else {
+		tag_id = add_tag(tag.c_str(), value.c_str(), id);
+		if (tag_id <= 0)
+			return -1;
+		/* as db_add_tag_info() appends it, only to the files
+		 * that don't have it already */
+		entry = tag + ":" + value + " ";
+		sql[0] = "UPDATE files SET tags = tags||?2 "
+			"WHERE ino IN (SELECT ino FROM " + *table + ") AND "
+			"ino NOT IN (SELECT ino FROM assoc WHERE tag_id = ?1);";
+		sql[1] = "INSERT OR IGNORE INTO assoc (ino, tag_id) "
+			"SELECT ino, ?1 FROM " + *table + ";";
+	}
 	
-	sqlite3_stmt* sql;
+	for (i = 0; i < 2; i++) {
+		ret = sqlite3_prepare_v2(db, sql[i].c_str(), -1, &stmt, 0);
+		DB_ERROR(ret != SQLITE_OK || !stmt, "Preparing retag: ", db);
+		sqlite3_bind_int(stmt, 1, tag_id);
+		if (sqlite3_bind_parameter_count(stmt) > 1)
+			sqlite3_bind_text(stmt, 2, entry.c_str(), entry.length(),
+			                  SQLITE_STATIC);
+		ret = sqlite3_step(stmt);
+		DB_ERROR(ret != SQLITE_DONE, "Cannot change the tags: ", db);
+		sqlite3_finalize(stmt);
+		stmt = NULL;
+	}
+	if (id)
+		touch_tag_id(dict->name_of(id));
+	else
+		touch_tag(tag.c_str());
+	ret = 0;
 	
-	DBG_PRINT("Rename file path in DB: from=%s to=%s\n", from, to);
-	res = sqlite3_prepare_v2(db, "UPDATE files SET path = ?1 "
-			"WHERE files.path LIKE ?2", -1, &sql, 0);
-	if (res != SQLITE_OK || !sql) {
-		DB_PRINTERR("Preparing path update: ",db);
+out:
+	if (stmt)
+		sqlite3_finalize(stmt);
+	
+	return ret;
+}
+
+int DbBackend::untag_set(string *table)
+{
+	int ret;
+	string sql;
+	sqlite3_stmt *select = NULL;
+	
+	/* the virtual directories of the old tags are changing */
+	sql = "SELECT DISTINCT tags.tag FROM tags, assoc "
+		"WHERE tags.tag_id = assoc.tag_id AND "
+		"assoc.ino IN (SELECT ino FROM " + *table + ");";
+	ret = sqlite3_prepare_v2(db, sql.c_str(), -1, &select, 0);
+	DB_ERROR(ret != SQLITE_OK || !select, "Preparing select: ", db);
+	while ((ret = sqlite3_step(select)) == SQLITE_ROW)
+		touch_tag((const char *)sqlite3_column_text(select, 0));
+	DB_ERROR(ret != SQLITE_DONE, "Cannot read the old tags: ", db);
+	
+	sql = "DELETE FROM assoc WHERE ino IN (SELECT ino FROM " + *table + ");";
+	ret = run_simple_query(sql.c_str());
+	DB_ERROR(ret != SQLITE_OK, "Cannot delete the old tags: ", db);
+	sql = "UPDATE files SET tags = ' ' "
+		"WHERE ino IN (SELECT ino FROM " + *table + ");";
+	ret = run_simple_query(sql.c_str());
+	DB_ERROR(ret != SQLITE_OK, "Cannot delete the old tags: ", db);
+	ret = 0;
+	
+out:
+	if (select)
+		sqlite3_finalize(select);
+	
+	return ret;
+}
+
+long DbBackend::db_retag_files(string *query, string *path,
+                               vector<tags_op_t> *ops,
+                               vector<new_file_info_t> *files)
+{
+	int ret;
+	long count = -1;
+	char *err;
+	string sql;
+	string *table = NULL;
+	
+	DBG_SHOWFC();
+	
+	if (db_begin_transaction())
+		return -1;
+	
+	/* the set of files is fixed before the tags start changing */
+	table = build_temp_table(query, path);
+	if (table == NULL)
+		goto error;
+	sql = "SELECT ino, mode, path FROM " + *table + ";";
+	ret = sqlite3_exec(db, sql.c_str(), files_callback, files, &err);
+	if (ret != SQLITE_OK) {
+		PRINT_ERROR("SQL error: %s\n", err);
+		sqlite3_free(err);
 		goto error;
 	}
 	
-	sqlite3_bind_text(sql, 1, to, -1, SQLITE_STATIC);
-	sqlite3_bind_text(sql, 2, from, -1, SQLITE_STATIC);
+	for (vector<tags_op_t>::iterator op = ops->begin(); op != ops->end();
+			op++) {
+		if ((*op).op == TAG_REPLACE && untag_set(table))
+			goto error;
+		for (vector<string>::iterator t = (*op).tags.begin();
+				t != (*op).tags.end(); t++) {
+			if (retag_set(table, ((*op).op == TAG_REMOVE) ?
+			              TAG_REMOVE : TAG_ADD, &(*t)))
+				goto error;
+		}
+	}
 	
-	res = sqlite3_step(sql);
-	if (res != SQLITE_DONE) {
-		DB_PRINTERR("Error at trying to replace file path: ",db);
-		goto error;
+	count = files->size();
+	
+error:
+	/* in the transaction; a rollback takes the table away as well */
+	if (table) {
+		delete_temp_table(table);
+		delete table;
 	}
-	res = 0;
+	if (count < 0)
+		db_rollback();
+	else if (db_end_transaction())
+		count = -1;
+	
+	return count;
+}
+
+int DbBackend::update_file_path(const char *from, const char *to)
+{
+	int res;
+	long long from_dir, to_dir;
+	string from_name, to_name;
+	sqlite3_stmt* sql = NULL;
+	
+	DBG_PRINT("Rename file path in DB: from=%s to=%s\n", from, to);
+	/* a file: its row moves to the new directory */
+	if (split_path(from, strlen(from), &from_dir, &from_name, 0) == 0) {
+		res = split_path(to, strlen(to), &to_dir, &to_name, 1);
+		if (res)
+			goto error;
+		/* an old path left from before the dirs table goes too */
+		res = sqlite3_prepare_v2(db, "UPDATE files SET dir_id = ?1, "
+				"name = ?2, path = NULL WHERE dir_id = ?3 AND name = ?4;",
+				-1, &sql, 0);
+		if (res != SQLITE_OK || !sql) {
+			DB_PRINTERR("Preparing path update: ",db);
+			goto error;
+		}
+		
+		sqlite3_bind_int64(sql, 1, to_dir);
+		sqlite3_bind_text(sql, 2, to_name.data(), to_name.length(),
+		                  SQLITE_STATIC);
+		sqlite3_bind_int64(sql, 3, from_dir);
+		sqlite3_bind_text(sql, 4, from_name.data(), from_name.length(),
+		                  SQLITE_STATIC);
+		
+		res = sqlite3_step(sql);
+		if (res != SQLITE_DONE) {
+			DB_PRINTERR("Error at trying to replace file path: ",db);
+			goto error;
+		}
+		if (sqlite3_changes(db) > 0) {
+			/* queries restricted to a real path may see a
+			 * different content */
+			touch_file_tags(to);
+			res = 0;
+			goto error;
+		}
+	}
+	
+	/* a directory: only its row changes, the files under it follow */
+	res = rename_dir(from, to);
+	if (res == 0) {
+		/* the counts under the real paths are all suspect now */
+		drop_attr_cache();
+	}
+	/* nothing of ours was there */
+	if (res == 1)
+		res = 0;
 	
 error:
 	if(sql)
@@ -1266,43 +3823,73 @@ error:
 	return res;
 }
 
-int DbBackend::db_begin_transaction()
+int DbBackend::trans_begin(const char *begin)
 {
 	int res;
 	
-	res = sqlite3_exec(db, "BEGIN",NULL,NULL,NULL);
-	if(res != SQLITE_OK) {
-		DB_PRINTERR("begin transaction error: ",db);
-		return -1;
+	pthread_mutex_lock(&trans_lock);
+	/* inside a transaction of this thread, it becomes part of it */
+	if (trans_depth == 0) {
+		res = sqlite3_exec(db, begin, NULL, NULL, NULL);
+		if(res != SQLITE_OK) {
+			DB_PRINTERR("begin transaction error: ",db);
+			pthread_mutex_unlock(&trans_lock);
+			return -1;
+		}
+		trans_failed = 0;
 	}
+	trans_depth++;
 	
 	return 0;
 }
+
+int DbBackend::db_begin_transaction()
+{
+	return trans_begin("BEGIN");
+}
 	
 int DbBackend::db_rollback()
 {
-	int res;
-		
-	res = sqlite3_exec(db, "ROLLBACK",NULL,NULL,NULL);
-	if(res != SQLITE_OK) {
-		DB_PRINTERR("rollback transaction error: ",db);
-		return -1;
+	int res = SQLITE_OK;
+	
+	/* SQLite can't undo only the inner part, the outer one will fail */
+	trans_depth--;
+	if (trans_depth == 0) {
+		res = sqlite3_exec(db, "ROLLBACK",NULL,NULL,NULL);
+		if(res != SQLITE_OK)
+			DB_PRINTERR("rollback transaction error: ",db);
 	}
+	else
+		trans_failed = 1;
+	pthread_mutex_unlock(&trans_lock);
 	
-	return 0;
+	return (res == SQLITE_OK) ? 0 : -1;
 }
 	
 int DbBackend::db_end_transaction()
 {
-	int res;
-		
+	int res = SQLITE_OK;
+	
+	trans_depth--;
+	if (trans_depth > 0) {
+		pthread_mutex_unlock(&trans_lock);
+		return 0;
+	}
+	if (trans_failed) {
+		/* a part of it was rolled back */
+		res = sqlite3_exec(db, "ROLLBACK",NULL,NULL,NULL);
+		pthread_mutex_unlock(&trans_lock);
+		return -1;
+	}
 	res = sqlite3_exec(db, "COMMIT",NULL,NULL,NULL);
 	if(res != SQLITE_OK) {
 		DB_PRINTERR("commit transaction error: ",db);
-		return -1;
+		/* the others must not find it open */
+		sqlite3_exec(db, "ROLLBACK",NULL,NULL,NULL);
 	}
+	pthread_mutex_unlock(&trans_lock);
 	
-	return 0;
+	return (res == SQLITE_OK) ? 0 : -1;
 }
 
 } // namespace hybfs
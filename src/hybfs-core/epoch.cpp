@@ -0,0 +1,164 @@
+/*
+ epoch.cpp - Epoch based reclamation for the lock-free readers
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <list>
+
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+
+#include "core/hybfsdef.h"
+#include "core/epoch.hpp"
+
+namespace hybfs {
+
+using namespace std;
+
+/*
+ * Each reader owns a slot where it writes the global epoch when it enters a
+ * read section, and 0 when it exits. A retired version is stamped with the
+ * global epoch, which is then incremented: the readers that entered after
+ * that can only see the new version, so the old one can be destroyed once no
+ * slot holds an epoch older or equal to its stamp.
+ */
+typedef struct {
+	volatile unsigned long epoch;
+	volatile int used;
+	/* keep each slot on its own cache line */
+	char pad[64 - sizeof(unsigned long) - sizeof(int)];
+} epoch_slot_t;
+
+typedef struct {
+	void *ptr;
+	epoch_destroy_t destroy;
+	unsigned long epoch;
+} retired_t;
+
+static epoch_slot_t slots[EPOCH_MAX_THREADS];
+
+static volatile unsigned long global_epoch = 1;
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static list<retired_t> retired;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+
+static __thread int my_slot = -1;
+static __thread int depth = 0;
+
+/* the fuse threads come and go, so give the slot back when they exit */
+static void release_slot(void *arg)
+{
+	long slot = (long) arg - 1;
+
+	slots[slot].epoch = 0;
+	__sync_synchronize();
+	slots[slot].used = 0;
+}
+
+static void make_key()
+{
+	pthread_key_create(&slot_key, release_slot);
+}
+
+static int get_slot()
+{
+	int i;
+
+	if (my_slot >= 0)
+		return my_slot;
+
+	pthread_once(&key_once, make_key);
+	while (1) {
+		for (i = 0; i < EPOCH_MAX_THREADS; i++) {
+			if (slots[i].used)
+				continue;
+			if (__sync_bool_compare_and_swap(&slots[i].used, 0, 1)) {
+				my_slot = i;
+				pthread_setspecific(slot_key, (void *) (long) (i + 1));
+				return i;
+			}
+		}
+		/* too many readers, wait for one of them to go away */
+		sched_yield();
+	}
+}
+
+void epoch_enter()
+{
+	int slot;
+
+	if (depth++ > 0)
+		return;
+
+	slot = get_slot();
+	slots[slot].epoch = global_epoch;
+	__sync_synchronize();
+}
+
+void epoch_exit()
+{
+	if (--depth > 0)
+		return;
+
+	__sync_synchronize();
+	slots[my_slot].epoch = 0;
+}
+
+/* the retire_lock must be held */
+static void reclaim()
+{
+	int i;
+	unsigned long ep, oldest = ULONG_MAX;
+
+	for (i = 0; i < EPOCH_MAX_THREADS; i++) {
+		ep = slots[i].epoch;
+		if (ep != 0 && ep < oldest)
+			oldest = ep;
+	}
+
+	list<retired_t>::iterator it = retired.begin();
+	while (it != retired.end()) {
+		if ((*it).epoch < oldest) {
+			(*it).destroy((*it).ptr);
+			it = retired.erase(it);
+		} else
+			it++;
+	}
+}
+
+void epoch_retire(void *ptr, epoch_destroy_t destroy)
+{
+	retired_t r;
+
+	if (ptr == NULL)
+		return;
+
+	r.ptr = ptr;
+	r.destroy = destroy;
+	__sync_synchronize();
+	r.epoch = __sync_fetch_and_add(&global_epoch, 1);
+
+	pthread_mutex_lock(&retire_lock);
+	retired.push_back(r);
+	reclaim();
+	pthread_mutex_unlock(&retire_lock);
+}
+
+void epoch_reclaim()
+{
+	pthread_mutex_lock(&retire_lock);
+	reclaim();
+	pthread_mutex_unlock(&retire_lock);
+}
+
+} // namespace hybfs
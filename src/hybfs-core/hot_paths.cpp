@@ -0,0 +1,101 @@
+/*
+ hot_paths.cpp - Tells the indexer which real paths are being used
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "core/hybfsdef.h"
+#include "core/db_backend.hpp"
+#include "core/hot_paths.hpp"
+
+namespace hybfs {
+
+static int hot_fd = -1;
+
+int hot_init()
+{
+	if (hot_fd != -1)
+		return 0;
+	
+	hot_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (hot_fd == -1) {
+		PRINT_ERROR("hybfs: cannot create the hot paths socket: %s\n",
+		            strerror(errno));
+		return -1;
+	}
+	
+	return 0;
+}
+
+int hot_socket_addr(const char *dir, struct sockaddr_un *addr, socklen_t *len)
+{
+	size_t dlen = strlen(dir), n;
+	int slash = (dlen == 0 || dir[dlen - 1] != '/');
+	
+	n = dlen + slash + strlen(METADIR HOT_SOCKET);
+	if (n >= sizeof(addr->sun_path))
+		return -1;
+	
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	memcpy(addr->sun_path, dir, dlen);
+	if (slash)
+		addr->sun_path[dlen] = '/';
+	strcpy(addr->sun_path + dlen + slash, METADIR HOT_SOCKET);
+	*len = offsetof(struct sockaddr_un, sun_path) + n + 1;
+	
+	return 0;
+}
+
+void hot_close()
+{
+	if (hot_fd != -1)
+		close(hot_fd);
+	hot_fd = -1;
+}
+
+void hot_notify(char type, const char *dir, const char *relpath)
+{
+	char msg[PATH_MAX + 2];
+	size_t len, dlen;
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	
+	if (hot_fd == -1 || dir == NULL || hot_socket_addr(dir, &addr, &addrlen))
+		return;
+	
+	msg[0] = type;
+	dlen = strlen(dir);
+	if (dlen + 1 >= sizeof(msg))
+		return;
+	memcpy(msg + 1, dir, dlen);
+	len = dlen + 1;
+	if (strcmp(relpath, ".") != 0) {
+		if (dlen == 0 || dir[dlen - 1] != '/')
+			msg[len++] = '/';
+		if (len + strlen(relpath) > sizeof(msg))
+			return;
+		memcpy(msg + len, relpath, strlen(relpath));
+		len += strlen(relpath);
+	}
+	
+	/* without an indexer, this fails on the lookup of the socket, which
+	 * costs about as much as the lstat of the path did */
+	sendto(hot_fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL,
+	       (struct sockaddr *) &addr, addrlen);
+}
+
+}
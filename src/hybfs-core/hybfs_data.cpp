@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -21,6 +22,7 @@
 #include "core/misc.h"
 #include "core/hybfs_data.hpp"
 #include "core/path_crawler.hpp"
+#include "core/hot_paths.hpp"
 
 namespace hybfs {
 
@@ -29,6 +31,53 @@ HybfsData::HybfsData(char *_mountp)
 	mountp = _mountp;
 	doexit = 0;
 	retval = 0;
+	branches = new branch_list_t;
+	pthread_mutex_init(&branch_lock, NULL);
+	reconciler = new Reconciler(this);
+	root_cache = new RootCache();
+	maintainer = new Maintainer(this);
+	nshards = 0;
+}
+
+/* microseconds since start */
+static long since(struct timeval *start)
+{
+	struct timeval now;
+	
+	gettimeofday(&now, NULL);
+	
+	return (now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_usec - start->tv_usec);
+}
+
+static void destroy_list(void *ptr)
+{
+	delete (branch_list_t *) ptr;
+}
+
+static void destroy_branch(void *ptr)
+{
+	branch_t *br = (branch_t *) ptr;
+	
+	delete br->vdir;
+	delete br;
+}
+
+void HybfsData::publish_branches(branch_list_t *list)
+{
+	branch_list_t *old = branches;
+	
+	EPOCH_PUBLISH(branches, list);
+	epoch_retire(old, destroy_list);
+}
+
+void HybfsData::update_root_cache()
+{
+	vector<string> paths;
+	
+	for (int i = 0; i < (int) branches->size(); i++)
+		paths.push_back((*branches)[i]->path);
+	root_cache->set_branches(&paths);
 }
 
 int HybfsData::add_branch(const char * branch)
@@ -36,6 +85,8 @@ int HybfsData::add_branch(const char * branch)
 	struct stat buf;
 	string *abspath = NULL;
 	VirtualDirectory *vdir;
+	branch_t *br;
+	branch_list_t *list;
 	int ret;
 
 	abspath = make_absolute(branch);
@@ -54,19 +105,29 @@ int HybfsData::add_branch(const char * branch)
 		goto out;
 	}
 
-	branches.push_back(*abspath);
-
 	vdir = new VirtualDirectory(abspath->c_str());
 	if(vdir == NULL) {
 		ret = -1;
 		goto out;
 	}
-	if(vdir->check_for_init()) {
+	/* all the ops on the branch go through its descriptor */
+	if(vdir->check_for_init() || vdir->get_dirfd() == -1) {
+		delete vdir;
 		ret = -1;
 		goto out;
 	}
 
-	vdirs.push_back(vdir);
+	br = new branch_t;
+	br->path = *abspath;
+	br->vdir = vdir;
+
+	/* the readers still see the old list until we publish this one */
+	pthread_mutex_lock(&branch_lock);
+	list = new branch_list_t(*branches);
+	list->push_back(br);
+	publish_branches(list);
+	update_root_cache();
+	pthread_mutex_unlock(&branch_lock);
 	ret = 0;
 out:
 	if(abspath != NULL)
@@ -77,20 +138,27 @@ out:
 
 int HybfsData::delete_branch(const char * branch)
 {
-	int i, ret;
-
-	ret = 0;
-	for (i=0; i< (int) branches.size(); i++) {
-		if (strncmp(branches[i].c_str(), branch, branches[i].size() )
-		                == 0) {
-			/* delete the branch path */
-			branches.erase(branches.begin()+i, branches.begin()+1+i);
-			/* delete the associated vdir handle*/
-			vdirs.erase(vdirs.begin()+i, vdirs.begin()+1+i);
+	int i;
+	branch_t *br;
+	branch_list_t *list;
+
+	pthread_mutex_lock(&branch_lock);
+	for (i=0; i< (int) branches->size(); i++) {
+		br = (*branches)[i];
+		if (strncmp(br->path.c_str(), branch, br->path.size()) == 0) {
+			list = new branch_list_t(*branches);
+			list->erase(list->begin()+i, list->begin()+1+i);
+			publish_branches(list);
+			update_root_cache();
+			pthread_mutex_unlock(&branch_lock);
+			/* the path and the vdir handle go away with the
+			 * last reader */
+			epoch_retire(br, destroy_branch);
 			
 			return 0;
 		}
 	}
+	pthread_mutex_unlock(&branch_lock);
 	PRINT_ERROR("Could not find branch %s \n", branch);
 
 	return 1;
@@ -103,7 +171,7 @@ int HybfsData::parse_branches(const char *arg)
 {
 	PathCrawler pc(arg, ROOT_SEP);
 	
-	if (branches.size() != 0)
+	if (get_nbranches() != 0)
 		return 0;
 
 	ABORT((arg[0] == '\0'), "HybFS: No branches specified! \n");
@@ -117,50 +185,55 @@ int HybfsData::parse_branches(const char *arg)
 		add_branch(branch);
 	}
 
-	return branches.size();
+	return get_nbranches();
+}
+
+int HybfsData::get_branch_fd(int brid)
+{
+	EpochGuard guard;
+	branch_list_t *list = branches;
+	
+	if (brid < 0 || brid >= (int) list->size())
+		return -1;
+
+	return (*list)[brid]->vdir->get_dirfd();
 }
 
 const char * HybfsData::get_branch_path(int brid)
 {
-	if (brid < 0 || brid > (int) branches.size())
+	EpochGuard guard;
+	branch_list_t *list = branches;
+	
+	if (brid < 0 || brid >= (int) list->size())
 		return NULL;
 
-	return branches[brid].c_str();
+	return (*list)[brid]->path.c_str();
 }
 
 int HybfsData::get_nlinks()
 {
-	int i, nlinks;
-	int size;
-	struct stat st;
-	int ret;
-	
-	memset(&st, 0, sizeof(st));
-	
-	size = branches.size();
-	nlinks = 0;
-	
-	for(i = 0; i< size; i++) {
-		ret = lstat(branches[i].c_str(), &st);
-		if(!ret)
-			nlinks += st.st_nlink;
-	}
-	
-	return nlinks;
+	return root_cache->get_nlinks();
+}
+
+void HybfsData::get_root_stat(stat_t *st)
+{
+	root_cache->get_root_stat(st);
 }
 
 int HybfsData::virtual_readroot(const char *path, void *buf,
 		                                filler_t filler)
 {
+	EpochGuard guard;
+	branch_list_t *list = branches;
 	int i, size, brid;
 	int ret = 0;
-	std::string *rpath;
+	const char *relpath;
 
-	size = vdirs.size();
+	size = list->size();
 	/* call a virtual readdir for each branch */
 	if (path[0] == '\0' || strcmp(path, "/") == 0) {
 		for (i=0; i<size; i++) {
-			ret = vdirs[i]->vdir_list_root(NULL,buf, filler);
+			ret = (*list)[i]->vdir->vdir_list_root(NULL,buf, filler);
 			if (ret)
 				break;
 		}
@@ -168,56 +241,147 @@ int HybfsData::virtual_readroot(const char *path, void *buf,
 	}
 
 	/* find out in which branch the directory is */
-	rpath = resolve_path(this, path, &brid);
-	delete rpath;
+	if (resolve_fd(this, path, &brid, &relpath) == -1 || brid >= size)
+		return -ENOENT;
 	/* call virtual readdir for that branch */
-	ret = vdirs[brid]->vdir_list_root(path, buf, filler);
+	ret = (*list)[brid]->vdir->vdir_list_root(path, buf, filler);
 
 	return ret;
 }
 
 int HybfsData::virtual_readdir(const char *query, void *buf, filler_t filler)
 {
+	EpochGuard guard;
+	branch_list_t *list = branches;
 	int i, size;
 	int ret = 0;
+	struct timeval start;
 	
 	if(query == NULL)
 		return -EINVAL;
 	
-	size = vdirs.size();
+	gettimeofday(&start, NULL);
+	size = list->size();
 	for(i=0; i<size; i++) {
-		ret = vdirs[i]->vdir_readdir(query, buf, filler);
+		ret = (*list)[i]->vdir->vdir_readdir(query, buf, filler);
 		if(ret)
 			break;
 	}
+	maintainer->note_query(since(&start));
 
 	return ret;
 }
 
+int HybfsData::virtual_getattr(const char *query, stat_t *st)
+{
+	EpochGuard guard;
+	branch_list_t *list = branches;
+	int i, size;
+	int ret = 0;
+	long nentries, total;
+	time_t mtime, newest;
+	struct timeval start;
+	
+	if(query == NULL)
+		return -EINVAL;
+	
+	gettimeofday(&start, NULL);
+	total  = 0;
+	newest = 0;
+	size = list->size();
+	for(i=0; i<size; i++) {
+		ret = (*list)[i]->vdir->vdir_getattr(query, &nentries, &mtime);
+		if(ret)
+			return ret;
+		total += nentries;
+		if(mtime > newest)
+			newest = mtime;
+	}
+	fill_vdir_stat(st, total, newest);
+	maintainer->note_query(since(&start));
+
+	return 0;
+}
+
 int HybfsData::virtual_remove_file(const char *path, int brid)
 {
+	EpochGuard guard;
+	branch_list_t *list = branches;
 	int ret = 0;
 	
-	if(brid <0 || brid >= (int) vdirs.size() || path == NULL)
+	if(brid <0 || brid >= (int) list->size() || path == NULL)
 		return -EINVAL;
 	
-	ret = vdirs[brid]->vdir_remove_file(path);
+	ret = (*list)[brid]->vdir->vdir_remove_file(path);
 	
 	return ret;
 }
 
+void HybfsData::queue_stale_file(const char *path, int brid)
+{
+	reconciler->queue_stale(path, brid);
+}
+
+int HybfsData::virtual_remove_stale(vector<string> *paths, int brid)
+{
+	EpochGuard guard;
+	branch_list_t *list = branches;
+	
+	if(brid <0 || brid >= (int) list->size() || paths == NULL)
+		return -EINVAL;
+	
+	return (*list)[brid]->vdir->vdir_remove_stale(paths);
+}
+
+int HybfsData::virtual_sweep(long long *cursor, int max, vector<string> *stale,
+                             int brid)
+{
+	EpochGuard guard;
+	branch_list_t *list = branches;
+	
+	if(brid <0 || brid >= (int) list->size() || stale == NULL)
+		return -EINVAL;
+	
+	return (*list)[brid]->vdir->vdir_sweep(cursor, max, stale);
+}
+
+long HybfsData::virtual_set_cache(int brid, long bytes)
+{
+	EpochGuard guard;
+	branch_list_t *list = branches;
+	
+	if(brid <0 || brid >= (int) list->size())
+		return -EINVAL;
+	
+	return (*list)[brid]->vdir->set_cache(bytes);
+}
+
+int HybfsData::virtual_maintain(int brid, maint_stats_t *stats)
+{
+	EpochGuard guard;
+	branch_list_t *list = branches;
+	
+	if(brid <0 || brid >= (int) list->size() || stats == NULL)
+		return -EINVAL;
+	
+	return (*list)[brid]->vdir->maintain(stats);
+}
+
 int HybfsData::virtual_updatetags(PathCrawler *from, const char *path,
-                                  const char *abspath, int brid)
+                                  int brid)
 {
+	EpochGuard guard;
+	branch_list_t *list = branches;
 	int ret = 0;
 	int pathlen;
 	struct stat st;
 	file_info_t *finfo = NULL;
 	
-	if(brid <0 || brid >= (int) vdirs.size() || path == NULL)
+	if(brid <0 || brid >= (int) list->size() || path == NULL)
 		return -EINVAL;
+	maintainer->note_busy();
 	
-	ret = stat(abspath, &st);
+	ret = fstatat((*list)[brid]->vdir->get_dirfd(), path+1, &st, 0);
 	if(ret) {
 		return -errno;
 	}
@@ -234,29 +398,29 @@ int HybfsData::virtual_updatetags(PathCrawler *from, const char *path,
 	finfo->fid = st.st_ino;
 	finfo->mode = st.st_mode;
 		
-	ret = vdirs[brid]->vdir_update_tags(from, finfo);
+	ret = (*list)[brid]->vdir->vdir_update_tags(from, finfo);
 	
 	free(finfo);
 		
 	return ret;
 }
 
-int HybfsData::virtual_addtag(PathCrawler *pc, const char *path,
-                              const char *abspath, int brid)
+int HybfsData::virtual_addtag(PathCrawler *pc, const char *path, int brid)
 {
+	EpochGuard guard;
+	branch_list_t *list = branches;
 	struct stat st;
 	int pathlen;
 	int ret = 0;
 	file_info_t *finfo = NULL;
 			
-	DBG_PRINT("absolute path is %s\n", abspath);
-	
-	if(brid <0 || brid >= (int) vdirs.size() || path == NULL)
+	if(brid <0 || brid >= (int) list->size() || path == NULL)
 		return -EINVAL;
 	if(pc->get_nqueries() == 0)
 		return 0;
+	maintainer->note_busy();
 	
-	ret = stat(abspath, &st);
+	ret = fstatat((*list)[brid]->vdir->get_dirfd(), path+1, &st, 0);
 	if(ret) {
 		return -errno;
 	}
@@ -273,7 +437,7 @@ int HybfsData::virtual_addtag(PathCrawler *pc, const char *path,
 	finfo->fid = st.st_ino;
 	finfo->mode = st.st_mode;
 	
-	ret = vdirs[brid]->vdir_add_tag(pc, finfo);
+	ret = (*list)[brid]->vdir->vdir_add_tag(pc, finfo);
 	
 	free(finfo);
 	
@@ -283,21 +447,29 @@ int HybfsData::virtual_addtag(PathCrawler *pc, const char *path,
 int HybfsData::virtual_replace_query(const char*relfrom, const char *relto,
                                      PathCrawler *from, PathCrawler *to, int do_fsmv)
 {
+	EpochGuard guard;
+	branch_list_t *list = branches;
 	int ret;
 	const char *relfroml, *reltol;
+	vector<tags_op_t> ops;
 	
 	relfroml = relfrom;
 	reltol   = relto;
 	if(relfroml) {
 		if(relfroml[0] == '/')
-			relfrom++;
+			relfroml++;
 	}
 	if(reltol) {
 		if(reltol[0] == '/')
 			reltol++;
 	}
-	for(int i=0; i< (int) vdirs.size(); i++) {
-		ret = vdirs[i]->vdir_replace(relfroml, reltol, from, to, do_fsmv);
+	maintainer->note_busy();
+	/* the queries are used up as they are read, so only once */
+	ret = VirtualDirectory::parse_tag_ops(to, &ops);
+	if(ret)
+		return ret;
+	for(int i=0; i< (int) list->size(); i++) {
+		ret = (*list)[i]->vdir->vdir_replace(relfroml, reltol, from, &ops, do_fsmv);
 		if(ret)
 			return ret;
 	}
@@ -307,40 +479,92 @@ int HybfsData::virtual_replace_query(const char*relfrom, const char *relto,
 
 int  HybfsData::virtual_replace_path(const char *from, const char * to, int brid)
 {
+	EpochGuard guard;
+	branch_list_t *list = branches;
 	int ret;
 	
-	if(brid <0 || brid >= (int) vdirs.size())
+	if(brid <0 || brid >= (int) list->size())
 		return -EINVAL;
 	
-	ret = vdirs[brid]->vdir_replace_path(from, to);
+	ret = (*list)[brid]->vdir->vdir_replace_path(from, to);
 	
 	return ret;
 }
 
 int HybfsData::start_db_storage()
 {
+	EpochGuard guard;
+	branch_list_t *list = branches;
 	int ret;
 	
-	for(int i=0; i< (int) vdirs.size(); i++) {
-		ret = vdirs[i]->init();
+	for(int i=0; i< (int) list->size(); i++) {
+		ret = (*list)[i]->vdir->init(nshards);
 		if(ret)
 			return ret;
+		/* nobody waits for the rebuild yet; the database just keeps
+		 * its size if it fails */
+		(*list)[i]->vdir->convert_vacuum();
 	}
 	
 	return 0;
 }
 
+int HybfsData::start_workers()
+{
+	EpochGuard guard;
+	branch_list_t *list = branches;
+	int ret;
+	
+	/* the shards of a branch are only queried one by one without them */
+	for (int i = 0; i < (int) list->size(); i++) {
+		if ((*list)[i]->vdir->start())
+			PRINT_ERROR("hybfs: the shards of branch %d have no "
+			            "threads\n", i);
+	}
+	ret = reconciler->start();
+	/* the databases only miss their maintenance */
+	if (maintainer->start())
+		PRINT_ERROR("hybfs: the databases are not maintained\n");
+	/* without the watcher, the root attributes just expire sooner */
+	if (root_cache->start())
+		PRINT_ERROR("hybfs: the branch roots are not watched\n");
+	/* the indexer then finds the hot paths by itself, later */
+	hot_init();
+	
+	return ret;
+}
+
+void HybfsData::stop_workers()
+{
+	EpochGuard guard;
+	branch_list_t *list = branches;
+	
+	hot_close();
+	maintainer->stop();
+	root_cache->stop();
+	reconciler->stop();
+	/* the last of the others may still have asked the shards for work */
+	for (int i = 0; i < (int) list->size(); i++)
+		(*list)[i]->vdir->stop();
+}
+
 HybfsData::~HybfsData()
 {
-	branches.clear();
+	/* the reconciler still needs the databases */
+	delete reconciler;
+	delete maintainer;
+	delete root_cache;
 	try{
-	for(int i=0; i< (int) vdirs.size(); i++) {
-		delete vdirs[i];
+	for(int i=0; i< (int) branches->size(); i++) {
+		destroy_branch((*branches)[i]);
 	}
 	} catch(exception) {
 		PRINT_ERROR("Failed to destroy FS data!\n");
 	}
-	vdirs.clear();
+	delete branches;
+	/* nobody reads anymore, so free what is left */
+	epoch_reclaim();
+	pthread_mutex_destroy(&branch_lock);
 }
 
 } // namespace hybfs
@@ -0,0 +1,249 @@
+/*
+ maintainer.cpp - Background maintenance of the branch databases
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <string>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "core/hybfsdef.h"
+#include "core/epoch.hpp"
+#include "core/hybfs_data.hpp"
+#include "core/maintainer.hpp"
+
+namespace hybfs {
+
+using namespace std;
+
+Maintainer::Maintainer(HybfsData *_data)
+{
+	data = _data;
+	running = 0;
+	mem_budget = 0;
+	last_busy = 0;
+	last_run = next_run = 0;
+	memset(&window, 0, sizeof(window));
+	memset(&last_window, 0, sizeof(last_window));
+	memset(&prev_window, 0, sizeof(prev_window));
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+Maintainer::~Maintainer()
+{
+	stop();
+
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void *Maintainer::worker(void *arg)
+{
+	Maintainer *maint = (Maintainer *) arg;
+
+	maint->run();
+
+	return NULL;
+}
+
+int Maintainer::start()
+{
+	int ret;
+
+	pthread_mutex_lock(&lock);
+	if (running) {
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	running = 1;
+	/* the first run waits only for the first idle period */
+	last_busy = next_run = time(NULL);
+	pthread_mutex_unlock(&lock);
+
+	ret = pthread_create(&thread, NULL, Maintainer::worker, this);
+	if (ret) {
+		PRINT_ERROR("hybfs: cannot start the maintenance thread: %s\n",
+		            strerror(ret));
+		running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void Maintainer::stop()
+{
+	pthread_mutex_lock(&lock);
+	if (!running) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	running = 0;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+}
+
+void Maintainer::set_budget(long bytes)
+{
+	pthread_mutex_lock(&lock);
+	mem_budget = bytes;
+	pthread_mutex_unlock(&lock);
+}
+
+void Maintainer::note_query(long usec)
+{
+	last_busy = time(NULL);
+	__sync_add_and_fetch(&window.count, 1);
+	__sync_add_and_fetch(&window.usec, (unsigned long long) usec);
+}
+
+void Maintainer::set_caches()
+{
+	int brid, nbranches;
+	long budget;
+
+	pthread_mutex_lock(&lock);
+	budget = mem_budget;
+	pthread_mutex_unlock(&lock);
+
+	nbranches = data->get_nbranches();
+	if (budget <= 0 || nbranches == 0)
+		return;
+	for (brid = 0; brid < nbranches; brid++)
+		data->virtual_set_cache(brid, budget / nbranches);
+}
+
+static const char *vacuum_name(int vacuum)
+{
+	switch (vacuum) {
+	case 1:
+		return "incremental";
+	default:
+		return "none";
+	}
+}
+
+static unsigned long avg_usec(query_window_t *w)
+{
+	return w->count ? (unsigned long) (w->usec / w->count) : 0;
+}
+
+void Maintainer::write_status(int brid, int result, maint_stats_t *stats)
+{
+	EpochGuard guard;
+	const char *branch;
+	string path, tmp;
+	char when[32], next[32];
+	FILE *f;
+
+	branch = data->get_branch_path(brid);
+	if (branch == NULL)
+		return;
+	path = branch;
+	if (path.length() > 0 && path[path.length() - 1] != '/')
+		path.append("/");
+	path.append(METADIR MAINT_STATUS_FILE);
+	tmp = path + ".tmp";
+
+	f = fopen(tmp.c_str(), "w");
+	if (f == NULL) {
+		DBG_PRINT("cannot write %s: %s\n", tmp.c_str(), strerror(errno));
+		return;
+	}
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&last_run));
+	strftime(next, sizeof(next), "%Y-%m-%d %H:%M:%S", localtime(&next_run));
+
+	fprintf(f, "schedule: every %ds, after %ds idle\n", MAINT_INTERVAL,
+	        MAINT_IDLE);
+	fprintf(f, "last run: %s\n", when);
+	fprintf(f, "next run: %s or later\n", next);
+	fprintf(f, "result: %s\n", result == 0 ? "ok" :
+	        (result == 1 ? "busy" : "error"));
+	fprintf(f, "memory budget: %ld bytes\n", mem_budget);
+	fprintf(f, "cache: %ld pages\n", stats->cache_pages);
+	fprintf(f, "pages: %ld before, %ld after, %ld free\n",
+	        stats->pages_before, stats->pages_after, stats->free_pages);
+	fprintf(f, "vacuum: %s, %ld ms\n", vacuum_name(stats->vacuum),
+	        stats->vacuum_ms);
+	fprintf(f, "analyze: %s, %ld ms\n", stats->analyzed ? "yes" : "no",
+	        stats->analyze_ms);
+	/* the queries are counted for all the branches together */
+	fprintf(f, "queries before this run: %lu, %lu us on average\n",
+	        last_window.count, avg_usec(&last_window));
+	fprintf(f, "queries before the previous run: %lu, %lu us on average\n",
+	        prev_window.count, avg_usec(&prev_window));
+
+	if (fclose(f) || rename(tmp.c_str(), path.c_str()))
+		unlink(tmp.c_str());
+}
+
+void Maintainer::maintain()
+{
+	int brid, nbranches, ret;
+	maint_stats_t stats;
+
+	/* the queries since the last run show how good it was; a run with
+	 * no queries before it keeps the old numbers */
+	if (window.count > 0) {
+		prev_window = last_window;
+		last_window.count = __sync_fetch_and_and(&window.count, 0);
+		last_window.usec = __sync_fetch_and_and(&window.usec, 0);
+	}
+	last_run = time(NULL);
+	next_run = last_run + MAINT_INTERVAL;
+
+	/* the branches may have changed since the last time */
+	set_caches();
+
+	nbranches = data->get_nbranches();
+	for (brid = 0; brid < nbranches; brid++) {
+		memset(&stats, 0, sizeof(stats));
+		ret = data->virtual_maintain(brid, &stats);
+		if (ret < 0)
+			PRINT_ERROR("hybfs: the maintenance of branch %d failed\n",
+			            brid);
+		write_status(brid, ret, &stats);
+	}
+}
+
+void Maintainer::run()
+{
+	struct timespec ts;
+	time_t now, due;
+
+	set_caches();
+
+	pthread_mutex_lock(&lock);
+	while (running) {
+		now = time(NULL);
+		due = last_busy + MAINT_IDLE;
+		if (due < next_run)
+			due = next_run;
+		if (now < due) {
+			ts.tv_sec  = due;
+			ts.tv_nsec = 0;
+			pthread_cond_timedwait(&cond, &lock, &ts);
+			continue;
+		}
+
+		pthread_mutex_unlock(&lock);
+		maintain();
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+} // namespace hybfs
@@ -93,22 +93,20 @@ std::string * make_absolute(const char * relpath)
 }
 
 
-std::string * resolve_path(HybfsData *hybfs_core, const char *path, int *brid)
+int resolve_fd(HybfsData *hybfs_core, const char *path, int *brid,
+               const char **relpath)
 {
-	std::string *abspath;
-
 	/* TODO 
 	 * of course, the path should be found, but in our case, we start with
 	 * only one mounted directory
 	 */
 	*brid = 0;
-	abspath = new string(hybfs_core->get_branch_path(*brid));
-	if(abspath == NULL)
-		return NULL;
 	
-	abspath->append(path);
+	while(path[0] == '/')
+		path++;
+	*relpath = (path[0] == '\0') ? "." : path;
 
-	return abspath;
+	return hybfs_core->get_branch_fd(*brid);
 }
 
 
@@ -188,6 +186,17 @@ int get_stat(const char *path, stat_t *buf)
 	return ret;
 }
 
+int get_stat_at(int dirfd, const char *path, stat_t *buf)
+{
+	int ret;
+	
+	memset(buf, 0, sizeof(*buf));
+	ret = fstatat(dirfd, path, (struct stat *)buf, AT_SYMLINK_NOFOLLOW);
+	if(ret)
+		PRINT_ERROR("Cannot stat file %s\n", path);
+	return ret;
+}
+
 void fill_dummy_stat(stat_t *st)
 {
 	struct timeval tmv;
@@ -201,3 +210,16 @@ void fill_dummy_stat(stat_t *st)
 	
 	st->st_atime = st->st_mtime = st->st_ctime = tmv.tv_sec;
 }
+
+void fill_vdir_stat(stat_t *st, long nentries, time_t mtime)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_mode = S_IFDIR | 0755;
+	/* the files are not directories, so this can only overestimate */
+	st->st_nlink = 2 + nentries;
+	st->st_size = nentries;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	
+	st->st_atime = st->st_mtime = st->st_ctime = mtime;
+}
@@ -16,6 +16,7 @@
 #include "hybfs.h"
 #include "core/misc.h"
 #include "core/path_crawler.hpp"
+#include "core/tag_dict.hpp"
 
 namespace hybfs {
 
@@ -141,14 +142,16 @@ int PathCrawler::has_next_query()
 	return (components.size() == 0) ? 0 : 1;
 }
 
-std::string * PathCrawler::db_build_sql_query(vector<tag_info_t> *tags)
+std::string * PathCrawler::db_build_sql_query(vector<tag_info_t> *tags,
+                                              string *key)
 {
 	string * result;
 	ostringstream sql_query;
 	string tag_value;
 	string tag;
 	string value;
-	int i, size;
+	tag_info_t tinfo;
+	int i, size, nokey = 0;
 
 	size = components.size();
 	i = 0;
@@ -158,11 +161,17 @@ std::string * PathCrawler::db_build_sql_query(vector<tag_info_t> *tags)
 			iter != components.end(); iter++) {
 		i++;
 		Tok t(*iter, sep);
-		sql_query << "SELECT ino, mode, path FROM files WHERE ";
+		if (key)
+			key->append(1, '/');
+		sql_query << "SELECT ino, mode, " FILE_PATH " AS path "
+				"FROM files WHERE ";
 		for (Tok::iterator beg=t.begin(); beg!=t.end(); ++beg) {
 			if ((*beg).length() == 0)
 				continue;
 
+			/* the operators are kept as they are */
+			if (key && strchr("()+|!", (*beg)[0]))
+				key->append(1, (*beg)[0]);
 			switch ((*beg)[0])
 			{
 			case '(':
@@ -180,21 +189,33 @@ std::string * PathCrawler::db_build_sql_query(vector<tag_info_t> *tags)
 				break;
 			default:
 				/* split the tag:value in pieces */
-				tag_info_t tinfo;
-
 				tag_value = *beg;
+				/* break_tag() leaves it as it was without ':' */
+				value.clear();
 				break_tag(&tag_value, &tag, &value);
 				sql_query << "files.tags LIKE '% " << tag_value;
 				if (value.length() > 0)
 					sql_query << " %'";
 				else
 					sql_query << ":%'";
-				/* we store all the tags from the query, for
-				 *  later use */
-				if (tags) {
-					tinfo.tag = tag;
-					tinfo.value = value;
+				if (tags == NULL && key == NULL)
+					break;
+				/* from here on the tag is a number; a tag
+				 * that no file has yet gets one too, the
+				 * listing needs its strings */
+				tinfo.id = TagDict::get()->intern(tag.c_str(),
+						value.length() > 0 ? value.c_str() : NULL);
+				tinfo.name = TagDict::get()->name_of(tinfo.id);
+				if (tags)
 					tags->push_back(tinfo);
+				/* "tag:" asks for something else than "tag" */
+				if (tinfo.id == 0 || (value.length() == 0 &&
+				                      tag_value != tag))
+					nokey = 1;
+				else if (key) {
+					key->append(1, 't');
+					key->append((const char *) &tinfo.id,
+					            sizeof(tinfo.id));
 				}
 				break;
 			}
@@ -205,6 +226,8 @@ std::string * PathCrawler::db_build_sql_query(vector<tag_info_t> *tags)
 	}
 
 	sql_query << " ;";
+	if (key && nokey)
+		key->clear();
 
 	result = new string(sql_query.str());
 
@@ -0,0 +1,206 @@
+/*
+ reconciler.cpp - Background removal of the stale entries from the databases
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <sstream>
+#include <map>
+
+#include <errno.h>
+#include <string.h>
+
+#include "core/hybfsdef.h"
+#include "core/hybfs_data.hpp"
+#include "core/reconciler.hpp"
+
+namespace hybfs {
+
+using namespace std;
+
+static string stale_key(int brid, const char *path)
+{
+	ostringstream key;
+
+	key << brid << ":" << path;
+
+	return key.str();
+}
+
+Reconciler::Reconciler(HybfsData *_data)
+{
+	data = _data;
+	running = 0;
+	next_sweep = 0;
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+Reconciler::~Reconciler()
+{
+	stop();
+
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void *Reconciler::worker(void *arg)
+{
+	Reconciler *rec = (Reconciler *) arg;
+
+	rec->run();
+
+	return NULL;
+}
+
+int Reconciler::start()
+{
+	int ret;
+
+	pthread_mutex_lock(&lock);
+	if (running) {
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	running = 1;
+	next_sweep = time(NULL) + SWEEP_INTERVAL;
+	pthread_mutex_unlock(&lock);
+
+	ret = pthread_create(&thread, NULL, Reconciler::worker, this);
+	if (ret) {
+		PRINT_ERROR("hybfs: cannot start the reconciliation thread: %s\n",
+		            strerror(ret));
+		running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void Reconciler::stop()
+{
+	pthread_mutex_lock(&lock);
+	if (!running) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	running = 0;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+
+	/* don't lose what was already found */
+	while (!pending.empty())
+		flush();
+}
+
+void Reconciler::queue_stale(const char *path, int brid)
+{
+	stale_entry_t entry;
+	string key;
+
+	if (path == NULL)
+		return;
+	if (path[0] == '/')
+		path++;
+	if (path[0] == '\0')
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (!running) {
+		pthread_mutex_unlock(&lock);
+		data->virtual_remove_file(path, brid);
+		return;
+	}
+
+	key = stale_key(brid, path);
+	if (queued.find(key) == queued.end()) {
+		entry.brid = brid;
+		entry.path = path;
+		pending.push_back(entry);
+		queued.insert(key);
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void Reconciler::flush()
+{
+	int n;
+	map<int, vector<string> > batch;
+
+	pthread_mutex_lock(&lock);
+	for (n = 0; n < RECONCILE_BATCH && !pending.empty(); n++) {
+		stale_entry_t &entry = pending.front();
+
+		batch[entry.brid].push_back(entry.path);
+		queued.erase(stale_key(entry.brid, entry.path.c_str()));
+		pending.pop_front();
+	}
+	pthread_mutex_unlock(&lock);
+
+	/* one transaction for each branch */
+	for (map<int, vector<string> >::iterator it = batch.begin();
+			it != batch.end(); it++) {
+		DBG_PRINT("removing %d stale paths from branch %d\n",
+		          (int) it->second.size(), it->first);
+		data->virtual_remove_stale(&it->second, it->first);
+	}
+}
+
+void Reconciler::sweep()
+{
+	int brid, nbranches;
+
+	nbranches = data->get_nbranches();
+	if ((int) cursors.size() < nbranches)
+		cursors.resize(nbranches, 0);
+
+	for (brid = 0; brid < nbranches; brid++) {
+		vector<string> stale;
+
+		if (data->virtual_sweep(&cursors[brid], SWEEP_BATCH, &stale, brid))
+			continue;
+		for (vector<string>::iterator it = stale.begin();
+				it != stale.end(); it++)
+			queue_stale((*it).c_str(), brid);
+	}
+}
+
+void Reconciler::run()
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&lock);
+	while (running) {
+		if (pending.empty() && time(NULL) < next_sweep) {
+			ts.tv_sec  = next_sweep;
+			ts.tv_nsec = 0;
+			pthread_cond_timedwait(&cond, &lock, &ts);
+			continue;
+		}
+
+		if (!pending.empty()) {
+			pthread_mutex_unlock(&lock);
+			flush();
+			pthread_mutex_lock(&lock);
+			continue;
+		}
+
+		/* nothing is pending, so it's time for the sweep */
+		pthread_mutex_unlock(&lock);
+		sweep();
+		pthread_mutex_lock(&lock);
+		next_sweep = time(NULL) + SWEEP_INTERVAL;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+} // namespace hybfs
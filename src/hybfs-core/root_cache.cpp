@@ -0,0 +1,241 @@
+/*
+ root_cache.cpp - Cached attributes for the mount root and the branch roots
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "core/hybfsdef.h"
+#include "core/root_cache.hpp"
+
+namespace hybfs {
+
+/* everything that changes the attributes of a directory */
+#define ROOT_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+			IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+RootCache::RootCache()
+{
+	inotify_fd = -1;
+	stop_pipe[0] = stop_pipe[1] = -1;
+	valid = 0;
+	stamp = 0;
+	nlinks = 0;
+	memset(&root_st, 0, sizeof(root_st));
+
+	pthread_mutex_init(&lock, NULL);
+}
+
+RootCache::~RootCache()
+{
+	stop();
+	paths.clear();
+
+	pthread_mutex_destroy(&lock);
+}
+
+void *RootCache::watcher(void *arg)
+{
+	RootCache *cache = (RootCache *) arg;
+
+	cache->watch();
+
+	return NULL;
+}
+
+void RootCache::add_watches()
+{
+	int wd;
+
+	wds.clear();
+	for (int i = 0; i < (int) paths.size(); i++) {
+		wd = inotify_add_watch(inotify_fd, paths[i].c_str(),
+		                       ROOT_EVENTS | IN_ONLYDIR);
+		if (wd == -1)
+			PRINT_ERROR("hybfs: cannot watch %s: %s\n",
+			            paths[i].c_str(), strerror(errno));
+		wds.push_back(wd);
+	}
+}
+
+void RootCache::set_branches(vector<string> *branches)
+{
+	pthread_mutex_lock(&lock);
+	if (inotify_fd != -1) {
+		for (int i = 0; i < (int) wds.size(); i++)
+			if (wds[i] != -1)
+				inotify_rm_watch(inotify_fd, wds[i]);
+	}
+	paths = *branches;
+	if (inotify_fd != -1)
+		add_watches();
+	valid = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+int RootCache::start()
+{
+	int ret;
+
+	if (inotify_fd != -1)
+		return 0;
+
+	if (pipe(stop_pipe) == -1) {
+		perror("hybfs: cannot watch the branches");
+		return -1;
+	}
+	pthread_mutex_lock(&lock);
+	inotify_fd = inotify_init();
+	if (inotify_fd == -1) {
+		perror("hybfs: cannot watch the branches");
+		goto error;
+	}
+	add_watches();
+	/* the changes done before we started watching are lost */
+	valid = 0;
+
+	ret = pthread_create(&thread, NULL, RootCache::watcher, this);
+	if (ret) {
+		PRINT_ERROR("hybfs: cannot start the watcher thread: %s\n",
+		            strerror(ret));
+		goto error;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+
+error:
+	if (inotify_fd != -1)
+		close(inotify_fd);
+	inotify_fd = -1;
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+	stop_pipe[0] = stop_pipe[1] = -1;
+	pthread_mutex_unlock(&lock);
+
+	return -1;
+}
+
+void RootCache::stop()
+{
+	if (inotify_fd == -1)
+		return;
+
+	if (write(stop_pipe[1], "x", 1) != 1)
+		perror("hybfs: cannot stop the watcher thread");
+	pthread_join(thread, NULL);
+
+	pthread_mutex_lock(&lock);
+	close(inotify_fd);
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+	inotify_fd = -1;
+	stop_pipe[0] = stop_pipe[1] = -1;
+	/* from now on, rely on the TTL */
+	valid = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+void RootCache::watch()
+{
+	int ret;
+	char buf[4096];
+	struct pollfd fds[2];
+
+	fds[0].fd = inotify_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = stop_pipe[0];
+	fds[1].events = POLLIN;
+
+	while (1) {
+		ret = poll(fds, 2, -1);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("hybfs: watcher poll");
+			break;
+		}
+		if (fds[1].revents)
+			break;
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		/* we don't care what happened, just that something did */
+		ret = read(inotify_fd, buf, sizeof(buf));
+		if (ret <= 0 && errno != EINTR)
+			break;
+
+		pthread_mutex_lock(&lock);
+		valid = 0;
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+void RootCache::refresh()
+{
+	struct stat st;
+	time_t newest = 0;
+
+	nlinks = 0;
+	for (int i = 0; i < (int) paths.size(); i++) {
+		if (lstat(paths[i].c_str(), &st))
+			continue;
+		nlinks += st.st_nlink;
+		if (st.st_mtime > newest)
+			newest = st.st_mtime;
+	}
+
+	memset(&root_st, 0, sizeof(root_st));
+	root_st.st_mode = S_IFDIR | 0755;
+	root_st.st_nlink = 2 + nlinks;
+	root_st.st_uid = getuid();
+	root_st.st_gid = getgid();
+	root_st.st_atime = root_st.st_mtime = root_st.st_ctime = newest;
+
+	stamp = time(NULL);
+	valid = 1;
+}
+
+void RootCache::check()
+{
+	if (!valid) {
+		refresh();
+		return;
+	}
+	/* without inotify, trust the attributes only for a while */
+	if (inotify_fd == -1 && time(NULL) - stamp >= ROOT_CACHE_TTL)
+		refresh();
+}
+
+void RootCache::get_root_stat(stat_t *st)
+{
+	pthread_mutex_lock(&lock);
+	check();
+	memcpy(st, &root_st, sizeof(*st));
+	pthread_mutex_unlock(&lock);
+}
+
+int RootCache::get_nlinks()
+{
+	int ret;
+
+	pthread_mutex_lock(&lock);
+	check();
+	ret = nlinks;
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+} // namespace hybfs
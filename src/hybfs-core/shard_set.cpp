@@ -0,0 +1,437 @@
+/*
+ shard_set.cpp - The databases that hold the metadata of a branch
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "core/hybfsdef.h"
+#include "core/shard_set.hpp"
+
+namespace hybfs {
+
+using namespace std;
+
+/* what a worker thread needs to know */
+typedef struct {
+	ShardSet *set;
+	int shard;
+} worker_arg_t;
+
+ShardSet::ShardSet(const char *_meta_path, const char *_vdir_path)
+{
+	meta_path = _meta_path;
+	vdir_path = _vdir_path;
+	running = 0;
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&work, NULL);
+
+	add_shard(0);
+}
+
+ShardSet::~ShardSet()
+{
+	stop();
+
+	for (vector<shard_t *>::iterator s = shards.begin(); s != shards.end();
+			s++) {
+		delete (*s)->db;
+		delete *s;
+	}
+
+	pthread_cond_destroy(&work);
+	pthread_mutex_destroy(&lock);
+}
+
+int ShardSet::add_shard(int shard)
+{
+	char suffix[16];
+	string path = meta_path + MAINDB;
+	shard_t *s;
+
+	/* the first shard is the database the branches always had */
+	if (shard > 0) {
+		snprintf(suffix, sizeof(suffix), ".%d", shard);
+		path.append(suffix);
+	}
+
+	s = new shard_t;
+	s->db = new DbBackend(path.c_str(), vdir_path.c_str());
+	if (s->db->db_get_dirfd() == -1) {
+		delete s->db;
+		delete s;
+		return -1;
+	}
+	shards.push_back(s);
+
+	return 0;
+}
+
+int ShardSet::read_count()
+{
+	string path = meta_path + SHARDS_FILE;
+	FILE *f;
+	int count;
+
+	f = fopen(path.c_str(), "r");
+	if (f == NULL)
+		return (errno == ENOENT) ? 0 : -1;
+	if (fscanf(f, "%d", &count) != 1 || count < 1 || count > MAX_SHARDS) {
+		PRINT_ERROR("hybfs: %s is damaged\n", path.c_str());
+		count = -1;
+	}
+	fclose(f);
+
+	return count;
+}
+
+int ShardSet::write_count(int count)
+{
+	string path = meta_path + SHARDS_FILE;
+	string tmp = path + ".tmp";
+	FILE *f;
+
+	f = fopen(tmp.c_str(), "w");
+	if (f == NULL) {
+		PRINT_ERROR("hybfs: cannot write %s: %s\n", tmp.c_str(),
+		            strerror(errno));
+		return -1;
+	}
+	fprintf(f, "%d\n", count);
+	if (fclose(f) || rename(tmp.c_str(), path.c_str())) {
+		PRINT_ERROR("hybfs: cannot write %s: %s\n", path.c_str(),
+		            strerror(errno));
+		unlink(tmp.c_str());
+		return -1;
+	}
+
+	return 0;
+}
+
+int ShardSet::init(int nshards)
+{
+	int count, i;
+	struct stat st;
+	string main_db = meta_path + MAINDB;
+
+	if (shards.size() == 0)
+		return -1;
+
+	count = read_count();
+	if (count < 0)
+		return -1;
+	if (count == 0) {
+		if (stat(main_db.c_str(), &st) == 0) {
+			/* the metadata is there already, in one database */
+			count = 1;
+			if (nshards > 1)
+				PRINT_ERROR("hybfs: %s has a single shard; export "
+				            "its tags and import them in a new "
+				            "branch to split it\n",
+				            vdir_path.c_str());
+		} else {
+			count = (nshards > 0) ? nshards : 1;
+			if (count > MAX_SHARDS)
+				count = MAX_SHARDS;
+			if (count > 1 && write_count(count))
+				return -1;
+		}
+	} else if (nshards > 0 && nshards != count)
+		PRINT_ERROR("hybfs: %s keeps its %d shards\n", vdir_path.c_str(),
+		            count);
+
+	for (i = shards.size(); i < count; i++) {
+		if (add_shard(i))
+			return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (shards[i]->db->db_init_storage())
+			return -1;
+	}
+
+	return 0;
+}
+
+void *ShardSet::worker(void *arg)
+{
+	worker_arg_t *wa = (worker_arg_t *) arg;
+	ShardSet *set = wa->set;
+	int shard = wa->shard;
+
+	delete wa;
+	set->run(shard);
+
+	return NULL;
+}
+
+int ShardSet::start()
+{
+	int ret, i;
+	worker_arg_t *wa;
+
+	if (running || shards.size() < 2)
+		return 0;
+
+	running = 1;
+	/* the first shard is served by the callers themselves */
+	for (i = 1; i < (int) shards.size(); i++) {
+		wa = new worker_arg_t;
+		wa->set = this;
+		wa->shard = i;
+		ret = pthread_create(&shards[i]->thread, NULL, ShardSet::worker,
+		                     wa);
+		if (ret) {
+			PRINT_ERROR("hybfs: cannot start the thread of shard %d: "
+			            "%s\n", i, strerror(ret));
+			delete wa;
+			/* stop the ones that did start */
+			pthread_mutex_lock(&lock);
+			running = 0;
+			pthread_cond_broadcast(&work);
+			pthread_mutex_unlock(&lock);
+			while (--i > 0)
+				pthread_join(shards[i]->thread, NULL);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void ShardSet::stop()
+{
+	pthread_mutex_lock(&lock);
+	if (!running) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	running = 0;
+	pthread_cond_broadcast(&work);
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 1; i < (int) shards.size(); i++)
+		pthread_join(shards[i]->thread, NULL);
+}
+
+void ShardSet::run(int shard)
+{
+	shard_t *s = shards[shard];
+	shard_job_t *job;
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (running && s->queue.empty())
+			pthread_cond_wait(&work, &lock);
+		/* the work queued before the stop is done anyway */
+		if (s->queue.empty())
+			break;
+		job = s->queue.front();
+		s->queue.pop_front();
+		pthread_mutex_unlock(&lock);
+
+		job->ret = job->fn(s->db, shard, job->arg);
+
+		pthread_mutex_lock(&lock);
+		if (--job->fan->pending == 0)
+			pthread_cond_signal(&job->fan->done);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+int ShardSet::fan_out(shard_fn_t fn, void **args, int *rets)
+{
+	int i, n = shards.size(), ret = 0;
+	vector<shard_job_t> jobs(n);
+	fan_out_t fan;
+
+	if (n == 1)
+		goto serial;
+
+	pthread_mutex_lock(&lock);
+	/* before start() and after stop() nobody would take the work */
+	if (!running) {
+		pthread_mutex_unlock(&lock);
+		goto serial;
+	}
+	fan.pending = n - 1;
+	pthread_cond_init(&fan.done, NULL);
+	for (i = 1; i < n; i++) {
+		jobs[i].fn = fn;
+		jobs[i].arg = args[i];
+		jobs[i].ret = 0;
+		jobs[i].fan = &fan;
+		shards[i]->queue.push_back(&jobs[i]);
+	}
+	pthread_cond_broadcast(&work);
+	pthread_mutex_unlock(&lock);
+
+	/* our share, while the others work on theirs */
+	jobs[0].ret = fn(shards[0]->db, 0, args[0]);
+
+	pthread_mutex_lock(&lock);
+	while (fan.pending > 0)
+		pthread_cond_wait(&fan.done, &lock);
+	pthread_mutex_unlock(&lock);
+	pthread_cond_destroy(&fan.done);
+	goto out;
+
+serial:
+	for (i = 0; i < n; i++)
+		jobs[i].ret = fn(shards[i]->db, i, args[i]);
+
+out:
+	for (i = 0; i < n; i++) {
+		if (rets)
+			rets[i] = jobs[i].ret;
+		if (jobs[i].ret)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+DbBackend *ShardSet::of_path(const char *path)
+{
+	struct stat st;
+
+	if (shards.size() == 1)
+		return shards[0]->db;
+
+	if (path[0] == '/')
+		path++;
+	if (path[0] == '\0' || fstatat(shards[0]->db->db_get_dirfd(), path, &st,
+	                               AT_SYMLINK_NOFOLLOW))
+		return shards[0]->db;
+
+	return of_ino(st.st_ino);
+}
+
+int ShardSet::export_tags(FILE *out, export_stats_t *stats)
+{
+	int i, locked, n = shards.size();
+	ExportWriter w(out);
+
+	memset(stats, 0, sizeof(export_stats_t));
+
+	/* all the shards are locked together, so their copies are the
+	 * branch as it was at one moment; the stream is written after */
+	for (locked = 0; locked < n; locked++) {
+		if (shards[locked]->db->db_export_begin())
+			break;
+	}
+	for (i = 0; i < locked; i++)
+		shards[i]->db->db_export_end();
+	if (locked < n) {
+		for (i = 0; i < locked; i++)
+			shards[i]->db->db_export_drop();
+		return -1;
+	}
+
+	if (w.header())
+		goto io_error;
+	for (i = 0; i < n; i++) {
+		if (shards[i]->db->db_export(&w, i, n, stats))
+			goto error;
+	}
+
+	w.begin(EXP_END);
+	w.put_u64(stats->ntags);
+	w.put_u64(stats->nfiles);
+	w.put_u64(stats->nassoc);
+	if (w.end())
+		goto io_error;
+
+	return 0;
+
+io_error:
+	PRINT_ERROR("hybfs: cannot write the export: %s\n", strerror(errno));
+error:
+	/* the copies that were not read yet */
+	for (i = 0; i < n; i++)
+		shards[i]->db->db_export_drop();
+	return -1;
+}
+
+/* the part of an import done by a shard */
+typedef struct {
+	FILE *in;
+	int nshards;
+	export_stats_t stats;
+} import_arg_t;
+
+static int import_shard(DbBackend *db, int shard, void *arg)
+{
+	import_arg_t *ia = (import_arg_t *) arg;
+
+	return db->db_import(ia->in, shard, ia->nshards, &ia->stats);
+}
+
+int ShardSet::import_tags(const char *file, export_stats_t *stats)
+{
+	int i, n = shards.size(), ret = 0;
+	vector<import_arg_t> ia(n);
+	vector<void *> args(n);
+
+	memset(stats, 0, sizeof(export_stats_t));
+
+	/* the shards commit in batches, so a damaged stream is refused
+	 * before any of them starts */
+	ia[0].in = fopen(file, "r");
+	if (ia[0].in == NULL) {
+		PRINT_ERROR("hybfs: cannot open %s: %s\n", file, strerror(errno));
+		return -1;
+	}
+	setvbuf(ia[0].in, NULL, _IOFBF, 1 << 20);
+	ret = ExportReader(ia[0].in).check();
+	fclose(ia[0].in);
+	ia[0].in = NULL;
+	if (ret) {
+		PRINT_ERROR("hybfs: %s is damaged or was cut\n", file);
+		return -1;
+	}
+
+	/* every shard reads the whole stream, at its own pace */
+	for (i = 0; i < n; i++) {
+		ia[i].nshards = n;
+		ia[i].in = fopen(file, "r");
+		if (ia[i].in == NULL) {
+			PRINT_ERROR("hybfs: cannot open %s: %s\n", file,
+			            strerror(errno));
+			ret = -1;
+			goto out;
+		}
+		setvbuf(ia[i].in, NULL, _IOFBF, 1 << 20);
+		args[i] = &ia[i];
+	}
+
+	ret = fan_out(import_shard, &args[0], NULL);
+
+	/* all of them read the same tags and files */
+	stats->ntags = ia[0].stats.ntags;
+	stats->nfiles = ia[0].stats.nfiles;
+	stats->nskipped = ia[0].stats.nskipped;
+	for (i = 0; i < n; i++)
+		stats->nassoc += ia[i].stats.nassoc;
+
+out:
+	for (i = 0; i < n; i++) {
+		if (ia[i].in)
+			fclose(ia[i].in);
+	}
+
+	return ret;
+}
+
+} // namespace hybfs
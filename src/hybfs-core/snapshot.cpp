@@ -0,0 +1,385 @@
+/*
+ snapshot.cpp - Read-only image of the tag index of a branch
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include "core/snapshot.hpp"
+#include "core/tag_dict.hpp"
+
+namespace hybfs {
+
+IndexSnapshot::IndexSnapshot()
+{
+	fd = -1;
+	map = NULL;
+	size = 0;
+	hdr = NULL;
+	tags = NULL;
+	posts = NULL;
+	files = NULL;
+	strings = NULL;
+}
+
+IndexSnapshot::~IndexSnapshot()
+{
+	close();
+}
+
+/* a region of n entries of elem bytes starting at off lies after the
+ * header and inside the file; the count is checked against the space
+ * left, a damaged header could make off + n * elem wrap around
+ */
+static int region_ok(uint64_t off, uint64_t n, size_t elem, size_t size)
+{
+	if (off < sizeof(snap_header_t) || off > size)
+		return 0;
+	return n <= (size - off) / elem;
+}
+
+int IndexSnapshot::check()
+{
+	if (size < sizeof(snap_header_t))
+		return -1;
+	hdr = (const snap_header_t *) map;
+	if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != SNAP_VERSION)
+		return -1;
+
+	/* a file cut short must not send us outside the mapping */
+	if (!region_ok(hdr->tags_off, hdr->ntags, sizeof(snap_tag_t), size) ||
+	    !region_ok(hdr->posts_off, hdr->nposts, sizeof(uint64_t), size) ||
+	    !region_ok(hdr->files_off, hdr->nfiles, sizeof(snap_file_t), size) ||
+	    !region_ok(hdr->strings_off, hdr->strings_len, 1, size))
+		return -1;
+	if (hdr->strings_len == 0 ||
+	    map[hdr->strings_off + hdr->strings_len - 1] != '\0')
+		return -1;
+
+	tags = (const snap_tag_t *) (map + hdr->tags_off);
+	posts = (const uint64_t *) (map + hdr->posts_off);
+	files = (const snap_file_t *) (map + hdr->files_off);
+	strings = map + hdr->strings_off;
+
+	return 0;
+}
+
+int IndexSnapshot::open(const char *path)
+{
+	struct stat st;
+	void *addr;
+
+	close();
+
+	fd = ::open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) || st.st_size == 0)
+		goto error;
+
+	/* nothing is read here, the pages come in when they are used */
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		goto error;
+	map = (char *) addr;
+	size = st.st_size;
+
+	if (check()) {
+		PRINT_ERROR("hybfs: ignoring the damaged snapshot %s\n", path);
+		goto error;
+	}
+
+	return 0;
+
+error:
+	close();
+	return -1;
+}
+
+void IndexSnapshot::close()
+{
+	if (map != NULL)
+		munmap(map, size);
+	if (fd != -1)
+		::close(fd);
+	fd = -1;
+	map = NULL;
+	size = 0;
+	hdr = NULL;
+}
+
+const uint64_t *IndexSnapshot::get_posts(size_t i, size_t *n)
+{
+	/* the entries were checked only as a whole */
+	if (tags[i].first > hdr->nposts || tags[i].count > hdr->nposts - tags[i].first) {
+		*n = 0;
+		return NULL;
+	}
+	*n = tags[i].count;
+	return posts + tags[i].first;
+}
+
+size_t IndexSnapshot::find_tag(const char *tag, size_t *first, size_t *last)
+{
+	size_t lo, hi, mid;
+
+	/* the first entry that is not smaller */
+	lo = 0;
+	hi = hdr->ntags;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcasecmp(get_tag(mid), tag) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*first = lo;
+
+	/* the first entry that is bigger */
+	hi = hdr->ntags;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcasecmp(get_tag(mid), tag) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*last = lo;
+
+	return *last - *first;
+}
+
+const char *IndexSnapshot::find_file(uint64_t ino, unsigned int *mode)
+{
+	size_t lo = 0, hi = hdr->nfiles, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (files[mid].ino < ino)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == hdr->nfiles || files[lo].ino != ino ||
+	    files[lo].path >= hdr->strings_len)
+		return NULL;
+
+	if (mode)
+		*mode = files[lo].mode;
+	return strings + files[lo].path;
+}
+
+long IndexSnapshot::count_all(vector<tag_info_t> *query)
+{
+	vector<uint64_t> result, tagged, merged;
+	const uint64_t *p;
+	const dict_entry_t *e;
+	size_t first, last, n;
+	int started = 0;
+
+	for (vector<tag_info_t>::iterator q = query->begin(); q != query->end(); q++) {
+		e = TagDict::get()->entry((*q).id);
+		if (e == NULL)
+			return -1;
+		/* the files with the tag, for any of the values asked */
+		tagged.clear();
+		find_tag(e->tag.c_str(), &first, &last);
+		for (size_t i = first; i < last; i++) {
+			if (e->value.length() > 0 &&
+			    strcasecmp(get_value(i), e->value.c_str()))
+				continue;
+			p = get_posts(i, &n);
+			merged.clear();
+			std::set_union(tagged.begin(), tagged.end(), p, p + n,
+			               back_inserter(merged));
+			tagged.swap(merged);
+		}
+
+		if (!started) {
+			result.swap(tagged);
+			started = 1;
+		} else {
+			merged.clear();
+			std::set_intersection(result.begin(), result.end(),
+			                      tagged.begin(), tagged.end(),
+			                      back_inserter(merged));
+			result.swap(merged);
+		}
+		if (result.empty())
+			break;
+	}
+
+	return result.size();
+}
+
+int IndexSnapshot::read_counter(const char *path, unsigned int *counter)
+{
+	snap_header_t h;
+	int sfd;
+	ssize_t n;
+
+	sfd = ::open(path, O_RDONLY);
+	if (sfd == -1)
+		return -1;
+	n = pread(sfd, &h, sizeof(h), 0);
+	::close(sfd);
+
+	if (n != sizeof(h) || memcmp(h.magic, SNAP_MAGIC, sizeof(h.magic)) ||
+	    h.version != SNAP_VERSION)
+		return -1;
+
+	*counter = h.counter;
+	return 0;
+}
+
+/* the order of the dictionary: LIKE doesn't care about the case, so the
+ * entries that differ only by it must be next to each other */
+static bool snap_tag_less(const snap_build_tag_t &a, const snap_build_tag_t &b)
+{
+	int c;
+
+	c = strcasecmp(a.tag.c_str(), b.tag.c_str());
+	if (c == 0)
+		c = strcmp(a.tag.c_str(), b.tag.c_str());
+	if (c == 0)
+		c = strcasecmp(a.value.c_str(), b.value.c_str());
+	if (c == 0)
+		c = strcmp(a.value.c_str(), b.value.c_str());
+
+	return c < 0;
+}
+
+static bool snap_file_less(const snap_build_file_t &a, const snap_build_file_t &b)
+{
+	return a.ino < b.ino;
+}
+
+/* appends a string to the string table, returns its offset */
+static int snap_add_string(string *table, const string &s, uint32_t *off)
+{
+	if (table->length() + s.length() + 1 > 0xffffffffULL)
+		return -1;
+	*off = table->length();
+	table->append(s);
+	table->append(1, '\0');
+
+	return 0;
+}
+
+int IndexSnapshot::write(const char *path, unsigned int counter,
+                         vector<snap_build_tag_t> *btags,
+                         vector<snap_build_file_t> *bfiles)
+{
+	snap_header_t h;
+	snap_tag_t t;
+	snap_file_t f;
+	string strtab;
+	ostringstream tmp;
+	FILE *out = NULL;
+	uint64_t first = 0;
+	int ret = -1;
+
+	std::sort(btags->begin(), btags->end(), snap_tag_less);
+	std::sort(bfiles->begin(), bfiles->end(), snap_file_less);
+
+	/* the empty string is at offset 0 */
+	strtab.append(1, '\0');
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+	h.version = SNAP_VERSION;
+	h.counter = counter;
+	h.ntags = btags->size();
+	h.nfiles = bfiles->size();
+	for (vector<snap_build_tag_t>::iterator i = btags->begin(); i != btags->end(); i++) {
+		std::sort((*i).inos.begin(), (*i).inos.end());
+		(*i).inos.erase(std::unique((*i).inos.begin(), (*i).inos.end()),
+		                (*i).inos.end());
+		h.nposts += (*i).inos.size();
+	}
+	h.tags_off = sizeof(h);
+	h.posts_off = h.tags_off + h.ntags * sizeof(snap_tag_t);
+	h.files_off = h.posts_off + h.nposts * sizeof(uint64_t);
+	h.strings_off = h.files_off + h.nfiles * sizeof(snap_file_t);
+
+	/* the new file takes the place of the old one only when complete */
+	tmp << path << ".tmp" << getpid();
+	out = fopen(tmp.str().c_str(), "w");
+	if (out == NULL) {
+		PRINT_ERROR("hybfs: cannot write %s: %s\n", tmp.str().c_str(),
+		            strerror(errno));
+		return -1;
+	}
+	/* the header is written again at the end, with the string table size */
+	if (fwrite(&h, sizeof(h), 1, out) != 1)
+		goto out;
+
+	for (vector<snap_build_tag_t>::iterator i = btags->begin(); i != btags->end(); i++) {
+		memset(&t, 0, sizeof(t));
+		t.tag_id = (*i).tag_id;
+		if (snap_add_string(&strtab, (*i).tag, &t.tag) ||
+		    snap_add_string(&strtab, (*i).value, &t.value))
+			goto out;
+		t.first = first;
+		t.count = (*i).inos.size();
+		first += t.count;
+		if (fwrite(&t, sizeof(t), 1, out) != 1)
+			goto out;
+	}
+	for (vector<snap_build_tag_t>::iterator i = btags->begin(); i != btags->end(); i++) {
+		if ((*i).inos.size() > 0 &&
+		    fwrite(&(*i).inos[0], sizeof(uint64_t), (*i).inos.size(), out) !=
+		    (*i).inos.size())
+			goto out;
+	}
+	for (vector<snap_build_file_t>::iterator i = bfiles->begin(); i != bfiles->end(); i++) {
+		memset(&f, 0, sizeof(f));
+		f.ino = (*i).ino;
+		f.mode = (*i).mode;
+		if (snap_add_string(&strtab, (*i).path, &f.path))
+			goto out;
+		if (fwrite(&f, sizeof(f), 1, out) != 1)
+			goto out;
+	}
+	if (fwrite(strtab.data(), 1, strtab.length(), out) != strtab.length())
+		goto out;
+
+	h.strings_len = strtab.length();
+	if (fseek(out, 0, SEEK_SET) || fwrite(&h, sizeof(h), 1, out) != 1)
+		goto out;
+	if (fflush(out) || fsync(fileno(out)))
+		goto out;
+	ret = 0;
+
+out:
+	if (fclose(out) && ret == 0)
+		ret = -1;
+	if (ret == 0 && rename(tmp.str().c_str(), path))
+		ret = -1;
+	if (ret) {
+		PRINT_ERROR("hybfs: cannot write the snapshot %s: %s\n", path,
+		            strerror(errno));
+		unlink(tmp.str().c_str());
+	}
+
+	return ret;
+}
+
+}
@@ -0,0 +1,145 @@
+/*
+ tag_dict.cpp - Process wide dictionary of the tags
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <string.h>
+
+#include "core/hybfsdef.h"
+#include "core/tag_dict.hpp"
+
+namespace hybfs {
+
+static pthread_once_t dict_once = PTHREAD_ONCE_INIT;
+static TagDict *dict = NULL;
+
+void TagDict::create()
+{
+	dict = new TagDict();
+}
+
+TagDict *TagDict::get()
+{
+	pthread_once(&dict_once, create);
+	return dict;
+}
+
+TagDict::TagDict()
+{
+	pthread_rwlock_init(&lock, NULL);
+	memset(chunks, 0, sizeof(chunks));
+	/* id 0 is no entry */
+	next = 1;
+	full = 0;
+	chunks[0] = new dict_entry_t[DICT_CHUNK];
+	chunks[0][0].name = 0;
+}
+
+static void dict_key(string *key, const char *tag, const char *value)
+{
+	key->assign(tag);
+	key->append(1, '\0');
+	if (value)
+		key->append(value);
+}
+
+/* called with the write lock */
+dict_id_t TagDict::add(const string &key, const string &tag,
+                       const string &value, dict_id_t name)
+{
+	dict_id_t id = next;
+	dict_entry_t *e;
+
+	if (id > DICT_MAX) {
+		if (!full)
+			PRINT_ERROR("hybfs: the tag dictionary is full, the new "
+			            "tags go without ids\n");
+		full = 1;
+		return 0;
+	}
+	if (chunks[id / DICT_CHUNK] == NULL)
+		chunks[id / DICT_CHUNK] = new dict_entry_t[DICT_CHUNK];
+
+	e = &chunks[id / DICT_CHUNK][id % DICT_CHUNK];
+	e->tag = tag;
+	e->value = value;
+	e->name = name ? name : id;
+	ids[key] = id;
+
+	/* entry() may see the id only after the entry is complete */
+	__sync_synchronize();
+	next = id + 1;
+
+	return id;
+}
+
+dict_id_t TagDict::find(const char *tag, const char *value)
+{
+	boost::unordered_map<string, dict_id_t>::iterator i;
+	dict_id_t id = 0;
+	string key;
+
+	dict_key(&key, tag, value);
+	pthread_rwlock_rdlock(&lock);
+	i = ids.find(key);
+	if (i != ids.end())
+		id = i->second;
+	pthread_rwlock_unlock(&lock);
+
+	return id;
+}
+
+dict_id_t TagDict::intern(const char *tag, const char *value)
+{
+	boost::unordered_map<string, dict_id_t>::iterator i;
+	dict_id_t id, name = 0;
+	string key, name_key;
+
+	id = find(tag, value);
+	if (id)
+		return id;
+
+	dict_key(&key, tag, value);
+	pthread_rwlock_wrlock(&lock);
+	/* someone may have added it meanwhile */
+	i = ids.find(key);
+	if (i != ids.end()) {
+		id = i->second;
+		goto out;
+	}
+	/* every pair points to the entry of its tag name */
+	if (value && value[0] != '\0') {
+		dict_key(&name_key, tag, NULL);
+		i = ids.find(name_key);
+		if (i != ids.end())
+			name = i->second;
+		else
+			name = add(name_key, tag, "", 0);
+		if (name == 0)
+			goto out;
+	}
+	id = add(key, tag, value ? value : "", name);
+
+out:
+	pthread_rwlock_unlock(&lock);
+	return id;
+}
+
+dict_id_t TagDict::intern_pair(const string &tag_value)
+{
+	size_t pos = tag_value.find(':');
+
+	if (pos == string::npos)
+		return intern(tag_value.c_str(), NULL);
+
+	return intern(tag_value.substr(0, pos).c_str(),
+	              tag_value.c_str() + pos + 1);
+}
+
+}
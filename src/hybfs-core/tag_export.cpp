@@ -0,0 +1,242 @@
+/*
+ tag_export.cpp - Portable stream of the tags of a branch
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <string.h>
+
+#include <set>
+
+#include "core/hybfsdef.h"
+#include "core/tag_export.hpp"
+
+namespace hybfs {
+
+/* the record header: the type and the length of the payload */
+#define REC_HDR 5
+
+static void le_u32(char *buf, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		buf[i] = (char) (v >> (8 * i));
+}
+
+static uint32_t u32_le(const char *buf)
+{
+	uint32_t v = 0;
+
+	for (int i = 0; i < 4; i++)
+		v |= (uint32_t) (unsigned char) buf[i] << (8 * i);
+
+	return v;
+}
+
+ExportWriter::ExportWriter(FILE *_out)
+{
+	out = _out;
+	type = 0;
+}
+
+int ExportWriter::header()
+{
+	char version[4];
+
+	le_u32(version, EXPORT_VERSION);
+	if (fwrite(EXPORT_MAGIC, sizeof(EXPORT_MAGIC) - 1, 1, out) != 1 ||
+	    fwrite(version, sizeof(version), 1, out) != 1)
+		return -1;
+
+	return 0;
+}
+
+void ExportWriter::begin(int _type)
+{
+	type = _type;
+	rec.clear();
+}
+
+void ExportWriter::put_u32(uint32_t v)
+{
+	char buf[4];
+
+	le_u32(buf, v);
+	rec.append(buf, sizeof(buf));
+}
+
+void ExportWriter::put_u64(uint64_t v)
+{
+	put_u32((uint32_t) v);
+	put_u32((uint32_t) (v >> 32));
+}
+
+void ExportWriter::put_str(const char *s, size_t len)
+{
+	put_u32(len);
+	rec.append(s, len);
+}
+
+int ExportWriter::end()
+{
+	char hdr[REC_HDR];
+
+	hdr[0] = (char) type;
+	le_u32(hdr + 1, rec.length());
+	if (fwrite(hdr, sizeof(hdr), 1, out) != 1)
+		return -1;
+	if (rec.length() > 0 && fwrite(rec.data(), rec.length(), 1, out) != 1)
+		return -1;
+
+	return 0;
+}
+
+ExportReader::ExportReader(FILE *_in)
+{
+	in = _in;
+	pos = 0;
+}
+
+int ExportReader::header()
+{
+	char buf[sizeof(EXPORT_MAGIC) - 1 + 4];
+	uint32_t version;
+
+	if (fread(buf, sizeof(buf), 1, in) != 1 ||
+	    memcmp(buf, EXPORT_MAGIC, sizeof(EXPORT_MAGIC) - 1)) {
+		PRINT_ERROR("hybfs: this is not a tag export\n");
+		return -1;
+	}
+	version = u32_le(buf + sizeof(EXPORT_MAGIC) - 1);
+	if (version > EXPORT_VERSION) {
+		PRINT_ERROR("hybfs: the export has version %u, we read up to %d\n",
+		            version, EXPORT_VERSION);
+		return -1;
+	}
+
+	return 0;
+}
+
+int ExportReader::next()
+{
+	char hdr[REC_HDR];
+	size_t len, n;
+
+	n = fread(hdr, 1, sizeof(hdr), in);
+	if (n == 0 && feof(in))
+		return 0;
+	if (n != sizeof(hdr))
+		return -1;
+
+	len = u32_le(hdr + 1);
+	if (len > EXPORT_REC_MAX)
+		return -1;
+	rec.resize(len);
+	pos = 0;
+	if (len > 0 && fread(&rec[0], len, 1, in) != 1)
+		return -1;
+
+	return (unsigned char) hdr[0];
+}
+
+int ExportReader::get_u32(uint32_t *v)
+{
+	if (pos + 4 > rec.length())
+		return -1;
+	*v = u32_le(rec.data() + pos);
+	pos += 4;
+
+	return 0;
+}
+
+int ExportReader::get_u64(uint64_t *v)
+{
+	uint32_t lo, hi;
+
+	if (get_u32(&lo) || get_u32(&hi))
+		return -1;
+	*v = ((uint64_t) hi << 32) | lo;
+
+	return 0;
+}
+
+int ExportReader::get_str(string *s)
+{
+	uint32_t len;
+
+	if (get_u32(&len) || pos + len > rec.length())
+		return -1;
+	s->assign(rec.data() + pos, len);
+	pos += len;
+
+	return 0;
+}
+
+int ExportReader::get_path(string *s)
+{
+	size_t start, end;
+
+	if (get_str(s) || s->empty() || (*s)[0] == '/')
+		return -1;
+	for (start = 0; start < s->length(); start = end + 1) {
+		end = s->find('/', start);
+		if (end == string::npos)
+			end = s->length();
+		if (s->compare(start, end - start, "..") == 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int ExportReader::check()
+{
+	int type;
+	uint32_t id, mode, nids;
+	uint64_t ino, counts[3];
+	long long ntags = 0, nfiles = 0;
+	string str;
+	set<uint32_t> ids;
+
+	if (header())
+		return -1;
+
+	while ((type = next()) > 0) {
+		switch (type) {
+		case EXP_TAG:
+			if (get_u32(&id) || get_str(&str) || get_str(&str))
+				return -1;
+			ids.insert(id);
+			ntags++;
+			break;
+		case EXP_FILE:
+			if (get_u64(&ino) || get_u32(&mode) || get_path(&str) ||
+			    get_u32(&nids))
+				return -1;
+			for (; nids > 0; nids--) {
+				if (get_u32(&id) || ids.find(id) == ids.end())
+					return -1;
+			}
+			nfiles++;
+			break;
+		case EXP_END:
+			if (get_u64(&counts[0]) || get_u64(&counts[1]) ||
+			    get_u64(&counts[2]))
+				return -1;
+			if ((long long) counts[0] != ntags ||
+			    (long long) counts[1] != nfiles)
+				return -1;
+			return 0;
+		default:
+			break;
+		}
+	}
+
+	return -1;
+}
+
+}
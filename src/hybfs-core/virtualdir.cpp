@@ -11,6 +11,7 @@
 
 #include <vector>
 #include <string>
+#include <algorithm>
 
 #include <string.h>
 #include <stdlib.h>
@@ -18,6 +19,7 @@
 
 #include <boost/tokenizer.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/unordered_set.hpp>
 
 #include "core/misc.h"
 #include "core/hybfsdef.h"
@@ -41,7 +43,7 @@ VirtualDirectory::VirtualDirectory(const char *path)
 	vdir_path.assign(path);
 
 	abspath.append(METADIR);
-	db = NULL;
+	shards = NULL;
 
 	/* check if the directory exists and if not, create */
 	if (lstat(abspath.c_str(), &buf) == -1) {
@@ -51,20 +53,137 @@ VirtualDirectory::VirtualDirectory(const char *path)
 			perror("Failed to create directory: ");
 		}
 	}
-	abspath.append(MAINDB);
 
-	db = new DbBackend(abspath.c_str(), path);
+	shards = new ShardSet(abspath.c_str(), path);
 }
 
 VirtualDirectory::~VirtualDirectory()
 {
 
-	delete db;
+	delete shards;
 }
 
 int VirtualDirectory::check_for_init()
 {
-	return (db == NULL) ? -1 : 0;
+	return (shards == NULL || shards->size() == 0) ? -1 : 0;
+}
+
+int VirtualDirectory::maintain(maint_stats_t *stats)
+{
+	int i, res, ret = 0;
+	maint_stats_t part;
+
+	for (i = 0; i < shards->size(); i++) {
+		memset(&part, 0, sizeof(part));
+		res = shards->get(i)->db_maintain(&part);
+		if (res < 0 || (res > 0 && ret == 0))
+			ret = res;
+		stats->pages_before += part.pages_before;
+		stats->pages_after += part.pages_after;
+		stats->free_pages += part.free_pages;
+		stats->cache_pages += part.cache_pages;
+		stats->vacuum_ms += part.vacuum_ms;
+		stats->analyze_ms += part.analyze_ms;
+		if (part.vacuum > stats->vacuum)
+			stats->vacuum = part.vacuum;
+		if (part.analyzed)
+			stats->analyzed = 1;
+	}
+
+	return ret;
+}
+
+int VirtualDirectory::convert_vacuum()
+{
+	int i, ret = 0;
+
+	for (i = 0; i < shards->size(); i++) {
+		if (shards->get(i)->db_convert_vacuum())
+			ret = -1;
+	}
+
+	return ret;
+}
+
+long VirtualDirectory::set_cache(long bytes)
+{
+	int i;
+	long pages, total = 0;
+
+	for (i = 0; i < shards->size(); i++) {
+		pages = shards->get(i)->db_set_cache(bytes / shards->size());
+		if (pages < 0)
+			return -1;
+		total += pages;
+	}
+
+	return total;
+}
+
+int VirtualDirectory::write_snapshot()
+{
+	int ret = 0;
+
+	for (int i = 0; i < shards->size(); i++) {
+		if (shards->get(i)->db_write_snapshot())
+			ret = -1;
+	}
+
+	return ret;
+}
+
+int VirtualDirectory::get_fingerprints(int module, fprint_map_t *fps)
+{
+	for (int i = 0; i < shards->size(); i++) {
+		if (shards->get(i)->db_get_fingerprints(module, fps))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int add_files_shard(DbBackend *db, int shard, void *arg)
+{
+	vector<tagged_file_t> *files = (vector<tagged_file_t> *) arg;
+	int failed;
+
+	if (files->size() == 0)
+		return 0;
+	failed = db->db_add_files_info(files);
+
+	return (failed < 0) ? (int) files->size() : failed;
+}
+
+int VirtualDirectory::update_files(vector<tagged_file_t> *files)
+{
+	int i, n = shards->size(), failed = 0;
+	vector<vector<tagged_file_t> > parts;
+	vector<int> shard_of(files->size());
+	vector<size_t> next(n, 0);
+	vector<void *> args(n);
+	vector<int> rets(n);
+	size_t f;
+
+	if (n == 1)
+		return shards->get(0)->db_add_files_info(files);
+
+	/* each shard writes its own files, in its own transaction */
+	parts.resize(n);
+	for (f = 0; f < files->size(); f++) {
+		shard_of[f] = shard_of_ino((*files)[f].finfo->fid, n);
+		parts[shard_of[f]].push_back((*files)[f]);
+	}
+	for (i = 0; i < n; i++)
+		args[i] = &parts[i];
+
+	shards->fan_out(add_files_shard, &args[0], &rets[0]);
+	for (i = 0; i < n; i++)
+		failed += rets[i];
+	/* the caller needs to know which ones are in */
+	for (f = 0; f < files->size(); f++)
+		(*files)[f].failed = parts[shard_of[f]][next[shard_of[f]]++].failed;
+
+	return (files->size() > 0 && failed == (int) files->size()) ? -1 : failed;
 }
 
 int VirtualDirectory::vdir_add_tag(PathCrawler *pc, file_info_t *finfo)
@@ -85,7 +204,7 @@ int VirtualDirectory::vdir_add_tag(PathCrawler *pc, file_info_t *finfo)
 		}
 	}
 
-	res = db->db_add_file_info(tags, finfo, 0);
+	res = shards->of_ino(finfo->fid)->db_add_file_info(tags, finfo, 0);
 	if (res == -1)
 		res = -EINVAL;
 
@@ -98,10 +217,22 @@ out:
 	return res;
 }
 
+/* the file is gone, so any shard may have had it */
+static int remove_file_shard(DbBackend *db, int shard, void *arg)
+{
+	return db->db_delete_file_info((const char *) arg);
+}
+
+static int remove_files_shard(DbBackend *db, int shard, void *arg)
+{
+	return db->db_delete_files_info((vector<string> *) arg);
+}
+
 int VirtualDirectory::vdir_remove_file(const char *path)
 {
 	int res;
 	const char *lpath;
+	vector<void *> args;
 
 	if (path == NULL)
 		return -EINVAL;
@@ -112,18 +243,110 @@ int VirtualDirectory::vdir_remove_file(const char *path)
 	if (path[0] == '/')
 		lpath = path + 1;
 
-	res = db->db_delete_file_info(lpath);
+	args.assign(shards->size(), (void *) lpath);
+	res = shards->fan_out(remove_file_shard, &args[0], NULL);
+
+	if (res)
+		res = -EINVAL;
+
+	return res;
+}
+
+int VirtualDirectory::vdir_remove_stale(vector<string> *paths)
+{
+	int res;
+	struct stat st;
+	vector<string> missing;
+	vector<void *> args;
+
+	if (paths == NULL)
+		return -EINVAL;
 
+	/* the file may have come back since it was queued */
+	for (vector<string>::iterator it = paths->begin(); it != paths->end();
+			it++) {
+		if (fstatat(get_dirfd(), (*it).c_str(), &st,
+		            AT_SYMLINK_NOFOLLOW) == -1 && errno == ENOENT)
+			missing.push_back(*it);
+	}
+	if (missing.size() == 0)
+		return 0;
+
+	args.assign(shards->size(), (void *) &missing);
+	res = shards->fan_out(remove_files_shard, &args[0], NULL);
 	if (res)
 		res = -EINVAL;
 
 	return res;
 }
 
+/* the next files of a shard for the sweep */
+typedef struct {
+	long long cursor;
+	int max;
+	vector<new_file_info_t> files;
+} sweep_arg_t;
+
+static int sweep_shard(DbBackend *db, int shard, void *arg)
+{
+	sweep_arg_t *sa = (sweep_arg_t *) arg;
+
+	return db->db_get_files_after(sa->cursor, sa->max, &sa->files);
+}
+
+static bool ino_less(const new_file_info_t &a, const new_file_info_t &b)
+{
+	return a.ino < b.ino;
+}
+
+int VirtualDirectory::vdir_sweep(long long *cursor, int max,
+                                 vector<string> *stale)
+{
+	int i, res, n = shards->size();
+	struct stat st;
+	vector<new_file_info_t> files;
+	vector<sweep_arg_t> parts(n);
+	vector<void *> args(n);
+
+	/* the first 'max' inodes after the cursor, from all the shards */
+	for (i = 0; i < n; i++) {
+		parts[i].cursor = *cursor;
+		parts[i].max = max;
+		args[i] = &parts[i];
+	}
+	res = shards->fan_out(sweep_shard, &args[0], NULL);
+	if (res)
+		return -EIO;
+	for (i = 0; i < n; i++)
+		files.insert(files.end(), parts[i].files.begin(),
+		             parts[i].files.end());
+	if (n > 1) {
+		sort(files.begin(), files.end(), ino_less);
+		if ((int) files.size() > max)
+			files.resize(max);
+	}
+
+	for (vector<new_file_info_t>::iterator it = files.begin();
+			it != files.end(); it++) {
+		if (fstatat(get_dirfd(), (*it).path.c_str(), &st,
+		            AT_SYMLINK_NOFOLLOW) == -1 && errno == ENOENT)
+			stale->push_back((*it).path);
+	}
+
+	/* start again from the beginning when we reached the end */
+	if ((int) files.size() < max)
+		*cursor = 0;
+	else
+		*cursor = files.back().ino;
+
+	return 0;
+}
+
 int VirtualDirectory::update_file(vector<string> *tags, int op,
                                   file_info_t *finfo, int exist)
 {
 	int res = 0;
+	DbBackend *db = shards->of_ino(finfo->fid);
 
 	switch (op)
 	{
@@ -143,110 +366,170 @@ int VirtualDirectory::update_file(vector<string> *tags, int op,
 	return res;
 }
 
+int VirtualDirectory::parse_tag_ops(PathCrawler *to, vector<tags_op_t> *ops)
+{
+	int res;
+	string stag;
+	tags_op_t tagop;
+
+	while (to->has_next_query()) {
+		tagop.tags.clear();
+		stag = to->pop_next_query();
+		res = parse_tags(&stag, &tagop.tags, &tagop.op);
+		if (res != 0) {
+			PRINT_ERROR("Invalid tag operation for a file %s:%d",
+					__func__,__LINE__);
+			return -EINVAL;
+		}
+		ops->push_back(tagop);
+	}
+
+	return 0;
+}
+
+/* a file that was moved in the real directory */
+typedef struct {
+	long long ino;
+	string from;
+	string to;
+} moved_file_t;
+
+int VirtualDirectory::move_files(const char *relfrom, const char *relto,
+                                 vector<new_file_info_t> *files)
+{
+	int res = 0, i;
+	int dirfd = get_dirfd();
+	size_t pos;
+	string to;
+	moved_file_t mf;
+	vector<moved_file_t> moved;
+	DbBackend *db;
+
+	for (vector<new_file_info_t>::iterator it = files->begin();
+			it != files->end(); it++) {
+		to = (*it).path;
+		if (relfrom != NULL && relfrom[0] != '\0')
+			replace_first(to, relfrom, relto);
+		else {
+			/* only the name goes to the new directory */
+			pos = to.find_last_of('/');
+			if (pos != string::npos)
+				to.erase(0, pos + 1);
+			if (relto[0] != '\0') {
+				if (relto[strlen(relto) - 1] != '/')
+					to.insert(0, "/");
+				to.insert(0, relto);
+			}
+		}
+		if (to == (*it).path)
+			continue;
+
+		DBG_PRINT("I move file %s to %s\n", (*it).path.c_str(), to.c_str());
+		if (renameat(dirfd, (*it).path.c_str(), dirfd, to.c_str())) {
+			res = -errno;
+			break;
+		}
+		mf.ino = (*it).ino;
+		mf.from = (*it).path;
+		mf.to = to;
+		moved.push_back(mf);
+	}
+
+	/* the files that did move are recorded, even after an error; one
+	 * transaction for the files of each shard */
+	if (moved.size() == 0)
+		return res;
+	for (i = 0; i < shards->size(); i++) {
+		db = shards->get(i);
+		if (db->db_begin_transaction())
+			return -EIO;
+		for (vector<moved_file_t>::iterator m = moved.begin();
+				m != moved.end(); m++) {
+			if (shard_of_ino((*m).ino, shards->size()) != i)
+				continue;
+			if (db->update_file_path((*m).from.c_str(),
+			                         (*m).to.c_str())) {
+				db->db_rollback();
+				return -EIO;
+			}
+		}
+		if (db->db_end_transaction())
+			return -EIO;
+	}
+
+	return res;
+}
+
+/* the files of a shard that a rename retags */
+typedef struct {
+	string *query;
+	string *path;
+	vector<tags_op_t> *ops;
+	long nfiles;
+	vector<new_file_info_t> files;
+} retag_arg_t;
+
+static int retag_shard(DbBackend *db, int shard, void *arg)
+{
+	retag_arg_t *ra = (retag_arg_t *) arg;
+
+	ra->nfiles = db->db_retag_files(ra->query, ra->path, ra->ops,
+	                                &ra->files);
+
+	return (ra->nfiles < 0) ? -1 : 0;
+}
+
 int VirtualDirectory::vdir_replace(const char*relfrom, const char *relto,
-                                   PathCrawler *from, PathCrawler *to,
+                                   PathCrawler *from, vector<tags_op_t> *ops,
                                    int do_fsmv)
 {
-	return 0;
-	/*	
-	int res = 0;
-	int nfiles, ntagops, op;
-	string *sql_query;
-	string stag;
-	string *path= NULL;
+	int res = 0, i, n = shards->size();
+	long nfiles = 0;
+	string *sql_query = NULL;
+	string *path = NULL;
 	vector<new_file_info_t> files;
-	vector<tags_op_t> tagops;
-	file_info_t *finfo= NULL;
+	vector<retag_arg_t> parts(n);
+	vector<void *> args(n);
 
 	DBG_PRINT("rel_from is %s rel_to is %s\n", relfrom, relto);
-	
-	 if(relfrom)
-	 path = new string(relfrom);
-	 
-	 // Get the file names for this query and update tags, and do a rename (?)
-	 sql_query = from->db_build_sql_query(NULL);
-	 res = db->get_file_names(sql_query, path, &files);
-	 if(files.size() == 0) {
-	 res = -ENOENT;
-	 goto out;
-	 }
-	 
-	 while (to->has_next_query()) {
-	 vector<string> tags; 
-	 tags_op_t tagop;
-	 stag = to->pop_next_query();
-	 res = parse_tags(&stag, &tags, &op);
-	 if (res != 0) {
-	 PRINT_ERROR("Invalid tag operation for a file %s:%d",
-	 __func__,__LINE__);
-	 res = -EINVAL;
-	 goto out;
-	 }
-	 tagop.tags = tags;
-	 tagop.op   = op;
-	 tagops.push_back(tagop);
-	 }
-	 
-	 nfiles = files.size();
-	 ntagops = tagops.size();
-	 for(int i=0; i< nfiles; i++) {
-	 res = 0;
-	 finfo = (file_info_t*) malloc(sizeof(*finfo) + files[i].path.length() +1);
-	 finfo->namelen = files[i].path.length();
-	 finfo->fid     = files[i].ino;
-	 memcpy(&finfo->name[0], files[i].path.c_str(), finfo->namelen);
-	 finfo->name[finfo->namelen] = '\0';	
-	 
-	 for(int j = 0; j<ntagops; j++) {
-	 res = update_file(&tagops[j].tags, tagops[j].op, finfo,1);
-	 tagops[j].tags.clear();
-	 if(res)
-	 break;
-	 }
-	 if(res == 0 && relto != NULL && do_fsmv) {
-	 // build the real path(s) 
-	 string absfrom = files[i].path;
-	 string to = files[i].path;
-	 string absto = files[i].path;
-	 if(relfrom != NULL)
-	 replace_first(to, relfrom, relto);
-	 else {
-	 size_t pos = to.find_last_of('/');
-	 if(pos != string::npos)
-	 to.erase(0,pos);
-	 if(relto != NULL) {
-	 if(relto[strlen(relto)-1] != '/')
-	 to.insert(0,"/");
-	 to.insert(0,relto);	
-	 }
-	 }
-	 absto.assign(vdir_path);
-	 absto.append(to);
-	 absfrom.insert(0,vdir_path);
-	 
-	 DBG_PRINT("I move file %s to %s\n", absfrom.c_str(),
-	 absto.c_str());
-	 
-	 res = fs_rename(absfrom.c_str(), absto.c_str());
-	 if(res == 0)
-	 db->update_file_path(files[i].path.c_str(), to.c_str());
-	 }
-	 free(finfo);
-	 if(res)
-	 break;
-	 
-	 }
-	 out:		
-	 if(res == -1)
-	 res = -EINVAL;
-	 if(path)
-	 delete path;
-	 tagops.clear();
-	 files.clear();
-	 delete sql_query;
-	 
-	 return res;
-	 */
+
+	if (relfrom)
+		path = new string(relfrom);
+	/* a real directory alone stands for all the files under it */
+	if (from->get_nqueries() == 0) {
+		if (path == NULL)
+			return 0;
+		do_fsmv = 0;
+	} else
+		sql_query = from->db_build_sql_query(NULL);
+
+	/* every shard retags its own files */
+	for (i = 0; i < n; i++) {
+		parts[i].query = sql_query;
+		parts[i].path = path;
+		parts[i].ops = ops;
+		args[i] = &parts[i];
+	}
+	if (shards->fan_out(retag_shard, &args[0], NULL)) {
+		res = -EIO;
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		nfiles += parts[i].nfiles;
+		files.insert(files.end(), parts[i].files.begin(),
+		             parts[i].files.end());
+	}
+
+	if (nfiles > 0 && relto != NULL && do_fsmv)
+		res = move_files(relfrom, relto, &files);
+
+out:
+	if (path)
+		delete path;
+	if (sql_query)
+		delete sql_query;
+
+	return res;
 }
 
 int VirtualDirectory::vdir_update_tags(PathCrawler *from, file_info_t *finfo)
@@ -282,10 +565,26 @@ out:
 	return res;
 }
 
+/* the two paths of a rename */
+typedef struct {
+	const char *from;
+	const char *to;
+} rename_arg_t;
+
+static int rename_shard(DbBackend *db, int shard, void *arg)
+{
+	rename_arg_t *ra = (rename_arg_t *) arg;
+
+	return db->update_file_path(ra->from, ra->to);
+}
+
 int VirtualDirectory::vdir_replace_path(const char *from, const char *to)
 {
 	int res;
 	const char *froml, *tol;
+	struct stat st;
+	rename_arg_t ra;
+	vector<void *> args;
 
 	froml = from;
 	tol = to;
@@ -295,7 +594,17 @@ int VirtualDirectory::vdir_replace_path(const char *from, const char *to)
 	if (tol[0] == '/')
 		tol++;
 
-	res = db->update_file_path(froml, tol);
+	/* a file is in the shard of its inode; every shard has its own rows
+	 * for the directories */
+	if (fstatat(get_dirfd(), tol, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+	    !S_ISDIR(st.st_mode))
+		res = shards->of_ino(st.st_ino)->update_file_path(froml, tol);
+	else {
+		ra.from = froml;
+		ra.to = tol;
+		args.assign(shards->size(), (void *) &ra);
+		res = shards->fan_out(rename_shard, &args[0], NULL);
+	}
 
 	if (res)
 		return -EINVAL;
@@ -303,6 +612,49 @@ int VirtualDirectory::vdir_replace_path(const char *from, const char *to)
 	return 0;
 }
 
+/* an entry listed by a shard, until the shards are merged */
+typedef struct {
+	string name;
+	stat_t st;
+	int has_stat;
+} dir_entry_t;
+
+static int collect_entry(void *buf, const char *name, const stat_t *st,
+                         off_t off)
+{
+	vector<dir_entry_t> *entries = (vector<dir_entry_t> *) buf;
+	dir_entry_t e;
+
+	e.name = name;
+	e.has_stat = (st != NULL);
+	if (st)
+		e.st = *st;
+	entries->push_back(e);
+
+	return 0;
+}
+
+/* the tags are in all the shards, so only the first of each name is kept */
+static int fill_merged(vector<vector<dir_entry_t> > *parts, void *buf,
+                       filler_t filler)
+{
+	boost::unordered_set<string> seen;
+
+	for (vector<vector<dir_entry_t> >::iterator p = parts->begin();
+			p != parts->end(); p++) {
+		for (vector<dir_entry_t>::iterator e = p->begin(); e != p->end();
+				e++) {
+			if (!seen.insert(e->name).second)
+				continue;
+			if (filler(buf, e->name.c_str(),
+			           e->has_stat ? &e->st : NULL, 0))
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
 static int fill_buf(list<string> *tags, void *buf, filler_t filler)
 {
 	for (list<string>::const_iterator i = tags->begin(); 
@@ -314,12 +666,16 @@ static int fill_buf(list<string> *tags, void *buf, filler_t filler)
 	return 0;
 }
 
-int VirtualDirectory::vdir_list_root(const char * path, void *buf,
-                                     filler_t filler)
+static int list_root_db(DbBackend *db, const char *path, void *buf,
+                        filler_t filler)
 {
 	list<string> *tags;
 	int res = 0;
 
+	/* the whole catalog is kept in memory */
+	if(path == NULL)
+		return db->db_list_catalog(buf, filler);
+
 	try {
 		/* get all the simple tags */
 		tags = db->db_get_tags(path);
@@ -352,10 +708,77 @@ int VirtualDirectory::vdir_list_root(const char * path, void *buf,
 	return 0;
 }
 
+/* what a shard lists of the root or of a real directory */
+typedef struct {
+	const char *path;
+	vector<dir_entry_t> entries;
+} list_arg_t;
+
+static int list_root_shard(DbBackend *db, int shard, void *arg)
+{
+	list_arg_t *la = (list_arg_t *) arg;
+
+	return list_root_db(db, la->path, &la->entries, collect_entry);
+}
+
+int VirtualDirectory::vdir_list_root(const char * path, void *buf,
+                                     filler_t filler)
+{
+	int i, n = shards->size();
+	vector<list_arg_t> parts(n);
+	vector<vector<dir_entry_t> > entries(n);
+	vector<void *> args(n);
+
+	if (n == 1)
+		return list_root_db(shards->get(0), path, buf, filler);
+
+	for (i = 0; i < n; i++) {
+		parts[i].path = path;
+		args[i] = &parts[i];
+	}
+	if (shards->fan_out(list_root_shard, &args[0], NULL))
+		return -EIO;
+	for (i = 0; i < n; i++)
+		entries[i].swap(parts[i].entries);
+	fill_merged(&entries, buf, filler);
+
+	return 0;
+}
+
+/* a query sent to a shard and what it gave */
+typedef struct {
+	string *sql_query;
+	string *key;
+	vector<tag_info_t> *tags;
+	string *path;
+	vector<dir_entry_t> entries;
+	long nentries;
+	time_t mtime;
+} query_arg_t;
+
+static int readdir_shard(DbBackend *db, int shard, void *arg)
+{
+	query_arg_t *qa = (query_arg_t *) arg;
+
+	return db->db_get_filesinfo(qa->sql_query, qa->tags, qa->path,
+	                            &qa->entries, collect_entry);
+}
+
+static int getattr_shard(DbBackend *db, int shard, void *arg)
+{
+	query_arg_t *qa = (query_arg_t *) arg;
+
+	return db->db_get_query_attr(qa->sql_query, qa->key, qa->tags, qa->path,
+	                             &qa->nentries, &qa->mtime);
+}
+
 int VirtualDirectory::vdir_readdir(const char * query, void *buf,
                                    filler_t filler)
 {
-	int res = 0;
+	int res = 0, i, n = shards->size();
+	vector<query_arg_t> parts(n);
+	vector<vector<dir_entry_t> > entries(n);
+	vector<void *> args(n);
 	PathCrawler *pc= NULL;
 	string *path_query= NULL;
 	string *sql_query= NULL;
@@ -386,7 +809,82 @@ int VirtualDirectory::vdir_readdir(const char * query, void *buf,
 
 	tags = new vector<tag_info_t>;
 	sql_query = pc->db_build_sql_query(tags);
-	res = db->db_get_filesinfo(sql_query, tags, path_query, buf, filler);
+	if (n == 1)
+		res = shards->get(0)->db_get_filesinfo(sql_query, tags, path_query,
+		                                       buf, filler);
+	else {
+		/* all the shards answer at once, then the lists are merged */
+		for (i = 0; i < n; i++) {
+			parts[i].sql_query = sql_query;
+			parts[i].key = NULL;
+			parts[i].tags = tags;
+			parts[i].path = path_query;
+			args[i] = &parts[i];
+		}
+		res = shards->fan_out(readdir_shard, &args[0], NULL);
+		if (res == 0) {
+			for (i = 0; i < n; i++)
+				entries[i].swap(parts[i].entries);
+			fill_merged(&entries, buf, filler);
+		}
+	}
+
+	delete pc;
+	tags->clear();
+	delete tags;
+
+	if (path_query)
+		delete path_query;
+	if (sql_query)
+		delete sql_query;
+
+	return (res == -1) ? -EIO : 0;
+}
+
+int VirtualDirectory::vdir_getattr(const char * query, long *nentries,
+                                   time_t *mtime)
+{
+	int res = 0, i, n = shards->size();
+	vector<query_arg_t> parts(n);
+	vector<void *> args(n);
+	PathCrawler *pc= NULL;
+	string *path_query= NULL;
+	string *sql_query= NULL;
+	string key;
+	vector<tag_info_t> *tags= NULL;
+
+	if (query[0] == '\0')
+		return -EINVAL;
+
+	pc = new PathCrawler(query);
+	if (pc == NULL)
+		return -ENOMEM;
+
+	if (pc->break_queries() == 0) {
+		delete pc;
+		return -ENOENT;
+	}
+
+	path_query = extract_real_path(query, pc);
+
+	tags = new vector<tag_info_t>;
+	sql_query = pc->db_build_sql_query(tags, &key);
+	for (i = 0; i < n; i++) {
+		parts[i].sql_query = sql_query;
+		parts[i].key = &key;
+		parts[i].tags = tags;
+		parts[i].path = path_query;
+		args[i] = &parts[i];
+	}
+	res = shards->fan_out(getattr_shard, &args[0], NULL);
+	/* every file is in one shard only */
+	*nentries = 0;
+	*mtime = 0;
+	for (i = 0; i < n && res == 0; i++) {
+		*nentries += parts[i].nentries;
+		if (parts[i].mtime > *mtime)
+			*mtime = parts[i].mtime;
+	}
 
 	delete pc;
 	tags->clear();
@@ -10,6 +10,7 @@
  */
 
 #include <unistd.h>
+#include <fcntl.h>
 #include "hybfs.h"
 
 #include "core/misc.h"
@@ -44,8 +45,10 @@ int hybfs_mkdir(const char *path, mode_t mode)
         	res = 0;
         	goto out;
         }
-        DBG_PRINT("i make dir %s\n", pdata->abspath_str());
-        res = mkdir(pdata->abspath_str(), mode);
+        DBG_PRINT("i make dir %s\n", pdata->relpath_str());
+        res = mkdirat(pdata->get_dirfd(), pdata->fdpath_str(), mode);
+        if(res == -1)
+        	res = -errno;
         
 out: 
 	if(pc)
@@ -86,8 +89,10 @@ int hybfs_rmdir(const char *path)
         	goto out;
         }
         
-        DBG_PRINT("i remove dir %s\n", pdata->abspath_str());
-        res = rmdir(pdata->abspath_str());
+        DBG_PRINT("i remove dir %s\n", pdata->relpath_str());
+        res = unlinkat(pdata->get_dirfd(), pdata->fdpath_str(), AT_REMOVEDIR);
+        if(res == -1)
+        	res = -errno;
         
 out: 
 	if(pc)
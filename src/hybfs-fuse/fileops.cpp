@@ -24,6 +24,7 @@
 #include "core/hybfsdef.h"
 #include "core/path_crawler.hpp"
 #include "core/path_data.hpp"
+#include "core/hot_paths.hpp"
 
 /* 
  * Warning: the rename is done properly for a SINGLE branch. 
@@ -55,8 +56,8 @@ static int normal_rename(HybfsData *data, PathData *from, PathData *to)
 
 	DBG_SHOWFC();
 	
-	pf = from->abspath_str();
-	pt = to->abspath_str();
+	pf = from->check_path_data() ? from->fdpath_str() : NULL;
+	pt = to->check_path_data() ? to->fdpath_str() : NULL;
 	
 	brid_from = from->get_brid();
 	brid_to   = to->get_brid();
@@ -69,7 +70,9 @@ static int normal_rename(HybfsData *data, PathData *from, PathData *to)
 	if(pf != NULL && pt != NULL) {
 		/* path to path */
 		DBG_PRINT("normal rename from=%s to=%s\n", pf, pt);
-		ret = rename(pf, pt);
+		ret = renameat(from->get_dirfd(), pf, to->get_dirfd(), pt);
+		if (ret)
+			ret = -errno;
 		if (ret == 0) {
 			ret = data->virtual_replace_path(from->relpath_str(), 
 					to->relpath_str(), brid_from);
@@ -91,7 +94,8 @@ static int normal_rename(HybfsData *data, PathData *from, PathData *to)
  * specified. If this exists, then a rename will also happen.
  * 
  * If the from path is 100% real, then all the ops will be performed on this. 
- * We are NOT supporting tags ops for directories (not yet).
+ * For a real directory, they are performed on all the files under it, with
+ * what the database knows about them.
  * If both the from and to paths are real (no queries) then we rely on the underlying
  * rename operation. Otherwise, we have to do it ourselves, and search in the database
  * for the file paths that do a match on the query.
@@ -142,11 +146,11 @@ int hybfs_rename(const char *from, const char *to)
 	
 	/* test if is a directory or a file.*/
 	isdir = 0;
-	if(pdf->abspath_str() ==  NULL) {
+	if(pdf->check_path_data() == 0) {
 		isdir = 1; /* think of a query as a virtual dir */
 	} else {
 		memset(&st,0, sizeof(struct stat));
-		res = stat(pdf->abspath_str(), &st);
+		res = fstatat(pdf->get_dirfd(), pdf->fdpath_str(), &st, 0);
 		if(res) {
 			res = -errno;
 			goto out;
@@ -167,7 +171,7 @@ int hybfs_rename(const char *from, const char *to)
 	/* if it's a file, update the tags for it, even if the path is a query (?) */
 	if(!isdir) {
 		res = hybfs_core->virtual_updatetags(pct, pdf->relpath_str(),
-				pdf->abspath_str(), pdf->get_brid());
+				pdf->get_brid());
 	}
 	
 	/* do the real rename for a specified path, if any */
@@ -215,12 +219,14 @@ int hybfs_open(const char *path, struct fuse_file_info *fi)
                 goto out;
         }
        
-        fid = open(pd->abspath_str(), fi->flags);
+        fid = openat(pd->get_dirfd(), pd->fdpath_str(), fi->flags);
         if (fid == -1) {
         	res = -errno;
         	if(res == -ENOENT) {
-        		/* TODO: try to delete the info from the db, 
-        		 * because it means it was changed underneath us! */
+        		/* it was changed underneath us, so delete the info
+        		 * from the db */
+        		hybfs_core->queue_stale_file(pd->relpath_str(),
+        		                             pd->get_brid());
         	}
         	goto out;
         }
@@ -228,7 +234,7 @@ int hybfs_open(const char *path, struct fuse_file_info *fi)
         /* add the tags to the db for this file if the create flag was specified*/
         if(fi->flags & O_CREAT) {
 	        res = hybfs_core->virtual_addtag(pc, pd->relpath_str(),
-	        		pd->abspath_str(), pd->get_brid());
+	        		pd->get_brid());
 	        if(res)
 	        	goto out;
         }
@@ -236,6 +242,10 @@ int hybfs_open(const char *path, struct fuse_file_info *fi)
         fi->fh = (unsigned long) fid;
         res = 0;
         
+        /* the indexer takes it before the files nobody looks at */
+        hot_notify(HOT_FILE, hybfs_core->get_branch_path(pd->get_brid()),
+                   pd->fdpath_str());
+        
 out: 
 	if(fid >0 && res !=0)
 		close(fid);
@@ -278,7 +288,7 @@ int hybfs_write(const char *path, const char *buf, size_t size, off_t offset,
 
 int hybfs_truncate(const char *path, off_t size) 
 {
-	int res, nqueries;
+	int res, nqueries, fd;
 	PathCrawler *pc= NULL;
 	PathData *pd;
 	HybfsData *hybfs_core = get_data();
@@ -298,7 +308,16 @@ int hybfs_truncate(const char *path, off_t size)
 		res = -ENOMEM;
 		goto out;
 	}
-	res = truncate(pd->abspath_str(), size);
+	/* there is no truncateat(), so open it relative to the branch */
+	fd = openat(pd->get_dirfd(), pd->fdpath_str(), O_WRONLY);
+	if (fd == -1) {
+		res = -errno;
+		goto out;
+	}
+	res = ftruncate(fd, size);
+	if (res == -1)
+		res = -errno;
+	close(fd);
 out:
 	if (pc)
 		delete pc;
@@ -341,7 +360,6 @@ int hybfs_release(const char *path, struct fuse_file_info *fi)
 int hybfs_utimens(const char *path, const struct timespec ts[2]) 
 {
 	int res, nqueries;
-        struct timeval tv[2];
         PathData *pd = NULL;
         PathCrawler *pc = NULL;
        
@@ -363,12 +381,10 @@ int hybfs_utimens(const char *path, const struct timespec ts[2])
         	goto out;
         }
         
-        tv[0].tv_sec = ts[0].tv_sec;
-        tv[0].tv_usec = ts[0].tv_nsec / 1000;
-        tv[1].tv_sec = ts[1].tv_sec;
-        tv[1].tv_usec = ts[1].tv_nsec / 1000;
-        	
-        res = utimes(pd->abspath_str(), tv);
+        /* this keeps the nanoseconds, utimes() didn't */
+        res = utimensat(pd->get_dirfd(), pd->fdpath_str(), ts, 0);
+        if(res == -1)
+        	res = -errno;
         
 out: 
 	if(pc)
@@ -400,7 +416,9 @@ int hybfs_chmod(const char *path, mode_t mode)
 		res = -ENOMEM;
 		goto out;
 	}
-	res = chmod(pd->abspath_str(), mode);
+	res = fchmodat(pd->get_dirfd(), pd->fdpath_str(), mode, 0);
+	if (res == -1)
+		res = -errno;
 out:
 	if (pc)
 		delete pc;
@@ -431,7 +449,9 @@ int hybfs_chown(const char *path, uid_t uid, gid_t gid)
 		res = -ENOMEM;
 		goto out;
 	}
-	res = chown(pd->abspath_str(), uid, gid);
+	res = fchownat(pd->get_dirfd(), pd->fdpath_str(), uid, gid, 0);
+	if (res == -1)
+		res = -errno;
 out:
 	if (pc)
 		delete pc;
@@ -444,12 +464,13 @@ out:
 /**
  * Set file owner of after an operation, which created a file.
  */
-static int set_owner(const char *path)
+static int set_owner(PathData *pd)
 {
 	struct fuse_context *ctx = fuse_get_context();
 
 	if (ctx->uid != 0 && ctx->gid != 0) {
-		int res = lchown(path, ctx->uid, ctx->gid);
+		int res = fchownat(pd->get_dirfd(), pd->fdpath_str(), ctx->uid,
+		                   ctx->gid, AT_SYMLINK_NOFOLLOW);
 		if (res)
 			return -errno;
 	}
@@ -478,18 +499,18 @@ int hybfs_mknod(const char *path, mode_t mode, dev_t rdev)
 		res = -ENOMEM;
 		goto out;
 	}
-	res = mknod(pd->abspath_str(), mode, rdev);
+	res = mknodat(pd->get_dirfd(), pd->fdpath_str(), mode, rdev);
 	if (res == -1) {
 		res = -errno;
 		goto out;
 	}
 	/* add the tags to the db for this file if the create flag was specified*/
 	res = hybfs_core->virtual_addtag(pc, pd->relpath_str(),
-			pd->abspath_str(), pd->get_brid());
+			pd->get_brid());
 	if (res)
 		goto out;
 
-	set_owner(pd->abspath_str());
+	set_owner(pd);
 
 out:
 	if (pc)
@@ -524,9 +545,8 @@ int hybfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 		goto out;
 	}
 	
-	DBG_PRINT("absolute path is %s rel path is %s\n",pd->abspath_str(),
-			pd->relpath_str());
-	fid = open(pd->abspath_str(), fi->flags, mode);
+	DBG_PRINT("rel path is %s\n", pd->relpath_str());
+	fid = openat(pd->get_dirfd(), pd->fdpath_str(), fi->flags, mode);
 	if (fid == -1) {
 		res = -errno;
 		goto out;
@@ -534,7 +554,7 @@ int hybfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 
 	/* add the tags to the db for this file if the create flag was specified*/
 	res = hybfs_core->virtual_addtag(pc, pd->relpath_str(),
-			pd->abspath_str(), pd->get_brid());
+			pd->get_brid());
 	if (res)
 		goto out;
 
@@ -543,7 +563,7 @@ int hybfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	res = 0;
 
 	/* no error check, since creating the file succeeded */
-	set_owner(pd->abspath_str());
+	set_owner(pd);
 
 out: 
 	if (fid >0 && res !=0)
@@ -578,8 +598,8 @@ int hybfs_unlink(const char *path)
 		res = -ENOMEM;
 		goto out;
 	}
-	DBG_PRINT("unlink path is %s\n", pd->abspath_str());
-	res = unlink(pd->abspath_str());
+	DBG_PRINT("unlink path is %s\n", pd->relpath_str());
+	res = unlinkat(pd->get_dirfd(), pd->fdpath_str(), 0);
 	if (res) {
 		res = -errno;
 		if(res == -ENOENT) {
@@ -23,6 +23,7 @@
 
 #include <sys/types.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "hybfs.h"
@@ -42,8 +43,12 @@ static void print_usage()
 	fprintf(stderr,
 	"HybFS\n"
 	"Usage: hybfs directory mountpoint\n"
-	"general options: (you don't have any choice here)\n"
-	"    -h   --help            print help\n");
+	"general options:\n"
+	"    -h   --help            print help\n"
+	"    --mem-budget=MB        memory for the database caches of all the\n"
+	"                           branches together\n"
+	"    --shards=N             split the metadata of a new branch into N\n"
+	"                           databases, by inode\n");
 }
 
 int hybfs_opts(void *data, const char *arg, int key,
@@ -52,6 +57,8 @@ int hybfs_opts(void *data, const char *arg, int key,
 	HybfsData *hybfs_core = (HybfsData *) data;
 	
 	int res = 0;
+	char *end;
+	long mb, n;
 	
 	DBG_PRINT("arguments: %s\n", arg);
 
@@ -63,6 +70,25 @@ int hybfs_opts(void *data, const char *arg, int key,
 			return 0;
 		hybfs_core->retval = 1;
 		return 1;
+	case KEY_MEM_BUDGET:
+		mb = strtol(strchr(arg, '=') + 1, &end, 10);
+		if (*end != '\0' || mb < 0) {
+			fprintf(stderr, "hybfs: bad memory budget %s\n", arg);
+			hybfs_core->retval = 1;
+			return -1;
+		}
+		hybfs_core->set_mem_budget(mb * 1024 * 1024);
+		return 0;
+	case KEY_SHARDS:
+		n = strtol(strchr(arg, '=') + 1, &end, 10);
+		if (*end != '\0' || n < 1 || n > MAX_SHARDS) {
+			fprintf(stderr, "hybfs: bad number of shards %s, it must "
+			        "be between 1 and %d\n", arg, MAX_SHARDS);
+			hybfs_core->retval = 1;
+			return -1;
+		}
+		hybfs_core->set_shards(n);
+		return 0;
 	case KEY_HELP:
 		print_usage();
 		fuse_opt_add_arg(outargs, "-ho");
@@ -74,6 +100,27 @@ int hybfs_opts(void *data, const char *arg, int key,
 	}
 }
 
+/*
+ * The background threads are started here and not before fuse_main, because
+ * they wouldn't survive the fork done when fuse goes in background.
+ */
+static void *hybfs_init(struct fuse_conn_info *conn)
+{
+	HybfsData *data = get_data();
+	
+	if (data->start_workers())
+		PRINT_ERROR("hybfs: Warning! Running without background workers\n");
+	
+	return data;
+}
+
+static void hybfs_destroy(void *private_data)
+{
+	HybfsData *data = (HybfsData *) private_data;
+	
+	data->stop_workers();
+}
+
 #define INIT_KEY(index, string, key) \
 	options[index].templ = string; \
 	options[index].offset = -1U; \
@@ -84,7 +131,7 @@ int main(int argc, char *argv[])
 	int i;
 	int res, exit, retval;
 	struct fuse_args args;
-	static struct fuse_opt options[3];
+	static struct fuse_opt options[5];
 	static struct fuse_operations hybfs_oper;
 	
 	HybfsData *data = new HybfsData(NULL);
@@ -112,11 +159,15 @@ int main(int argc, char *argv[])
 	hybfs_oper.utimens =  hybfs_utimens;
 	hybfs_oper.chmod   =  hybfs_chmod;
 	hybfs_oper.chown   =  hybfs_chown;
+	hybfs_oper.init    =  hybfs_init;
+	hybfs_oper.destroy =  hybfs_destroy;
 	/* ------end FUSE interface------ */
 	
 	INIT_KEY(0,"--help", KEY_HELP);
 	INIT_KEY(1,"-h", KEY_HELP);
-	INIT_KEY(2,NULL,0);
+	INIT_KEY(2,"--mem-budget=", KEY_MEM_BUDGET);
+	INIT_KEY(3,"--shards=", KEY_SHARDS);
+	INIT_KEY(4,NULL,0);
 
 #ifdef DBG
 	for(i=0; i<argc; i++)
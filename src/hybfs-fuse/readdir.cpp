@@ -10,23 +10,32 @@
  */
 
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "hybfs.h"
 #include "core/misc.h"
 #include "core/db_backend.hpp" /* for METADIR */
+#include "core/hot_paths.hpp"
 
-static inline int normal_readdir(const char *path, void *buf,
+static inline int normal_readdir(int dirfd, const char *path, void *buf,
                                  fuse_fill_dir_t filler)
 {
+	int fd;
 	DIR *dp;
 	struct dirent *de;
 	struct stat st;
 
 	DBG_PRINT("path = %s\n", path);
 
-	dp = opendir(path);
-	if (dp == NULL)
+	fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
 		return -errno;
+	dp = fdopendir(fd);
+	if (dp == NULL) {
+		close(fd);
+		return -errno;
+	}
 
 	while ((de = readdir(dp)) != NULL) {
 		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..")
@@ -55,12 +64,7 @@ static inline int fill_root(HybfsData *hybfs_core, void *buf,
 
 	/* we are in root: add a path to the real directories (the special
 	 * tag "path" with ":" appended, and list all the tags */
-	memset(&st, 0, sizeof(st));
-
-	st.st_mode = S_IFDIR | 0755;
-	st.st_nlink = 2 + hybfs_core->get_nlinks();
-	st.st_uid = geteuid();
-	st.st_gid = getegid();
+	hybfs_core->get_root_stat(&st);
 	ret = filler(buf, REAL_DIR, &st, 0);
 
 	ret = hybfs_core->virtual_readroot("/", buf, filler);
@@ -71,12 +75,11 @@ static inline int fill_root(HybfsData *hybfs_core, void *buf,
 int hybfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                   off_t offset, struct fuse_file_info *fi)
 {
-	const char * brpath;
+	EpochGuard guard;
+	const char *p;
 	int ret;
-	int i, n, brid, nqueries;
+	int i, n, dirfd, brid, nqueries;
 	unsigned int path_len;
-	std::string *p = NULL;
-	std::string *relpath = NULL;
 	PathCrawler *pc = NULL;
 	HybfsData *hybfs_core = get_data();
 
@@ -93,8 +96,10 @@ int hybfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		/* the root path */
 		n = hybfs_core->get_nbranches();
 		for (i=0; i<n; i++) {
-			brpath = hybfs_core->get_branch_path(i);
-			ret = normal_readdir(brpath, buf, filler);
+			dirfd = hybfs_core->get_branch_fd(i);
+			if (dirfd == -1)
+				continue;
+			ret = normal_readdir(dirfd, ".", buf, filler);
 			if (ret)
 				return ret;
 			/* list the tags and tag-value pairs for the root dir */
@@ -112,15 +117,17 @@ int hybfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	
 	if(nqueries == 0 && strncmp(path+1, REAL_DIR, strlen(REAL_DIR)-1) == 0) {
 		/* if it's only a real path, do a normal readdir first */
-		p = resolve_path(hybfs_core, path+strlen(REAL_DIR), &brid);
-		if (p==NULL) {
-			ret = -ENOMEM;
+		dirfd = resolve_fd(hybfs_core, path+strlen(REAL_DIR), &brid, &p);
+		if (dirfd == -1) {
+			ret = -ENOENT;
 			goto out;
 		}
-		ret = normal_readdir(p->c_str(), buf, filler);
+		ret = normal_readdir(dirfd, p, buf, filler);
 		/* something is wrong or the buffer is full */
 		if(ret)
 			goto out;
+		/* somebody browses it, so its files should get their tags soon */
+		hot_notify(HOT_DIR, hybfs_core->get_branch_path(brid), p);
 		ret = hybfs_core->virtual_readroot(path+strlen(REAL_DIR),
 				buf, filler);
 		goto out;
@@ -129,10 +136,6 @@ int hybfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	ret = hybfs_core->virtual_readdir(path, buf, filler);
 
 out:
-	if(p)
-		delete p;
-	if(relpath)
-		delete relpath;
 	if(pc)
 		delete pc;
 	
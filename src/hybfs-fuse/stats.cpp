@@ -30,21 +30,20 @@
 static inline int normal_getattr(HybfsData *data, const char *path,
                                  struct stat *stbuf)
 {
-	std::string *p;
-	int brid;
+	EpochGuard guard;
+	const char *p;
+	int brid, dirfd;
 	int res = 0;
 
-	p = resolve_path(data, path+strlen(REAL_DIR), &brid);
-	if (p==NULL)
-		return -ENOMEM;
+	dirfd = resolve_fd(data, path+strlen(REAL_DIR), &brid, &p);
+	if (dirfd == -1)
+		return -ENOENT;
 
-	DBG_PRINT("my path is %s\n", p->c_str());
+	DBG_PRINT("my path is %s\n", p);
 
-	res = lstat(p->c_str(), stbuf);
+	res = fstatat(dirfd, p, stbuf, AT_SYMLINK_NOFOLLOW);
 	if (res)
 		res = -errno;
-	
-	delete p;
 
 	return res;
 }
@@ -70,9 +69,8 @@ int hybfs_getattr(const char *path, struct stat *stbuf)
 	memset(stbuf, 0, sizeof(struct stat));
 	
 	if (strcmp(path, "/") == 0 || strcmp(path+1, REAL_DIR) == 0) {
-		/* this is expensive */
-		fill_dummy_stat(stbuf);
-		stbuf->st_nlink += hybfs_core->get_nlinks();
+		/* cached, this doesn't touch the branches */
+		hybfs_core->get_root_stat(stbuf);
 
 		return 0;
 	}
@@ -111,19 +109,19 @@ int hybfs_getattr(const char *path, struct stat *stbuf)
 		
 	if(pd->check_path_data() == 0) {
 	/* a query is treated like a virtual directory */
-		fill_dummy_stat(stbuf);
-		res = 0;
+		res = hybfs_core->virtual_getattr(path, stbuf);
 		goto out;
 		
 	}
 	
-	DBG_PRINT(" I have real path: %s \n", pd->abspath_str());
-	res = lstat(pd->abspath_str(), stbuf);
+	DBG_PRINT(" I have real path: %s \n", pd->relpath_str());
+	res = fstatat(pd->get_dirfd(), pd->fdpath_str(), stbuf,
+	              AT_SYMLINK_NOFOLLOW);
 	if(res)
 		res = -errno;
 	if(res == -ENOENT) {
-		/* FIXME - swallow the error? */
-		hybfs_core->virtual_remove_file(pd->relpath_str(), pd->get_brid());
+		/* the DB is cleaned in background, getattr must stay cheap */
+		hybfs_core->queue_stale_file(pd->relpath_str(), pd->get_brid());
 	}
 	
 out:
@@ -165,7 +163,7 @@ int hybfs_access(const char *path, int mask)
 		goto out;
 	}
 	
-	res = access(pd->abspath_str(), mask);
+	res = faccessat(pd->get_dirfd(), pd->fdpath_str(), mask, 0);
 	if (res == -1)
 		res = -errno;
 
@@ -14,9 +14,17 @@
 
 #include <string>
 #include <list> 
+#include <map>
+#include <set>
 
+#include <time.h>
+#include <pthread.h>
 #include <sqlite3.h>
+#include <boost/unordered_map.hpp>
 #include "hybfsdef.h"
+#include "snapshot.hpp"
+#include "tag_dict.hpp"
+#include "tag_export.hpp"
 
 /**
  * Default meta dir path. Define it at compile time if you want to change it.
@@ -27,20 +35,234 @@
 
 /**
  * Default databases names. Define them at compile time if you want to change them.
+ * The other shards of a branch have their number after the name.
  */
 #ifndef MAINDB
 #define MAINDB  ".hybfs_main.db"
 #endif
 
+/**
+ * Milliseconds a writer waits for the others, an export for instance, to
+ * release the database.
+ */
+#ifndef DB_BUSY_TIMEOUT
+#define DB_BUSY_TIMEOUT 10000
+#endif
+
+/**
+ * Appended to the path of the database to name the copy an export reads.
+ * The copy is made under a read lock, which holds back the writers of a
+ * mounted branch, so it's a plain file copy: it must be done well within
+ * DB_BUSY_TIMEOUT.
+ */
+#ifndef EXPORT_COPY_SUFFIX
+#define EXPORT_COPY_SUFFIX ".export"
+#endif
+
+/**
+ * Bytes of page cache an import of tags works with.
+ */
+#ifndef IMPORT_CACHE_BYTES
+#define IMPORT_CACHE_BYTES (64 * 1024 * 1024)
+#endif
+
+/**
+ * Files an import adds in one transaction. A batch has to be written well
+ * within DB_BUSY_TIMEOUT, or the writers of a mounted branch give up.
+ */
+#ifndef IMPORT_BATCH
+#define IMPORT_BATCH 10000
+#endif
+
+/**
+ * Milliseconds an import waits after each batch. SQLite retries a busy
+ * lock at most every 100ms, so a shorter pause may not let a writer in.
+ */
+#ifndef IMPORT_PAUSE_MS
+#define IMPORT_PAUSE_MS 100
+#endif
+
+/**
+ * Maximum number of virtual directories whose attributes are kept in the cache.
+ */
+#ifndef ATTR_CACHE_MAX
+#define ATTR_CACHE_MAX 1024
+#endif
+
+/**
+ * Number of buckets for the tag generation stamps, indexed by the dictionary
+ * id of the tag name. The tags that fall in the same bucket share the stamp, which only makes the cache a bit more eager to
+ * count again.
+ */
+#ifndef TAG_GEN_BUCKETS
+#define TAG_GEN_BUCKETS 1024
+#endif
+
+/**
+ * Maximum number of free pages given back to the file system by a single
+ * maintenance run.
+ */
+#ifndef MAINT_VACUUM_PAGES
+#define MAINT_VACUUM_PAGES 2048
+#endif
+
+/**
+ * Number of free pages from which a database without incremental vacuum is
+ * rebuilt once, at mount time, to have it.
+ */
+#ifndef MAINT_CONVERT_PAGES
+#define MAINT_CONVERT_PAGES 4096
+#endif
+
+/**
+ * Number of changed rows after which the statistics of the planner are
+ * gathered again.
+ */
+#ifndef MAINT_ANALYZE_CHANGES
+#define MAINT_ANALYZE_CHANGES 10000
+#endif
+
 namespace hybfs {
 
 using namespace std;
 
 typedef struct{
-	int ino;
+	long long ino;
 	string path;
 } new_file_info_t;
 
+/**
+ * A tag operation from a path (TAG_ADD, TAG_REPLACE or TAG_REMOVE) and the
+ * tag:value strings it works with.
+ */
+typedef struct {
+	int op;
+	std::vector<std::string> tags;
+} tags_op_t;
+
+/**
+ * What was known about a file when a module extracted its tags. If none of
+ * this changed, the file doesn't need to be read again.
+ */
+typedef struct {
+	int module;
+	int version;
+	long long size;
+	long long mtime_ns;
+	unsigned long long name_hash;
+} file_fprint_t;
+
+/**
+ * The fingerprints of a module, by inode.
+ */
+typedef boost::unordered_map<long long, file_fprint_t> fprint_map_t;
+
+/**
+ * A file and the tags that will be added for it, for the bulk inserts. The
+ * fingerprint is stored with the tags if its version is not 0. 'failed' is
+ * set by the insert when the file was not committed.
+ */
+typedef struct {
+	file_info_t *finfo;
+	vector<string> tags;
+	file_fprint_t fp;
+	int failed;
+} tagged_file_t;
+
+/**
+ * Hash of the relative path of a file, to check that a fingerprint still
+ * belongs to the same name without keeping all the names in memory.
+ */
+static inline unsigned long long fprint_name_hash(const char *name, size_t len)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 1099511628211ULL;
+	}
+	
+	return hash;
+}
+
+/**
+ * The shard of the file with this inode, out of nshards. The inodes are mixed
+ * first, so the shards stay even when they are given in sequence.
+ */
+static inline int shard_of_ino(long long ino, int nshards)
+{
+	unsigned long long hash = (unsigned long long) ino * 0x9E3779B97F4A7C15ULL;
+	
+	return nshards > 1 ? (int) ((hash >> 32) % nshards) : 0;
+}
+
+/**
+ * Generation stamp of a tag: it changes every time a file gains or loses the tag.
+ */
+typedef struct {
+	volatile unsigned long gen;
+	volatile time_t mtime;
+} tag_gen_t;
+
+/**
+ * Cached attributes of a virtual directory (a query). The entry is valid as long
+ * as none of the tags from the query has a generation newer than 'gen' and
+ * no other process wrote the database since 'fgen'.
+ */
+typedef struct {
+	long nentries;
+	unsigned long gen;
+	unsigned long fgen;
+} vdir_attr_t;
+
+/**
+ * A version of the attributes cache, by the real path and the key of the query,
+ * which holds the dictionary ids of its tags. It's never changed after it was
+ * published.
+ */
+typedef map<string, vdir_attr_t> attr_cache_t;
+
+/**
+ * A version of the tag catalog: all the tags and the tag:value pairs from the
+ * database, as they are listed in the mount root. It is valid while the
+ * generation and the change counter of the database file stay the same.
+ */
+typedef struct {
+	list<string> tags;
+	list<string> tags_values;
+	unsigned long gen;
+	unsigned int counter;
+} tag_catalog_t;
+
+/**
+ * What a maintenance run of a database did.
+ */
+typedef struct {
+	/** pages of the database file, before and after */
+	long pages_before;
+	long pages_after;
+	/** free pages left in the file */
+	long free_pages;
+	/** 0 for no vacuum, 1 for an incremental one */
+	int vacuum;
+	/** set if the statistics were gathered again */
+	int analyzed;
+	/** the page cache size, in pages */
+	long cache_pages;
+	/** how long the vacuum and the analyze took, in milliseconds */
+	long vacuum_ms;
+	long analyze_ms;
+} maint_stats_t;
+
+/**
+ * A directory of the branch, as it is in the dirs table. The root of the
+ * branch is the directory 0 and has no row.
+ */
+typedef struct {
+	long long parent;
+	string name;
+} dir_node_t;
+
 /**
  * @class DbBackend
  * @brief
@@ -51,9 +273,18 @@ typedef struct{
  * table tags: tag_id primary hey (autoincremented number)
  * 		tag, value
  * \par
- * table files: ino primary key, mode, path, tags (string of tags:values)
+ * table files: ino primary key, mode, dir_id, name, tags (string of
+ * 		tags:values), path (as it was when the file was added)
+ * \par
+ * table dirs: dir_id primary key (autoincremented number), parent, name.
+ * 		Renaming a directory changes only its row.
  * \par
  * table assoc: (ino, tag_id) primary key
+ * \par
+ * table fingerprints: (ino, module) primary key, version, size, mtime
+ * \par
+ * table checkpoints: (root, dir) primary key, the directories done by an
+ * unfinished indexing run
  */
 
 class DbBackend{
@@ -62,11 +293,40 @@ private:
 	 * Wrapper for running a query. This is mostly used for creating tables.
 	 */
 	int run_simple_query(const char* query);
+	
+	/**
+	 * Runs a query that has the relative path of a file as its only
+	 * parameter.
+	 */
+	int run_path_query(const char *query, const char *path);
 	/**
 	 * Creates initial tables for the given database
 	 */
 	int create_main_tables();
 	
+	/**
+	 * Creates the table of the fingerprints, also in the databases made
+	 * before it existed.
+	 */
+	int create_fprint_table();
+	
+	/**
+	 * Creates the table of the indexing checkpoints, if it's missing.
+	 */
+	int create_checkpoint_table();
+	
+	/**
+	 * Indexes the associations by tag, and replaces the delete trigger of
+	 * the older databases, which looked at all the tags for every row.
+	 */
+	int create_assoc_index();
+	
+	/**
+	 * Creates the table of the directories. The files of an older database
+	 * are moved to it.
+	 */
+	int create_dirs_table();
+	
 	/**
 	 * Adds a pair (tag,value) to the "tags" table. Returns the associated 
 	 * unique number. It does not replace the value for an existing tag.
@@ -85,12 +345,197 @@ private:
 	 */
 	int db_add_file(file_info_t * finfo);
 	
+	/**
+	 * Deletes the records for the file with this relative path. The caller
+	 * takes care of the transaction.
+	 */
+	int delete_file_info(const char *path);
+	
 	int fill_files(string *path, string *temp_table, void *buf, filler_t filler);
 	
 	string *build_temp_table(string *query, string *path);
 	
+	/**
+	 * Builds a temporary table with all the files under a real directory,
+	 * found through the directories table, one level at a time.
+	 */
+	string *build_subtree_table(string *path);
+	
+	/**
+	 * Makes the temporary table "dirs" (dir_id, depth) with the real
+	 * directory of the path and all the ones under it. It has only -1
+	 * if the database doesn't know the directory. Returns 0 on success,
+	 * -1 on error.
+	 */
+	int build_dir_table(string *path, const string &dirs);
+	
+	/**
+	 * Starts the transaction of a query restricted to a real path, and
+	 * names in "dirs" the table build_dir_table() made for it; "dirs" is
+	 * empty when there's no path to keep to. Returns 0 on success, -1 on
+	 * error; only after a success must end_restrict() be called.
+	 */
+	int begin_restrict(const char *path, string *dirs);
+	
+	/**
+	 * Drops the table of begin_restrict() and ends its transaction.
+	 */
+	int end_restrict(string *dirs);
+	
 	int delete_temp_table(string *name);
 	
+	/**
+	 * Adds a tag to all the files from a temporary table, or removes it
+	 * (op is TAG_ADD or TAG_REMOVE). Returns 0 on success, -1 on error.
+	 */
+	int retag_set(string *table, int op, string *tag_value);
+	
+	/**
+	 * Removes all the tags of the files from a temporary table.
+	 */
+	int untag_set(string *table);
+	
+	/**
+	 * Counts the files that match the query, restricted to the path, if any.
+	 * Returns -1 in case of error.
+	 */
+	long count_files(string *query, string *path);
+	
+	/**
+	 * Marks the tag as modified now.
+	 */
+	void touch_tag(const char *tag);
+	
+	/**
+	 * Same as touch_tag(), with the dictionary id of the tag name.
+	 */
+	void touch_tag_id(dict_id_t name);
+	
+	/**
+	 * Returns the id from the tags table of a tag, adding the tag to the
+	 * table if it's not there. Returns -1 on error.
+	 *
+	 * @param id The dictionary entry of the tag, to cache its id; 0 if the
+	 * dictionary is full.
+	 */
+	int add_tag(const char *tag, const char *value, dict_id_t id);
+	
+	/**
+	 * Reads all the tags of the database into the dictionary and the cache
+	 * of their ids.
+	 */
+	int load_tag_ids();
+	
+	/**
+	 * Returns 1 if the cache of the tag ids can be used: nobody else wrote
+	 * the database since we last looked. Otherwise the cache is emptied.
+	 * Called with tag_ids_lock held.
+	 */
+	int tag_ids_valid();
+	
+	/**
+	 * Returns foreign_gen, after checking the change counter of the
+	 * database for the transactions of the other processes.
+	 */
+	unsigned long check_foreign_writes();
+	
+	/**
+	 * Returns the id of a directory given by its relative path, "" being
+	 * the root. The missing directories are added if 'create' is set.
+	 * Returns -1 if the directory is missing or on error.
+	 */
+	long long find_dir(const char *path, size_t len, int create);
+	
+	/**
+	 * Reads the row of a directory, adding it if 'create' is set, and
+	 * keeps it in the cache. Returns -1 if it's missing or on error.
+	 */
+	long long lookup_dir(long long parent, const string &name, int create);
+	
+	/**
+	 * Splits a relative path in the id of its directory and its name.
+	 * Returns 0 on success, -1 if the directory is missing or on error.
+	 */
+	int split_path(const char *path, size_t len, long long *dir_id,
+	               string *name, int create);
+	
+	/**
+	 * Returns the relative path of a directory, from the cache if it's
+	 * there. Returns 0 on success, -1 on error.
+	 */
+	int get_dir_path(long long dir_id, string *path);
+	
+	/**
+	 * Empties the cache of the directories if another process wrote the
+	 * database; it's called before the queries that list paths.
+	 */
+	void sync_dirs();
+	
+	/**
+	 * Moves a directory, with all that is under it. Returns 1 if 'from'
+	 * is not a directory we know, 0 on success, -1 on error.
+	 */
+	int rename_dir(const char *from, const char *to);
+	
+	/**
+	 * SQL functions for the paths of the files: hybfs_path(dir_id, name,
+	 * path) builds the path, hybfs_dir(path) and hybfs_find_dir(path) give
+	 * the directory of a path (adding it, or NULL when it's missing) and
+	 * hybfs_name(path) gives the name.
+	 */
+	static void sql_path(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+	static void sql_dir(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+	static void sql_find_dir(sqlite3_context *ctx, int argc,
+	                         sqlite3_value **argv);
+	static void sql_name(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+	
+	/**
+	 * SQL function called by a trigger when a row of the tags table is
+	 * deleted; its id is taken out of the cache.
+	 */
+	static void sql_tag_dropped(sqlite3_context *ctx, int argc,
+	                            sqlite3_value **argv);
+	
+	/**
+	 * Counts the transactions we commit, to tell them from the ones of the
+	 * other processes.
+	 */
+	static int sql_commit_hook(void *arg);
+	
+	/**
+	 * A rolled back transaction may have added tags that we cached.
+	 */
+	static void sql_rollback_hook(void *arg);
+	
+	/**
+	 * Marks as modified all the tags of the file with this relative path.
+	 */
+	void touch_file_tags(const char *path);
+	
+	/**
+	 * Returns the change counter from the header of the database file. Any
+	 * process that writes the database increments it.
+	 */
+	unsigned int read_change_counter();
+	
+	/**
+	 * Reads the tag catalog from the database, or from the snapshot if it's
+	 * still valid.
+	 */
+	tag_catalog_t *build_catalog(unsigned long gen, unsigned int counter);
+	
+	/**
+	 * Returns 1 if the snapshot shows the database as it is now.
+	 */
+	int snapshot_valid(unsigned int counter);
+	
+	/**
+	 * Counts the files of a query from the snapshot. Only the queries made
+	 * of tags joined with AND, without a real path, can be answered.
+	 * Returns -1 if the query must go to the database.
+	 */
+	long snapshot_count(string *query, vector<tag_info_t> *tags, string *path);
+	
 	/**
 	 * path to the database
 	 */
@@ -101,12 +546,167 @@ private:
 	 */
 	string vdir_path;
 	
+	/**
+	 * O_PATH descriptor of our branch; the paths from the DB are resolved
+	 * relative to it
+	 */
+	int dir_fd;
+	
 	/**
 	 * handle to the database 
 	 */
 	sqlite3 *db;
 	
-	/* cached requests structures should be here */
+	/**
+	 * Serializes the writers of the attributes cache. The readers don't
+	 * take it.
+	 */
+	pthread_mutex_t cache_lock;
+	
+	/**
+	 * Serializes the rebuilds of the tag catalog
+	 */
+	pthread_mutex_t catalog_lock;
+	
+	/**
+	 * Global generation counter, incremented on each tag modification
+	 */
+	volatile unsigned long generation;
+	
+	/**
+	 * Modification time of the database when we opened it, or when we
+	 * last saw another process writing it. This is the modification time
+	 * reported for tags we didn't see changing.
+	 */
+	volatile time_t base_mtime;
+	
+	/**
+	 * Time of the last modification done through this handle
+	 */
+	volatile time_t last_mtime;
+	
+	/**
+	 * Generation stamps of the tags modified since we opened the database,
+	 * hashed by the tag name
+	 */
+	tag_gen_t tag_gens[TAG_GEN_BUCKETS];
+	
+	/**
+	 * Cached attributes for the virtual directories, keyed by path and query.
+	 * The readers use the current version from an epoch read section.
+	 */
+	attr_cache_t * volatile attr_cache;
+	
+	/**
+	 * The foreign_gen the entries of the attributes cache were counted at
+	 */
+	volatile unsigned long attr_fgen;
+	
+	/**
+	 * Publishes an empty attributes cache.
+	 */
+	void drop_attr_cache();
+	
+	/**
+	 * The current version of the tag catalog, or NULL if it wasn't read yet
+	 */
+	tag_catalog_t * volatile catalog;
+	
+	/**
+	 * Read only descriptor of the database file, for its change counter
+	 */
+	int counter_fd;
+	
+	/**
+	 * The index as it was at the last clean close, mapped from the disk
+	 */
+	IndexSnapshot snapshot;
+	
+	/**
+	 * path to the snapshot file
+	 */
+	string snap_path;
+	
+	/**
+	 * The ids in our tags table of the dictionary entries, and the way back
+	 */
+	boost::unordered_map<dict_id_t, int> tag_ids;
+	boost::unordered_map<int, dict_id_t> tag_dict_ids;
+	pthread_mutex_t tag_ids_lock;
+	
+	/**
+	 * Change counter of the database when we last looked, and the
+	 * transactions we committed since then
+	 */
+	unsigned int seen_counter;
+	volatile unsigned int own_commits;
+	pthread_mutex_t counter_lock;
+	
+	/**
+	 * Incremented when another process wrote the database or one of our
+	 * transactions was rolled back: the rows we cached may be gone
+	 */
+	volatile unsigned long foreign_gen;
+	
+	/**
+	 * The foreign_gen the caches of the tag ids and of the directories
+	 * were filled at
+	 */
+	unsigned long tag_ids_gen;
+	unsigned long dirs_gen;
+	
+	/**
+	 * The rows of the dirs table we've read, by id and by parent and name,
+	 * and the paths built from them for the listings. The lock is never
+	 * held while the database is used.
+	 */
+	boost::unordered_map<long long, dir_node_t> dir_nodes;
+	boost::unordered_map<string, long long> dir_ids;
+	boost::unordered_map<long long, string> dir_paths;
+	pthread_mutex_t dirs_lock;
+	/** incremented when the cache of the directories is emptied */
+	unsigned long dirs_moved;
+	
+	/**
+	 * Held from the start to the end of a transaction. The threads share
+	 * the connection, so without it the statements of one would run in
+	 * the transaction of another, and a second BEGIN would fail. A thread
+	 * that starts a transaction inside its own joins it; trans_depth
+	 * counts them, and trans_failed is set when an inner one is rolled
+	 * back (our SQLite has no savepoints), so the outer one is too.
+	 */
+	pthread_mutex_t trans_lock;
+	int trans_depth;
+	int trans_failed;
+	
+	/**
+	 * Our own changes and the foreign_gen when the statistics were last
+	 * gathered; the changes are -1 before the first maintenance run
+	 */
+	int analyze_changes;
+	unsigned long analyze_gen;
+	
+	/**
+	 * Returns the integer value of a pragma, or -1.
+	 */
+	long pragma_value(const char *pragma);
+	
+	/**
+	 * Takes trans_lock and starts a transaction with the given statement
+	 * ("BEGIN" or "BEGIN IMMEDIATE"), unless this thread has one open.
+	 */
+	int trans_begin(const char *begin);
+	
+	/**
+	 * Gives the free pages back, a few at a time. A database made without
+	 * incremental vacuum is left to db_convert_vacuum().
+	 */
+	int vacuum_step(maint_stats_t *stats);
+	
+	/**
+	 * Gathers the statistics of the planner again, if enough changed.
+	 */
+	int analyze_step(maint_stats_t *stats);
 	
 public:
 	
@@ -121,10 +721,113 @@ public:
 	int db_init_storage();
 	
 	/**
-	 * Closes the database.
+	 * Closes the database. The snapshot is written first, if the database
+	 * changed since the last one.
 	 */
 	void db_close_storage();
 	
+	/**
+	 * Writes a snapshot of the tags, the associations and the files, which
+	 * the next mount maps instead of reading the tables. Nothing is written
+	 * if the snapshot on the disk is up to date.
+	 * 
+	 * @return Returns 0 on success, -1 on error.
+	 */
+	int db_write_snapshot();
+	
+	/**
+	 * Starts an export: copies the database file under a read lock, so
+	 * the copy is the database as it is at one moment. The lock is kept
+	 * until db_export_end(); the shards of a branch are all locked
+	 * before any of them is released, so their copies are taken at the
+	 * same moment.
+	 * 
+	 * @return Returns 0 on success, -1 on error. Only after a success must
+	 * db_export_end() be called.
+	 */
+	int db_export_begin();
+	
+	/**
+	 * Lets the writers in again, after db_export_begin().
+	 */
+	void db_export_end();
+	
+	/**
+	 * Removes the copy of db_export_begin(), if db_export() won't read it.
+	 */
+	void db_export_drop();
+	
+	/**
+	 * Writes the tags, the files and their associations of this shard to
+	 * a stream, from the copy made by db_export_begin(), and removes the
+	 * copy. No lock is held meanwhile, however long the stream takes.
+	 * The header and the end record are written by the caller, once for
+	 * all the shards.
+	 * 
+	 * @param w The stream, see tag_export.hpp for the format.
+	 * @param shard The number of this shard, to keep its tag ids apart
+	 * from the ones of the others in the stream.
+	 * @param nshards The number of shards of the branch.
+	 * @param stats What was written is added here.
+	 * @return Returns 0 on success, -1 on error.
+	 */
+	int db_export(ExportWriter *w, int shard, int nshards,
+	              export_stats_t *stats);
+	
+	/**
+	 * Adds the tags from an export stream to the files of this shard, in
+	 * transactions of IMPORT_BATCH files, so the branch can stay mounted.
+	 * The files are found by their path in the
+	 * branch, so they may have other inodes than in the stream; the ones
+	 * that are missing are skipped and so are the ones of the other
+	 * shards. The tags the files already have are kept.
+	 * 
+	 * @param in The stream.
+	 * @param shard The number of this shard.
+	 * @param nshards The number of shards of the branch.
+	 * @param stats What was read and imported. Only the first shard counts
+	 * the missing files.
+	 * @return Returns 0 on success, -1 on error, in which case the
+	 * batches written before stay. Importing the stream again is safe.
+	 */
+	int db_import(FILE *in, int shard, int nshards, export_stats_t *stats);
+	
+	/**
+	 * Sets the size of the page cache of the database.
+	 * 
+	 * @param bytes The memory the cache can use.
+	 * @return Returns the size of the cache in pages, or -1 on error.
+	 */
+	long db_set_cache(long bytes);
+	
+	/**
+	 * Runs the maintenance of the database: the incremental vacuum and
+	 * the statistics of the planner. It does nothing while a transaction
+	 * is open, and no transaction starts until it is done.
+	 * 
+	 * @param stats What was done.
+	 * @return Returns 0 on success, 1 if the database was busy and -1 on
+	 * error.
+	 */
+	int db_maintain(maint_stats_t *stats);
+	
+	/**
+	 * Rebuilds a database made without incremental vacuum, once it has
+	 * MAINT_CONVERT_PAGES free pages, so the maintenance can give them
+	 * back. The rebuild locks the database for as long as it copies it:
+	 * call it at mount time, before the file system serves anybody.
+	 * 
+	 * @return Returns 0 on success or when there was nothing to do, -1 on
+	 * error.
+	 */
+	int db_convert_vacuum();
+	
+	/**
+	 * Returns the descriptor of the branch directory, or -1 if it could
+	 * not be opened.
+	 */
+	int db_get_dirfd() { return dir_fd; }
+	
 	/**
 	 * Adds the file information for a list of tags in the main db.
 	 * 
@@ -140,6 +843,79 @@ public:
 	 */
 	int db_add_file_info(vector<string> *tags, file_info_t * finfo, int exist);
 	
+	/**
+	 * Adds the information and the tags for a batch of files, in a single
+	 * transaction. A file that fails is skipped, the others are kept.
+	 * 
+	 * @param files The files and the tags for each of them; the ones that
+	 * were not committed get their 'failed' set.
+	 * @return Returns the number of files that could not be added, or -1 if
+	 * the transaction failed.
+	 */
+	int db_add_files_info(vector<tagged_file_t> *files);
+	
+	/**
+	 * Returns the tags of a file as tag:value strings, or only the tag
+	 * when it has no value.
+	 * 
+	 * @param ino The inode of the file.
+	 * @param tags The vector where the tags are added.
+	 * @return Returns 0 on success, -1 on error.
+	 */
+	int db_get_file_tag_pairs(long long ino, vector<string> *tags);
+	
+	/**
+	 * Gives to a copy of a file the tags of the original. The tags the copy
+	 * had before are removed. When the original is in the same DB, the
+	 * associations are copied by tag_id, without reading them out.
+	 * \par
+	 * It doesn't start a transaction, so many copies can go in one: call it
+	 * between db_begin_transaction() and db_end_transaction().
+	 * 
+	 * @param src_ino The inode of the original.
+	 * @param src_db The DB of the original; it can be this one.
+	 * @param finfo The relative path, mode and inode of the copy.
+	 * @return Returns 0 on success, -1 on error.
+	 */
+	int db_copy_file_tags(long long src_ino, DbBackend *src_db, file_info_t *finfo);
+	
+	/**
+	 * Loads the fingerprints stored by a module for the files that are
+	 * still in the DB.
+	 * 
+	 * @param module The type of the module that stored them.
+	 * @param fps The map where they are added, by inode.
+	 * @return Returns 0 on success, -1 on error.
+	 */
+	int db_get_fingerprints(int module, fprint_map_t *fps);
+	
+	/**
+	 * Records the directories whose files were all indexed by a run that
+	 * started from 'root', in a single transaction.
+	 * 
+	 * @param root The directory the run started from.
+	 * @param dirs The directories finished since the last call.
+	 * @return Returns 0 on success, -1 on error.
+	 */
+	int db_checkpoint_add(const char *root, vector<string> *dirs);
+	
+	/**
+	 * Loads the directories already indexed by an unfinished run.
+	 * 
+	 * @param root The directory the run started from.
+	 * @param dirs The set where the directories are added.
+	 * @return Returns 0 on success, -1 on error.
+	 */
+	int db_checkpoint_load(const char *root, set<string> *dirs);
+	
+	/**
+	 * Forgets the checkpoint of a run, once it finished.
+	 * 
+	 * @param root The directory the run started from.
+	 * @return Returns 0 on success, -1 on error.
+	 */
+	int db_checkpoint_clear(const char *root);
+	
 	/**
 	 * Deletes the records from the DB for the file with the absolute path "abspath".
 	 * 
@@ -147,6 +923,14 @@ public:
 	 */
 	int db_delete_file_info(const char *abspath);
 	
+	/**
+	 * Deletes the records for all the files from the vector, in a single
+	 * transaction.
+	 * 
+	 * @param paths The relative file paths.
+	 */
+	int db_delete_files_info(vector<string> *paths);
+	
 	/**
 	 * Deletes the tag for this file, from the db. If a value is specified, then is
 	 * replaced with null in the BD. This means I delete the value for this tag.
@@ -175,7 +959,24 @@ public:
 	int db_update_file_tags(vector<string> *new_tags, file_info_t *finfo, int exist);
 	
 	/**
-	 * Updates the file path from the db, in the case of a rename
+	 * Applies tag operations to all the files that match a query, in a
+	 * single transaction. Each tag is one statement over the whole set of
+	 * files, whatever their number.
+	 * 
+	 * @param query The SQL query built from the source path. If it is NULL,
+	 * the files are all the ones under the path.
+	 * @param path The real path that restricts the query. It can be NULL.
+	 * @param ops The tag operations, in the order they are applied.
+	 * @param files The files that matched, as they were before the change.
+	 * @return Returns the number of files that matched, or -1 on error.
+	 */
+	long db_retag_files(string *query, string *path, vector<tags_op_t> *ops,
+	                    vector<new_file_info_t> *files);
+	
+	/**
+	 * Updates the file path from the db, in the case of a rename. When
+	 * 'from' is a directory, only its row changes and the files under it
+	 * follow.
 	 */
 	int update_file_path(const char *from, const char *to);
 	
@@ -233,7 +1034,49 @@ public:
 	int get_file_names(string *query, string *path, vector<new_file_info_t> *files);
 	
 	/**
-	 * This starts a transation on the DB.
+	 * Returns at most 'limit' files, in the order of their inode number,
+	 * starting after the inode 'ino'. This is used to walk the files table
+	 * a piece at a time.
+	 */
+	int db_get_files_after(long long ino, int limit, vector<new_file_info_t> *files);
+	
+	/**
+	 * Returns the attributes of the virtual directory given by a query: the
+	 * number of files that match it and the last modification time of any tag
+	 * involved. The number of entries is cached and it's recomputed only when
+	 * one of the tags changes.
+	 * 
+	 * @param query The SQL query built from the path.
+	 * @param query_key The key of the query, as PathCrawler gives it. The
+	 * query isn't cached when it is empty.
+	 * @param tags The tags from the query.
+	 * @param path The real path that restricts the query. It can be NULL.
+	 * @param nentries The number of files from the virtual directory.
+	 * @param mtime The modification time of the virtual directory.
+	 */
+	int db_get_query_attr(string *query, string *query_key,
+	                      vector<tag_info_t> *tags, string *path,
+	                      long *nentries, time_t *mtime);
+	
+	/**
+	 * Lists all the tags and the tag:value pairs from the database, as
+	 * db_get_tags() and db_get_tags_values() do for a NULL path, but from a
+	 * snapshot. Only one thread reads the database again when the snapshot
+	 * is out of date; the others list the old version meanwhile.
+	 * 
+	 * @param buf The buffer that will be filled with the names.
+	 * @param filler The function that will fill the names in the buffer.
+	 */
+	int db_list_catalog(void *buf, filler_t filler);
+	
+	/**
+	 * This starts a transation on the DB. The other threads wait until it
+	 * ends to start theirs; inside a transaction of the same thread, it
+	 * becomes part of it, and rolling it back makes the outer
+	 * db_end_transaction() roll back everything and fail.
+	 * 
+	 * @return Returns 0 on success, -1 on error. Only after a success must
+	 * db_rollback() or db_end_transaction() be called.
 	 */
 	int db_begin_transaction();
 	
@@ -243,7 +1086,8 @@ public:
 	int db_rollback();
 	
 	/**
-	 * This commits a transaction.
+	 * This commits a transaction. A commit that fails is rolled back, so
+	 * there's no need for db_rollback() afterwards.
 	 */
 	int db_end_transaction();
 };
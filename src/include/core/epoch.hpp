@@ -0,0 +1,80 @@
+/*
+ epoch.hpp - Epoch based reclamation for the lock-free readers
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef EPOCH_HPP_
+#define EPOCH_HPP_
+
+/**
+ * Maximum number of threads that can be in a read section at the same time.
+ */
+#ifndef EPOCH_MAX_THREADS
+#define EPOCH_MAX_THREADS 256
+#endif
+
+/**
+ * Publishes a new version of a shared structure. The readers that pinned the
+ * epoch before this keep seeing the old version, which must be retired with
+ * epoch_retire() and not freed directly.
+ */
+#define EPOCH_PUBLISH(ptr, val) \
+	do { \
+		__sync_synchronize(); \
+		(ptr) = (val); \
+		__sync_synchronize(); \
+	} while (0)
+
+namespace hybfs {
+
+/**
+ * Function that destroys a retired version of a structure.
+ */
+typedef void (*epoch_destroy_t)(void *ptr);
+
+/**
+ * @brief Enters a read section: the versions that the current thread can see
+ * from now on won't be freed until it calls epoch_exit(). This takes no lock
+ * and it can be nested.
+ */
+void epoch_enter();
+
+/**
+ * @brief Exits a read section.
+ */
+void epoch_exit();
+
+/**
+ * @brief Retires a version that is not published anymore. It will be
+ * destroyed when all the readers that could still see it have exited their
+ * read sections.
+ *
+ * @param[in] ptr The old version.
+ * @param[in] destroy The function that frees it.
+ */
+void epoch_retire(void *ptr, epoch_destroy_t destroy);
+
+/**
+ * @brief Destroys the retired versions that nobody can see anymore.
+ */
+void epoch_reclaim();
+
+/**
+ * @class EpochGuard
+ * @brief Keeps the current thread in a read section for as long as it lives.
+ */
+class EpochGuard {
+public:
+	EpochGuard() { epoch_enter(); }
+	~EpochGuard() { epoch_exit(); }
+};
+
+}
+
+#endif /*EPOCH_HPP_*/
@@ -0,0 +1,70 @@
+/*
+ hot_paths.hpp - Tells the indexer which real paths are being used
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef HOT_PATHS_HPP_
+#define HOT_PATHS_HPP_
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Name of the socket where the indexer listens for the hot paths of a branch,
+ * in the METADIR directory of the branch. The indexer makes it readable and
+ * writable by its owner only, so nobody else can feed it paths or listen in
+ * its place.
+ */
+#ifndef HOT_SOCKET
+#define HOT_SOCKET "hot_paths"
+#endif
+
+/**
+ * Types of the messages. A message is the type followed by the absolute path,
+ * without the terminating zero.
+ */
+#define HOT_FILE	'f'
+#define HOT_DIR		'd'
+
+namespace hybfs {
+
+/**
+ * Creates the socket used to send the hot paths.
+ * @return Returns 0 for success, -1 otherwise.
+ */
+int hot_init();
+
+/**
+ * Closes the socket.
+ */
+void hot_close();
+
+/**
+ * Tells the indexer that a real path was used. It never blocks, and the
+ * message is lost if nobody listens or the indexer is behind.
+ * 
+ * @param type HOT_FILE for an opened file, HOT_DIR for a listed directory.
+ * @param dir The path of the branch.
+ * @param relpath The path relative to the branch, "." for the branch itself.
+ */
+void hot_notify(char type, const char *dir, const char *relpath);
+
+/**
+ * Fills in the address of the hot paths socket of a branch.
+ * 
+ * @param dir The path of the branch.
+ * @param addr The address.
+ * @param len Its length.
+ * @return Returns 0 for success, -1 if the path is too long for a socket.
+ */
+int hot_socket_addr(const char *dir, struct sockaddr_un *addr, socklen_t *len);
+
+}
+
+#endif /*HOT_PATHS_HPP_*/
@@ -15,14 +15,33 @@
 #include <vector>
 #include <string>
 
+#include <pthread.h>
+
 #include "hybfsdef.h"
+#include "epoch.hpp"
 #include "path_crawler.hpp"
 #include "virtualdir.hpp"
+#include "reconciler.hpp"
+#include "root_cache.hpp"
+#include "maintainer.hpp"
 
 namespace hybfs {
 
 using namespace std;
 
+/**
+ * A branch: the real directory and the database handle for it.
+ */
+typedef struct {
+	string path;
+	VirtualDirectory *vdir;
+} branch_t;
+
+/**
+ * A version of the branch list. It's never changed after it was published.
+ */
+typedef vector<branch_t *> branch_list_t;
+
 /**
  * @class HybfsData
  * @brief
@@ -36,13 +55,42 @@ private:
 	 */
 	char *mountp;
 	/**
-	 *  Branch paths 
+	 *  The current version of the branch list. The readers use it without
+	 *  any lock, from an epoch read section.
+	 */
+	branch_list_t * volatile branches;
+	/**
+	 *  Serializes the changes of the branch list
+	 */
+	pthread_mutex_t branch_lock;
+	/**
+	 *  Removes the stale entries from the databases, in background
+	 */
+	Reconciler *reconciler;
+	/**
+	 *  Attributes of the root, kept up to date by watching the branches
+	 */
+	RootCache *root_cache;
+	/**
+	 *  Vacuums and analyzes the databases when we are idle
 	 */
-	vector <string> branches;
+	Maintainer *maintainer;
 	/**
-	 *  Database handle for each branch 
+	 *  Number of shards for the branches that have no metadata yet; 0
+	 *  gives them one
 	 */
-	vector<VirtualDirectory *> vdirs;
+	int nshards;
+
+	/**
+	 * Publishes a new version of the branch list and retires the old one.
+	 * The branch_lock must be held.
+	 */
+	void publish_branches(branch_list_t *list);
+	
+	/**
+	 * Sets the paths watched by the root cache. The branch_lock must be held.
+	 */
+	void update_root_cache();
 
 public:
 	HybfsData(char *mountp);
@@ -64,14 +112,21 @@ public:
 	int parse_branches(const char *arg);
 	
 	/**
-	 * Returns the branch path
+	 * Returns the branch path. If the branches can change, the caller
+	 * must be in an epoch read section for as long as it uses the path.
 	 */
 	const char * get_branch_path(int brid);
 	
+	/**
+	 * Returns the O_PATH descriptor of the branch directory, or -1. The
+	 * caller must be in an epoch read section for as long as it uses it.
+	 */
+	int get_branch_fd(int brid);
+	
 	/**
 	 * Returns the number of branches
 	 */
-	int get_nbranches() { return branches.size(); }
+	int get_nbranches() { EpochGuard guard; return branches->size(); }
 	
 	/** 
 	 * Starts the databases
@@ -79,10 +134,49 @@ public:
 	int start_db_storage();
 	
 	/**
-	 * Get the number of links from under us
+	 * Sets the number of databases the metadata of a new branch is split
+	 * into. The branches that have metadata keep what they have.
+	 */
+	void set_shards(int n) { nshards = n; }
+	
+	/**
+	 * Starts the background threads. This must be called after fuse
+	 * detached from the terminal, from the init operation.
+	 */
+	int start_workers();
+	
+	/**
+	 * Stops the background threads.
+	 */
+	void stop_workers();
+	
+	/**
+	 * Sets the memory that the page caches of all the databases can use.
+	 */
+	void set_mem_budget(long bytes) { maintainer->set_budget(bytes); }
+	
+	/**
+	 * Sets the memory the page cache of the DB of the branch with id brid
+	 * can use.
+	 */
+	long virtual_set_cache(int brid, long bytes);
+	
+	/**
+	 * Runs the maintenance of the DB of the branch with id brid. Returns
+	 * 0 for success, 1 if the DB was busy and a negative value otherwise.
+	 */
+	int virtual_maintain(int brid, maint_stats_t *stats);
+	
+	/**
+	 * Get the number of links from under us. This is cached.
 	 */
 	int get_nlinks();
 	
+	/**
+	 * Get the attributes of the mount root. This is cached.
+	 */
+	void get_root_stat(stat_t *st);
+	
 	/**
 	 * virtual readdir that lists the tags and tag-value pairs that are
 	 * associated with the real path - this includes the root dir also.
@@ -94,21 +188,44 @@ public:
 	 */
 	int virtual_readdir(const char * query, void *buf, filler_t filler);
 	
+	/**
+	 * virtual getattr for a query: the number of entries and the modification
+	 * time are gathered from all the branches
+	 */
+	int virtual_getattr(const char * query, stat_t *st);
+	
 	/**
 	 * Removes all info related to a file specified by path, from the DB
 	 * coresponding to the branch with id brid 
 	 */
 	int virtual_remove_file(const char *path, int brid);
 	
+	/**
+	 * Queues a path that was found missing from the branch with id brid,
+	 * so that its info is removed from the DB in background.
+	 */
+	void queue_stale_file(const char *path, int brid);
+	
+	/**
+	 * Removes the info for the paths that are still missing from the
+	 * branch with id brid, in a single transaction.
+	 */
+	int virtual_remove_stale(vector<string> *paths, int brid);
+	
+	/**
+	 * Checks the next 'max' files from the DB of the branch with id brid
+	 * and returns the paths of the missing ones.
+	 */
+	int virtual_sweep(long long *cursor, int max, vector<string> *stale,
+	                  int brid);
+	
 	/**
 	 * Adds a tag for this path to the corresponding db. The path is relative
-	 * and it will be changed to absolute here.
+	 * and the file is looked up relative to the branch directory.
 	 */
-	int virtual_addtag(PathCrawler *pc, const char *path, 
-	                   const char *abspath, int brid);
+	int virtual_addtag(PathCrawler *pc, const char *path, int brid);
 	
-	int virtual_updatetags(PathCrawler *from, const char *path, 
-	                       const char *abspath, int brid);
+	int virtual_updatetags(PathCrawler *from, const char *path, int brid);
 	
 	/**
 	 * This is a sort of rename/move but for tags or complex query. 
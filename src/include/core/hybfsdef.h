@@ -27,6 +27,8 @@
  *  mount options keys 
  */
 #define KEY_HELP 0
+#define KEY_MEM_BUDGET 1
+#define KEY_SHARDS 2
 
 /**
  *  virtual directory for showing what is underneath us 
@@ -38,6 +40,14 @@
  */
 #define NULL_VALUE "null"
 
+/**
+ * The relative path of a file, in the SQL queries. The files table keeps the
+ * directory and the name of the file. The path column is a fallback from
+ * before the table of the directories: it's never read when dir_id is set,
+ * the new rows leave it empty and a directory rename doesn't touch it.
+ */
+#define FILE_PATH "hybfs_path(files.dir_id, files.name, files.path)"
+
 /**
  * Define the types of operations on tags - this is useful when we want to
  * update the tags from the DB and we decide to remove, add or replace them
@@ -80,12 +90,17 @@ typedef struct
 } file_info_t;
 
 /**
- * structure that holds info about a tag. I use strings for now, but it's not good
+ * structure that holds info about a tag of a query, as ids of the tag
+ * dictionary: its strings are the ones of the entry. The ids are 0 only
+ * when the dictionary is full.
  */
 typedef struct tag_info_t
 {
-	std::string tag;
-	std::string value;
+	/** id of the tag name */
+	unsigned int name;
+	/** id of the tag as the query gives it: the tag:value pair, or the
+	 *  tag name when there is no value */
+	unsigned int id;
 } tag_info_t;
 
 /* for debugging */
@@ -0,0 +1,167 @@
+/*
+ maintainer.hpp - Background maintenance of the branch databases
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef MAINTAINER_HPP_
+#define MAINTAINER_HPP_
+
+#include <pthread.h>
+#include <time.h>
+
+#include "hybfsdef.h"
+#include "db_backend.hpp"
+
+/**
+ * Minimum number of seconds between two maintenance runs.
+ */
+#ifndef MAINT_INTERVAL
+#define MAINT_INTERVAL 900
+#endif
+
+/**
+ * Seconds without any query or tag change before the maintenance runs.
+ */
+#ifndef MAINT_IDLE
+#define MAINT_IDLE 60
+#endif
+
+/**
+ * Name of the file with the schedule and the results of the last run, in the
+ * METADIR directory of each branch.
+ */
+#ifndef MAINT_STATUS_FILE
+#define MAINT_STATUS_FILE "maintenance"
+#endif
+
+namespace hybfs {
+
+class HybfsData;
+
+/**
+ * The queries answered between two maintenance runs and their total time.
+ */
+typedef struct {
+	unsigned long count;
+	unsigned long long usec;
+} query_window_t;
+
+/**
+ * @class Maintainer
+ * @brief Keeps the branch databases in shape while the file system is idle.
+ * \par
+ * When nothing was asked of us for MAINT_IDLE seconds, and at most once in
+ * MAINT_INTERVAL seconds, the free pages of each database are given back to
+ * the file system and the statistics of the planner are gathered again if
+ * enough rows changed. The page caches of the databases share the memory
+ * budget given at mount time. What was done is written in the status file
+ * of each branch, with the query latency before this run and before the
+ * previous one.
+ */
+class Maintainer {
+private:
+	/**
+	 * The file system data, for access to the branches
+	 */
+	HybfsData *data;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/**
+	 * Set while the worker thread is running
+	 */
+	int running;
+
+	/**
+	 * The memory of all the page caches, in bytes; 0 leaves them alone
+	 */
+	long mem_budget;
+
+	/**
+	 * When we were last asked something
+	 */
+	volatile time_t last_busy;
+
+	/**
+	 * The queries since the last run, and the ones before it and before
+	 * the previous one
+	 */
+	query_window_t window;
+	query_window_t last_window;
+	query_window_t prev_window;
+
+	/**
+	 * When the last run happened and when the next one is due
+	 */
+	time_t last_run;
+	time_t next_run;
+
+	static void *worker(void *arg);
+
+	/**
+	 * The worker thread loop
+	 */
+	void run();
+
+	/**
+	 * Shares the memory budget between the branches.
+	 */
+	void set_caches();
+
+	/**
+	 * Runs the maintenance of all the branches.
+	 */
+	void maintain();
+
+	/**
+	 * Writes the status file of a branch.
+	 */
+	void write_status(int brid, int result, maint_stats_t *stats);
+
+public:
+	Maintainer(HybfsData *data);
+	~Maintainer();
+
+	/**
+	 * @brief Starts the worker thread.
+	 * @return Returns 0 for success and -1 otherwise.
+	 */
+	int start();
+
+	/**
+	 * @brief Stops the worker thread.
+	 */
+	void stop();
+
+	/**
+	 * @brief Sets the memory that the page caches of the databases can
+	 * use together. It's used from the next run on.
+	 *
+	 * @param[in] bytes The budget, or 0 for the SQLite default.
+	 */
+	void set_budget(long bytes);
+
+	/**
+	 * @brief Notes that the file system is in use; the maintenance waits.
+	 */
+	void note_busy() { last_busy = time(NULL); }
+
+	/**
+	 * @brief Notes a query and the time it took.
+	 *
+	 * @param[in] usec The duration of the query, in microseconds.
+	 */
+	void note_query(long usec);
+};
+
+}
+
+#endif /*MAINTAINER_HPP_*/
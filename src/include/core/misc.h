@@ -14,9 +14,16 @@
 
 #include <string>
 
+#include <fcntl.h>
+
 #include "core/hybfs_data.hpp"
 #include "core/path_crawler.hpp"
 
+/* kernels older than 2.6.39 don't know O_PATH; a read only fd does the job */
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+
 namespace hybfs {
 
 /**
@@ -36,15 +43,19 @@ std::string* extract_real_path(const char *path, PathCrawler *pc);
 std::string * make_absolute(const char *relpath);
 
 /**
- * Transforms the relative path to the real one, so it can be used in ops from the
- * undelying fs. This implies a search in our branches, to see which one of them
- * has the path.
+ * Finds the branch that has the path, so it can be used in the *at ops from the
+ * underlying fs. This implies a search in our branches, to see which one of them
+ * has the path. The caller must be in an epoch read section for as long as it
+ * uses the descriptor.
  * @param hybfs_core the HybFS data class that holds information about branches and dbs
  * @param path the relative path to our mount point
  * @param brid the branch id of our path
- * @ret the absolute path. It must be deleted after using it.
+ * @param relpath the path relative to the branch directory. It points inside
+ * 'path', or to "." for the branch directory itself.
+ * @ret the descriptor of the branch directory, or -1 if there is no branch.
  */
-std::string * resolve_path(HybfsData *hybfs_core, const char *path, int *brid);
+int resolve_fd(HybfsData *hybfs_core, const char *path, int *brid,
+               const char **relpath);
 
 /**
  * Breaks the tag:value pair in two separate strings: one for the tag, and the other one
@@ -72,6 +83,17 @@ int parse_tags(std::string *query, vector<std::string> *tags, int *op_type);
  */
 extern int get_stat(const char *path, stat_t *buf);
 
+/**
+ * Same as get_stat, but for a path relative to the directory dirfd.
+ */
+extern int get_stat_at(int dirfd, const char *path, stat_t *buf);
+
 extern void fill_dummy_stat(stat_t *st);
 
+/**
+ * Fills the stat structure for a virtual directory with nentries files, that
+ * was last modified at mtime.
+ */
+extern void fill_vdir_stat(stat_t *st, long nentries, time_t mtime);
+
 #endif /*MISC_H_*/
@@ -138,8 +138,14 @@ public:
 	 * @brief
 	 * This builds an SQL query from all the queries specified in this path.
 	 * It returns the query to be processed.
-	 */
-	std::string *db_build_sql_query(vector<tag_info_t> *tags);
+	 *
+	 * @param tags If not NULL, gets the tags of the query.
+	 * @param key If not NULL, gets the query written with the dictionary
+	 * ids of its tags, to find it in the caches; it is empty if a tag has
+	 * no id.
+	 */
+	std::string *db_build_sql_query(vector<tag_info_t> *tags,
+	                                string *key = NULL);
 };
 
 }
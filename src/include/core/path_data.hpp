@@ -41,16 +41,29 @@ private:
 	std::string *relpath;
 	/**
 	 * @brief
-	 * The real path from the underlying file system
+	 * The descriptor of the branch directory
 	 */
-	std::string *abspath;
+	int dirfd;
+	/**
+	 * @brief
+	 * The path relative to the branch directory, for the *at calls. It
+	 * points inside relpath.
+	 */
+	const char *fdpath;
+	/**
+	 * @brief
+	 * Set if we are in an epoch read section, which keeps dirfd open
+	 */
+	int pinned;
 		
 public:
 	
 	PathData(const char *path, HybfsData *hybfs_core, PathCrawler *pc)
 	{
 		relpath = NULL;
-		abspath = NULL;
+		dirfd = -1;
+		fdpath = NULL;
+		pinned = 0;
 		
 		if(pc == NULL || path == NULL || hybfs_core == NULL) {
 			PRINT_ERROR("%s:%d : Null argument!\n", __func__, __LINE__);
@@ -65,39 +78,48 @@ public:
 		if(relpath == NULL) {
 			return;
 		}
-			
-		abspath = resolve_path(hybfs_core, relpath->c_str(), &brid);
+		
+		/* the branch can't go away while we use its descriptor */
+		epoch_enter();
+		pinned = 1;
+		dirfd = resolve_fd(hybfs_core, relpath->c_str(), &brid, &fdpath);
 	}
 	
 	~PathData()
 	{
 		if(relpath != NULL)
 			delete relpath;
-		if(abspath != NULL)
-			delete abspath;
+		if(pinned)
+			epoch_exit();
 	}
 	
 	/**
 	 * @brief
 	 * Checks if this class contains valid path data. This checks only if the
-	 *  paths are not null.
+	 *  path is not null and there is a branch for it.
 	 * @return Returns 1 if the path is valid (it may represent a real path)
 	 * and 0 otherwise.
 	 */
 	int check_path_data()
 	{
-		return ( (relpath == NULL || abspath == NULL) ? 0 : 1);
+		return ( (relpath == NULL || dirfd == -1) ? 0 : 1);
 	}
 	
 	/**
-	 * @brief Returns the absolute path as a char pointer. It must not be freed.
+	 * @brief Returns the relative path as a char pointer. It must not be freed.
 	 */
-	const char * abspath_str() { return (abspath) ? abspath->c_str() : NULL; }
+	const char * relpath_str() { return (relpath) ? relpath->c_str() : NULL; }
 	
 	/**
-	 * @brief Returns the relative path as a char pointer. It must not be freed.
+	 * @brief Returns the descriptor of the branch directory.
 	 */
-	const char * relpath_str() { return (relpath) ? relpath->c_str() : NULL; }
+	int	     get_dirfd()   { return dirfd; }
+	
+	/**
+	 * @brief Returns the path relative to the branch directory, to be used
+	 * with get_dirfd() in the *at calls. It must not be freed.
+	 */
+	const char * fdpath_str()  { return fdpath; }
 	
 	/**
 	 * @brief Returns the branch identifier.
@@ -0,0 +1,151 @@
+/*
+ reconciler.hpp - Background removal of the stale entries from the databases
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef RECONCILER_HPP_
+#define RECONCILER_HPP_
+
+#include <pthread.h>
+#include <time.h>
+
+#include <string>
+#include <list>
+#include <set>
+#include <vector>
+
+#include "hybfsdef.h"
+
+/**
+ * Maximum number of stale paths removed in a single transaction.
+ */
+#ifndef RECONCILE_BATCH
+#define RECONCILE_BATCH 256
+#endif
+
+/**
+ * Seconds between two steps of the periodic sweep.
+ */
+#ifndef SWEEP_INTERVAL
+#define SWEEP_INTERVAL 5
+#endif
+
+/**
+ * Maximum number of files checked by a single sweep step, for each branch.
+ */
+#ifndef SWEEP_BATCH
+#define SWEEP_BATCH 128
+#endif
+
+namespace hybfs {
+
+using namespace std;
+
+class HybfsData;
+
+/**
+ * A path that may not exist anymore in the branch with the id brid.
+ */
+typedef struct {
+	int brid;
+	string path;
+} stale_entry_t;
+
+/**
+ * @class Reconciler
+ * @brief Removes from the databases the files that were deleted underneath us.
+ * \par
+ * The FUSE operations only queue the paths they found missing, and a
+ * background thread removes them in batches, so that the deletes (and the
+ * triggers that come with them) don't run in getattr. The same thread sweeps
+ * periodically through the files table and compares it with the branch
+ * contents, a few files at a time.
+ */
+class Reconciler {
+private:
+	/**
+	 * The file system data, for access to the branches
+	 */
+	HybfsData *data;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/**
+	 * Set while the worker thread is running
+	 */
+	int running;
+
+	/**
+	 * The paths waiting to be checked and removed
+	 */
+	list<stale_entry_t> pending;
+
+	/**
+	 * The same paths, so that they are not queued twice
+	 */
+	set<string> queued;
+
+	/**
+	 * The last inode checked by the sweep, for each branch
+	 */
+	vector<long long> cursors;
+
+	/**
+	 * When the next sweep step is due
+	 */
+	time_t next_sweep;
+
+	static void *worker(void *arg);
+
+	/**
+	 * The worker thread loop
+	 */
+	void run();
+
+	/**
+	 * Removes at most RECONCILE_BATCH pending paths from the databases.
+	 */
+	void flush();
+
+	/**
+	 * Checks the next SWEEP_BATCH files from each branch and queues the
+	 * ones that are missing.
+	 */
+	void sweep();
+
+public:
+	Reconciler(HybfsData *data);
+	~Reconciler();
+
+	/**
+	 * @brief Starts the worker thread.
+	 * @return Returns 0 for success and -1 otherwise.
+	 */
+	int start();
+
+	/**
+	 * @brief Stops the worker thread and removes what is still pending.
+	 */
+	void stop();
+
+	/**
+	 * @brief Queues a path that was found missing. If the worker is not
+	 * running, the path is removed right away.
+	 *
+	 * @param[in] path The relative file path.
+	 * @param[in] brid The branch identifier.
+	 */
+	void queue_stale(const char *path, int brid);
+};
+
+}
+
+#endif /*RECONCILER_HPP_*/
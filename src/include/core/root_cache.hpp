@@ -0,0 +1,147 @@
+/*
+ root_cache.hpp - Cached attributes for the mount root and the branch roots
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef ROOT_CACHE_HPP_
+#define ROOT_CACHE_HPP_
+
+#include <pthread.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "hybfsdef.h"
+
+/**
+ * Seconds for which the cached attributes are trusted when the branch roots
+ * cannot be watched with inotify.
+ */
+#ifndef ROOT_CACHE_TTL
+#define ROOT_CACHE_TTL 1
+#endif
+
+namespace hybfs {
+
+using namespace std;
+
+/**
+ * @class RootCache
+ * @brief Keeps the attributes of the mount root, computed from the branch
+ * roots.
+ * \par
+ * The attributes are refreshed only when inotify reports a change in one of
+ * the branch roots, so that a getattr on the root doesn't need any system
+ * call. If inotify is not available, the attributes expire after
+ * ROOT_CACHE_TTL seconds.
+ */
+class RootCache {
+private:
+	/**
+	 * The branch root paths
+	 */
+	vector<string> paths;
+
+	/**
+	 * The inotify watch descriptor for each branch root
+	 */
+	vector<int> wds;
+
+	pthread_mutex_t lock;
+	pthread_t thread;
+
+	/**
+	 * The inotify handle, or -1 if we don't watch the branches
+	 */
+	int inotify_fd;
+
+	/**
+	 * Pipe used to wake up the watcher thread when we stop
+	 */
+	int stop_pipe[2];
+
+	/**
+	 * Set if the cached attributes are up to date
+	 */
+	int valid;
+
+	/**
+	 * When the attributes were computed, for the TTL
+	 */
+	time_t stamp;
+
+	/**
+	 * The attributes of the mount root
+	 */
+	stat_t root_st;
+
+	/**
+	 * Sum of the link counts of the branch roots
+	 */
+	int nlinks;
+
+	static void *watcher(void *arg);
+
+	/**
+	 * The watcher thread loop: it invalidates the attributes on each event.
+	 */
+	void watch();
+
+	/**
+	 * Adds the inotify watches for all the branch roots.
+	 */
+	void add_watches();
+
+	/**
+	 * Computes the attributes again. The lock must be held.
+	 */
+	void refresh();
+
+	/**
+	 * Refreshes the attributes if they are not valid anymore. The lock
+	 * must be held.
+	 */
+	void check();
+
+public:
+	RootCache();
+	~RootCache();
+
+	/**
+	 * @brief Sets the branch roots. The cached attributes are invalidated.
+	 */
+	void set_branches(vector<string> *branches);
+
+	/**
+	 * @brief Starts watching the branch roots.
+	 * @return Returns 0 if the watcher thread started, -1 otherwise. The
+	 * cache works without it, but with a TTL.
+	 */
+	int start();
+
+	/**
+	 * @brief Stops watching the branch roots.
+	 */
+	void stop();
+
+	/**
+	 * @brief Returns the attributes of the mount root.
+	 */
+	void get_root_stat(stat_t *st);
+
+	/**
+	 * @brief Returns the sum of the link counts of the branch roots.
+	 */
+	int get_nlinks();
+};
+
+}
+
+#endif /*ROOT_CACHE_HPP_*/
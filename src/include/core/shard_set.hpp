@@ -0,0 +1,207 @@
+/*
+ shard_set.hpp - The databases that hold the metadata of a branch
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef SHARD_SET_HPP_
+#define SHARD_SET_HPP_
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include <string>
+#include <list>
+#include <vector>
+
+#include "hybfsdef.h"
+#include "db_backend.hpp"
+
+/**
+ * Name of the file with the number of shards, in the METADIR directory of the
+ * branch. A branch without it has a single database.
+ */
+#ifndef SHARDS_FILE
+#define SHARDS_FILE "shards"
+#endif
+
+/**
+ * Maximum number of shards of a branch.
+ */
+#ifndef MAX_SHARDS
+#define MAX_SHARDS 64
+#endif
+
+namespace hybfs {
+
+using namespace std;
+
+/**
+ * Work done on one shard; it returns 0 for success.
+ */
+typedef int (*shard_fn_t)(DbBackend *db, int shard, void *arg);
+
+/**
+ * The work for all the shards of a call to ShardSet::fan_out(). The last
+ * shard that is done wakes up the caller.
+ */
+typedef struct {
+	int pending;
+	pthread_cond_t done;
+} fan_out_t;
+
+/**
+ * Work queued for the worker of a shard.
+ */
+typedef struct {
+	shard_fn_t fn;
+	void *arg;
+	int ret;
+	fan_out_t *fan;
+} shard_job_t;
+
+/**
+ * A shard: its database and the work waiting for its worker thread.
+ */
+typedef struct {
+	DbBackend *db;
+	pthread_t thread;
+	list<shard_job_t *> queue;
+} shard_t;
+
+/**
+ * @class ShardSet
+ * @brief The metadata of a branch, split by inode between N databases.
+ * \par
+ * The first shard is the usual database of the branch, the others sit next
+ * to it with the shard number after the name. A file is in the shard given
+ * by the hash of its inode, so everything about a file is in a single
+ * database. The number of shards is chosen when the metadata of the branch
+ * is created and it's written in the SHARDS_FILE; a branch that has a
+ * database already keeps the number it has.
+ * \par
+ * Each shard after the first has its own thread, from start() on. A query is
+ * sent to all the shards at once and the calling thread does the work of the
+ * first one meanwhile, so a branch with a single shard runs no threads at
+ * all. Before start() the shards are queried one after the other.
+ */
+class ShardSet {
+private:
+	/**
+	 * The METADIR directory of the branch and the branch itself
+	 */
+	string meta_path;
+	string vdir_path;
+
+	vector<shard_t *> shards;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+
+	/**
+	 * Set while the worker threads are running
+	 */
+	int running;
+
+	static void *worker(void *arg);
+
+	/**
+	 * The loop of the worker of the shard with this number
+	 */
+	void run(int shard);
+
+	/**
+	 * Reads the number of shards of the branch: 0 if it was never set,
+	 * -1 if the file is damaged.
+	 */
+	int read_count();
+
+	int write_count(int count);
+
+	int add_shard(int shard);
+
+public:
+	/**
+	 * @brief Opens the first shard, which all the branches have.
+	 * @param[in] meta_path The METADIR directory of the branch.
+	 * @param[in] vdir_path The branch.
+	 */
+	ShardSet(const char *meta_path, const char *vdir_path);
+	~ShardSet();
+
+	/**
+	 * @brief Opens all the shards. Their threads are started by start().
+	 * @return Returns 0 for success and -1 otherwise.
+	 *
+	 * @param[in] nshards The number of shards for a branch that has no
+	 * metadata yet; 0 keeps what the branch has.
+	 */
+	int init(int nshards);
+
+	/**
+	 * @brief Starts the threads of the shards. A process that forks has to
+	 * call it after the fork, the threads don't survive it.
+	 * @return Returns 0 for success and -1 otherwise; the shards are then
+	 * still queried, one after the other.
+	 */
+	int start();
+
+	/**
+	 * @brief Stops the threads, after the work queued for them is done.
+	 */
+	void stop();
+
+	int size() { return shards.size(); }
+
+	DbBackend *get(int shard) { return shards[shard]->db; }
+
+	/**
+	 * @brief Returns the database of the file with this inode.
+	 */
+	DbBackend *of_ino(long long ino)
+	{
+		return shards[shard_of_ino(ino, shards.size())]->db;
+	}
+
+	/**
+	 * @brief Returns the database of the file with this path, relative to
+	 * the branch. A path that doesn't exist gives the first shard.
+	 */
+	DbBackend *of_path(const char *path);
+
+	/**
+	 * @brief Runs the function on all the shards in parallel and waits
+	 * for all of them.
+	 * @return Returns 0 if it returned 0 everywhere, -1 otherwise.
+	 *
+	 * @param[in] fn The function.
+	 * @param[in] args The argument for each shard.
+	 * @param[out] rets What it returned for each shard, or NULL.
+	 */
+	int fan_out(shard_fn_t fn, void **args, int *rets);
+
+	/**
+	 * @brief Writes the tags of all the shards to a single stream. Each
+	 * shard is exported from a copy of its database, see
+	 * DbBackend::db_export_begin(); the copies are taken while all the
+	 * shards are locked, so the stream is the branch at one moment.
+	 * @return Returns 0 on success, -1 on error.
+	 */
+	int export_tags(FILE *out, export_stats_t *stats);
+
+	/**
+	 * @brief Imports an export stream. The stream is checked first; then
+	 * each shard reads it by itself and keeps its files.
+	 * @return Returns 0 on success, -1 if a shard failed.
+	 */
+	int import_tags(const char *file, export_stats_t *stats);
+};
+
+}
+
+#endif /*SHARD_SET_HPP_*/
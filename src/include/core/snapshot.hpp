@@ -0,0 +1,213 @@
+/*
+ snapshot.hpp - Read-only image of the tag index of a branch
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef SNAPSHOT_HPP_
+#define SNAPSHOT_HPP_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "hybfsdef.h"
+
+/**
+ * Name of the snapshot file, in the METADIR directory of the branch.
+ */
+#define SNAPSHOT_FILE ".hybfs_snapshot"
+
+#define SNAP_MAGIC "HYBFSNAP"
+#define SNAP_VERSION 1
+
+namespace hybfs {
+
+using namespace std;
+
+/**
+ * Header of the snapshot file. The offsets are from the start of the file;
+ * all the numbers are in the byte order of the machine that wrote it.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	/** change counter of the database when the snapshot was taken */
+	uint32_t counter;
+	uint64_t ntags;
+	uint64_t nposts;
+	uint64_t nfiles;
+	uint64_t tags_off;
+	uint64_t posts_off;
+	uint64_t files_off;
+	uint64_t strings_off;
+	uint64_t strings_len;
+} snap_header_t;
+
+/**
+ * An entry of the tag dictionary. The entries are sorted by tag and value,
+ * without case first, like SQLite's LIKE compares them.
+ */
+typedef struct {
+	uint64_t tag_id;
+	/** offsets of the strings */
+	uint32_t tag;
+	uint32_t value;
+	/** the inodes of the files with this tag, sorted */
+	uint64_t first;
+	uint64_t count;
+} snap_tag_t;
+
+/**
+ * An entry of the path table, sorted by inode.
+ */
+typedef struct {
+	uint64_t ino;
+	uint32_t mode;
+	uint32_t path;
+} snap_file_t;
+
+/**
+ * A tag and its files, as they are read from the database to write a
+ * snapshot.
+ */
+typedef struct {
+	long long tag_id;
+	string tag;
+	string value;
+	vector<uint64_t> inos;
+} snap_build_tag_t;
+
+/**
+ * A file, as it is read from the database to write a snapshot.
+ */
+typedef struct {
+	long long ino;
+	int mode;
+	string path;
+} snap_build_file_t;
+
+/**
+ * @class IndexSnapshot
+ * @brief A compact image of the tags table, of the associations and of the
+ * files table, mapped in memory.
+ * \par
+ * The file has a sorted tag dictionary, the list of inodes of each tag and a
+ * path table sorted by inode. It is mapped read only, so opening it costs
+ * nothing: the pages are read from the disk only when they are used. It is
+ * valid while the change counter of the database is the one it was taken at.
+ */
+class IndexSnapshot {
+private:
+	int fd;
+	char *map;
+	size_t size;
+
+	const snap_header_t *hdr;
+	const snap_tag_t *tags;
+	const uint64_t *posts;
+	const snap_file_t *files;
+	const char *strings;
+
+	/**
+	 * Checks that all the tables are inside the file.
+	 */
+	int check();
+
+public:
+	IndexSnapshot();
+
+	~IndexSnapshot();
+
+	/**
+	 * @brief Maps a snapshot file.
+	 *
+	 * @return Returns 0 on success, -1 if the file is missing or damaged.
+	 */
+	int open(const char *path);
+
+	/**
+	 * @brief Unmaps the snapshot.
+	 */
+	void close();
+
+	int is_open() { return map != NULL; }
+
+	/**
+	 * Returns the change counter of the database the snapshot was taken at.
+	 */
+	unsigned int get_counter() { return hdr->counter; }
+
+	size_t get_ntags() { return hdr->ntags; }
+
+	size_t get_nfiles() { return hdr->nfiles; }
+
+	const char *get_tag(size_t i)
+	{
+		return (tags[i].tag < hdr->strings_len) ? strings + tags[i].tag : "";
+	}
+
+	const char *get_value(size_t i)
+	{
+		return (tags[i].value < hdr->strings_len) ? strings + tags[i].value : "";
+	}
+
+	/**
+	 * @brief Returns the sorted inodes of the files that have the tag i.
+	 */
+	const uint64_t *get_posts(size_t i, size_t *n);
+
+	/**
+	 * @brief Finds the entries of a tag, whatever the case of the letters.
+	 *
+	 * @param[out] first The first entry with the tag.
+	 * @param[out] last The entry after the last one.
+	 * @return Returns the number of entries.
+	 */
+	size_t find_tag(const char *tag, size_t *first, size_t *last);
+
+	/**
+	 * @brief Returns the relative path of a file, or NULL if the snapshot
+	 * doesn't have it.
+	 */
+	const char *find_file(uint64_t ino, unsigned int *mode);
+
+	/**
+	 * @brief Counts the files that have all the tags. A tag without a value
+	 * stands for any of its values, as in the queries.
+	 *
+	 * @return Returns the number of files, or -1 if a tag has no id.
+	 */
+	long count_all(vector<tag_info_t> *query);
+
+	/**
+	 * @brief Reads the change counter from the header of a snapshot file,
+	 * without mapping it.
+	 *
+	 * @return Returns 0 on success, -1 if there is no valid snapshot.
+	 */
+	static int read_counter(const char *path, unsigned int *counter);
+
+	/**
+	 * @brief Writes a snapshot. The file is replaced only when the new one
+	 * is complete, so the readers never see half of it.
+	 *
+	 * @param tags The tags with their files; they are sorted here.
+	 * @param files The files; they are sorted here.
+	 * @return Returns 0 on success, -1 on error.
+	 */
+	static int write(const char *path, unsigned int counter,
+	                 vector<snap_build_tag_t> *tags,
+	                 vector<snap_build_file_t> *files);
+};
+
+}
+
+#endif /*SNAPSHOT_HPP_*/
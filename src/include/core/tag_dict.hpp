@@ -0,0 +1,142 @@
+/*
+ tag_dict.hpp - Process wide dictionary of the tags
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef TAG_DICT_HPP_
+#define TAG_DICT_HPP_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <string>
+#include <boost/unordered_map.hpp>
+
+/**
+ * The entries are allocated in chunks of this size, which never move.
+ */
+#define DICT_CHUNK 4096
+
+/**
+ * Maximum number of entries. The dictionary never forgets an entry, so this
+ * bounds what it takes for the life of the mount; the tags that come after
+ * it is full are stored and searched by their strings, without an id.
+ */
+#ifndef DICT_MAX
+#define DICT_MAX (1 << 20)
+#endif
+
+/**
+ * Number of chunks, enough for DICT_MAX entries and the unused id 0.
+ */
+#define DICT_CHUNKS (DICT_MAX / DICT_CHUNK + 1)
+
+namespace hybfs {
+
+using namespace std;
+
+/**
+ * Id of an entry of the dictionary; 0 is no entry.
+ */
+typedef uint32_t dict_id_t;
+
+/**
+ * An entry: a tag with a value, or only the name of a tag, when the value
+ * is empty. A tag stored without a value has NULL_VALUE.
+ */
+typedef struct {
+	string tag;
+	string value;
+	/** the entry of the name of the tag */
+	dict_id_t name;
+} dict_entry_t;
+
+/**
+ * @class TagDict
+ * @brief Gives small integer ids to the tags and to the tag:value pairs
+ * seen by the process, so that they are compared and hashed as integers.
+ * \par
+ * The ids are dense and never change while the process runs; they are not
+ * the ids of the tags table, which are different for every branch. The
+ * entries are never removed, and there are at most DICT_MAX of them: the
+ * callers get 0 after that and go on with the strings.
+ * \par
+ * entry() takes no lock: the entries don't move once they are added.
+ * The lookups by string share a read lock with the other readers.
+ */
+class TagDict {
+private:
+	pthread_rwlock_t lock;
+	/** "tag\0value" to id */
+	boost::unordered_map<string, dict_id_t> ids;
+	dict_entry_t *chunks[DICT_CHUNKS];
+	/** the next id */
+	volatile dict_id_t next;
+	/** the full dictionary was reported */
+	int full;
+
+	TagDict();
+
+	static void create();
+
+	dict_id_t add(const string &key, const string &tag, const string &value,
+	              dict_id_t name);
+
+public:
+	/**
+	 * @brief Returns the dictionary of the process.
+	 */
+	static TagDict *get();
+
+	/**
+	 * @brief Returns the id of a tag:value pair, adding it if it's new.
+	 *
+	 * @param value The value; NULL or "" stands for the name of the tag.
+	 * @return Returns the id, or 0 if the dictionary is full.
+	 */
+	dict_id_t intern(const char *tag, const char *value);
+
+	/**
+	 * @brief Same as intern(), for the "tag:value" form of the queries and
+	 * of the modules.
+	 */
+	dict_id_t intern_pair(const string &tag_value);
+
+	/**
+	 * @brief Returns the id of a pair without adding it.
+	 *
+	 * @return Returns the id, or 0 if the pair is not in the dictionary.
+	 */
+	dict_id_t find(const char *tag, const char *value);
+
+	/**
+	 * @brief Returns an entry, or NULL for an id that wasn't given.
+	 */
+	const dict_entry_t *entry(dict_id_t id)
+	{
+		if (id == 0 || id >= next)
+			return NULL;
+		return &chunks[id / DICT_CHUNK][id % DICT_CHUNK];
+	}
+
+	/**
+	 * @brief Returns the id of the name of the tag of an entry.
+	 */
+	dict_id_t name_of(dict_id_t id)
+	{
+		const dict_entry_t *e = entry(id);
+		return e ? e->name : 0;
+	}
+
+	size_t size() { return next - 1; }
+};
+
+}
+
+#endif /*TAG_DICT_HPP_*/
@@ -0,0 +1,159 @@
+/*
+ tag_export.hpp - Portable stream of the tags of a branch
+
+ Copyright (C) 2008-2009  Stefania Costache
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef TAG_EXPORT_HPP_
+#define TAG_EXPORT_HPP_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+#include "hybfsdef.h"
+
+/**
+ * The stream starts with the magic and the version (a 32 bit number). Then
+ * come the records: a type byte, the length of the payload (32 bits) and the
+ * payload. All the numbers are little endian and the strings are a 32 bit
+ * length followed by the bytes.
+ *
+ * EXP_TAG: tag id (32 bits), tag, value. The id only has a meaning inside
+ * the stream; a branch split into shards may give the same tag more than
+ * once, with other ids.
+ * EXP_FILE: inode (64 bits), mode (32 bits), path relative to the branch,
+ * number of tags (32 bits) and the id of each tag (32 bits). The tags of a
+ * file always come before it.
+ * EXP_END: the number of tags, files and associations (64 bits each) in the
+ * stream. A stream without it was cut.
+ *
+ * A reader skips the records it doesn't know; a new version is only needed
+ * when the known ones change.
+ */
+#define EXPORT_MAGIC "HYBFSEXP"
+#define EXPORT_VERSION 1
+
+#define EXP_TAG  'T'
+#define EXP_FILE 'F'
+#define EXP_END  'E'
+
+/**
+ * Largest record a reader accepts. The biggest ones are the files with many
+ * tags; a longer length only comes from a damaged stream.
+ */
+#ifndef EXPORT_REC_MAX
+#define EXPORT_REC_MAX (16 * 1024 * 1024)
+#endif
+
+namespace hybfs {
+
+using namespace std;
+
+/**
+ * What went through an export or an import.
+ */
+typedef struct {
+	long long ntags;
+	long long nfiles;
+	long long nassoc;
+	/** files of an import that are not in the branch */
+	long long nskipped;
+} export_stats_t;
+
+/**
+ * @class ExportWriter
+ * @brief Writes the records of an export stream.
+ */
+class ExportWriter {
+private:
+	FILE *out;
+	/** the payload of the current record */
+	string rec;
+	int type;
+
+public:
+	ExportWriter(FILE *out);
+
+	/**
+	 * @brief Writes the magic and the version.
+	 * @return Returns 0 on success, -1 on error.
+	 */
+	int header();
+
+	/**
+	 * @brief Starts a record of the given type.
+	 */
+	void begin(int type);
+
+	void put_u32(uint32_t v);
+	void put_u64(uint64_t v);
+	void put_str(const char *s, size_t len);
+
+	/**
+	 * @brief Writes the current record.
+	 * @return Returns 0 on success, -1 on error.
+	 */
+	int end();
+};
+
+/**
+ * @class ExportReader
+ * @brief Reads the records of an export stream.
+ */
+class ExportReader {
+private:
+	FILE *in;
+	/** the payload of the current record and how much of it was read */
+	string rec;
+	size_t pos;
+
+public:
+	ExportReader(FILE *in);
+
+	/**
+	 * @brief Checks the magic and the version.
+	 * @return Returns 0 on success, -1 if this is not a stream we can read.
+	 */
+	int header();
+
+	/**
+	 * @brief Reads the next record.
+	 * @return Returns its type, 0 at the end of the file and -1 if the
+	 * record was cut or is too long.
+	 */
+	int next();
+
+	/**
+	 * @brief Reads the whole stream and checks that it is complete: the
+	 * fields of the known records, the ids of the tags of the files and
+	 * the counts of the end record.
+	 * @return Returns 0 if the stream can be imported, -1 if not.
+	 */
+	int check();
+
+	/**
+	 * The fields of the current record, in order. They return -1 when
+	 * the record is shorter than that.
+	 */
+	int get_u32(uint32_t *v);
+	int get_u64(uint64_t *v);
+	int get_str(string *s);
+
+	/**
+	 * Reads a path relative to the branch. Empty and absolute paths and
+	 * the ones with a ".." in them are refused, so the path stays inside
+	 * the branch.
+	 */
+	int get_path(string *s);
+};
+
+}
+
+#endif /*TAG_EXPORT_HPP_*/
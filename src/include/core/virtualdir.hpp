@@ -19,16 +19,11 @@
 #include <vector>
 
 #include "db_backend.hpp"
+#include "shard_set.hpp"
 #include "path_crawler.hpp"
 
 namespace hybfs {
 
-typedef struct {
-	int op;
-	std::vector<std::string> tags;
-} tags_op_t;
-
-
 /**
  * @class VirtualDirectory
  * @brief Wrapper class for virtual directory operations. 
@@ -38,9 +33,10 @@ typedef struct {
 class VirtualDirectory{
 private:
 	/**
-	 * The database interface pointer.
+	 * The databases of the branch; a file is in the one given by its
+	 * inode.
 	 */
-	DbBackend * db;
+	ShardSet *shards;
 	
 	/**
 	 * The real path for the directory used by the database (temporary
@@ -48,6 +44,13 @@ private:
 	 */
 	std::string vdir_path;
 	
+	/**
+	 * Moves the files to the real path 'relto' and updates their paths in
+	 * one transaction. It stops at the first file that cannot be moved.
+	 */
+	int move_files(const char *relfrom, const char *relto,
+	               vector<new_file_info_t> *files);
+	
 public:
 	VirtualDirectory(const char *path);
 	
@@ -64,7 +67,59 @@ public:
 	 * @brief Start the database associated with the current virtual directory.
 	 * @return Returns -1 in the case of an internal error.
 	 */
-	int init() { return db->db_init_storage(); }
+	int init(int nshards = 0) { return shards->init(nshards); }
+	
+	/**
+	 * @brief Starts and stops the threads of the databases; see
+	 * ShardSet::start().
+	 */
+	int start() { return shards->start(); }
+	void stop() { shards->stop(); }
+	
+	/**
+	 * @brief Returns the descriptor of the branch directory, for the *at
+	 * calls. It stays valid as long as this object lives.
+	 */
+	int get_dirfd() { return shards->get(0)->db_get_dirfd(); }
+	
+	/**
+	 * @brief Returns the number of databases of the branch.
+	 */
+	int get_nshards() { return shards->size(); }
+	
+	/**
+	 * @brief Runs the maintenance of the databases, one after the other.
+	 * The stats are added up.
+	 * @return Returns 0 for success, 1 if a database was busy and -1
+	 * otherwise.
+	 */
+	int maintain(maint_stats_t *stats);
+	
+	/**
+	 * @brief Rebuilds the databases that can't give their free pages back
+	 * yet. See DbBackend::db_convert_vacuum().
+	 * @return Returns 0 for success, -1 if a database could not be rebuilt.
+	 */
+	int convert_vacuum();
+	
+	/**
+	 * @brief Sets the memory the page caches of the databases can use
+	 * together.
+	 * @return Returns the size of the caches in pages, or -1.
+	 */
+	long set_cache(long bytes);
+	
+	/**
+	 * @brief Writes the tags of the branch to a stream; see
+	 * ShardSet::export_tags().
+	 */
+	int export_tags(FILE *out, export_stats_t *stats) { return shards->export_tags(out, stats); }
+	
+	/**
+	 * @brief Imports the tags from an export file; see
+	 * ShardSet::import_tags().
+	 */
+	int import_tags(const char *file, export_stats_t *stats) { return shards->import_tags(file, stats); }
 	
 	/**
 	 * @brief Adds the associated metadata for this file, to the db.
@@ -110,6 +165,17 @@ public:
 	 */
 	int vdir_readdir(const char * query, void *buf, fuse_fill_dir_t filler);
 	
+	/**
+	 * @brief Gets the attributes of a virtual directory specified by a query.
+	 * @return Returns 0 for success and !=0 otherwise.
+	 * 
+	 * @param[in] query This can contain a query, a conjunction of queries and/or
+	 * a real path.
+	 * @param[out] nentries The number of files that match the query.
+	 * @param[out] mtime The last modification time of the tags from the query.
+	 */
+	int vdir_getattr(const char * query, long *nentries, time_t *mtime);
+	
 	/**
 	 * @brief Update the tags for a file. The type of update is given by the 
 	 * op and exist parameters.
@@ -124,15 +190,67 @@ public:
 	int update_file(vector<string> *tags, int op, file_info_t *finfo, int exist);
 	
 	/**
-	 * @brief Replaces the tag-value components provided by the 'oldq' 
-	 * query with the ones provided by the 'newq' query.
-	 * You should specify if the relative destination has a real component,
-	 * so that the real rename from the unerlying fs will be called.
-	 * \par
-	 * This is not (yet) implemented.
+	 * @brief Adds a batch of files with their tags, in a single transaction
+	 * for each shard. The shards write their files in parallel.
+	 * @return Returns the number of files that failed, or -1 if none of them
+	 * could be added.
+	 * 
+	 * @param[in,out] files The files and the tags for each of them; the
+	 * ones that were not committed get their 'failed' set.
+	 */
+	int update_files(vector<tagged_file_t> *files);
+	
+	/**
+	 * @brief Loads the fingerprints stored by a module for its files.
+	 * @return Returns 0 for success and -1 otherwise.
+	 * 
+	 * @param[in] module The type of the module.
+	 * @param[out] fps The fingerprints, by inode.
+	 */
+	int get_fingerprints(int module, fprint_map_t *fps);
+	
+	/**
+	 * @brief Wrappers for the checkpoints of the indexing runs; see the
+	 * db_checkpoint_* methods of DbBackend. They are kept in the first
+	 * shard.
+	 */
+	int checkpoint_add(const char *root, vector<string> *dirs) { return shards->get(0)->db_checkpoint_add(root, dirs); }
+	int checkpoint_load(const char *root, set<string> *dirs) { return shards->get(0)->db_checkpoint_load(root, dirs); }
+	int checkpoint_clear(const char *root) { return shards->get(0)->db_checkpoint_clear(root); }
+	
+	/**
+	 * @brief Writes the snapshots that the mount maps at startup, one for
+	 * each shard; see DbBackend::db_write_snapshot().
+	 */
+	int write_snapshot();
+	
+	/**
+	 * @brief Reads the tag operations from the queries of a path, once
+	 * for all the branches.
+	 * @return Returns 0 for success and -EINVAL for a bad operation.
+	 * 
+	 * @param[in] to The destination path of a rename.
+	 * @param[out] ops The operations, in the order of the queries.
+	 */
+	static int parse_tag_ops(PathCrawler *to, vector<tags_op_t> *ops);
+	
+	/**
+	 * @brief Applies the tag operations to all the files that match the
+	 * 'from' query: one statement for each tag, whatever the number of
+	 * files. When the destination has a real component, the files are
+	 * also moved in the underlying fs and their paths are updated in a
+	 * single transaction. A source without queries is a real directory
+	 * and the tags go to every file under it; nothing is moved then.
+	 * @return Returns 0 for success and a negative error code otherwise.
+	 * 
+	 * @param[in] relfrom The real path of the source, or NULL.
+	 * @param[in] relto The real path of the destination, or NULL.
+	 * @param[in] from The source path; its queries select the files.
+	 * @param[in] ops The tag operations, from parse_tag_ops().
+	 * @param[in] do_fs_mv Set if the files are moved to 'relto'.
 	 */
 	int vdir_replace(const char*relfrom, const char *relto,
-                         PathCrawler *from, PathCrawler *to, int do_fs_mv);
+                         PathCrawler *from, vector<tags_op_t> *ops, int do_fs_mv);
 	
 	/**
 	 * @brief Removes all info from the DB for this file.
@@ -142,6 +260,27 @@ public:
 	 */
 	int vdir_remove_file(const char *path);
 	
+	/**
+	 * @brief Removes from the DB the files that don't exist anymore in the
+	 * real directory. The paths that exist again are skipped.
+	 * @return Returns 0 for success and !=0 otherwise.
+	 * 
+	 * @param[in] paths The relative file paths.
+	 */
+	int vdir_remove_stale(vector<string> *paths);
+	
+	/**
+	 * @brief Checks the next 'max' files from the DB, in inode order, and
+	 * returns the ones that are missing from the real directory.
+	 * @return Returns 0 for success and !=0 otherwise.
+	 * 
+	 * @param[in,out] cursor The last inode checked. It's reset to 0 when
+	 * the end of the table is reached.
+	 * @param[in] max The maximum number of files to check.
+	 * @param[out] stale The relative paths of the missing files.
+	 */
+	int vdir_sweep(long long *cursor, int max, vector<string> *stale);
+	
 	/**
 	 * @brief Replaces the old path, given by from with the new one (to).
 	 * @return Returns 0 for success and !=0 otherwise.
@@ -12,6 +12,9 @@
 #ifndef BASE_MODULE_HPP_
 #define BASE_MODULE_HPP_
 
+#include <string>
+#include <vector>
+
 #include "core/hybfsdef.h"
 #include "core/virtualdir.hpp"
 
@@ -35,7 +38,7 @@ public:
 	GenericModule();
 
 	/** destructor */
-	~GenericModule();
+	virtual ~GenericModule();
 
 	/** initializes the virtual directory
 	 * used by the implemented module
@@ -47,9 +50,28 @@ public:
 	 */
 	file_info_t * get_file_info(const char * path);
 
+	/** same as get_file_info, but with the stat information
+	 * already known
+	 */
+	file_info_t * make_file_info(const char * path, struct stat *st);
+
+	/** removes from the database the files that don't exist
+	 * anymore; the paths are absolute
+	 */
+	int remove_files(std::vector<std::string> *paths);
+
 	/** returns the type of the module */
 	virtual mod_type module_type() = 0;
 
+	/** returns the version of the extractor; it must change
+	 * when extract_tags gives other tags for the same file, so
+	 * the files are read again
+	 */
+	virtual int extractor_version() = 0;
+
+	/** returns the path of the module */
+	const char * get_path() { return path; }
+
 	/** virtual function that will be implemented by
 	 * all classes that will define this virtual class
 	 * This will load information specific
@@ -62,10 +84,25 @@ public:
 	 */
 	virtual int check_file (const char * path) = 0;
 
+	/** the extensions of the files the module wants, lowercase
+	 * and without the dot, ending with NULL; the registry routes
+	 * the files with them
+	 */
+	virtual const char * const * extensions () = 0;
+
 	/** puts module specific information in the database
 	 */
 	virtual int put_to_db () = 0;
 
+	/** extracts the tags of the file without touching the
+	 * module state, so it can be called from many threads
+	 * at once. hdr holds the first hdrlen bytes of the file,
+	 * if they were read already (it can be NULL).
+	 * Returns 0 for success, -1 for error
+	 */
+	virtual int extract_tags (const char * path, const char * hdr,
+			size_t hdrlen, std::vector<std::string> *tags) = 0;
+
 };
 
 
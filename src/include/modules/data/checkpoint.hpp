@@ -0,0 +1,104 @@
+/*
+ checkpoint.hpp
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef CHECKPOINT_HPP_
+#define CHECKPOINT_HPP_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+
+#include "module_loader.hpp"
+
+using namespace std;
+
+/** seconds between two saves of the checkpoint */
+#ifndef CKPT_INTERVAL
+#define CKPT_INTERVAL 10
+#endif
+
+/** what we know about a directory of the run */
+struct ckpt_dir
+{
+	/** files sent to the pipeline and not committed yet */
+	long pending;
+	/** all its entries were read */
+	int read;
+};
+
+/** remembers the directories whose files were all committed by a
+ * parsedir run, so an interrupted run goes on from there
+ * The crawler walks the tree with many threads, in no fixed order,
+ * so there is no single position to go back to: a directory is done
+ * when the crawler read all its entries and the writer committed all
+ * the files it sent. The done directories are saved in the databases
+ * of the modules that cover them, every CKPT_INTERVAL seconds.
+ */
+class Checkpoint
+{
+private:
+	ModuleManager *manager;
+	string root;
+	pthread_mutex_t lock;
+
+	/** done by the previous runs */
+	set<string> done;
+	/** the directories the crawler is still busy with */
+	map<string, ckpt_dir> dirs;
+	/** done since the last save */
+	vector<string> finished;
+	time_t last_save;
+
+	/** moves a directory to "finished" if nothing is left in it;
+	 * called with the lock held
+	 */
+	void check_dir(map<string, ckpt_dir>::iterator d);
+
+public:
+	/** root is the directory the run starts from */
+	Checkpoint(ModuleManager *manager, const char *root);
+
+	/** destructor */
+	~Checkpoint();
+
+	/** loads the directories done by the previous runs from root
+	 * Returns their number, -1 on ERROR
+	 */
+	long load();
+
+	/** Returns 1 if the files of the directory were all indexed */
+	int is_done(const string &dir);
+
+	/** the crawler sends a file of the directory to the pipeline */
+	void file_queued(const string &dir);
+
+	/** the crawler read all the entries of the directory */
+	void dir_read(const string &dir);
+
+	/** the pipeline is finished with a file, committed or not */
+	void file_done(const string &path);
+
+	/** writes the finished directories in the databases, if
+	 * CKPT_INTERVAL passed since the last time or force is set
+	 * Returns 0 on SUCCESS, -1 on ERROR
+	 */
+	int save(int force);
+
+	/** the run finished, the next one starts over
+	 * Returns 0 on SUCCESS, -1 on ERROR
+	 */
+	int clear();
+};
+
+#endif /* CHECKPOINT_HPP_ */
@@ -0,0 +1,177 @@
+/*
+ crawler.hpp
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef CRAWLER_HPP_
+#define CRAWLER_HPP_
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include "work_queue.hpp"
+#include "registry.hpp"
+#include "checkpoint.hpp"
+
+using namespace std;
+
+/** size of the buffer for one getdents64 call */
+#ifndef CRAWL_BUF_SIZE
+#define CRAWL_BUF_SIZE (32 * 1024)
+#endif
+
+/** maximum number of candidate files waiting to be processed */
+#ifndef CRAWL_QUEUE_MAX
+#define CRAWL_QUEUE_MAX 4096
+#endif
+
+/** threads per core; the disk has requests queued while
+ * some of the threads wait for it
+ */
+#ifndef CRAWL_THREADS_PER_CPU
+#define CRAWL_THREADS_PER_CPU 2
+#endif
+
+/** structure used for the directories that wait to be read
+ * by one thread; the others can steal from it
+ */
+struct crawl_deque
+{
+	pthread_mutex_t lock;
+	deque<string> dirs;
+};
+
+/** decides if a file found by the crawler can be left out;
+ * it's called from all the crawler threads at once
+ */
+class CrawlFilter
+{
+public:
+	virtual ~CrawlFilter() {}
+
+	/** dirfd is the directory of the file and name its entry
+	 * in it; ino comes from the directory entry
+	 * Returns 1 if the file is not wanted, 0 otherwise
+	 */
+	virtual int skip(int dirfd, const char *name, const string &path,
+			unsigned long long ino) = 0;
+};
+
+/** walks a directory tree with a pool of threads
+ * Each thread reads the directories from its own deque (the last
+ * one found first) and steals the oldest directory of another
+ * thread when it has nothing left. The regular files that match
+ * one of the patterns are put in the output queue, which is
+ * closed when the walk is finished.
+ */
+class DirCrawler
+{
+private:
+	int nthreads;
+	vector<crawl_deque *> deques;
+	vector<pthread_t> threads;
+	vector<string> patterns;
+	ModuleRegistry *registry;
+	WorkQueue<string> *out;
+	CrawlFilter *filter;
+	Checkpoint *ckpt;
+
+	/** directories queued or being read */
+	volatile long pending;
+	/** threads that didn't finish yet */
+	volatile int running;
+
+	volatile long nfiles;
+	volatile long ndirs;
+	volatile long nskipped;
+	volatile long nresumed;
+	/** set by stop(), the threads leave what they are doing */
+	volatile int stopping;
+
+	static void *worker(void *arg);
+
+	/** the loop of a crawler thread */
+	void run(int id);
+
+	/** gets a directory from the deque of the thread, or steals one
+	 * Returns 0 on SUCCESS, -1 if there is nothing to read
+	 */
+	int next_dir(int id, string *dir);
+
+	/** adds a directory to the deque of the thread */
+	void push_dir(int id, const string &dir);
+
+	/** reads a directory and sends its entries where they belong */
+	void read_dir(int id, const string &dir);
+
+	/** checks the file name against the patterns */
+	int match(const char *name);
+
+public:
+	/** constructor; with nthreads 0 the number of threads
+	 * depends on the number of cores
+	 */
+	DirCrawler(WorkQueue<string> *out, int nthreads);
+
+	/** destructor */
+	~DirCrawler();
+
+	/** adds a fnmatch pattern for the files we want; with no
+	 * pattern, all the regular files are wanted
+	 */
+	void add_pattern(const char *pattern);
+
+	/** only the files with an extension known to the registry
+	 * are wanted; it's used instead of the patterns
+	 */
+	void set_registry(ModuleRegistry *registry);
+
+	/** sets a filter for the files that match the patterns */
+	void set_filter(CrawlFilter *filter);
+
+	/** the files of the directories done by the previous run are
+	 * left out, and the crawler tells the checkpoint what it reads
+	 */
+	void set_checkpoint(Checkpoint *ckpt);
+
+	/** starts walking the tree from root
+	 * Returns 0 on SUCCESS, -1 on ERROR
+	 */
+	int start(const char *root);
+
+	/** waits for all the threads to finish */
+	void wait();
+
+	/** the walk ends early; the output queue is closed as usual.
+	 * It only sets a flag, so it can be called from a signal handler
+	 */
+	void stop() { stopping = 1; }
+
+	/** Returns 1 if the walk was stopped before the end */
+	int get_stopped() { return stopping; }
+
+	/** Returns 1 if the walk finished or was stopped */
+	int is_done() { return running == 0; }
+
+	/** number of files sent to the output queue */
+	long get_nfiles() { return nfiles; }
+
+	/** number of directories read */
+	long get_ndirs() { return ndirs; }
+
+	/** number of files left out by the filter */
+	long get_nskipped() { return nskipped; }
+
+	/** number of files left out because the checkpoint has them */
+	long get_nresumed() { return nresumed; }
+};
+
+#endif /* CRAWLER_HPP_ */
@@ -0,0 +1,54 @@
+/*
+ fingerprint.hpp
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef FINGERPRINT_HPP_
+#define FINGERPRINT_HPP_
+
+#include <map>
+#include <string>
+
+#include "crawler.hpp"
+#include "module_loader.hpp"
+
+using namespace std;
+
+/** leaves out the files that didn't change since the modules
+ * extracted their tags: same inode, name, size, modification
+ * time and extractor version
+ * The fingerprints of all the modules are loaded in memory before
+ * the walk starts and are only read after that.
+ */
+class FingerprintFilter : public CrawlFilter
+{
+private:
+	ModuleManager *manager;
+	map<GenericModule *, fprint_map_t *> fps;
+
+public:
+	/** constructor */
+	FingerprintFilter(ModuleManager *manager);
+
+	/** destructor */
+	virtual ~FingerprintFilter();
+
+	/** loads the fingerprints of all the modules
+	 * Returns the number of fingerprints loaded, -1 on ERROR
+	 */
+	long load();
+
+	/** Returns 1 if all the modules that want the file have
+	 * already seen it as it is now
+	 */
+	virtual int skip(int dirfd, const char *name, const string &path,
+			unsigned long long ino);
+};
+
+#endif /* FINGERPRINT_HPP_ */
@@ -0,0 +1,106 @@
+/*
+ hot_listener.hpp
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef HOT_LISTENER_HPP_
+#define HOT_LISTENER_HPP_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <time.h>
+
+#include "core/hot_paths.hpp"
+#include "crawler.hpp"
+#include "module_loader.hpp"
+#include "work_queue.hpp"
+
+using namespace std;
+
+/** seconds during which a path is not queued again */
+#ifndef HOT_RECENT
+#define HOT_RECENT 60
+#endif
+
+/** paths remembered as recently queued, at most */
+#ifndef HOT_RECENT_MAX
+#define HOT_RECENT_MAX 4096
+#endif
+
+/** milliseconds between two checks of the stop flag */
+#ifndef HOT_POLL_MS
+#define HOT_POLL_MS 500
+#endif
+
+/** a socket we listen on and its file */
+struct hot_sock {
+	int fd;
+	string path;
+};
+
+/** receives from the mounted file system the real paths that are
+ * opened or listed, and queues their files ahead of the bulk work
+ * The files that didn't change since they were indexed are left
+ * out by the filter, if there is one.
+ * Each branch of the modules has its own socket, in its METADIR
+ * directory; only the owner of the indexer can write to it.
+ */
+class HotListener
+{
+private:
+	ModuleManager *manager;
+	WorkQueue<string> *out;
+	CrawlFilter *filter;
+	vector<hot_sock> socks;
+	pthread_t thread;
+	volatile int running;
+
+	/** when each path was queued the last time */
+	map<string, time_t> recent;
+	volatile long nqueued;
+
+	static void *listen_thread(void *arg);
+
+	/** the loop of the listener thread */
+	void run();
+
+	/** queues a file, if it's wanted and was not queued lately */
+	void queue_file(const string &path, time_t now);
+
+	/** queues the files of a directory, without going down */
+	void queue_dir(const string &path, time_t now);
+
+	/** creates the socket of a branch and adds it to socks
+	 * Returns 0 on SUCCESS, -1 on ERROR
+	 */
+	int bind_branch(const string &branch);
+
+public:
+	/** the files are pushed as urgent in "out" */
+	HotListener(ModuleManager *manager, WorkQueue<string> *out, CrawlFilter *filter);
+
+	/** destructor */
+	~HotListener();
+
+	/** binds the sockets and starts listening
+	 * Returns 0 on SUCCESS, -1 on ERROR (another indexer may
+	 * have the sockets)
+	 */
+	int start();
+
+	/** stops listening */
+	void stop();
+
+	/** number of files queued because they were used */
+	long get_nqueued() { return nqueued; }
+};
+
+#endif /* HOT_LISTENER_HPP_ */
@@ -13,6 +13,7 @@
 #define MODULE_LOADER_HPP_
 
 #include "base_module.hpp"
+#include "registry.hpp"
 #include <vector>
 
 using namespace std;
@@ -30,6 +31,11 @@ class ModuleManager
 {
 private:
 	vector<module_assoc> modules;
+	/** routes the files to the modules */
+	ModuleRegistry registry;
+
+	/** builds the registry again after a module is removed */
+	void rebuild_registry();
 public:
 	ModuleManager();
 	~ModuleManager();
@@ -51,9 +57,23 @@ public:
 	/** process a file and add it to the apropriate database */
 	int mod_process_file (const char * path);
 
+	/** finds the modules that can process the file
+	 * Returns the number of modules found
+	 */
+	int mod_find_modules (const char * path, vector<GenericModule *> *found);
+
+	/** the registry of the modules, for the crawler */
+	ModuleRegistry * mod_get_registry() { return &registry; }
+
 	/** lists all the modules loaded */
 	vector<string> * mod_list_modules();
 
+	/** adds all the modules loaded to "mods" */
+	void mod_get_modules(vector<GenericModule *> *mods);
+
+	/** adds the paths of the modules to "paths", each one once */
+	void mod_list_paths(vector<string> *paths);
+
 	/** mod_type to string converter */
 	string mod_get_type(mod_type t);
 
@@ -16,15 +16,36 @@
 #include "base_module.hpp"
 //#include "virtualdir.hpp"
 
+/** version of the tags extracted by the module */
+#define MP3_EXTRACTOR_VERSION 1
+
 using namespace std;
 
+/** the fields of the ID3 tag we keep, each one converted once */
+struct mp3_record
+{
+	string album;
+	string artist;
+	string title;
+	unsigned int year;
+};
+
 class Mp3File:public GenericModule
 {
 private:
-	TagLib::FileRef *f;
-	TagLib::Tag *tag;
+	char * file_path;
+	mp3_record record;
 	char * path;
 
+	/** reads only the tag of the file, without the audio
+	 * properties, so TagLib doesn't scan the frames
+	 * Returns 0 for success, -1 for error
+	 */
+	int read_record(const char * path, mp3_record *rec);
+
+	/** makes the tags of a record */
+	void record_to_tags(mp3_record *rec, vector<string> *tags);
+
 public:
 	/** constructor for the mp3 module
 	 * in the same time it initializes the VirtualDirectory
@@ -32,6 +53,8 @@ public:
 	 */
 	Mp3File (const char * path);
 
+	~Mp3File ();
+
 	/** loads the tag from the file
 	 * given as argument
 	 * returns 0 for success, -1 for error
@@ -44,12 +67,26 @@ public:
 	 */
 	virtual int check_file(const char * path);
 
+	/** the extensions of the mp3 files */
+	virtual const char * const * extensions();
+
 	/** adds the file information to database */
 	virtual int put_to_db();
 
+	/** extracts the tags of the file with its own record,
+	 * so it can be called from many threads at once: each
+	 * call has its own TagLib objects, and TagLib shares
+	 * nothing mutable between the objects of different files
+	 */
+	virtual int extract_tags(const char * path, const char * hdr,
+			size_t hdrlen, vector<string> *tags);
+
 	/** returns the type of the module */
 	virtual mod_type module_type();
 
+	/** returns the version of the extractor */
+	virtual int extractor_version();
+
 	/** artist information */
 	string mp3_get_artist();
 
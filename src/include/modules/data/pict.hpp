@@ -13,8 +13,24 @@ pict.hpp
 #define PICT_HPP_
 
 #include <cstdio>
+#include "image.hpp"
 #include "base_module.hpp"
 
+/** version of the tags extracted by the module */
+#define EXIF_EXTRACTOR_VERSION 1
+
+/** bytes read from the beginning of the file when the caller
+ * has no header; the APP1 segment is usually in them
+ */
+#ifndef EXIF_HDR_SIZE
+#define EXIF_HDR_SIZE (64 * 1024)
+#endif
+
+/** the IFD0 tags we want */
+#define EXIF_TAG_DESCRIPTION	0x010E
+#define EXIF_TAG_MODEL		0x0110
+#define EXIF_TAG_DATETIME	0x0132
+
 using namespace std;
 
 class PictFile:public GenericModule
@@ -34,6 +50,9 @@ public:
 	/** returns the type of the module */
 	virtual mod_type module_type();
 
+	/** returns the version of the extractor */
+	virtual int extractor_version();
+
 	/** loads the exif information from file
 	 * returns 0 for success, -1 for error
 	 */
@@ -45,9 +64,35 @@ public:
 	 */
 	virtual int check_file (const char * path);
 
+	/** the extensions of the pictures with exif information */
+	virtual const char * const * extensions ();
+
 	/** adds the file information to database */
 	virtual int put_to_db ();
 
+	/** extracts the exif tags, from the header if it holds
+	 * them, or from the file otherwise. Many threads can call
+	 * it; the ones that need Exiv2 use it one at a time
+	 */
+	virtual int extract_tags (const char * path, const char * hdr,
+			size_t hdrlen, vector<string> *tags);
+
+	/** reads the exif tags from an opened image */
+	int read_exif (Exiv2::Image::AutoPtr image, const char * path,
+			vector<string> *tags);
+
+	/** reads the three tags we want straight from the APP1
+	 * segment of a JPEG, or from the IFD0 of a TIFF, without
+	 * parsing the rest of the metadata
+	 * Returns 0 for success, -1 if the file has no exif data
+	 * and 1 if Exiv2 should try
+	 */
+	int fast_exif (const char * path, const char * hdr, size_t hdrlen,
+			vector<string> *tags);
+
+	/** adds the tags for the value of an IFD0 entry */
+	void add_exif_tag (int tag, const string &value, vector<string> *tags);
+
 	/** erases all the spaces at the end of the string */
 	string erase_end_spaces(string s);
 
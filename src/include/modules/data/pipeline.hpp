@@ -0,0 +1,230 @@
+/*
+ pipeline.hpp
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef PIPELINE_HPP_
+#define PIPELINE_HPP_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "base_module.hpp"
+#include "module_loader.hpp"
+#include "work_queue.hpp"
+#include "tag_cache.hpp"
+#include "crawler.hpp"
+#include "checkpoint.hpp"
+
+using namespace std;
+
+/** bytes read from the beginning of each file by the I/O stage */
+#ifndef PIPE_HDR_SIZE
+#define PIPE_HDR_SIZE (64 * 1024)
+#endif
+
+/** default number of threads for the I/O stage */
+#ifndef PIPE_READERS
+#define PIPE_READERS 4
+#endif
+
+/** default number of threads for the parsing stage; 0 means
+ * one for each core
+ */
+#ifndef PIPE_PARSERS
+#define PIPE_PARSERS 0
+#endif
+
+/** default size of the queues between the stages */
+#ifndef PIPE_QUEUE_MAX
+#define PIPE_QUEUE_MAX 1024
+#endif
+
+/** maximum number of files committed in one transaction */
+#ifndef PIPE_BATCH
+#define PIPE_BATCH 256
+#endif
+
+/** milliseconds an urgent file waits in the writer for others
+ * to share its transaction
+ */
+#ifndef PIPE_URGENT_MS
+#define PIPE_URGENT_MS 100
+#endif
+
+/** seconds between two progress reports */
+#ifndef PIPE_REPORT_INTERVAL
+#define PIPE_REPORT_INTERVAL 5
+#endif
+
+/** the sizes of the pipeline stages */
+struct pipe_conf
+{
+	int nreaders;
+	int nparsers;
+	size_t queue_max;
+	int batch;
+	/** the tags of the contents already seen, NULL if the
+	 * copies of a file are parsed again
+	 */
+	TagCache *cache;
+};
+
+/** what the items of the same file share */
+struct pipe_file
+{
+	/** items of the file still in the pipeline */
+	volatile int refs;
+	/** one of them was not committed */
+	volatile int failed;
+};
+
+/** a file that goes through the pipeline, for one module */
+struct pipe_item
+{
+	string path;
+	GenericModule *module;
+	struct stat st;
+	char *hdr;
+	size_t hdrlen;
+	/** fingerprint of the content, if has_content is set */
+	unsigned long long content;
+	int has_content;
+	/** somebody is using the file, it goes before the others */
+	int urgent;
+	/** shared by the items of the file; NULL if nobody waits for
+	 * the file to be done
+	 */
+	pipe_file *file;
+	/** its tags are in the database */
+	int committed;
+	vector<string> tags;
+};
+
+/** counters of a stage */
+struct pipe_stage
+{
+	const char *name;
+	int nthreads;
+	volatile int running;
+	volatile long done;
+	volatile long failed;
+};
+
+/** indexes the files from a queue in three stages, each with
+ * its own threads and connected by bounded queues:
+ * - the I/O threads find the modules for a file and read its header
+ * - the parser threads run the extractors of the modules
+ * - one writer thread commits the tags in batches, one transaction
+ *   for each batch and database
+ */
+class IndexPipeline
+{
+private:
+	ModuleManager *manager;
+	pipe_conf conf;
+
+	WorkQueue<string> *in;
+	WorkQueue<pipe_item *> *parse_q;
+	WorkQueue<pipe_item *> *write_q;
+
+	pipe_stage readers;
+	pipe_stage parsers;
+	pipe_stage writer;
+
+	vector<pthread_t> threads;
+	pthread_t reporter;
+	int reporting;
+	pthread_mutex_t report_lock;
+	pthread_cond_t report_cond;
+	time_t started;
+	volatile long deduped;
+	/** bytes of the files read by the I/O stage */
+	volatile long long nbytes;
+
+	/** where the files come from, for the time left */
+	DirCrawler *source;
+	Checkpoint *ckpt;
+	/** the files each module failed to index */
+	map<GenericModule *, long> errors;
+	pthread_mutex_t errors_lock;
+
+	static void *reader_thread(void *arg);
+	static void *parser_thread(void *arg);
+	static void *writer_thread(void *arg);
+	static void *reporter_thread(void *arg);
+
+	void run_reader();
+	void run_parser();
+	void run_writer();
+	void run_reporter();
+
+	/** starts the threads of a stage */
+	int start_stage(pipe_stage *stage, void *(*fn)(void *));
+
+	/** reads the header of the file for each module that wants it */
+	void read_file(const string &path, int urgent);
+
+	/** passes an item to the next stage, ahead of the others if
+	 * it is urgent
+	 * Returns 0 on SUCCESS, -1 if the queue was closed
+	 */
+	int pass(WorkQueue<pipe_item *> *q, pipe_item *item);
+
+	/** commits the files waiting for the writer */
+	void flush(vector<pipe_item *> *batch);
+
+	/** frees the memory of an item */
+	void free_item(pipe_item *item);
+
+	/** counts the files a module failed to index */
+	void module_failed(GenericModule *mod, long n);
+
+public:
+	/** the files are taken from "in", until it is closed */
+	IndexPipeline(ModuleManager *manager, WorkQueue<string> *in, pipe_conf *conf);
+
+	/** destructor */
+	~IndexPipeline();
+
+	/** fills in the default sizes of the stages */
+	static void default_conf(pipe_conf *conf);
+
+	/** the crawler that fills the input queue; the report tells
+	 * how long it takes to index the files it found
+	 */
+	void set_source(DirCrawler *source) { this->source = source; }
+
+	/** the checkpoint is told when the files are done and saved
+	 * after the commits
+	 */
+	void set_checkpoint(Checkpoint *ckpt) { this->ckpt = ckpt; }
+
+	/** starts all the stages
+	 * Returns 0 on SUCCESS, -1 on ERROR
+	 */
+	int start();
+
+	/** waits until all the files from the input queue are committed */
+	void wait();
+
+	/** prints the queue depths and the throughput of each stage,
+	 * the time left and the errors of each module
+	 */
+	void report();
+
+	/** number of files whose tags were copied from the cache */
+	long get_deduped() { return deduped; }
+};
+
+#endif /* PIPELINE_HPP_ */
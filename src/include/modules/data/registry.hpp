@@ -0,0 +1,92 @@
+/*
+ registry.hpp
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef REGISTRY_HPP_
+#define REGISTRY_HPP_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+#include "base_module.hpp"
+
+using namespace std;
+
+/** longest extension we look for; longer ones belong to no module */
+#define REG_EXT_MAX 16
+
+/** the modules of one extension */
+typedef boost::unordered_map<string, vector<GenericModule *> > reg_ext_map;
+
+/** node of the path trie, one for each path component */
+struct reg_node
+{
+	map<string, reg_node *> children;
+	/** the modules whose path ends at this node, by extension */
+	reg_ext_map modules;
+};
+
+/** finds the modules for a file
+ * The module paths are kept in a trie of path components, and each
+ * node maps the extensions to the modules mounted there, so a file is
+ * routed with one hash lookup for each module path above it. The
+ * extensions come from GenericModule::extensions().
+ * The registry is built when the modules change and is only read
+ * after that, so the crawler and the pipeline threads share it.
+ */
+class ModuleRegistry
+{
+private:
+	reg_node *root;
+	/** all the extensions, for the crawler */
+	boost::unordered_set<string> all_exts;
+
+	/** frees a subtree */
+	void free_node(reg_node *node);
+
+	/** copies the lowercase extension of the name in ext
+	 * Returns 0 on SUCCESS, -1 if the name has no usable extension
+	 */
+	static int get_ext(const char *name, char *ext);
+
+public:
+	/** constructor */
+	ModuleRegistry();
+
+	/** destructor */
+	~ModuleRegistry();
+
+	/** adds a module, under its path, for all its extensions */
+	void add(GenericModule *module);
+
+	/** removes all the modules */
+	void clear();
+
+	/** adds to "found" the modules that can process the file
+	 * Returns the number of modules found
+	 */
+	int find(const char *path, vector<GenericModule *> *found);
+
+	/** adds to "found" the modules mounted on the directory or
+	 * above it, whatever their extensions
+	 * Returns the number of modules found
+	 */
+	int find_dir(const char *dir, vector<GenericModule *> *found);
+
+	/** checks if any module wants a file with this name
+	 * Returns 1 if it does, 0 otherwise
+	 */
+	int wants(const char *name);
+};
+
+#endif /* REGISTRY_HPP_ */
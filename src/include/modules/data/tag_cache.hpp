@@ -0,0 +1,113 @@
+/*
+ tag_cache.hpp
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef TAG_CACHE_HPP_
+#define TAG_CACHE_HPP_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+#include <boost/unordered_map.hpp>
+
+using namespace std;
+
+/** bytes hashed from the beginning and from the end of a file */
+#ifndef DEDUP_BLOCK
+#define DEDUP_BLOCK 4096
+#endif
+
+/** maximum number of tag sets kept; after that the new ones are
+ * not cached
+ */
+#ifndef TAG_CACHE_MAX
+#define TAG_CACHE_MAX 200000
+#endif
+
+/** default file where the cache is kept between runs */
+#ifndef TAG_CACHE_FILE
+#define TAG_CACHE_FILE ".tag_cache"
+#endif
+
+/** first line of the cache file; the files of another format
+ * are not read
+ */
+#define TAG_CACHE_MAGIC "hybfs tag cache 2"
+
+/** the tags extracted by one module from a content */
+struct tag_cache_entry
+{
+	int module;
+	int version;
+	vector<string> tags;
+};
+
+/** fingerprint of the content of a file: its size, the first and
+ * the last DEDUP_BLOCK bytes
+ * head holds the first headlen bytes of the file; the end is read
+ * from fd if it's not in them.
+ * Returns 0 on SUCCESS, -1 on ERROR
+ */
+int content_hash(int fd, off_t size, const char *head, size_t headlen,
+		unsigned long long *hash);
+
+/** the tags already extracted for a content, so the copies of a file
+ * get them without being parsed again
+ * It's shared by all the parser threads and by all the modules and
+ * branches; the entries also depend on the module and on its
+ * extractor version.
+ */
+class TagCache
+{
+private:
+	boost::unordered_map<unsigned long long, vector<tag_cache_entry> > entries;
+	size_t count;
+	pthread_mutex_t lock;
+
+	volatile long hits;
+
+public:
+	/** constructor */
+	TagCache();
+
+	/** destructor */
+	~TagCache();
+
+	/** copies the tags cached for the content in "tags"
+	 * Returns 1 if they were found, 0 otherwise
+	 */
+	int lookup(unsigned long long hash, int module, int version,
+			vector<string> *tags);
+
+	/** adds the tags extracted for a content */
+	void insert(unsigned long long hash, int module, int version,
+			const vector<string> &tags);
+
+	/** reads the entries saved by save()
+	 * Returns the number of entries read, -1 on ERROR
+	 */
+	long load(FILE *f);
+
+	/** writes all the entries, one on each line, after the
+	 * TAG_CACHE_MAGIC line
+	 * Returns 0 on SUCCESS, -1 on ERROR
+	 */
+	int save(FILE *f);
+
+	/** number of tag sets in the cache */
+	size_t size() { return count; }
+
+	/** number of files that got their tags from the cache */
+	long get_hits() { return hits; }
+};
+
+#endif /* TAG_CACHE_HPP_ */
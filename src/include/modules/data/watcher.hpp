@@ -0,0 +1,114 @@
+/*
+ watcher.hpp
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef WATCHER_HPP_
+#define WATCHER_HPP_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <time.h>
+
+#include "module_loader.hpp"
+#include "pipeline.hpp"
+
+using namespace std;
+
+/** milliseconds without events after which the changes are indexed */
+#ifndef WATCH_QUIET_MS
+#define WATCH_QUIET_MS 500
+#endif
+
+/** seconds after which the changes are indexed even if the
+ * events keep coming
+ */
+#ifndef WATCH_MAX_DELAY
+#define WATCH_MAX_DELAY 10
+#endif
+
+/** size of the buffer for the inotify events */
+#ifndef WATCH_BUF_SIZE
+#define WATCH_BUF_SIZE (64 * 1024)
+#endif
+
+/** what is left to do for a file */
+enum watch_op
+{
+	WATCH_INDEX,
+	WATCH_REMOVE
+};
+
+/** watches the directories of the modules with inotify and
+ * indexes only the files that changed
+ * The events are coalesced: a file written many times, or created
+ * and removed, is handled once, with its last state, after the
+ * directories are quiet for WATCH_QUIET_MS.
+ */
+class IndexDaemon
+{
+private:
+	ModuleManager *manager;
+	pipe_conf conf;
+	int fd;
+
+	/** watched directory for each watch descriptor */
+	map<int, string> dirs;
+	/** files changed since the last flush */
+	map<string, watch_op> pending;
+	/** directories moved from a watched directory, by cookie */
+	map<unsigned int, string> moved;
+	/** when the oldest pending change arrived */
+	time_t first_change;
+	/** the kernel dropped events, so everything is scanned again */
+	int overflow;
+
+	/** adds watches on a directory and all its subdirectories;
+	 * the regular files found are added to "files", if not NULL
+	 */
+	int add_tree(const string &root, vector<string> *files);
+
+	/** drops the watches of a directory and of its subdirectories */
+	void remove_tree(const string &root);
+
+	/** a watched directory was renamed; the files under it are
+	 * indexed with the new path and removed with the old one
+	 */
+	void move_tree(const string &from, const string &to);
+
+	/** records the change of a file, if a module wants it */
+	void queue_file(const string &path, watch_op op);
+
+	/** handles the events from one read of the inotify descriptor */
+	void handle_events(char *buf, ssize_t len);
+
+	/** indexes and removes the pending files */
+	void flush();
+
+	/** indexes again all the directories of the modules */
+	void rescan();
+
+public:
+	/** constructor */
+	IndexDaemon(ModuleManager *manager, pipe_conf *conf);
+
+	/** destructor */
+	~IndexDaemon();
+
+	/** watches the directories of all the modules
+	 * Returns 0 on SUCCESS, -1 on ERROR
+	 */
+	int init();
+
+	/** handles the events until the process gets SIGINT or SIGTERM */
+	int run();
+};
+
+#endif /* WATCHER_HPP_ */
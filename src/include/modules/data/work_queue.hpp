@@ -0,0 +1,202 @@
+/*
+ work_queue.hpp
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#ifndef WORK_QUEUE_HPP_
+#define WORK_QUEUE_HPP_
+
+#include <list>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+using namespace std;
+
+/** bounded queue shared by the producer and the consumer
+ * threads. push() blocks while the queue is full and pop()
+ * blocks while it is empty, so a slow consumer slows down
+ * the producers instead of filling the memory.
+ * The urgent items are taken before all the others.
+ */
+template <class T>
+class WorkQueue
+{
+private:
+	list<T> items;
+	list<T> urgent;
+	size_t count;
+	size_t max;
+	int closed;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+
+public:
+	/** constructor; max is the maximum number of items */
+	WorkQueue(size_t max)
+	{
+		this->max = (max > 0) ? max : 1;
+		count = 0;
+		closed = 0;
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&not_empty, NULL);
+		pthread_cond_init(&not_full, NULL);
+	}
+
+	/** destructor */
+	~WorkQueue()
+	{
+		pthread_cond_destroy(&not_full);
+		pthread_cond_destroy(&not_empty);
+		pthread_mutex_destroy(&lock);
+	}
+
+	/** adds an item, waiting for room if the queue is full
+	 * Returns 0 on SUCCESS, -1 if the queue was closed
+	 */
+	int push(const T &item)
+	{
+		pthread_mutex_lock(&lock);
+		while (count >= max && !closed)
+			pthread_cond_wait(&not_full, &lock);
+		if (closed) {
+			pthread_mutex_unlock(&lock);
+			return -1;
+		}
+		items.push_back(item);
+		count++;
+		pthread_cond_signal(&not_empty);
+		pthread_mutex_unlock(&lock);
+
+		return 0;
+	}
+
+	/** adds an item that is taken before the others; it doesn't
+	 * wait for room, so the producer is never held back
+	 * Returns 0 on SUCCESS, -1 if the queue was closed
+	 */
+	int push_urgent(const T &item)
+	{
+		pthread_mutex_lock(&lock);
+		if (closed) {
+			pthread_mutex_unlock(&lock);
+			return -1;
+		}
+		urgent.push_back(item);
+		count++;
+		pthread_cond_signal(&not_empty);
+		pthread_mutex_unlock(&lock);
+
+		return 0;
+	}
+
+	/** takes the oldest item, waiting for one if the queue is empty;
+	 * is_urgent is set if the item was pushed with push_urgent()
+	 * Returns 0 on SUCCESS, -1 if the queue was closed and is empty
+	 */
+	int pop(T *item, int *is_urgent = NULL)
+	{
+		pthread_mutex_lock(&lock);
+		while (count == 0 && !closed)
+			pthread_cond_wait(&not_empty, &lock);
+		if (count == 0) {
+			pthread_mutex_unlock(&lock);
+			return -1;
+		}
+		take(item, is_urgent);
+		pthread_mutex_unlock(&lock);
+
+		return 0;
+	}
+
+	/** takes the oldest item, waiting for one until the deadline
+	 * (a CLOCK_REALTIME time) if the queue is empty
+	 * Returns 0 on SUCCESS, 1 if the deadline passed, -1 if the
+	 * queue was closed and is empty
+	 */
+	int timed_pop(T *item, const struct timespec *deadline, int *is_urgent = NULL)
+	{
+		int ret = 0;
+
+		pthread_mutex_lock(&lock);
+		while (count == 0 && !closed && ret != ETIMEDOUT)
+			ret = pthread_cond_timedwait(&not_empty, &lock, deadline);
+		if (count == 0) {
+			pthread_mutex_unlock(&lock);
+			return closed ? -1 : 1;
+		}
+		take(item, is_urgent);
+		pthread_mutex_unlock(&lock);
+
+		return 0;
+	}
+
+	/** takes the oldest item, without waiting
+	 * Returns 0 on SUCCESS, -1 if the queue is empty
+	 */
+	int try_pop(T *item, int *is_urgent = NULL)
+	{
+		pthread_mutex_lock(&lock);
+		if (count == 0) {
+			pthread_mutex_unlock(&lock);
+			return -1;
+		}
+		take(item, is_urgent);
+		pthread_mutex_unlock(&lock);
+
+		return 0;
+	}
+
+	/** no more items will be added; the consumers still get
+	 * the ones that are left
+	 */
+	void close()
+	{
+		pthread_mutex_lock(&lock);
+		closed = 1;
+		pthread_cond_broadcast(&not_empty);
+		pthread_cond_broadcast(&not_full);
+		pthread_mutex_unlock(&lock);
+	}
+
+	/** number of items waiting in the queue */
+	size_t size()
+	{
+		size_t ret;
+
+		pthread_mutex_lock(&lock);
+		ret = count;
+		pthread_mutex_unlock(&lock);
+
+		return ret;
+	}
+
+private:
+	/** takes the next item; called with the lock held and count > 0 */
+	void take(T *item, int *is_urgent)
+	{
+		int from_urgent = !urgent.empty();
+
+		if (from_urgent) {
+			*item = urgent.front();
+			urgent.pop_front();
+		}
+		else {
+			*item = items.front();
+			items.pop_front();
+		}
+		if (is_urgent != NULL)
+			*is_urgent = from_urgent;
+		count--;
+		pthread_cond_signal(&not_full);
+	}
+};
+
+#endif /* WORK_QUEUE_HPP_ */
@@ -13,15 +13,16 @@
 #define HYBFS_OPS_HPP_
 
 #include "core/db_backend.hpp"
+#include "core/shard_set.hpp"
 
 using namespace hybfs;
 
 using namespace std;
 
-/** structure to associate a database with a specific path */
+/** structure to associate the databases with a specific path */
 struct db_assoc
 {
-	DbBackend *db;
+	ShardSet *shards;
 	const char * path;
 };
 
@@ -31,6 +32,14 @@ class HybFSOps
 private:
 	//DbBackend *db;
 	vector<db_assoc> vect_db;
+
+	/** copies the content of a regular file; st is the stat of src */
+	int copy_content(const char *src, const char *dst, struct stat *st);
+
+	/** gives the copy dst the tags of the file with the inode src_ino;
+	 * the caller handles the transaction of dst_db
+	 */
+	int copy_tags(DbBackend *src_db, long long src_ino, DbBackend *dst_db, const char *dst);
 public:
 	HybFSOps();
 	~HybFSOps();
@@ -51,10 +60,32 @@ public:
 	 */
 	int ops_file_remove_tag(const char *tag, const char *path);
 
+	/** copies a file along with its tags; the kernel copies the data */
 	int ops_copy_file(const char *src, const char *dst);
 
+	/** copies a directory tree along with the tags of its files; the
+	 * tags go in each destination database in a single transaction,
+	 * and if one of them can't be copied, all of them are rolled back
+	 * (the data stays copied)
+	 */
+	int ops_copy_tree(const char *src, const char *dst);
+
+	/** writes the tags of the files of a mounted directory to a file,
+	 * as they are at one moment, while the directory stays mounted
+	 */
+	int ops_export(const char *path, const char *file);
+
+	/** adds the tags from an export file to the files of a mounted
+	 * directory, found by their paths
+	 */
+	int ops_import(const char *file, const char *path);
+
+	/** the database of the file with this path */
 	DbBackend * get_database(const char *path);
 
+	/** all the databases of the directory this path is in */
+	ShardSet * get_shards(const char *path);
+
 	const char * get_value(const char *str);
 
 	const char * get_tag(const char *str);
@@ -10,10 +10,22 @@ hybfs_ops.cpp
  */
 
 #include <cstring>
+#include <cerrno>
 #include <iostream>
-#include <fstream>
 #include <cstdio>
 #include <list>
+#include <set>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
 #include "hybfs_ops.hpp"
 
 #include "hybfs.h"
@@ -24,6 +36,9 @@ using namespace hybfs;
 
 using namespace std;
 
+/** size of the buffer used when the kernel can't copy the data */
+#define COPY_BUF_SIZE (64 * 1024)
+
 HybFSOps::HybFSOps()
 {
 
@@ -32,7 +47,7 @@ HybFSOps::HybFSOps()
 HybFSOps::~HybFSOps()
 {
 	for (vector<db_assoc>::iterator it = vect_db.begin(); it != vect_db.end(); it++) {
-		delete (*it).db;
+		delete (*it).shards;
 		delete (*it).path;
 	}
 	vect_db.clear();
@@ -54,11 +69,10 @@ int HybFSOps::ops_load_db(const char *path)
 		return -1;
 
 	db_assoc da;
-	DbBackend *db;
+	ShardSet *shards;
 	struct stat buf;
 	string abspath = path;
 	abspath.append(METADIR);
-	db = NULL;
 
 	/* check if the directory exists, if not - create */
 	if (lstat(abspath.c_str(), &buf) == -1) {
@@ -68,14 +82,16 @@ int HybFSOps::ops_load_db(const char *path)
 			perror("Failed to create directory: ");
 		}
 	}
-	abspath.append(MAINDB);
 
-	db = new DbBackend(abspath.c_str(), path);
+	shards = new ShardSet(abspath.c_str(), path);
 	da.path = strdup(path);
-	da.db = db;
+	da.shards = shards;
 	vect_db.push_back(da);
 
-	return db->db_init_storage();
+	/* the module manager doesn't fork, the threads can start now */
+	if (shards->init(0))
+		return -1;
+	return shards->start();
 }
 
 int HybFSOps::verify_database(const char *path)
@@ -89,22 +105,46 @@ int HybFSOps::verify_database(const char *path)
 
 list<string> * HybFSOps::ops_list_tags(const char *path)
 {
-	DbBackend *db = get_database(path);
-	if (db == NULL)
+	ShardSet *shards = get_shards(path);
+	list<string> *ret, *tags;
+
+	if (shards == NULL)
 		return NULL;
 
-	return db->db_get_tags_values(NULL);
+	/* every shard has the tags of its files */
+	ret = new list<string>;
+	for (int i = 0; i < shards->size(); i++) {
+		tags = shards->get(i)->db_get_tags_values(NULL);
+		if (tags == NULL)
+			continue;
+		ret->splice(ret->end(), *tags);
+		delete tags;
+	}
+	if (shards->size() > 1) {
+		ret->sort();
+		ret->unique();
+	}
+	return ret;
 }
 
-DbBackend * HybFSOps::get_database(const char *path)
+ShardSet * HybFSOps::get_shards(const char *path)
 {
 	for (vector<db_assoc>::iterator it = vect_db.begin(); it != vect_db.end(); ++it) {
 		if (strncmp((*it).path, path, strlen((*it).path)) == 0)
-			return (*it).db;
+			return (*it).shards;
 	}
 	return NULL;
 }
 
+DbBackend * HybFSOps::get_database(const char *path)
+{
+	ShardSet *shards = get_shards(path);
+
+	if (shards == NULL)
+		return NULL;
+	return shards->of_path(path + strlen(get_vdir_path(path)));
+}
+
 const char * HybFSOps::get_vdir_path(const char *path)
 {
 	for (vector<db_assoc>::iterator it = vect_db.begin(); it != vect_db.end(); it++) {
@@ -245,9 +285,133 @@ int HybFSOps::ops_read_conf_file (FILE * f)
 }
 
 
+/** a file whose data was copied, waiting for its tags */
+struct copied_file
+{
+	long long ino;
+	string src;
+	string dst;
+};
+
+/** copies what the other methods left, through a buffer */
+static int copy_rw(int in, int out, off_t off, off_t size)
+{
+	char buf[COPY_BUF_SIZE];
+	ssize_t n, w;
+
+	while (off < size) {
+		n = pread(in, buf, sizeof(buf), off);
+		if (n == 0)
+			break;
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (ssize_t done = 0; done < n; done += w) {
+			w = pwrite(out, buf + done, n - done, off + done);
+			if (w == -1) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				return -1;
+			}
+		}
+		off += n;
+	}
+	return 0;
+}
+
+int HybFSOps::copy_content(const char *src, const char *dst, struct stat *st)
+{
+	int in, out, ret = -1;
+	off_t off = 0;
+	ssize_t n = 0;
+
+	in = open(src, O_RDONLY);
+	if (in == -1) {
+		fprintf(stderr, "cannot open %s: %s\n", src, strerror(errno));
+		return -1;
+	}
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 07777);
+	if (out == -1) {
+		fprintf(stderr, "cannot create %s: %s\n", dst, strerror(errno));
+		close(in);
+		return -1;
+	}
+
+#ifdef FICLONE
+	/* the file systems that share the blocks don't copy anything */
+	if (ioctl(out, FICLONE, in) == 0) {
+		ret = 0;
+		goto out;
+	}
+#endif
+#ifdef __NR_copy_file_range
+	/* the data stays in the kernel, or on the server for NFS */
+	while (off < st->st_size) {
+		n = syscall(__NR_copy_file_range, in, NULL, out, NULL, st->st_size - off, 0);
+		if (n <= 0)
+			break;
+		off += n;
+	}
+	if (off >= st->st_size) {
+		ret = 0;
+		goto out;
+	}
+	if (n == -1 && errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+	    errno != EOPNOTSUPP)
+		goto error;
+#endif
+	/* still in the kernel, but through the page cache */
+	while (off < st->st_size) {
+		n = sendfile(out, in, &off, st->st_size - off);
+		if (n <= 0)
+			break;
+	}
+	if (off >= st->st_size) {
+		ret = 0;
+		goto out;
+	}
+	if (n == -1 && errno != ENOSYS && errno != EINVAL)
+		goto error;
+	ret = copy_rw(in, out, off, st->st_size);
+	if (ret == 0)
+		goto out;
+
+error:
+	fprintf(stderr, "cannot copy %s: %s\n", src, strerror(errno));
+	ret = -1;
+out:
+	close(in);
+	if (close(out) && ret == 0) {
+		fprintf(stderr, "cannot write %s: %s\n", dst, strerror(errno));
+		ret = -1;
+	}
+	return ret;
+}
+
+int HybFSOps::copy_tags(DbBackend *src_db, long long src_ino, DbBackend *dst_db, const char *dst)
+{
+	file_info_t *finfo;
+	int ret;
+
+	/* extract inode information about the destination file */
+	finfo = get_file_info(dst);
+	if (!finfo)
+		return -1;
+
+	ret = dst_db->db_copy_file_tags(src_ino, src_db, finfo);
+	free (finfo);
+	return ret;
+}
+
 int HybFSOps::ops_copy_file(const char *src, const char *dst)
 {
 	DbBackend *src_db, *dst_db;
+	struct stat buf;
+	int ret;
 
 	src_db = get_database(src);
 	dst_db = get_database(dst);
@@ -256,75 +420,199 @@ int HybFSOps::ops_copy_file(const char *src, const char *dst)
 		return -1;
 
 	/* verify if the path and the file exists */
-	struct stat buf;
-	if (stat(src, &buf) != 0)
+	if (stat(src, &buf) != 0 || !S_ISREG(buf.st_mode))
 		return -1;
 
-	char *dst_copy = strdup(dst);
-	char *delimiter;
-	delimiter = strrchr (dst_copy, '/');
-	(*delimiter) = '\0';
-	if (lstat(dst_copy, &buf) != 0) {
-		delete dst_copy;
-		return -1;
-	}
-	delete dst_copy;
-
 	/* copy the file effectively */
-	ifstream inputFile (src, ifstream::in);
-	ofstream outputFile (dst);
-
-	outputFile << inputFile.rdbuf();
+	if (copy_content(src, dst, &buf))
+		return -1;
 
+	if (dst_db->db_begin_transaction())
+		return -1;
+	ret = copy_tags(src_db, buf.st_ino, dst_db, dst);
+	if (ret)
+		dst_db->db_rollback();
+	else
+		ret = dst_db->db_end_transaction();
 
-	/* get file tags */
-	list<string> *tags = src_db->db_get_tags_values(src + strlen(get_vdir_path(src)));
+	return ret;
+}
 
-	/* the file have no tags -->
-	 * TODO: if path/filename is saved in the database
-	 * this data will be copied
-	 */
-	if (tags == NULL) {
-		return 0;
+/* returns 1 if the directory is the path or one of the directories above it;
+ * a path that doesn't exist yet is looked at from its parent
+ */
+static int is_under(const struct stat *dir, const char *path)
+{
+	struct stat st, parent;
+	string up = path;
+	size_t slash;
+
+	if (stat(up.c_str(), &st)) {
+		slash = up.rfind('/');
+		up = (slash == string::npos) ? "." : up.substr(0, slash ? slash : 1);
+		if (stat(up.c_str(), &st))
+			return 0;
+	}
+	/* by inode, so the links and the mounts don't fool us */
+	while (st.st_dev != dir->st_dev || st.st_ino != dir->st_ino) {
+		up.append("/..");
+		if (stat(up.c_str(), &parent))
+			return 0;
+		/* the root is its own parent */
+		if (parent.st_dev == st.st_dev && parent.st_ino == st.st_ino)
+			return 0;
+		st = parent;
 	}
 
-	/* get the new file attributes ... to populate the new database */
-	/* TODO: WHO frees the memory ???? */
-	vector<string> vtags; // = new vector<string>();
-	file_info_t *finfo;		// structure with info to populate the database
+	return 1;
+}
 
-	/* extract inode information about the destination file */
-	finfo = get_file_info(dst);
+int HybFSOps::ops_copy_tree(const char *src, const char *dst)
+{
+	vector<pair<string, string> > todo;
+	vector<copied_file> copied;
+	copied_file cf;
+	set<DbBackend *> dbs;
+	DbBackend *src_db, *dst_db;
+	struct dirent *de;
+	struct stat buf;
+	string sdir, ddir, spath, dpath;
+	DIR *d;
+	int ret = 0, tags_failed = 0;
 
-	if (!finfo) {
+	if (stat(src, &buf) != 0 || !S_ISDIR(buf.st_mode))
+		return -1;
+	/* the copy would go on copying itself */
+	if (is_under(&buf, dst)) {
+		fprintf(stderr, "cannot copy %s inside itself\n", src);
 		return -1;
 	}
-
-	/* copy the tags list into the vtags vector */
-	for (list<string>::iterator it = tags->begin(); it != tags->end(); ++it) {
-		vtags.push_back((*it).substr(1, (*it).size() - 2));
+	if (mkdir(dst, buf.st_mode & 07777) && errno != EEXIST) {
+		fprintf(stderr, "cannot create %s: %s\n", dst, strerror(errno));
+		return -1;
 	}
 
+	/* the data first, the tags of all the files at the end */
+	todo.push_back(make_pair(string(src), string(dst)));
+	while (!todo.empty()) {
+		sdir = todo.back().first;
+		ddir = todo.back().second;
+		todo.pop_back();
+
+		d = opendir(sdir.c_str());
+		if (d == NULL) {
+			fprintf(stderr, "cannot open %s: %s\n", sdir.c_str(), strerror(errno));
+			ret = -1;
+			continue;
+		}
+		while ((de = readdir(d)) != NULL) {
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			spath = sdir + "/" + de->d_name;
+			dpath = ddir + "/" + de->d_name;
+			if (lstat(spath.c_str(), &buf))
+				continue;
+			if (S_ISDIR(buf.st_mode)) {
+				if (mkdir(dpath.c_str(), buf.st_mode & 07777) && errno != EEXIST) {
+					fprintf(stderr, "cannot create %s: %s\n", dpath.c_str(), strerror(errno));
+					ret = -1;
+					continue;
+				}
+				todo.push_back(make_pair(spath, dpath));
+			}
+			else if (S_ISREG(buf.st_mode)) {
+				if (copy_content(spath.c_str(), dpath.c_str(), &buf)) {
+					ret = -1;
+					continue;
+				}
+				cf.ino = buf.st_ino;
+				cf.src = spath;
+				cf.dst = dpath;
+				copied.push_back(cf);
+			}
+		}
+		closedir(d);
+	}
 
-	/* set the tags for the file in the destination database */
-	dst_db->db_add_file_info(&vtags, finfo,0);
-
-	/* memory clean */
-	delete (finfo);
-	if (tags) {
-		tags->clear();
-		delete tags;
+	/* one transaction for each destination database; if a tag copy
+	 * fails, none of the tags are copied
+	 */
+	for (vector<copied_file>::iterator c = copied.begin(); c != copied.end(); c++) {
+		src_db = get_database((*c).src.c_str());
+		dst_db = get_database((*c).dst.c_str());
+		if (src_db == NULL || dst_db == NULL)
+			continue;
+		if (dbs.count(dst_db) == 0) {
+			if (dst_db->db_begin_transaction()) {
+				tags_failed = 1;
+				break;
+			}
+			dbs.insert(dst_db);
+		}
+		if (copy_tags(src_db, (*c).ino, dst_db, (*c).dst.c_str())) {
+			tags_failed = 1;
+			break;
+		}
+	}
+	for (set<DbBackend *>::iterator db = dbs.begin(); db != dbs.end(); db++) {
+		if (tags_failed)
+			(*db)->db_rollback();
+		else if ((*db)->db_end_transaction())
+			ret = -1;
 	}
-	if (vtags.empty()) {
-		vtags.clear();
-		//delete vtags; I believe this is done at function exit
+	if (tags_failed) {
+		fprintf(stderr, "the tags were not copied to %s\n", dst);
+		ret = -1;
 	}
 
+	return ret;
+}
 
+int HybFSOps::ops_export(const char *path, const char *file)
+{
+	ShardSet *shards = get_shards(path);
+	export_stats_t stats;
+	FILE *f;
+	int ret;
 
+	if (shards == NULL) {
+		fprintf(stderr, "%s is not in a loaded path\n", path);
+		return -1;
+	}
+	f = fopen(file, "w");
+	if (f == NULL) {
+		fprintf(stderr, "cannot create %s: %s\n", file, strerror(errno));
+		return -1;
+	}
+	/* the records are small, they go out in large writes */
+	setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+	ret = shards->export_tags(f, &stats);
+	if (fclose(f))
+		ret = -1;
+	if (ret) {
+		unlink(file);
+		return -1;
+	}
+	printf ("%lld tags, %lld files, %lld associations exported\n",
+			stats.ntags, stats.nfiles, stats.nassoc);
+	return 0;
+}
 
+int HybFSOps::ops_import(const char *file, const char *path)
+{
+	ShardSet *shards = get_shards(path);
+	export_stats_t stats;
 
-	/* TODO: if the dst file exists ... delete the apropriate entries in the database */
+	if (shards == NULL) {
+		fprintf(stderr, "%s is not in a loaded path\n", path);
+		return -1;
+	}
+	/* each database of the directory reads the file by itself */
+	if (shards->import_tags(file, &stats))
+		return -1;
+	printf ("%lld tags, %lld files read, %lld associations added, "
+			"%lld files not found\n", stats.ntags, stats.nfiles,
+			stats.nassoc, stats.nskipped);
 	return 0;
 }
-
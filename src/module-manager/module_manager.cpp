@@ -12,13 +12,11 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <csignal>
 
 #include <sys/types.h>
 
-#include <limits.h>
-#include <fnmatch.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <iostream>
 #include <list>
 
@@ -27,55 +25,185 @@
 #include "hybfs_ops.hpp"
 #include "base_module.hpp"
 #include "module_loader.hpp"
-
-#define FILTER1 "*.[mM][pP]3"
-#define FILTER2 "*.[jJ][pP][gG]"
+#include "crawler.hpp"
+#include "pipeline.hpp"
+#include "watcher.hpp"
+#include "fingerprint.hpp"
+#include "hot_listener.hpp"
+#include "checkpoint.hpp"
 
 using namespace std;
 
-int scandirectory(const char *dirname, ModuleManager *m)
+/* the sizes of the indexing stages, changed with the "threads" command */
+static pipe_conf pconf;
+
+/* the tags of the contents already parsed, used after "dedup on" */
+static TagCache tag_cache;
+
+int dedup(int on)
 {
-	DIR *dir;
-	struct dirent *entry;
-	char path[PATH_MAX];
+	FILE *f;
+	long n;
 
-	if (path == NULL) {
-		fprintf(stderr, "Out of memory error\n");
+	if (!on) {
+		pconf.cache = NULL;
 		return 0;
 	}
-	dir = opendir(dirname);
-	if (dir == NULL) {
-		perror("Error opendir()");
+	if (pconf.cache != NULL)
 		return 0;
+
+	/* the cache of the previous runs */
+	f = fopen(TAG_CACHE_FILE, "r");
+	if (f) {
+		n = tag_cache.load(f);
+		fclose(f);
+		printf ("%ld contents loaded from %s\n", n, TAG_CACHE_FILE);
 	}
+	pconf.cache = &tag_cache;
+	return 0;
+}
 
-	while ((entry = readdir(dir)) != NULL) {
-		if (entry->d_type == DT_DIR) {
-			if (strcmp(entry->d_name, ".")
-					&& strcmp(entry->d_name, "..")) {
-				snprintf(path, (size_t) PATH_MAX, "%s/%s", dirname,
-						entry->d_name);
-				scandirectory(path, m);
-			}
-		} else if (entry->d_type == DT_REG) {
-			if (!fnmatch(FILTER1, entry->d_name, 0) || !fnmatch(FILTER2, entry->d_name, 0)) {
-				/* files that are matched are passed to the ModuleManager
-				 * object to index them apropriately
-				 */
-				char *full_path;
-				full_path = (char *) malloc ((strlen(dirname) + strlen(entry->d_name) + 2) * sizeof(char));
-				sprintf (full_path, "%s/%s", dirname, entry->d_name);
-				m->mod_process_file(full_path);
-				if (full_path != NULL)
-					free (full_path);
-			}
-		}
+int save_dedup()
+{
+	FILE *f;
+	int ret;
+
+	if (pconf.cache == NULL)
+		return 0;
+
+	f = fopen(TAG_CACHE_FILE, "w");
+	if (!f) {
+		printf ("ERROR: could not write %s\n", TAG_CACHE_FILE);
+		return -1;
+	}
+	ret = tag_cache.save(f);
+	fclose(f);
+	return ret;
+}
+
+/* the walk stopped by Ctrl-C during parsedir */
+static DirCrawler *running_crawler = NULL;
+
+static void stop_scan(int sig)
+{
+	if (running_crawler != NULL)
+		running_crawler->stop();
+}
+
+/* "dir/" and "dir" are the same run: the checkpoint keeps the directories
+ * by the paths the crawler gives, which have no '/' at the end */
+static string crawl_root(const char *dirname)
+{
+	string root = dirname;
+
+	while (root.length() > 1 && root[root.length() - 1] == '/')
+		root.erase(root.length() - 1);
+	return root;
+}
+
+int scandirectory(const char *arg, ModuleManager *m, int force)
+{
+	string root = crawl_root(arg);
+	const char *dirname = root.c_str();
+	WorkQueue<string> files(CRAWL_QUEUE_MAX);
+	DirCrawler crawler(&files, 0);
+	IndexPipeline pipeline(m, &files, &pconf);
+	FingerprintFilter unchanged(m);
+	Checkpoint ckpt(m, dirname);
+	struct sigaction sa, old_sa;
+	int filtered = 0, resumed = 0;
+	long n;
+
+	/* the extensions of the modules tell which files we want */
+	crawler.set_registry(m->mod_get_registry());
+
+	/* the directories done by a run that was interrupted */
+	if (force) {
+		ckpt.clear();
+	}
+	else if ((n = ckpt.load()) > 0) {
+		printf ("resuming the previous run, %ld directories already done\n", n);
+		resumed = 1;
 	}
-	closedir(dir);
+	crawler.set_checkpoint(&ckpt);
+	pipeline.set_checkpoint(&ckpt);
+	pipeline.set_source(&crawler);
+
+	/* the files that didn't change since the last run are not read */
+	if (!force && unchanged.load() >= 0) {
+		crawler.set_filter(&unchanged);
+		filtered = 1;
+	}
+	/* the files used through the mount point go before the others */
+	HotListener hot(m, &files, filtered ? &unchanged : NULL);
+
+	/* files that are matched are passed to the pipeline, which
+	 * reads them, extracts the tags with the modules and adds
+	 * them in the apropriate databases
+	 */
+	if (pipeline.start() != 0)
+		return 0;
+	hot.start();
+	if (crawler.start(dirname) != 0) {
+		hot.stop();
+		pipeline.wait();
+		return 0;
+	}
+
+	/* Ctrl-C ends the walk; the files already found are committed
+	 * and the checkpoint saved, so the next parsedir goes on from there
+	 */
+	running_crawler = &crawler;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_scan;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &old_sa);
+
+	crawler.wait();
+	hot.stop();
+	pipeline.wait();
+
+	sigaction(SIGINT, &old_sa, NULL);
+	running_crawler = NULL;
+
+	printf ("%ld files found in %ld directories, %ld unchanged\n",
+			crawler.get_nfiles() + crawler.get_nskipped(),
+			crawler.get_ndirs(), crawler.get_nskipped());
+	if (resumed)
+		printf ("%ld files left out, their directories were done before\n",
+				crawler.get_nresumed());
+	if (crawler.get_stopped()) {
+		ckpt.save(1);
+		printf ("stopped; parsedir %s goes on from here\n", dirname);
+	}
+	else {
+		ckpt.clear();
+	}
+
+	/* the mount maps the snapshot instead of reading the tables */
+	vector<GenericModule *> mods;
+	m->mod_get_modules(&mods);
+	for (vector<GenericModule *>::iterator i = mods.begin(); i != mods.end(); i++)
+		(*i)->vdir->write_snapshot();
+	if (hot.get_nqueued() > 0)
+		printf ("%ld files indexed first because they were used\n", hot.get_nqueued());
+	pipeline.report();
 	return 1;
 }
 
 
+int rundaemon(ModuleManager *m)
+{
+	IndexDaemon daemon(m, &pconf);
+
+	if (daemon.init() != 0) {
+		printf ("can't watch the module paths\n");
+		return -1;
+	}
+	return daemon.run();
+}
+
+
 void print_help()
 {
 	cout<<"module_manager usage:"<<endl<<endl;
@@ -86,8 +214,14 @@ void print_help()
 	cout<<"list [path | modules]\n";
 	cout<<"\t-the list of all modules loaded [modules] or mounted directories paths [path]\n\n";
 	cout<<"parse file_path\n\t-if there is a module loaded for the path where the file resides, the information extracted from the file will be loaded in the appropriate database\n\n";
-	cout<<"parsedir dir_path\n\t-searches recursively in the dir_path and parses all the files that have the apropriate extensions\n\n";
+	cout<<"parsedir dir_path [-f]\n\t-searches recursively in the dir_path and parses all the files that have the apropriate extensions and changed since the last time, or all of them with -f\n\t-Ctrl-C stops it; the next parsedir of the same dir_path skips the directories already done, unless -f is given\n\n";
+	cout<<"daemon\n\t-watches the paths of the modules and indexes the files as they are written, moved or removed, until Ctrl-C\n\n";
+	cout<<"dedup on|off\n\t-files with the same size, first and last blocks as a file already parsed get the tags of that file without being parsed; the tags are kept in "<<TAG_CACHE_FILE<<"\n\n";
+	cout<<"threads io_threads parser_threads\n\t-sets the number of threads that read the files and that extract the tags for parsedir (0 for one parser per core)\n\n";
 	cout<<"cp src_location dst_location\n\t"<<"-copies a file along with its tags from one location to another. If the dst_location is in another mounted directory... the tag information will be stored in the appropriate database\n\n";
+	cout<<"cpdir src_dir dst_dir\n\t-copies a directory tree along with the tags of its files; the tags are stored in one transaction, and none of them are if one fails\n\n";
+	cout<<"export dir_path file\n\t-writes the tags of the files in dir_path, a loaded path, to file; the path can stay mounted\n\n";
+	cout<<"import file dir_path\n\t-adds the tags from an export file to the files of dir_path with the same relative paths\n\n";
 }
 
 
@@ -96,6 +230,8 @@ int main(int argc, char** argv)
 	ModuleManager m;
 	HybFSOps ops;
 
+	IndexPipeline::default_conf(&pconf);
+
 	/* trying to load the default module configuration */
 	FILE * f_conf;
 
@@ -134,22 +270,42 @@ int main(int argc, char** argv)
 	int count;
 	char cmd[100], arg1[100], arg2[100];
 
+	/* "-d" runs only the indexing daemon, without the prompt;
+	 * "-d dedup" also copies the tags between the same contents
+	 */
+	if (argc > 1 && strcmp(argv[1], "-d") == 0) {
+		if (argc > 2 && strcmp(argv[2], "dedup") == 0)
+			dedup(1);
+		ret = rundaemon(&m);
+		save_dedup();
+		return ret;
+	}
+
 	while (1) {
 		cout<<"command: ";
 		getline(cin, s);
 		count = sscanf(s.c_str(), "%s %s %s", cmd, arg1, arg2);
 
-		if (strcmp(cmd, "exit") == 0)
+		if (strcmp(cmd, "exit") == 0) {
+			save_dedup();
 			break;
+		}
 		if (strcmp(cmd, "help") == 0)
 			print_help();
 
+		if (count == 1 && strcmp(cmd, "daemon") == 0)
+			rundaemon(&m);
+
 		if (count == 2) {
-			if (strcmp(cmd, "parse") == 0) {
+			if (strcmp(cmd, "dedup") == 0) {
+				dedup(strcmp(arg1, "on") == 0);
+				cout<<"dedup "<<(pconf.cache ? "on" : "off")<<endl;
+			}
+			else if (strcmp(cmd, "parse") == 0) {
 				m.mod_process_file(arg1);
 			}
 			else if (strcmp(cmd, "parsedir") == 0) {
-				scandirectory(arg1, &m);
+				scandirectory(arg1, &m, 0);
 			}
 			else if (strcmp(cmd, "path") == 0) {
 				ret = ops.ops_load_db(arg1);
@@ -213,7 +369,12 @@ int main(int argc, char** argv)
 		}
 		else if (count == 3) {
 			if (strcmp(cmd, "cp") == 0) {
-				ops.ops_copy_file (arg1, arg2);
+				if (ops.ops_copy_file (arg1, arg2) != 0)
+					cout<<"error copying "<<arg1<<endl;
+			}
+			else if (strcmp(cmd, "cpdir") == 0) {
+				if (ops.ops_copy_tree (arg1, arg2) != 0)
+					cout<<"some files of "<<arg1<<" were not copied"<<endl;
 			}
 			else if (strcmp(cmd, "rm") == 0) {
 				if (ops.ops_file_remove_tag(arg1, arg2) == 0) {
@@ -224,6 +385,22 @@ int main(int argc, char** argv)
 				}
 
 			}
+			else if (strcmp(cmd, "parsedir") == 0 && strcmp(arg2, "-f") == 0) {
+				scandirectory(arg1, &m, 1);
+			}
+			else if (strcmp(cmd, "export") == 0) {
+				if (ops.ops_export(arg1, arg2) != 0)
+					cout<<"error exporting "<<arg1<<endl;
+			}
+			else if (strcmp(cmd, "import") == 0) {
+				if (ops.ops_import(arg1, arg2) != 0)
+					cout<<"error importing "<<arg1<<endl;
+			}
+			else if (strcmp(cmd, "threads") == 0) {
+				pconf.nreaders = atoi(arg1);
+				pconf.nparsers = atoi(arg2);
+				cout<<"io threads: "<<pconf.nreaders<<", parser threads: "<<pconf.nparsers<<endl;
+			}
 			else if (strcmp(cmd, "module") == 0) {
 				int ret = m.mod_add_module(m.mod_char_to_type(arg1), arg2);
 				if (ret != 0)
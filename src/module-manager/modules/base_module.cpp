@@ -35,37 +35,51 @@ void GenericModule::init_vdir(const char * path)
 {
 	this->path = strdup(path);
 	vdir = new VirtualDirectory(path);
-	vdir->init();
+	if (vdir->init() == 0)
+		vdir->start();
 }
 
 file_info_t * GenericModule::get_file_info(const char * path)
 {
-	struct stat *buf;			// file information structure for stat function
-	file_info_t *finfo = NULL;	// structure with info to populate the database
-
-	buf = (struct stat *) malloc (sizeof(struct stat));
-	if (!buf)
-		return NULL;
+	struct stat buf;			// file information structure for stat function
 
 	/* if the stat function returns an error */
-	if (0 != stat(path, buf)) {
+	if (0 != stat(path, &buf)) {
 		return NULL;
 	}
 
+	return make_file_info(path, &buf);
+}
+
+file_info_t * GenericModule::make_file_info(const char * path, struct stat *st)
+{
+	file_info_t *finfo = NULL;	// structure with info to populate the database
+
 	finfo = (file_info_t *) malloc (sizeof(file_info_t) + strlen(path) + 1 - strlen(this->path));
-	if (!finfo) {
-		free (buf);
+	if (!finfo)
 		return NULL;
-	}
 
 	/* copy stat information in the finfo structure */
-	finfo->fid = buf->st_ino;
-	finfo->mode = buf->st_mode;
+	finfo->fid = st->st_ino;
+	finfo->mode = st->st_mode;
 	finfo->namelen = strlen(path) - strlen(this->path);
 	strcpy(finfo->name, path + strlen(this->path));
 
-	/* clean up the mess */
-	delete (buf);
-
 	return finfo;
 }
+
+int GenericModule::remove_files(std::vector<std::string> *paths)
+{
+	std::vector<std::string> names;
+	size_t len = strlen(this->path);
+
+	/* the names are kept in the database as make_file_info() builds them */
+	for (std::vector<std::string>::iterator i = paths->begin(); i != paths->end(); i++) {
+		if ((*i).compare(0, len, this->path) == 0)
+			names.push_back((*i).substr(len));
+	}
+	if (names.empty())
+		return 0;
+
+	return vdir->vdir_remove_stale(&names);
+}
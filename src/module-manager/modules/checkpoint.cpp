@@ -0,0 +1,151 @@
+/*
+ checkpoint.cpp - Directories already indexed by an interrupted parsedir
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <cstdio>
+#include <cstring>
+
+#include "checkpoint.hpp"
+
+using namespace std;
+
+Checkpoint::Checkpoint(ModuleManager *manager, const char *root)
+{
+	this->manager = manager;
+	this->root = root;
+	/* the crawler gives the directories without the last '/' */
+	while (this->root.length() > 1 && this->root[this->root.length() - 1] == '/')
+		this->root.erase(this->root.length() - 1);
+	last_save = time(NULL);
+	pthread_mutex_init(&lock, NULL);
+}
+
+Checkpoint::~Checkpoint()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+long Checkpoint::load()
+{
+	vector<GenericModule *> mods;
+
+	manager->mod_get_modules(&mods);
+	for (vector<GenericModule *>::iterator m = mods.begin(); m != mods.end(); m++) {
+		if ((*m)->vdir->checkpoint_load(root.c_str(), &done)) {
+			printf ("can't load the checkpoint from %s\n", (*m)->get_path());
+			return -1;
+		}
+	}
+
+	return done.size();
+}
+
+int Checkpoint::is_done(const string &dir)
+{
+	/* only read after load(), no lock needed */
+	return done.count(dir) > 0;
+}
+
+void Checkpoint::check_dir(map<string, ckpt_dir>::iterator d)
+{
+	if (d->second.read && d->second.pending <= 0) {
+		finished.push_back(d->first);
+		dirs.erase(d);
+	}
+}
+
+void Checkpoint::file_queued(const string &dir)
+{
+	pthread_mutex_lock(&lock);
+	dirs[dir].pending++;
+	pthread_mutex_unlock(&lock);
+}
+
+void Checkpoint::dir_read(const string &dir)
+{
+	map<string, ckpt_dir>::iterator d;
+
+	pthread_mutex_lock(&lock);
+	/* a new entry starts with everything 0 */
+	d = dirs.insert(make_pair(dir, ckpt_dir())).first;
+	d->second.read = 1;
+	check_dir(d);
+	pthread_mutex_unlock(&lock);
+}
+
+void Checkpoint::file_done(const string &path)
+{
+	map<string, ckpt_dir>::iterator d;
+	size_t slash = path.rfind('/');
+
+	if (slash == string::npos)
+		return;
+
+	pthread_mutex_lock(&lock);
+	d = dirs.find(path.substr(0, (slash > 0) ? slash : 1));
+	if (d != dirs.end()) {
+		d->second.pending--;
+		check_dir(d);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+int Checkpoint::save(int force)
+{
+	map<GenericModule *, vector<string> > dbs;
+	map<GenericModule *, vector<string> >::iterator db;
+	vector<GenericModule *> mods;
+	vector<string> todo;
+	int ret = 0;
+
+	pthread_mutex_lock(&lock);
+	if (!force && time(NULL) - last_save < CKPT_INTERVAL) {
+		pthread_mutex_unlock(&lock);
+		return 0;
+	}
+	todo.swap(finished);
+	last_save = time(NULL);
+	pthread_mutex_unlock(&lock);
+
+	/* each directory goes in the databases of the modules that
+	 * index it; nobody indexes the ones without a module
+	 */
+	for (vector<string>::iterator d = todo.begin(); d != todo.end(); d++) {
+		mods.clear();
+		manager->mod_get_registry()->find_dir((*d).c_str(), &mods);
+		for (vector<GenericModule *>::iterator m = mods.begin(); m != mods.end(); m++)
+			dbs[*m].push_back(*d);
+	}
+	for (db = dbs.begin(); db != dbs.end(); db++) {
+		if (db->first->vdir->checkpoint_add(root.c_str(), &db->second)) {
+			printf ("can't save the checkpoint in %s\n", db->first->get_path());
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+int Checkpoint::clear()
+{
+	vector<GenericModule *> mods;
+	int ret = 0;
+
+	manager->mod_get_modules(&mods);
+	for (vector<GenericModule *>::iterator m = mods.begin(); m != mods.end(); m++) {
+		if ((*m)->vdir->checkpoint_clear(root.c_str()))
+			ret = -1;
+	}
+	pthread_mutex_lock(&lock);
+	finished.clear();
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
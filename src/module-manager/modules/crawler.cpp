@@ -0,0 +1,321 @@
+/*
+ crawler.cpp - Parallel walk of a directory tree
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <stdint.h>
+
+#include "crawler.hpp"
+
+using namespace std;
+
+/** sleep of a thread that has nothing to steal, in microseconds */
+#define CRAWL_IDLE_US 500
+
+/** the record returned by getdents64; glibc has no wrapper for it */
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct crawl_arg
+{
+	DirCrawler *crawler;
+	int id;
+};
+
+DirCrawler::DirCrawler(WorkQueue<string> *out, int nthreads)
+{
+	long ncpus;
+
+	if (nthreads <= 0) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpus < 1)
+			ncpus = 1;
+		nthreads = ncpus * CRAWL_THREADS_PER_CPU;
+	}
+	this->nthreads = nthreads;
+	this->out = out;
+	filter = NULL;
+	ckpt = NULL;
+	nresumed = 0;
+	stopping = 0;
+	registry = NULL;
+	nskipped = 0;
+	pending = 0;
+	running = 0;
+	nfiles = 0;
+	ndirs = 0;
+
+	for (int i = 0; i < nthreads; i++) {
+		crawl_deque *d = new crawl_deque;
+		pthread_mutex_init(&d->lock, NULL);
+		deques.push_back(d);
+	}
+}
+
+DirCrawler::~DirCrawler()
+{
+	wait();
+	for (vector<crawl_deque *>::iterator i = deques.begin(); i != deques.end(); i++) {
+		pthread_mutex_destroy(&(*i)->lock);
+		delete (*i);
+	}
+	deques.clear();
+}
+
+void DirCrawler::add_pattern(const char *pattern)
+{
+	patterns.push_back(pattern);
+}
+
+void DirCrawler::set_registry(ModuleRegistry *registry)
+{
+	this->registry = registry;
+}
+
+void DirCrawler::set_filter(CrawlFilter *filter)
+{
+	this->filter = filter;
+}
+
+void DirCrawler::set_checkpoint(Checkpoint *ckpt)
+{
+	this->ckpt = ckpt;
+}
+
+int DirCrawler::match(const char *name)
+{
+	if (registry != NULL)
+		return registry->wants(name);
+	if (patterns.empty())
+		return 1;
+	for (vector<string>::iterator i = patterns.begin(); i != patterns.end(); i++) {
+		if (!fnmatch((*i).c_str(), name, 0))
+			return 1;
+	}
+	return 0;
+}
+
+void DirCrawler::push_dir(int id, const string &dir)
+{
+	crawl_deque *d = deques[id];
+
+	/* count it before anybody can take it, so the walk doesn't
+	 * look finished in the meantime
+	 */
+	__sync_add_and_fetch(&pending, 1);
+	pthread_mutex_lock(&d->lock);
+	d->dirs.push_back(dir);
+	pthread_mutex_unlock(&d->lock);
+}
+
+int DirCrawler::next_dir(int id, string *dir)
+{
+	crawl_deque *d = deques[id];
+
+	/* our own work first, the last directory found is the
+	 * closest one on the disk
+	 */
+	pthread_mutex_lock(&d->lock);
+	if (!d->dirs.empty()) {
+		*dir = d->dirs.back();
+		d->dirs.pop_back();
+		pthread_mutex_unlock(&d->lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	/* steal the oldest directory of somebody else: it's the
+	 * one closest to the root, so it has the most work under it
+	 */
+	for (int i = 1; i < nthreads; i++) {
+		d = deques[(id + i) % nthreads];
+		if (pthread_mutex_trylock(&d->lock))
+			continue;
+		if (!d->dirs.empty()) {
+			*dir = d->dirs.front();
+			d->dirs.pop_front();
+			pthread_mutex_unlock(&d->lock);
+			return 0;
+		}
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	return -1;
+}
+
+void DirCrawler::read_dir(int id, const string &dir)
+{
+	int fd, n, off, resumed;
+	unsigned char type;
+	struct stat st;
+	struct linux_dirent64 *de;
+	char buf[CRAWL_BUF_SIZE] __attribute__ ((aligned (8)));
+	string path;
+
+	fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		fprintf(stderr, "cannot open %s: %s\n", dir.c_str(), strerror(errno));
+		return;
+	}
+	__sync_add_and_fetch(&ndirs, 1);
+	/* its files were indexed, but not its subdirectories */
+	resumed = (ckpt != NULL && ckpt->is_done(dir));
+
+	/* one system call returns as many entries as fit in the buffer */
+	while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		if (stopping)
+			break;
+		for (off = 0; off < n; off += de->d_reclen) {
+			de = (struct linux_dirent64 *) (buf + off);
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+
+			type = de->d_type;
+			/* not all the file systems fill in the type */
+			if (type == DT_UNKNOWN) {
+				if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+					continue;
+				if (S_ISDIR(st.st_mode))
+					type = DT_DIR;
+				else if (S_ISREG(st.st_mode))
+					type = DT_REG;
+			}
+			if (type != DT_DIR && type != DT_REG)
+				continue;
+			if (type == DT_REG && !match(de->d_name))
+				continue;
+			if (type == DT_REG && resumed) {
+				__sync_add_and_fetch(&nresumed, 1);
+				continue;
+			}
+
+			path = dir;
+			if (dir[dir.length() - 1] != '/')
+				path.append("/");
+			path.append(de->d_name);
+			if (type == DT_DIR) {
+				push_dir(id, path);
+			}
+			else if (filter != NULL &&
+			         filter->skip(fd, de->d_name, path, de->d_ino)) {
+				__sync_add_and_fetch(&nskipped, 1);
+			}
+			else {
+				if (ckpt != NULL)
+					ckpt->file_queued(dir);
+				/* this waits while the consumers are behind;
+				 * a file it can't take keeps the directory
+				 * from being done
+				 */
+				if (out->push(path) == 0)
+					__sync_add_and_fetch(&nfiles, 1);
+			}
+		}
+	}
+	if (n == -1)
+		fprintf(stderr, "cannot read %s: %s\n", dir.c_str(), strerror(errno));
+	/* a directory we didn't read to the end is read again next time */
+	else if (n == 0 && !resumed && ckpt != NULL)
+		ckpt->dir_read(dir);
+
+	close(fd);
+}
+
+void *DirCrawler::worker(void *arg)
+{
+	crawl_arg *ca = (crawl_arg *) arg;
+
+	ca->crawler->run(ca->id);
+	delete ca;
+
+	return NULL;
+}
+
+void DirCrawler::run(int id)
+{
+	string dir;
+
+	while (!stopping) {
+		if (next_dir(id, &dir) == 0) {
+			read_dir(id, dir);
+			__sync_sub_and_fetch(&pending, 1);
+			continue;
+		}
+		/* nothing queued and nothing being read: we are done */
+		if (pending == 0)
+			break;
+		usleep(CRAWL_IDLE_US);
+	}
+
+	/* the last one out tells the consumers */
+	if (__sync_sub_and_fetch(&running, 1) == 0)
+		out->close();
+}
+
+int DirCrawler::start(const char *root)
+{
+	string dir = root;
+	pthread_t t;
+	crawl_arg *ca;
+	int ret;
+
+	if (!threads.empty())
+		return -1;
+
+	/* "/a/b/" would give "/a/b//c" */
+	while (dir.length() > 1 && dir[dir.length() - 1] == '/')
+		dir.erase(dir.length() - 1);
+	push_dir(0, dir);
+
+	running = nthreads;
+	for (int i = 0; i < nthreads; i++) {
+		ca = new crawl_arg;
+		ca->crawler = this;
+		ca->id = i;
+		ret = pthread_create(&t, NULL, DirCrawler::worker, ca);
+		if (ret) {
+			fprintf(stderr, "cannot start crawler thread: %s\n", strerror(ret));
+			delete ca;
+			/* the ones that started can do the work */
+			if (__sync_sub_and_fetch(&running, nthreads - i) == 0) {
+				out->close();
+				return -1;
+			}
+			break;
+		}
+		threads.push_back(t);
+	}
+
+	return 0;
+}
+
+void DirCrawler::wait()
+{
+	for (vector<pthread_t>::iterator i = threads.begin(); i != threads.end(); i++)
+		pthread_join(*i, NULL);
+	threads.clear();
+}
@@ -0,0 +1,97 @@
+/*
+ fingerprint.cpp - Skips the files that didn't change since they were indexed
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <cstdio>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "fingerprint.hpp"
+
+using namespace std;
+
+FingerprintFilter::FingerprintFilter(ModuleManager *manager)
+{
+	this->manager = manager;
+}
+
+FingerprintFilter::~FingerprintFilter()
+{
+	for (map<GenericModule *, fprint_map_t *>::iterator i = fps.begin(); i != fps.end(); i++)
+		delete i->second;
+	fps.clear();
+}
+
+long FingerprintFilter::load()
+{
+	vector<GenericModule *> mods;
+	fprint_map_t *fp;
+	long n = 0;
+
+	manager->mod_get_modules(&mods);
+	for (vector<GenericModule *>::iterator m = mods.begin(); m != mods.end(); m++) {
+		fp = new fprint_map_t();
+		if ((*m)->vdir->get_fingerprints((*m)->module_type(), fp)) {
+			printf ("can't load the fingerprints for %s\n", (*m)->get_path());
+			delete fp;
+			return -1;
+		}
+		fps[*m] = fp;
+		n += fp->size();
+	}
+
+	return n;
+}
+
+int FingerprintFilter::skip(int dirfd, const char *name, const string &path,
+		unsigned long long ino)
+{
+	vector<GenericModule *> mods;
+	map<GenericModule *, fprint_map_t *>::iterator f;
+	fprint_map_t::iterator fp;
+	struct stat st;
+	long long mtime_ns;
+	const char *relpath;
+	size_t len;
+
+	if (manager->mod_find_modules(path.c_str(), &mods) == 0)
+		return 0;
+
+	/* a file that a module never saw must be read, no need to stat it */
+	for (vector<GenericModule *>::iterator m = mods.begin(); m != mods.end(); m++) {
+		f = fps.find(*m);
+		if (f == fps.end() || f->second->find(ino) == f->second->end())
+			return 0;
+	}
+
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW))
+		return 0;
+	if ((unsigned long long) st.st_ino != ino)
+		return 0;
+	mtime_ns = (long long) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+	for (vector<GenericModule *>::iterator m = mods.begin(); m != mods.end(); m++) {
+		fp = fps[*m]->find(ino);
+		if (fp->second.size != st.st_size || fp->second.mtime_ns != mtime_ns ||
+		    fp->second.version != (*m)->extractor_version())
+			return 0;
+
+		/* the inode may belong to another file by now */
+		len = strlen((*m)->get_path());
+		relpath = path.c_str() + len;
+		if (fp->second.name_hash != fprint_name_hash(relpath, path.length() - len))
+			return 0;
+	}
+
+	return 1;
+}
@@ -0,0 +1,224 @@
+/*
+ hot_listener.cpp - Indexes first the files that are being used
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "hot_listener.hpp"
+
+using namespace std;
+
+HotListener::HotListener(ModuleManager *manager, WorkQueue<string> *out,
+		CrawlFilter *filter)
+{
+	this->manager = manager;
+	this->out = out;
+	this->filter = filter;
+	running = 0;
+	nqueued = 0;
+}
+
+HotListener::~HotListener()
+{
+	stop();
+}
+
+void HotListener::queue_file(const string &path, time_t now)
+{
+	map<string, time_t>::iterator r;
+	vector<GenericModule *> mods;
+	struct stat st;
+
+	if (manager->mod_find_modules(path.c_str(), &mods) == 0)
+		return;
+
+	/* a directory listed again and again is queued once */
+	r = recent.find(path);
+	if (r != recent.end() && now - r->second < HOT_RECENT)
+		return;
+	if (lstat(path.c_str(), &st) || !S_ISREG(st.st_mode))
+		return;
+	if (filter != NULL && filter->skip(AT_FDCWD, path.c_str(), path, st.st_ino))
+		return;
+
+	if (recent.size() >= HOT_RECENT_MAX)
+		recent.clear();
+	recent[path] = now;
+	if (out->push_urgent(path) == 0)
+		nqueued++;
+}
+
+void HotListener::queue_dir(const string &path, time_t now)
+{
+	struct dirent *de;
+	string file;
+	DIR *d;
+
+	d = opendir(path.c_str());
+	if (d == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN)
+			continue;
+		file = path;
+		if (path[path.length() - 1] != '/')
+			file.append("/");
+		file.append(de->d_name);
+		queue_file(file, now);
+	}
+	closedir(d);
+}
+
+void *HotListener::listen_thread(void *arg)
+{
+	((HotListener *) arg)->run();
+	return NULL;
+}
+
+void HotListener::run()
+{
+	char msg[PATH_MAX + 2];
+	vector<struct pollfd> pfds(socks.size());
+	ssize_t len;
+	time_t now;
+
+	for (size_t i = 0; i < socks.size(); i++) {
+		pfds[i].fd = socks[i].fd;
+		pfds[i].events = POLLIN;
+	}
+	while (running) {
+		if (poll(&pfds[0], pfds.size(), HOT_POLL_MS) <= 0)
+			continue;
+		for (size_t i = 0; i < pfds.size(); i++) {
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+			len = recv(pfds[i].fd, msg, sizeof(msg) - 1, MSG_DONTWAIT);
+			if (len < 2)
+				continue;
+			msg[len] = '\0';
+
+			now = time(NULL);
+			if (msg[0] == HOT_FILE)
+				queue_file(msg + 1, now);
+			else if (msg[0] == HOT_DIR)
+				queue_dir(msg + 1, now);
+		}
+	}
+}
+
+/* a socket file that nobody reads, left behind by an indexer that died */
+static int stale_socket(struct sockaddr_un *addr, socklen_t addrlen)
+{
+	int probe, stale;
+
+	probe = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (probe == -1)
+		return 0;
+	stale = (connect(probe, (struct sockaddr *) addr, addrlen) == -1 &&
+			errno == ECONNREFUSED);
+	close(probe);
+
+	return stale;
+}
+
+int HotListener::bind_branch(const string &branch)
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	hot_sock hs;
+	int err;
+
+	if (hybfs::hot_socket_addr(branch.c_str(), &addr, &addrlen)) {
+		fprintf(stderr, "%s: the path is too long for the hot paths socket\n",
+				branch.c_str());
+		return -1;
+	}
+	hs.fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (hs.fd == -1) {
+		fprintf(stderr, "cannot create the hot paths socket: %s\n", strerror(errno));
+		return -1;
+	}
+	/* Linux gives the socket file the mode of the descriptor, so
+	 * nobody else can write to it, not even for a moment */
+	fchmod(hs.fd, 0600);
+
+	if (bind(hs.fd, (struct sockaddr *) &addr, addrlen) == 0)
+		goto bound;
+	err = errno;
+	if (err != EADDRINUSE || !stale_socket(&addr, addrlen))
+		goto error;
+	unlink(addr.sun_path);
+	if (bind(hs.fd, (struct sockaddr *) &addr, addrlen)) {
+		err = errno;
+		goto error;
+	}
+
+bound:
+	chmod(addr.sun_path, 0600);
+	hs.path = addr.sun_path;
+	socks.push_back(hs);
+	return 0;
+
+error:
+	/* EADDRINUSE: another indexer works on the branch */
+	fprintf(stderr, "cannot listen for the hot paths of %s: %s\n",
+			branch.c_str(), strerror(err));
+	close(hs.fd);
+	return -1;
+}
+
+int HotListener::start()
+{
+	vector<string> paths;
+	int ret;
+
+	/* one socket in each branch the modules index */
+	manager->mod_list_paths(&paths);
+	for (vector<string>::iterator p = paths.begin(); p != paths.end(); p++)
+		bind_branch(*p);
+	if (socks.empty())
+		return -1;
+
+	running = 1;
+	ret = pthread_create(&thread, NULL, HotListener::listen_thread, this);
+	if (ret) {
+		fprintf(stderr, "cannot start the hot paths thread: %s\n", strerror(ret));
+		running = 0;
+		stop();
+		return -1;
+	}
+	return 0;
+}
+
+void HotListener::stop()
+{
+	if (running) {
+		running = 0;
+		pthread_join(thread, NULL);
+	}
+	for (vector<hot_sock>::iterator s = socks.begin(); s != socks.end(); s++) {
+		close((*s).fd);
+		unlink((*s).path.c_str());
+	}
+	socks.clear();
+}
@@ -13,6 +13,7 @@
 #include <cstring>
 #include <vector>
 #include <cstdlib>
+#include <algorithm>
 #include "module_loader.hpp"
 #include "base_module.hpp"
 #include "mp3.h"
@@ -67,6 +68,7 @@ int ModuleManager::mod_add_module (mod_type t, const char * path)
 
 	/* add the new module */
 	modules.push_back (ma);
+	registry.add (ma.module);
 
 	return ret;
 }
@@ -83,6 +85,21 @@ vector<string>* ModuleManager::mod_list_modules()
 	return ret;
 }
 
+void ModuleManager::mod_get_modules(vector<GenericModule *> *mods)
+{
+	for (vector<module_assoc>::iterator i = this->modules.begin(); i != this->modules.end(); i++)
+		mods->push_back((*i).module);
+}
+
+void ModuleManager::mod_list_paths(vector<string> *paths)
+{
+	for (vector<module_assoc>::iterator i = this->modules.begin(); i != this->modules.end(); i++) {
+		/* more than one module can use the same path */
+		if (find(paths->begin(), paths->end(), string((*i).path)) == paths->end())
+			paths->push_back((*i).path);
+	}
+}
+
 /** removes the module of type "t" for the
  * path "path".
  * Returns 0 on SUCCESS, -1 on ERROR
@@ -93,13 +110,22 @@ int ModuleManager::mod_remove_module (mod_type t, const char * path)
 		if (strcmp((*i).path, path) == 0 && (*i).module->module_type() == t) {
 			/* free the memory used for the module */
 			delete ((*i).module);
-			delete ((*i).path);
+			free ((void *) (*i).path);
 			this->modules.erase(i);
+			rebuild_registry();
+			return 0;
 		}
 	}
 	return -1;
 }
 
+void ModuleManager::rebuild_registry()
+{
+	registry.clear();
+	for (vector<module_assoc>::iterator i = this->modules.begin(); i != this->modules.end(); i++)
+		registry.add((*i).module);
+}
+
 /** verifies if there is a module of type "t" in the specified path */
 int ModuleManager::mod_verify_module (mod_type t, const char * path)
 {
@@ -115,15 +141,13 @@ int ModuleManager::mod_verify_module (mod_type t, const char * path)
 int ModuleManager::mod_process_file (const char * path)
 {
 	int ret = -1;
+	vector<GenericModule *> mods;
 
 	/** search for the appropriate module to process the file */
-	for (vector<module_assoc>::iterator i = this->modules.begin(); i != this->modules.end(); i++) {
-		if (strncmp((*i).path, path, strlen((*i).path)) == 0) {
-			if (((*i).module->check_file(path)) == 0) {
-				(*i).module->load_file(path);
-				ret = (*i).module->put_to_db();
-			}
-		}
+	registry.find(path, &mods);
+	for (vector<GenericModule *>::iterator i = mods.begin(); i != mods.end(); i++) {
+		(*i)->load_file(path);
+		ret = (*i)->put_to_db();
 	}
 	if (ret == -1)
 		printf ("processing %s ... failed\n", path);
@@ -132,6 +156,14 @@ int ModuleManager::mod_process_file (const char * path)
 	return ret;
 }
 
+/** finds the modules that can process the file; the registry
+ * is only read here, so the pipeline threads can call it at once
+ */
+int ModuleManager::mod_find_modules (const char * path, vector<GenericModule *> *found)
+{
+	return registry.find(path, found);
+}
+
 mod_type ModuleManager::mod_char_to_type(char * type)
 {
 	if (strcmp(type, "mp3") == 0)
@@ -11,6 +11,7 @@
 
 #include <iostream>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include <sys/types.h>
@@ -38,26 +39,68 @@ TagLib::String formatSeconds(int seconds)
 
 Mp3File::Mp3File(const char * path)
 {
-	this->f		= NULL;
-	this->tag	= NULL;
+	this->file_path	= NULL;
+	this->record.year = 0;
 
 	/* initializes the vdir path for the database */
 	init_vdir (path);
 }
 
+Mp3File::~Mp3File()
+{
+	if (file_path)
+		free (file_path);
+}
+
+int Mp3File::read_record(const char * path, mp3_record *rec)
+{
+	TagLib::Tag *t;
+	/* without the audio properties TagLib reads only the ID3v2 tag
+	 * at the beginning and the ID3v1/APE tags at the end
+	 */
+	TagLib::FileRef file(path, false);
+
+	if (file.isNull() || (t = file.tag()) == NULL)
+		return -1;
+
+	rec->album = t->album().to8Bit();
+	rec->artist = t->artist().to8Bit();
+	rec->title = t->title().to8Bit();
+	rec->year = t->year();
+
+	return 0;
+}
+
+void Mp3File::record_to_tags(mp3_record *rec, vector<string> *tags)
+{
+	char buf[16];
+
+	if (!rec->album.empty())
+		tags->push_back("album:" + replace_spaces(rec->album));
+	if (!rec->artist.empty())
+		tags->push_back("artist:" + replace_spaces(rec->artist));
+	if (!rec->title.empty())
+		tags->push_back("title:" + replace_spaces(rec->title));
+	sprintf (buf, "%u", rec->year);
+	tags->push_back(string("year:") + buf);
+}
 
 int Mp3File::load_file(const char * path)
 {
-	delete(f);
-	this->f = new TagLib::FileRef(path);
-	if (!f->isNull() && f->tag()) {
-		this->tag = f->tag();
-		return 0;
-	}
-	else {
-		this->tag = NULL;
+	if (file_path)
+		free (file_path);
+	file_path = strdup(path);
+	if (file_path == NULL)
+		return -1;
+
+	if (read_record(path, &record)) {
+		record.album.clear();
+		record.artist.clear();
+		record.title.clear();
+		record.year = 0;
 		return -1;
 	}
+	return 0;
 }
 
 mod_type Mp3File::module_type()
@@ -65,6 +108,11 @@ mod_type Mp3File::module_type()
 	return MP3;
 }
 
+int Mp3File::extractor_version()
+{
+	return MP3_EXTRACTOR_VERSION;
+}
+
 
 int Mp3File::check_file(const char * path)
 {
@@ -78,39 +126,34 @@ int Mp3File::check_file(const char * path)
 	return (strcmp(ext, "mp3") == 0) ? 0 : -1;
 }
 
+const char * const * Mp3File::extensions()
+{
+	static const char * const exts[] = { "mp3", NULL };
+
+	return exts;
+}
+
 string Mp3File::mp3_get_artist()
 {
-	if (tag != NULL)
-		if (tag->artist().isAscii())
-			return (tag->artist()).to8Bit();
-	return NULL;
+	return record.artist;
 }
 
 string Mp3File::mp3_get_album()
 {
-	if (tag != NULL)
-		if (tag->artist().isAscii())
-			return (tag->album()).to8Bit();
-	return NULL;
+	return record.album;
 }
 
 string Mp3File::mp3_get_title()
 {
-	if (tag != NULL)
-		if (tag->artist().isAscii())
-			return (tag->title()).to8Bit();
-	return NULL;
+	return record.title;
 }
 
 string Mp3File::mp3_get_year()
 {
-	char buf[10];
-	if (tag != NULL) {
-		sprintf (buf, "%u", tag->year());
-		string s(buf);
-		return s;
-	}
-	return NULL;
+	char buf[16];
+
+	sprintf (buf, "%u", record.year);
+	return string(buf);
 }
 
 int Mp3File::put_to_db()
@@ -119,21 +162,17 @@ int Mp3File::put_to_db()
 	vector<string> *tags = new vector<string>();
 	file_info_t *finfo;		// structure with info to populate the database
 
+	if (!file_path)
+		return -1;
+
 	/* extract inode information about the file */
-	finfo = get_file_info(this->f->file()->name());
+	finfo = get_file_info(this->file_path);
 
 	if (!finfo) {
 		return -1;
 	}
 
-	if (!mp3_get_album().empty())
-		tags->push_back(string("album:" + replace_spaces(mp3_get_album())));
-	if (!mp3_get_artist().empty())
-		tags->push_back(string("artist:" + replace_spaces(mp3_get_artist())));
-	if (!mp3_get_title().empty())
-		tags->push_back(string("title:" + replace_spaces(mp3_get_title())));
-	if (!mp3_get_year().empty())
-		tags->push_back(string("year:" + mp3_get_year()));
+	record_to_tags(&record, tags);
 
 
 	int res = vdir->update_file (tags, TAG_ADD, finfo, 0);
@@ -147,6 +186,19 @@ int Mp3File::put_to_db()
 }
 
 
+int Mp3File::extract_tags(const char * path, const char * hdr,
+		size_t hdrlen, vector<string> *tags)
+{
+	mp3_record rec;
+
+	/* TagLib reads the end of the file too, so the header is not enough */
+	if (read_record(path, &rec))
+		return -1;
+	record_to_tags(&rec, tags);
+
+	return 0;
+}
+
 string Mp3File::replace_spaces(string s)
 {
 	string ret = s;
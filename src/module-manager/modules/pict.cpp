@@ -11,11 +11,18 @@
 
 #include <cstring>
 #include <cstdlib>
+#include <cerrno>
 #include <vector>
+#include <map>
 #include <cassert>
 #include <iomanip>
 #include <iostream>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+
 #include "image.hpp"
 #include "exif.hpp"
 #include "pict.hpp"
@@ -26,6 +33,17 @@ using namespace std;
 
 using namespace hybfs;
 
+/* Exiv2 keeps global state (the XMP toolkit it starts on the first
+ * image, its error handler) that the parser threads must not share at
+ * once; they take turns on it. The fast path doesn't need Exiv2. */
+static pthread_mutex_t exiv2_lock = PTHREAD_MUTEX_INITIALIZER;
+
+class Exiv2Guard {
+public:
+	Exiv2Guard() { pthread_mutex_lock(&exiv2_lock); }
+	~Exiv2Guard() { pthread_mutex_unlock(&exiv2_lock); }
+};
+
 PictFile::PictFile(const char * path)
 {
 	file_path = NULL;
@@ -56,6 +74,11 @@ mod_type PictFile::module_type()
 	return EXIF;
 }
 
+int PictFile::extractor_version()
+{
+	return EXIF_EXTRACTOR_VERSION;
+}
+
 /** loads the exif information from file
  * returns 0 for success, -1 for error
  */
@@ -89,6 +112,13 @@ int PictFile::check_file(const char * path)
 	return (strcmp(ext, ".jpg") == 0 || strcmp(ext, "jpeg") == 0 || strcmp(ext, "tiff") == 0) ? 0 : -1;
 }
 
+const char * const * PictFile::extensions()
+{
+	static const char * const exts[] = { "jpg", "jpeg", "tiff", NULL };
+
+	return exts;
+}
+
 string PictFile::get_month(string str)
 {
 	string s = str.substr(5, 2);
@@ -128,6 +158,283 @@ string PictFile::replace_spaces(string s)
 	return ret;
 }
 
+void PictFile::add_exif_tag(int tag, const string &value, vector<string> *tags)
+{
+	switch (tag) {
+	case EXIF_TAG_DESCRIPTION:
+		tags->push_back(replace_spaces(erase_end_spaces("description:" + value)));
+		break;
+	case EXIF_TAG_MODEL:
+		tags->push_back(replace_spaces(erase_end_spaces("camera:" + value)));
+		break;
+	case EXIF_TAG_DATETIME:
+		/* "YYYY:MM:DD HH:MM:SS" */
+		if (value.length() < 7)
+			break;
+		tags->push_back("year:" + get_year(value));
+		if (get_month(value).compare("unknown") != 0)
+			tags->push_back("month:" + get_month(value));
+		break;
+	}
+}
+
+/** reads the exif tags from an opened image */
+int PictFile::read_exif(Exiv2::Image::AutoPtr image, const char * path,
+		vector<string> *tags)
+{
+	assert(image.get() != 0);
+	image->readMetadata();
+
+	Exiv2::ExifData &exifData = image->exifData();
+	if (exifData.empty()) {
+		string error(path);
+		error+= ": No Exif data found in the file";
+		throw Exiv2::Error(1, error);
+	}
+
+	int count = 0;
+	tags->push_back(string("type:image"));
+	Exiv2::ExifData::const_iterator end = exifData.end();
+	for (Exiv2::ExifData::const_iterator i = exifData.begin(); i != end; i++) {
+		if (strcmp(i->key().c_str(), "Exif.Image.ImageDescription") == 0) {
+			add_exif_tag(EXIF_TAG_DESCRIPTION, i->value().toString(), tags);
+			count++;
+		}
+		else if (strcmp(i->key().c_str(), "Exif.Image.Model") == 0) {
+			add_exif_tag(EXIF_TAG_MODEL, i->value().toString(), tags);
+			count++;
+		}
+		else if (strcmp(i->key().c_str(), "Exif.Image.DateTime") == 0) {
+			add_exif_tag(EXIF_TAG_DATETIME, i->value().toString(), tags);
+			count++;
+		}
+		if (count == 3)
+			break;
+	}
+
+	return 0;
+}
+
+/** reads a 16 bit value with the byte order of the TIFF header */
+static uint16_t exif_get16(const unsigned char *p, int le)
+{
+	return le ? (p[0] | (p[1] << 8)) : ((p[0] << 8) | p[1]);
+}
+
+/** reads a 32 bit value with the byte order of the TIFF header */
+static uint32_t exif_get32(const unsigned char *p, int le)
+{
+	return le ? (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24)) :
+		(((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+}
+
+/** looks for the IFD0 entries we want in a TIFF structure
+ * Returns the number of entries in IFD0, -1 if the structure is
+ * not valid or not all in the buffer
+ */
+static int exif_parse_tiff(const unsigned char *tiff, size_t len,
+		map<int, string> *values)
+{
+	const unsigned char *entry;
+	uint32_t ifd, count, off;
+	uint16_t n, tag, type;
+	int le;
+
+	if (len < 8)
+		return -1;
+	if (memcmp(tiff, "II*\0", 4) == 0)
+		le = 1;
+	else if (memcmp(tiff, "MM\0*", 4) == 0)
+		le = 0;
+	else
+		return -1;
+
+	ifd = exif_get32(tiff + 4, le);
+	if (ifd > len - 2)
+		return -1;
+	n = exif_get16(tiff + ifd, le);
+	if ((size_t) n * 12 > len - ifd - 2)
+		return -1;
+
+	/* the entries are sorted by tag, we stop after the last one we want */
+	for (int i = 0; i < n; i++) {
+		entry = tiff + ifd + 2 + i * 12;
+		tag = exif_get16(entry, le);
+		if (tag > EXIF_TAG_DATETIME)
+			break;
+		if (tag != EXIF_TAG_DESCRIPTION && tag != EXIF_TAG_MODEL &&
+		    tag != EXIF_TAG_DATETIME)
+			continue;
+
+		type = exif_get16(entry + 2, le);
+		count = exif_get32(entry + 4, le);
+		/* they are all ASCII */
+		if (type != 2 || count == 0)
+			continue;
+		if (count <= 4) {
+			off = entry + 8 - tiff;
+		}
+		else {
+			off = exif_get32(entry + 8, le);
+			if (off > len || count > len - off)
+				return -1;
+		}
+		/* the string ends at the first NUL, as Exiv2 prints it */
+		(*values)[tag] = string((const char *) tiff + off,
+				strnlen((const char *) tiff + off, count));
+	}
+
+	return n;
+}
+
+/** finds the Exif APP1 segment of a JPEG
+ * Returns the offset of the segment data (the TIFF header) and its
+ * length in seglen, -1 if there is no Exif segment and -2 if the
+ * buffer ends before we know
+ */
+static long exif_find_app1(const unsigned char *buf, size_t len, size_t *seglen)
+{
+	size_t pos = 2;
+	unsigned int marker, size;
+
+	while (pos + 4 <= len) {
+		if (buf[pos] != 0xFF)
+			return -1;
+		marker = buf[pos + 1];
+		/* padding before the marker */
+		if (marker == 0xFF) {
+			pos++;
+			continue;
+		}
+		/* the image data starts, no more metadata */
+		if (marker == 0xDA || marker == 0xD9)
+			return -1;
+		size = (buf[pos + 2] << 8) | buf[pos + 3];
+		if (size < 2)
+			return -1;
+		if (marker == 0xE1 && size >= 8) {
+			if (pos + 10 > len)
+				return -2;
+			if (memcmp(buf + pos + 4, "Exif\0\0", 6) == 0) {
+				*seglen = size - 8;
+				return pos + 10;
+			}
+		}
+		pos += 2 + size;
+	}
+
+	return -2;
+}
+
+int PictFile::fast_exif(const char * path, const char * hdr, size_t hdrlen,
+		vector<string> *tags)
+{
+	const unsigned char *buf = (const unsigned char *) hdr;
+	unsigned char *seg = NULL;
+	map<int, string> values;
+	size_t seglen;
+	long off;
+	int fd, ret;
+
+	if (hdrlen < 4)
+		return 1;
+
+	if (buf[0] == 0xFF && buf[1] == 0xD8) {
+		off = exif_find_app1(buf, hdrlen, &seglen);
+		if (off == -1)
+			return -1;
+		if (off == -2)
+			return 1;
+		if (off + seglen > hdrlen) {
+			/* the segment goes past the header: read only the segment */
+			fd = open(path, O_RDONLY);
+			if (fd == -1)
+				return 1;
+			seg = (unsigned char *) malloc (seglen);
+			if (seg == NULL || pread(fd, seg, seglen, off) != (ssize_t) seglen) {
+				close(fd);
+				free (seg);
+				return 1;
+			}
+			close(fd);
+			ret = exif_parse_tiff(seg, seglen, &values);
+			free (seg);
+		}
+		else {
+			ret = exif_parse_tiff(buf + off, seglen, &values);
+		}
+	}
+	else {
+		/* a TIFF file is itself the exif structure */
+		ret = exif_parse_tiff(buf, hdrlen, &values);
+	}
+
+	if (ret == -1)
+		return 1;
+	if (ret == 0)
+		return -1;
+
+	tags->push_back(string("type:image"));
+	for (map<int, string>::iterator i = values.begin(); i != values.end(); i++)
+		add_exif_tag(i->first, i->second, tags);
+
+	return 0;
+}
+
+int PictFile::extract_tags(const char * path, const char * hdr,
+		size_t hdrlen, vector<string> *tags)
+{
+	char *buf = NULL;
+	ssize_t n;
+	int fd, ret;
+
+	/* the exif data is at the beginning of the file, so the header
+	 * read by the pipeline is usually enough
+	 */
+	if (hdr == NULL) {
+		fd = open(path, O_RDONLY);
+		if (fd != -1) {
+			buf = (char *) malloc (EXIF_HDR_SIZE);
+			n = (buf != NULL) ? pread(fd, buf, EXIF_HDR_SIZE, 0) : -1;
+			if (n > 0) {
+				hdr = buf;
+				hdrlen = n;
+			}
+			close(fd);
+		}
+	}
+
+	if (hdr != NULL && hdrlen > 0) {
+		ret = fast_exif(path, hdr, hdrlen, tags);
+		if (ret != 1) {
+			free (buf);
+			return ret;
+		}
+		tags->clear();
+
+		try {
+			Exiv2Guard guard;
+			ret = read_exif(Exiv2::ImageFactory::open(
+					(const Exiv2::byte *) hdr, hdrlen), path, tags);
+			free (buf);
+			return ret;
+		}
+		catch(Exiv2::AnyError& e) {
+			tags->clear();
+		}
+	}
+	free (buf);
+
+	try {
+		Exiv2Guard guard;
+		return read_exif(Exiv2::ImageFactory::open(path), path, tags);
+	}
+	catch(Exiv2::AnyError& e) {
+		tags->clear();
+		return -1;
+	}
+}
+
 /** adds the file information to database */
 int PictFile::put_to_db()
 {
@@ -145,48 +452,9 @@ int PictFile::put_to_db()
 		return -1;
 	}
 
-	try {
-		Exiv2::Image::AutoPtr image = Exiv2::ImageFactory::open(file_path);
-		assert(image.get() != 0);
-		image->readMetadata();
-
-		Exiv2::ExifData &exifData = image->exifData();
-		if (exifData.empty()) {
-			string error(this->file_path);
-			error+= ": No Exif data found in the file";
-			throw Exiv2::Error(1, error);
-		}
-
-		printf ("before tags\n");
-
-		int count = 0;
-		tags->push_back(string("type:image"));
-		Exiv2::ExifData::const_iterator end = exifData.end();
-		for (Exiv2::ExifData::const_iterator i = exifData.begin(); i != end; i++) {
-			if (strcmp(i->key().c_str(), "Exif.Image.ImageDescription") == 0) {
-				string s = erase_end_spaces("description:" + i->value().toString());
-				tags->push_back(replace_spaces(s));
-				count++;
-			}
-			else if (strcmp(i->key().c_str(), "Exif.Image.Model") == 0) {
-				string s = erase_end_spaces("camera:" + i->value().toString());
-				tags->push_back(replace_spaces(s));
-				count++;
-			}
-			else if (strcmp(i->key().c_str(), "Exif.Image.DateTime") == 0) {
-				tags->push_back("year:" + get_year(i->value().toString()));
-				string month = get_month(i->value().toString());
-				if (month.compare("unknown") != 0)
-					tags->push_back("month:" + month);
-				count++;
-			}
-			if (count == 3)
-				break;
-		}
-	}
-	catch(Exiv2::AnyError& e) {
+	if (extract_tags(file_path, NULL, 0, tags)) {
 		printf ("error\n");
-		tags->clear();
+		free (finfo);
 		delete tags;
 		return -1;
 	}
@@ -0,0 +1,543 @@
+/*
+ pipeline.cpp - Staged extraction of the tags: I/O, parsing, DB writes
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <map>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pipeline.hpp"
+
+using namespace std;
+
+IndexPipeline::IndexPipeline(ModuleManager *manager, WorkQueue<string> *in, pipe_conf *conf)
+{
+	this->manager = manager;
+	this->in = in;
+	if (conf != NULL)
+		this->conf = *conf;
+	else
+		default_conf(&this->conf);
+	if (this->conf.nreaders <= 0)
+		this->conf.nreaders = 1;
+	if (this->conf.nparsers <= 0) {
+		this->conf.nparsers = sysconf(_SC_NPROCESSORS_ONLN);
+		if (this->conf.nparsers < 1)
+			this->conf.nparsers = 1;
+	}
+	if (this->conf.batch <= 0)
+		this->conf.batch = 1;
+
+	parse_q = new WorkQueue<pipe_item *>(this->conf.queue_max);
+	write_q = new WorkQueue<pipe_item *>(this->conf.queue_max);
+
+	memset(&readers, 0, sizeof(readers));
+	readers.name = "io";
+	readers.nthreads = this->conf.nreaders;
+	memset(&parsers, 0, sizeof(parsers));
+	parsers.name = "parse";
+	parsers.nthreads = this->conf.nparsers;
+	memset(&writer, 0, sizeof(writer));
+	writer.name = "db";
+	writer.nthreads = 1;
+
+	reporting = 0;
+	started = 0;
+	deduped = 0;
+	nbytes = 0;
+	source = NULL;
+	ckpt = NULL;
+	pthread_mutex_init(&errors_lock, NULL);
+	pthread_mutex_init(&report_lock, NULL);
+	pthread_cond_init(&report_cond, NULL);
+}
+
+IndexPipeline::~IndexPipeline()
+{
+	pipe_item *item;
+
+	wait();
+	/* the items left behind if we failed to start */
+	while (parse_q->try_pop(&item) == 0)
+		free_item(item);
+	while (write_q->try_pop(&item) == 0)
+		free_item(item);
+	delete parse_q;
+	delete write_q;
+	pthread_cond_destroy(&report_cond);
+	pthread_mutex_destroy(&report_lock);
+	pthread_mutex_destroy(&errors_lock);
+}
+
+void IndexPipeline::default_conf(pipe_conf *conf)
+{
+	conf->nreaders = PIPE_READERS;
+	conf->nparsers = PIPE_PARSERS;
+	conf->queue_max = PIPE_QUEUE_MAX;
+	conf->batch = PIPE_BATCH;
+	conf->cache = NULL;
+}
+
+void IndexPipeline::free_item(pipe_item *item)
+{
+	if (item->hdr != NULL)
+		free (item->hdr);
+	if (item->file != NULL) {
+		if (!item->committed)
+			item->file->failed = 1;
+		/* the last module done with the file; one that failed
+		 * keeps its directory from being done, so the next run
+		 * reads it again
+		 */
+		if (__sync_sub_and_fetch(&item->file->refs, 1) == 0) {
+			if (!item->file->failed)
+				ckpt->file_done(item->path);
+			delete item->file;
+		}
+	}
+	delete item;
+}
+
+void IndexPipeline::module_failed(GenericModule *mod, long n)
+{
+	pthread_mutex_lock(&errors_lock);
+	errors[mod] += n;
+	pthread_mutex_unlock(&errors_lock);
+}
+
+void *IndexPipeline::reader_thread(void *arg)
+{
+	((IndexPipeline *) arg)->run_reader();
+	return NULL;
+}
+
+void *IndexPipeline::parser_thread(void *arg)
+{
+	((IndexPipeline *) arg)->run_parser();
+	return NULL;
+}
+
+void *IndexPipeline::writer_thread(void *arg)
+{
+	((IndexPipeline *) arg)->run_writer();
+	return NULL;
+}
+
+void *IndexPipeline::reporter_thread(void *arg)
+{
+	((IndexPipeline *) arg)->run_reporter();
+	return NULL;
+}
+
+int IndexPipeline::pass(WorkQueue<pipe_item *> *q, pipe_item *item)
+{
+	if (item->urgent)
+		return q->push_urgent(item);
+	return q->push(item);
+}
+
+void IndexPipeline::read_file(const string &path, int urgent)
+{
+	vector<GenericModule *> mods;
+	struct stat st;
+	char *hdr = NULL;
+	ssize_t n = 0;
+	size_t len;
+	unsigned long long content = 0;
+	pipe_file *file = NULL;
+	int fd, has_content = 0;
+	/* the crawler told the checkpoint about the file, the hot
+	 * paths come from elsewhere
+	 */
+	int tracked = (ckpt != NULL && !urgent);
+
+	if (manager->mod_find_modules(path.c_str(), &mods) == 0)
+		goto done;
+
+	fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "cannot open %s: %s\n", path.c_str(), strerror(errno));
+		__sync_add_and_fetch(&readers.failed, 1);
+		return;
+	}
+	if (fstat(fd, &st)) {
+		close(fd);
+		__sync_add_and_fetch(&readers.failed, 1);
+		return;
+	}
+	__sync_add_and_fetch(&nbytes, (long long) st.st_size);
+
+	/* the parsers find the header in memory; the rest of the
+	 * file is read by the extractor only if it needs it
+	 */
+	len = ((size_t) st.st_size < PIPE_HDR_SIZE) ? st.st_size : PIPE_HDR_SIZE;
+	if (len > 0) {
+		hdr = (char *) malloc (len);
+		if (hdr != NULL) {
+			n = pread(fd, hdr, len, 0);
+			if (n <= 0) {
+				free (hdr);
+				hdr = NULL;
+				n = 0;
+			}
+		}
+	}
+	/* the copies of a file have the same fingerprint; it costs one
+	 * more read, of the last block
+	 */
+	if (conf.cache != NULL && hdr != NULL)
+		has_content = (content_hash(fd, st.st_size, hdr, n, &content) == 0);
+	close(fd);
+
+	if (tracked) {
+		file = new pipe_file;
+		file->refs = mods.size();
+		file->failed = 0;
+		tracked = 0;
+	}
+	for (unsigned int i = 0; i < mods.size(); i++) {
+		pipe_item *item = new pipe_item;
+
+		item->path = path;
+		item->module = mods[i];
+		item->st = st;
+		item->hdrlen = n;
+		item->content = content;
+		item->has_content = has_content;
+		item->urgent = urgent;
+		item->file = file;
+		item->committed = 0;
+		if (i == mods.size() - 1 || hdr == NULL) {
+			item->hdr = hdr;
+		}
+		else {
+			item->hdr = (char *) malloc (n);
+			if (item->hdr != NULL)
+				memcpy(item->hdr, hdr, n);
+			else
+				item->hdrlen = 0;
+		}
+		if (pass(parse_q, item))
+			free_item(item);
+	}
+	__sync_add_and_fetch(&readers.done, 1);
+
+done:
+	/* nothing to wait for */
+	if (tracked)
+		ckpt->file_done(path);
+}
+
+void IndexPipeline::run_reader()
+{
+	string path;
+	int urgent;
+
+	while (in->pop(&path, &urgent) == 0)
+		read_file(path, urgent);
+
+	/* the last one out tells the next stage */
+	if (__sync_sub_and_fetch(&readers.running, 1) == 0)
+		parse_q->close();
+}
+
+void IndexPipeline::run_parser()
+{
+	pipe_item *item;
+	GenericModule *mod;
+
+	while (parse_q->pop(&item) == 0) {
+		mod = item->module;
+		/* a copy of a file we already parsed */
+		if (item->has_content &&
+		    conf.cache->lookup(item->content, mod->module_type(),
+				mod->extractor_version(), &item->tags)) {
+			__sync_add_and_fetch(&deduped, 1);
+		}
+		else if (mod->extract_tags(item->path.c_str(), item->hdr,
+				item->hdrlen, &item->tags)) {
+			printf ("processing %s ... failed\n", item->path.c_str());
+			__sync_add_and_fetch(&parsers.failed, 1);
+			module_failed(mod, 1);
+			free_item(item);
+			continue;
+		}
+		else if (item->has_content) {
+			conf.cache->insert(item->content, mod->module_type(),
+					mod->extractor_version(), item->tags);
+		}
+		/* the writer needs only the tags */
+		if (item->hdr != NULL) {
+			free (item->hdr);
+			item->hdr = NULL;
+		}
+		__sync_add_and_fetch(&parsers.done, 1);
+		if (pass(write_q, item))
+			free_item(item);
+	}
+
+	if (__sync_sub_and_fetch(&parsers.running, 1) == 0)
+		write_q->close();
+}
+
+void IndexPipeline::flush(vector<pipe_item *> *batch)
+{
+	map<GenericModule *, vector<tagged_file_t> > dbs;
+	map<GenericModule *, vector<tagged_file_t> >::iterator db;
+	/* the items of the files in dbs, in the same order */
+	map<GenericModule *, vector<pipe_item *> > items;
+	int ret;
+
+	for (vector<pipe_item *>::iterator i = batch->begin(); i != batch->end(); i++) {
+		tagged_file_t tf;
+
+		tf.finfo = (*i)->module->make_file_info((*i)->path.c_str(), &(*i)->st);
+		if (tf.finfo == NULL) {
+			writer.failed++;
+			module_failed((*i)->module, 1);
+			continue;
+		}
+		tf.tags.swap((*i)->tags);
+		/* what we saw of the file, so the next run can skip it */
+		tf.fp.module = (*i)->module->module_type();
+		tf.fp.version = (*i)->module->extractor_version();
+		tf.fp.size = (*i)->st.st_size;
+		tf.fp.mtime_ns = (long long) (*i)->st.st_mtim.tv_sec * 1000000000LL +
+				(*i)->st.st_mtim.tv_nsec;
+		tf.fp.name_hash = 0;
+		tf.failed = 0;
+		dbs[(*i)->module].push_back(tf);
+		items[(*i)->module].push_back(*i);
+	}
+
+	/* one transaction for each database */
+	for (db = dbs.begin(); db != dbs.end(); db++) {
+		ret = db->first->vdir->update_files(&db->second);
+		if (ret < 0) {
+			writer.failed += db->second.size();
+			module_failed(db->first, db->second.size());
+		}
+		else {
+			writer.failed += ret;
+			writer.done += db->second.size() - ret;
+			if (ret > 0)
+				module_failed(db->first, ret);
+		}
+		for (size_t f = 0; f < db->second.size(); f++) {
+			items[db->first][f]->committed = !db->second[f].failed;
+			free (db->second[f].finfo);
+		}
+	}
+
+	for (vector<pipe_item *>::iterator i = batch->begin(); i != batch->end(); i++)
+		free_item(*i);
+	batch->clear();
+
+	/* the directories whose files are all committed by now */
+	if (ckpt != NULL)
+		ckpt->save(0);
+}
+
+/* the time after ms milliseconds */
+static void deadline_after(struct timespec *ts, long ms)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* the deadline is not in the future */
+static int deadline_passed(const struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (now.tv_sec > ts->tv_sec ||
+		(now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec));
+}
+
+void IndexPipeline::run_writer()
+{
+	vector<pipe_item *> batch;
+	pipe_item *item;
+	struct timespec deadline;
+	int urgent = 0, ret;
+
+	while (1) {
+		if (batch.empty())
+			ret = write_q->pop(&item);
+		else if (urgent)
+			/* somebody waits for the tags of an urgent file, but
+			 * a burst of them goes in one transaction
+			 */
+			ret = write_q->timed_pop(&item, &deadline);
+		else if (write_q->try_pop(&item)) {
+			/* nothing else is ready, don't keep the tags waiting */
+			flush(&batch);
+			continue;
+		}
+		else
+			ret = 0;
+		if (ret == -1)
+			break;
+
+		if (ret == 0) {
+			batch.push_back(item);
+			if (item->urgent && !urgent) {
+				urgent = 1;
+				deadline_after(&deadline, PIPE_URGENT_MS);
+			}
+		}
+		if ((int) batch.size() >= conf.batch ||
+		    (urgent && (ret == 1 || deadline_passed(&deadline)))) {
+			flush(&batch);
+			urgent = 0;
+		}
+	}
+	flush(&batch);
+
+	writer.running = 0;
+}
+
+void IndexPipeline::run_reporter()
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&report_lock);
+	while (reporting) {
+		ts.tv_sec = time(NULL) + PIPE_REPORT_INTERVAL;
+		ts.tv_nsec = 0;
+		pthread_cond_timedwait(&report_cond, &report_lock, &ts);
+		if (reporting)
+			report();
+	}
+	pthread_mutex_unlock(&report_lock);
+}
+
+int IndexPipeline::start_stage(pipe_stage *stage, void *(*fn)(void *))
+{
+	pthread_t t;
+	int ret, n = stage->nthreads;
+
+	stage->nthreads = 0;
+	for (int i = 0; i < n; i++) {
+		/* count it first: a thread may finish before we start the next */
+		__sync_add_and_fetch(&stage->running, 1);
+		ret = pthread_create(&t, NULL, fn, this);
+		if (ret) {
+			fprintf(stderr, "cannot start %s thread: %s\n", stage->name, strerror(ret));
+			__sync_sub_and_fetch(&stage->running, 1);
+			break;
+		}
+		threads.push_back(t);
+		stage->nthreads++;
+	}
+	/* the ones that started can do the work */
+	return (stage->nthreads > 0) ? 0 : -1;
+}
+
+int IndexPipeline::start()
+{
+	started = time(NULL);
+
+	/* the consumers first, so the queues are drained from the start */
+	if (start_stage(&writer, IndexPipeline::writer_thread))
+		goto error;
+	if (start_stage(&parsers, IndexPipeline::parser_thread))
+		goto error;
+	if (start_stage(&readers, IndexPipeline::reader_thread))
+		goto error;
+
+	reporting = 1;
+	if (pthread_create(&reporter, NULL, IndexPipeline::reporter_thread, this))
+		reporting = 0;
+
+	return 0;
+
+error:
+	/* nobody would take the files, so stop everything */
+	in->close();
+	parse_q->close();
+	write_q->close();
+	return -1;
+}
+
+void IndexPipeline::wait()
+{
+	for (vector<pthread_t>::iterator i = threads.begin(); i != threads.end(); i++)
+		pthread_join(*i, NULL);
+	threads.clear();
+
+	pthread_mutex_lock(&report_lock);
+	if (reporting) {
+		reporting = 0;
+		pthread_cond_signal(&report_cond);
+		pthread_mutex_unlock(&report_lock);
+		pthread_join(reporter, NULL);
+	}
+	else
+		pthread_mutex_unlock(&report_lock);
+}
+
+void IndexPipeline::report()
+{
+	long elapsed = time(NULL) - started;
+	pipe_stage *stages[3] = { &readers, &parsers, &writer };
+	size_t depths[3];
+
+	if (elapsed < 1)
+		elapsed = 1;
+	/* the depth of the queue that feeds each stage */
+	depths[0] = in->size();
+	depths[1] = parse_q->size();
+	depths[2] = write_q->size();
+
+	for (int i = 0; i < 3; i++) {
+		printf ("%-6s %3d threads  queue %6lu  done %8ld (%6ld/s)  failed %ld\n",
+				stages[i]->name, stages[i]->nthreads, (unsigned long) depths[i],
+				stages[i]->done, stages[i]->done / elapsed, stages[i]->failed);
+	}
+	printf ("%ld files read, %.1f MB (%ld files/s, %.2f MB/s)\n",
+			readers.done, nbytes / 1048576.0, readers.done / elapsed,
+			nbytes / 1048576.0 / elapsed);
+	/* the rate of the I/O stage is the rate of the whole pipeline,
+	 * give or take the files in the queues
+	 */
+	if (source != NULL && readers.done > 0) {
+		long left = source->get_nfiles() - readers.done - readers.failed;
+		long eta = (left > 0) ? left * elapsed / readers.done : 0;
+
+		printf ("%ld files left, about %ldh%02ldm%02lds%s\n", (left > 0) ? left : 0,
+				eta / 3600, (eta / 60) % 60, eta % 60,
+				source->is_done() ? "" : ", still counting");
+	}
+	pthread_mutex_lock(&errors_lock);
+	for (map<GenericModule *, long>::iterator e = errors.begin(); e != errors.end(); e++)
+		printf ("%s module for %s: %ld errors\n",
+				manager->mod_get_type(e->first->module_type()).c_str(),
+				e->first->get_path(), e->second);
+	pthread_mutex_unlock(&errors_lock);
+	if (conf.cache != NULL)
+		printf ("%ld files had the tags of a copy, %lu contents cached\n",
+				deduped, (unsigned long) conf.cache->size());
+	fflush(stdout);
+}
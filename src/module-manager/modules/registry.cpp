@@ -0,0 +1,179 @@
+/*
+ registry.cpp - Routes the files to the modules by path and extension
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+#include "registry.hpp"
+
+using namespace std;
+
+ModuleRegistry::ModuleRegistry()
+{
+	root = new reg_node;
+}
+
+ModuleRegistry::~ModuleRegistry()
+{
+	free_node(root);
+}
+
+void ModuleRegistry::free_node(reg_node *node)
+{
+	for (map<string, reg_node *>::iterator i = node->children.begin();
+			i != node->children.end(); i++)
+		free_node(i->second);
+	delete node;
+}
+
+void ModuleRegistry::clear()
+{
+	free_node(root);
+	root = new reg_node;
+	all_exts.clear();
+}
+
+int ModuleRegistry::get_ext(const char *name, char *ext)
+{
+	const char *dot = strrchr(name, '.');
+	size_t len;
+
+	/* the dot must be in the last component */
+	if (dot == NULL || strchr(dot, '/') != NULL)
+		return -1;
+	dot++;
+	len = strlen(dot);
+	if (len == 0 || len >= REG_EXT_MAX)
+		return -1;
+	for (size_t i = 0; i <= len; i++)
+		ext[i] = tolower(dot[i]);
+
+	return 0;
+}
+
+void ModuleRegistry::add(GenericModule *module)
+{
+	const char * const *exts = module->extensions();
+	const char *path = module->get_path();
+	const char *start, *end;
+	reg_node *node = root;
+	reg_node *child;
+
+	/* one node for each component; "/a//b/" is the same as "/a/b" */
+	for (start = path; *start; start = end) {
+		while (*start == '/')
+			start++;
+		if (*start == '\0')
+			break;
+		end = strchr(start, '/');
+		if (end == NULL)
+			end = start + strlen(start);
+
+		string comp(start, end - start);
+		child = node->children[comp];
+		if (child == NULL) {
+			child = new reg_node;
+			node->children[comp] = child;
+		}
+		node = child;
+	}
+
+	for (; exts != NULL && *exts != NULL; exts++) {
+		node->modules[*exts].push_back(module);
+		all_exts.insert(*exts);
+	}
+}
+
+int ModuleRegistry::find(const char *path, vector<GenericModule *> *found)
+{
+	char ext[REG_EXT_MAX];
+	const char *start, *end;
+	map<string, reg_node *>::iterator child;
+	reg_ext_map::iterator mods;
+	reg_node *node = root;
+	string comp;
+	int n = 0;
+
+	if (get_ext(path, ext))
+		return 0;
+
+	/* the modules of every directory above the file, down to the
+	 * one that holds it
+	 */
+	for (start = path; node != NULL; start = end) {
+		if (!node->modules.empty()) {
+			mods = node->modules.find(ext);
+			if (mods != node->modules.end()) {
+				found->insert(found->end(), mods->second.begin(), mods->second.end());
+				n += mods->second.size();
+			}
+		}
+
+		while (*start == '/')
+			start++;
+		end = strchr(start, '/');
+		/* the last component is the file itself */
+		if (end == NULL)
+			break;
+
+		comp.assign(start, end - start);
+		child = node->children.find(comp);
+		node = (child != node->children.end()) ? child->second : NULL;
+	}
+
+	return n;
+}
+
+int ModuleRegistry::find_dir(const char *dir, vector<GenericModule *> *found)
+{
+	const char *start, *end;
+	map<string, reg_node *>::iterator child;
+	reg_node *node = root;
+	string comp;
+	int n = 0;
+
+	for (start = dir; node != NULL; start = end) {
+		/* a module has all its extensions in the node */
+		for (reg_ext_map::iterator e = node->modules.begin(); e != node->modules.end(); e++) {
+			for (vector<GenericModule *>::iterator m = e->second.begin(); m != e->second.end(); m++) {
+				if (std::find(found->begin(), found->end(), *m) == found->end()) {
+					found->push_back(*m);
+					n++;
+				}
+			}
+		}
+
+		while (*start == '/')
+			start++;
+		if (*start == '\0')
+			break;
+		end = strchr(start, '/');
+		if (end == NULL)
+			end = start + strlen(start);
+
+		comp.assign(start, end - start);
+		child = node->children.find(comp);
+		node = (child != node->children.end()) ? child->second : NULL;
+	}
+
+	return n;
+}
+
+int ModuleRegistry::wants(const char *name)
+{
+	char ext[REG_EXT_MAX];
+
+	if (get_ext(name, ext))
+		return 0;
+
+	return all_exts.count(ext) ? 1 : 0;
+}
@@ -0,0 +1,233 @@
+/*
+ tag_cache.cpp - Tags of the contents already seen, shared by the copies
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <unistd.h>
+
+#include "tag_cache.hpp"
+
+using namespace std;
+
+/** FNV-1a, 64 bits */
+static unsigned long long hash_bytes(unsigned long long hash, const void *buf, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) buf;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+int content_hash(int fd, off_t size, const char *head, size_t headlen,
+		unsigned long long *hash)
+{
+	char tail[DEDUP_BLOCK];
+	unsigned long long h = 14695981039346656037ULL;
+	long long sz = size;
+	size_t len;
+
+	h = hash_bytes(h, &sz, sizeof(sz));
+
+	len = (headlen < DEDUP_BLOCK) ? headlen : DEDUP_BLOCK;
+	if ((off_t) len < size && len < DEDUP_BLOCK)
+		return -1;
+	h = hash_bytes(h, head, len);
+
+	/* a small file was hashed whole */
+	if (size > DEDUP_BLOCK) {
+		len = (size > 2 * DEDUP_BLOCK) ? DEDUP_BLOCK : size - DEDUP_BLOCK;
+		if ((off_t) headlen >= size) {
+			h = hash_bytes(h, head + size - len, len);
+		}
+		else {
+			if (pread(fd, tail, len, size - len) != (ssize_t) len)
+				return -1;
+			h = hash_bytes(h, tail, len);
+		}
+	}
+
+	*hash = h;
+	return 0;
+}
+
+TagCache::TagCache()
+{
+	count = 0;
+	hits = 0;
+	pthread_mutex_init(&lock, NULL);
+}
+
+TagCache::~TagCache()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+int TagCache::lookup(unsigned long long hash, int module, int version,
+		vector<string> *tags)
+{
+	boost::unordered_map<unsigned long long, vector<tag_cache_entry> >::iterator e;
+	int found = 0;
+
+	pthread_mutex_lock(&lock);
+	e = entries.find(hash);
+	if (e != entries.end()) {
+		for (vector<tag_cache_entry>::iterator i = e->second.begin(); i != e->second.end(); i++) {
+			if ((*i).module == module && (*i).version == version) {
+				*tags = (*i).tags;
+				found = 1;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (found)
+		__sync_add_and_fetch(&hits, 1);
+	return found;
+}
+
+void TagCache::insert(unsigned long long hash, int module, int version,
+		const vector<string> &tags)
+{
+	tag_cache_entry entry;
+	vector<tag_cache_entry> *list;
+
+	entry.module = module;
+	entry.version = version;
+	entry.tags = tags;
+
+	pthread_mutex_lock(&lock);
+	if (count >= TAG_CACHE_MAX) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	list = &entries[hash];
+	/* another copy may have been parsed at the same time */
+	for (vector<tag_cache_entry>::iterator i = list->begin(); i != list->end(); i++) {
+		if ((*i).module == module && (*i).version == version) {
+			(*i).tags = tags;
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+	}
+	list->push_back(entry);
+	count++;
+	pthread_mutex_unlock(&lock);
+}
+
+/* the tags are written with their whitespace, '%' and control
+ * characters as %XX, so they can't run into each other or into the
+ * next line; an empty tag is written as a lone '%'
+ */
+static void put_tag(FILE *f, const string &tag)
+{
+	fputc(' ', f);
+	if (tag.empty()) {
+		fputc('%', f);
+		return;
+	}
+	for (size_t i = 0; i < tag.size(); i++) {
+		unsigned char c = tag[i];
+
+		if (c <= ' ' || c == '%' || c == 0x7f)
+			fprintf(f, "%%%02x", c);
+		else
+			fputc(c, f);
+	}
+}
+
+/* the reverse of put_tag()
+ * Returns 0 on SUCCESS, -1 if the token is not well formed
+ */
+static int get_tag(const string &tok, string *tag)
+{
+	char hexd[3] = { 0, 0, 0 };
+
+	tag->clear();
+	if (tok == "%")
+		return 0;
+	for (size_t i = 0; i < tok.size(); i++) {
+		if (tok[i] != '%') {
+			*tag += tok[i];
+			continue;
+		}
+		if (i + 2 >= tok.size() || !isxdigit(tok[i + 1]) || !isxdigit(tok[i + 2]))
+			return -1;
+		hexd[0] = tok[i + 1];
+		hexd[1] = tok[i + 2];
+		*tag += (char) strtol(hexd, NULL, 16);
+		i += 2;
+	}
+	return 0;
+}
+
+long TagCache::load(FILE *f)
+{
+	char *line = NULL;
+	size_t sz = 0;
+	long n = 0;
+	unsigned long long hash;
+	int module, version, ntags;
+	string tok, tag;
+
+	/* written by an older version, with other escaping rules */
+	if (getline(&line, &sz, f) == -1 || strcmp(line, TAG_CACHE_MAGIC "\n") != 0) {
+		free (line);
+		return 0;
+	}
+
+	/* hash module version ntags tag1 tag2 ... */
+	while (getline(&line, &sz, f) != -1) {
+		istringstream in(line);
+		vector<string> tags;
+
+		if (!(in >> hex >> hash >> dec >> module >> version >> ntags))
+			continue;
+		for (int i = 0; i < ntags && in >> tok; i++) {
+			if (get_tag(tok, &tag))
+				break;
+			tags.push_back(tag);
+		}
+		if ((int) tags.size() != ntags)
+			continue;
+		insert(hash, module, version, tags);
+		n++;
+	}
+	free (line);
+
+	return n;
+}
+
+int TagCache::save(FILE *f)
+{
+	boost::unordered_map<unsigned long long, vector<tag_cache_entry> >::iterator e;
+
+	pthread_mutex_lock(&lock);
+	fprintf(f, "%s\n", TAG_CACHE_MAGIC);
+	for (e = entries.begin(); e != entries.end(); e++) {
+		for (vector<tag_cache_entry>::iterator i = e->second.begin(); i != e->second.end(); i++) {
+			fprintf(f, "%llx %d %d %lu", e->first, (*i).module, (*i).version,
+					(unsigned long) (*i).tags.size());
+			for (vector<string>::iterator t = (*i).tags.begin(); t != (*i).tags.end(); t++)
+				put_tag(f, *t);
+			fprintf(f, "\n");
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	return ferror(f) ? -1 : 0;
+}
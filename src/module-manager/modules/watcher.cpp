@@ -0,0 +1,387 @@
+/*
+ watcher.cpp - Incremental indexing of the files changed in the module paths
+
+ Copyright (C) 2008-2009  Dan Pintilei
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "watcher.hpp"
+#include "crawler.hpp"
+#include "fingerprint.hpp"
+
+using namespace std;
+
+/** the events we want for each directory */
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | \
+		IN_CREATE | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/** set by the signal handler, the loop stops after the next flush */
+static volatile sig_atomic_t stop_daemon = 0;
+
+static void stop_handler(int sig)
+{
+	stop_daemon = 1;
+}
+
+IndexDaemon::IndexDaemon(ModuleManager *manager, pipe_conf *conf)
+{
+	this->manager = manager;
+	if (conf != NULL)
+		this->conf = *conf;
+	else
+		IndexPipeline::default_conf(&this->conf);
+	fd = -1;
+	first_change = 0;
+	overflow = 0;
+}
+
+IndexDaemon::~IndexDaemon()
+{
+	/* the watches go away with the descriptor */
+	if (fd != -1)
+		close(fd);
+}
+
+int IndexDaemon::add_tree(const string &root, vector<string> *files)
+{
+	vector<string> todo;
+	string dir, path;
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int wd, type;
+
+	todo.push_back(root);
+	while (!todo.empty()) {
+		dir = todo.back();
+		todo.pop_back();
+
+		wd = inotify_add_watch(fd, dir.c_str(), WATCH_MASK);
+		if (wd == -1) {
+			fprintf(stderr, "cannot watch %s: %s\n", dir.c_str(), strerror(errno));
+			if (errno == ENOSPC)
+				fprintf(stderr, "raise fs.inotify.max_user_watches to watch more directories\n");
+			/* the subdirectories created in the meantime are still wanted */
+			if (errno != ENOENT && errno != ENOTDIR && errno != EACCES)
+				return -1;
+			continue;
+		}
+		dirs[wd] = dir;
+
+		/* we read the directory after the watch is set, so a file
+		 * created in between is seen at least once
+		 */
+		d = opendir(dir.c_str());
+		if (d == NULL)
+			continue;
+		while ((de = readdir(d)) != NULL) {
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			path = dir;
+			if (dir[dir.length() - 1] != '/')
+				path.append("/");
+			path.append(de->d_name);
+
+			type = de->d_type;
+			if (type == DT_UNKNOWN) {
+				if (lstat(path.c_str(), &st))
+					continue;
+				if (S_ISDIR(st.st_mode))
+					type = DT_DIR;
+				else if (S_ISREG(st.st_mode))
+					type = DT_REG;
+			}
+			if (type == DT_DIR)
+				todo.push_back(path);
+			else if (type == DT_REG && files != NULL)
+				files->push_back(path);
+		}
+		closedir(d);
+	}
+
+	return 0;
+}
+
+void IndexDaemon::remove_tree(const string &root)
+{
+	string prefix = root + "/";
+	map<int, string>::iterator i, next;
+
+	for (i = dirs.begin(); i != dirs.end(); i = next) {
+		next = i;
+		next++;
+		if (i->second == root || i->second.compare(0, prefix.length(), prefix) == 0) {
+			inotify_rm_watch(fd, i->first);
+			dirs.erase(i);
+		}
+	}
+}
+
+void IndexDaemon::move_tree(const string &from, const string &to)
+{
+	string prefix = from + "/";
+	map<int, string>::iterator i;
+	vector<string> files;
+
+	/* the watches follow the directory, only the names change */
+	for (i = dirs.begin(); i != dirs.end(); i++) {
+		if (i->second == from)
+			i->second = to;
+		else if (i->second.compare(0, prefix.length(), prefix) == 0)
+			i->second = to + i->second.substr(from.length());
+	}
+
+	add_tree(to, &files);
+	for (vector<string>::iterator f = files.begin(); f != files.end(); f++) {
+		queue_file(from + (*f).substr(to.length()), WATCH_REMOVE);
+		queue_file(*f, WATCH_INDEX);
+	}
+}
+
+void IndexDaemon::queue_file(const string &path, watch_op op)
+{
+	vector<GenericModule *> mods;
+
+	if (manager->mod_find_modules(path.c_str(), &mods) == 0)
+		return;
+
+	if (pending.empty())
+		first_change = time(NULL);
+	/* only the last change matters */
+	pending[path] = op;
+}
+
+void IndexDaemon::handle_events(char *buf, ssize_t len)
+{
+	struct inotify_event *ev;
+	map<int, string>::iterator dir;
+	vector<string> files;
+	string path;
+
+	for (ssize_t off = 0; off < len; off += sizeof(struct inotify_event) + ev->len) {
+		ev = (struct inotify_event *) (buf + off);
+
+		if (ev->mask & IN_Q_OVERFLOW) {
+			overflow = 1;
+			continue;
+		}
+		if (ev->mask & IN_IGNORED) {
+			dirs.erase(ev->wd);
+			continue;
+		}
+		dir = dirs.find(ev->wd);
+		if (dir == dirs.end() || ev->len == 0)
+			continue;
+		path = dir->second;
+		if (path[path.length() - 1] != '/')
+			path.append("/");
+		path.append(ev->name);
+
+		if (ev->mask & IN_ISDIR) {
+			if (ev->mask & IN_MOVED_FROM) {
+				moved[ev->cookie] = path;
+			}
+			else if ((ev->mask & IN_MOVED_TO) && moved.count(ev->cookie)) {
+				move_tree(moved[ev->cookie], path);
+				moved.erase(ev->cookie);
+			}
+			else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+				files.clear();
+				add_tree(path, &files);
+				for (vector<string>::iterator f = files.begin(); f != files.end(); f++)
+					queue_file(*f, WATCH_INDEX);
+			}
+			/* the files of a deleted directory have their own events */
+			continue;
+		}
+
+		if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+			queue_file(path, WATCH_INDEX);
+		else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+			queue_file(path, WATCH_REMOVE);
+	}
+}
+
+void IndexDaemon::flush()
+{
+	WorkQueue<string> files(conf.queue_max);
+	map<GenericModule *, vector<string> > removed;
+	map<GenericModule *, vector<string> >::iterator r;
+	vector<GenericModule *> mods;
+	long nindex = 0, nremove = 0;
+
+	/* directories moved out of our trees: nothing comes from them
+	 * anymore. Their files are left for the stale sweep.
+	 */
+	for (map<unsigned int, string>::iterator m = moved.begin(); m != moved.end(); m++) {
+		printf ("%s moved away, not watched anymore\n", m->second.c_str());
+		remove_tree(m->second);
+	}
+	moved.clear();
+
+	if (overflow) {
+		overflow = 0;
+		pending.clear();
+		rescan();
+		return;
+	}
+	if (pending.empty())
+		return;
+
+	for (map<string, watch_op>::iterator p = pending.begin(); p != pending.end(); p++) {
+		if (p->second != WATCH_REMOVE)
+			continue;
+		mods.clear();
+		manager->mod_find_modules(p->first.c_str(), &mods);
+		for (vector<GenericModule *>::iterator m = mods.begin(); m != mods.end(); m++)
+			removed[*m].push_back(p->first);
+		nremove++;
+	}
+	for (r = removed.begin(); r != removed.end(); r++)
+		r->first->remove_files(&r->second);
+
+	IndexPipeline pipeline(manager, &files, &conf);
+	if (pipeline.start() == 0) {
+		for (map<string, watch_op>::iterator p = pending.begin(); p != pending.end(); p++) {
+			if (p->second != WATCH_INDEX)
+				continue;
+			if (files.push(p->first) == 0)
+				nindex++;
+		}
+	}
+	files.close();
+	pipeline.wait();
+
+	printf ("%ld files indexed, %ld removed\n", nindex, nremove);
+	fflush(stdout);
+	pending.clear();
+}
+
+void IndexDaemon::rescan()
+{
+	vector<string> paths;
+	FingerprintFilter unchanged(manager);
+	int filter;
+
+	printf ("events were lost, indexing all the directories again\n");
+	/* only the files that changed are read */
+	filter = (unchanged.load() >= 0);
+	manager->mod_list_paths(&paths);
+	for (vector<string>::iterator p = paths.begin(); p != paths.end(); p++) {
+		WorkQueue<string> files(CRAWL_QUEUE_MAX);
+		DirCrawler crawler(&files, 0);
+		IndexPipeline pipeline(manager, &files, &conf);
+
+		crawler.set_registry(manager->mod_get_registry());
+		if (filter)
+			crawler.set_filter(&unchanged);
+		/* the watches are still there, only the events were lost */
+		if (pipeline.start() != 0)
+			continue;
+		if (crawler.start((*p).c_str()) == 0)
+			crawler.wait();
+		pipeline.wait();
+		pipeline.report();
+	}
+}
+
+int IndexDaemon::init()
+{
+	vector<string> paths;
+
+	fd = inotify_init();
+	if (fd == -1) {
+		fprintf(stderr, "inotify_init: %s\n", strerror(errno));
+		return -1;
+	}
+
+	manager->mod_list_paths(&paths);
+	if (paths.empty()) {
+		fprintf(stderr, "no module paths to watch\n");
+		return -1;
+	}
+	for (vector<string>::iterator p = paths.begin(); p != paths.end(); p++) {
+		if (add_tree(*p, NULL))
+			return -1;
+		printf ("watching %s\n", (*p).c_str());
+	}
+	printf ("%lu directories watched\n", (unsigned long) dirs.size());
+
+	return 0;
+}
+
+int IndexDaemon::run()
+{
+	struct sigaction sa;
+	struct pollfd pfd;
+	char *buf;
+	ssize_t len;
+	int ret;
+
+	buf = (char *) malloc (WATCH_BUF_SIZE);
+	if (buf == NULL)
+		return -1;
+
+	/* no SA_RESTART, so poll() returns when we are told to stop */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!stop_daemon) {
+		ret = poll(&pfd, 1, WATCH_QUIET_MS);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll: %s\n", strerror(errno));
+			break;
+		}
+		if (ret == 0) {
+			/* quiet for a while: index what changed */
+			if (!pending.empty() || !moved.empty() || overflow)
+				flush();
+			continue;
+		}
+
+		len = read(fd, buf, WATCH_BUF_SIZE);
+		if (len == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fprintf(stderr, "read inotify: %s\n", strerror(errno));
+			break;
+		}
+		handle_events(buf, len);
+
+		/* a busy directory shouldn't delay the others forever */
+		if (!pending.empty() && time(NULL) - first_change >= WATCH_MAX_DELAY)
+			flush();
+	}
+
+	flush();
+	free (buf);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	stop_daemon = 0;
+
+	return 0;
+}